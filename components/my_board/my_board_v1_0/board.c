@@ -28,7 +28,7 @@
 #include "driver/gpio.h"
 
 #include "periph_sdcard.h"
-#include "periph_adc_button.h"
+#include "periph_button.h"
 
 static const char *TAG = "AUDIO_BOARD";
 
@@ -77,19 +77,29 @@ audio_hal_handle_t audio_board_codec_init(void)
 
 esp_err_t audio_board_key_init(esp_periph_set_handle_t set)
 {
-    esp_err_t ret = ESP_OK;
-    periph_adc_button_cfg_t adc_btn_cfg = PERIPH_ADC_BUTTON_DEFAULT_CONFIG();
-    adc_arr_t adc_btn_tag = ADC_DEFAULT_ARR();
-    adc_btn_tag.adc_ch = ADC_CHANNEL_0; // GPIO36
-    adc_btn_tag.total_steps = 4;
-    int btn_array[5] = {200, 1355, 1820, 2280, 2930};
-    adc_btn_tag.adc_level_step = btn_array;
-    adc_btn_cfg.arr = &adc_btn_tag;
-    adc_btn_cfg.arr_size = 1;
-    esp_periph_handle_t adc_btn_handle = periph_adc_button_init(&adc_btn_cfg);
-    AUDIO_NULL_CHECK(TAG, adc_btn_handle, return ESP_ERR_ADF_MEMORY_LACK);
-    ret = esp_periph_start(set, adc_btn_handle);
-    return ret;
+    const int8_t gpios[] = {
+        get_input_volup_id(), get_input_voldown_id(), get_input_mute_id(),
+        get_input_set_id(), get_input_play_id(), get_input_mode_id(),
+    };
+    uint64_t gpio_mask = 0;
+    for (int i = 0; i < (int)(sizeof(gpios) / sizeof(gpios[0])); i++)
+    {
+        if (gpios[i] >= 0)
+        {
+            gpio_mask |= 1ULL << gpios[i];
+        }
+    }
+    if (gpio_mask == 0)
+    {
+        ESP_LOGW(TAG, "No button GPIO configured");
+        return ESP_ERR_NOT_FOUND;
+    }
+    periph_button_cfg_t btn_cfg = {
+        .gpio_mask = gpio_mask,
+    };
+    esp_periph_handle_t btn_handle = periph_button_init(&btn_cfg);
+    AUDIO_NULL_CHECK(TAG, btn_handle, return ESP_ERR_ADF_MEMORY_LACK);
+    return esp_periph_start(set, btn_handle);
 }
 
 esp_err_t audio_board_sdcard_init(esp_periph_set_handle_t set, periph_sdcard_mode_t mode)
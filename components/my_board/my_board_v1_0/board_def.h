@@ -25,12 +25,18 @@
 #ifndef _AUDIO_BOARD_DEFINITION_H_
 #define _AUDIO_BOARD_DEFINITION_H_
 
-#define BUTTON_VOLUP_ID -1
-#define BUTTON_VOLDOWN_ID -1
-#define BUTTON_MUTE_ID -1
-#define BUTTON_SET_ID -1
-#define BUTTON_MODE_ID -1
-#define BUTTON_PLAY_ID -1
+/* GPIO buttons, from menuconfig: My Audio Board > Buttons; -1 when absent */
+#define BUTTON_VOLUP_ID CONFIG_MY_BOARD_BUTTON_VOLUP_GPIO
+#define BUTTON_VOLDOWN_ID CONFIG_MY_BOARD_BUTTON_VOLDOWN_GPIO
+#define BUTTON_MUTE_ID CONFIG_MY_BOARD_BUTTON_MUTE_GPIO
+#define BUTTON_SET_ID CONFIG_MY_BOARD_BUTTON_SET_GPIO
+#define BUTTON_MODE_ID CONFIG_MY_BOARD_BUTTON_MODE_GPIO
+#define BUTTON_PLAY_ID CONFIG_MY_BOARD_BUTTON_PLAY_GPIO
+#if CONFIG_MY_BOARD_BUTTON_ACTIVE_LOW
+#define BUTTON_ACTIVE_LEVEL 0
+#else
+#define BUTTON_ACTIVE_LEVEL 1
+#endif
 #define PA_ENABLE_GPIO 53 /* ESP32-P4: external PA enable */
 #define ADC_DETECT_GPIO -1
 #define BATTERY_DETECT_GPIO -1
@@ -68,29 +74,39 @@ extern audio_hal_func_t AUDIO_NEW_CODEC_DEFAULT_HANDLE;
     },                                         \
 };
 
-#define INPUT_KEY_NUM 4 /* You need to define the number of input buttons on your board */
+#define INPUT_KEY_NUM 6 /* You need to define the number of input buttons on your board */
 
 #define INPUT_KEY_DEFAULT_INFO() {            \
     {                                         \
-        .type = PERIPH_ID_ADC_BTN,            \
+        .type = PERIPH_ID_BUTTON,             \
         .user_id = INPUT_KEY_USER_ID_VOLUP,   \
         .act_id = BUTTON_VOLUP_ID,            \
     },                                        \
     {                                         \
-        .type = PERIPH_ID_ADC_BTN,            \
+        .type = PERIPH_ID_BUTTON,             \
         .user_id = INPUT_KEY_USER_ID_VOLDOWN, \
         .act_id = BUTTON_VOLDOWN_ID,          \
     },                                        \
     {                                         \
-        .type = PERIPH_ID_ADC_BTN,            \
+        .type = PERIPH_ID_BUTTON,             \
         .user_id = INPUT_KEY_USER_ID_MUTE,    \
         .act_id = BUTTON_MUTE_ID,             \
     },                                        \
     {                                         \
-        .type = PERIPH_ID_ADC_BTN,            \
+        .type = PERIPH_ID_BUTTON,             \
         .user_id = INPUT_KEY_USER_ID_SET,     \
         .act_id = BUTTON_SET_ID,              \
     },                                        \
+    {                                         \
+        .type = PERIPH_ID_BUTTON,             \
+        .user_id = INPUT_KEY_USER_ID_PLAY,    \
+        .act_id = BUTTON_PLAY_ID,             \
+    },                                        \
+    {                                         \
+        .type = PERIPH_ID_BUTTON,             \
+        .user_id = INPUT_KEY_USER_ID_MODE,    \
+        .act_id = BUTTON_MODE_ID,             \
+    },                                        \
 }
 
 #endif
@@ -25,12 +25,15 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_check.h"
-#include "driver/i2c.h"
+#include "driver/i2c_master.h"
 #include "board.h"
 #include "es8311_codec.h"
-#include "es8311.h"
 
 /* Fallbacks for older ADF/IDF where these macros may be missing */
 #ifndef AUDIO_HAL_CTRL_RESUME
@@ -40,60 +43,91 @@
 #define AUDIO_HAL_CTRL_PAUSE AUDIO_HAL_CTRL_STOP
 #endif
 
-/* Fallbacks for ES8311 symbols if the header is absent in the include path */
-#ifndef ES8311_RESOLUTION_16
-typedef enum
-{
-    ES8311_RESOLUTION_16 = 16,
-    ES8311_RESOLUTION_18 = 18,
-    ES8311_RESOLUTION_20 = 20,
-    ES8311_RESOLUTION_24 = 24,
-    ES8311_RESOLUTION_32 = 32,
-} es8311_resolution_t;
-#endif
-
-#ifndef ES8311_CLOCK_CONFIG_FWD
-#define ES8311_CLOCK_CONFIG_FWD
-typedef struct es8311_clock_config_t
-{
-    bool mclk_inverted;
-    bool sclk_inverted;
-    bool mclk_from_mclk_pin;
-    int mclk_frequency;
-    int sample_frequency;
-} es8311_clock_config_t;
-#endif
-
-#ifndef ES8311_ADDRRES_0
-#define ES8311_ADDRRES_0 0x18u
-#endif
-
-#ifndef es8311_handle_t
-typedef void *es8311_handle_t;
-#endif
-
-#ifndef ES8311_API_FWD
-#define ES8311_API_FWD
-es8311_handle_t es8311_create(const i2c_port_t port, const uint16_t dev_addr);
-void es8311_delete(es8311_handle_t dev);
-esp_err_t es8311_init(es8311_handle_t dev, const es8311_clock_config_t *const clk_cfg,
-                      const es8311_resolution_t res_in, const es8311_resolution_t res_out);
-esp_err_t es8311_sample_frequency_config(es8311_handle_t dev, int mclk_frequency, int sample_frequency);
-esp_err_t es8311_microphone_config(es8311_handle_t dev, bool digital_mic);
-esp_err_t es8311_voice_volume_set(es8311_handle_t dev, int volume, int *volume_set);
-#endif
-
 static const char *TAG = "es8311_board_codec";
 
-/* Keep the ES8311 wiring compatible with the example I2S playback */
+/*
+ * The codec is driven directly on the i2c_master bus driver. The espressif/es8311
+ * component talks through the legacy driver/i2c.h API, which cannot share a
+ * port with i2c_master, so the register sequences it used are reproduced here.
+ *
+ * Every register write goes through a shadow copy: values the chip already holds
+ * are not sent, and a run of consecutive registers goes out as one transaction
+ * (the ES8311 auto-increments the register address on multi-byte writes).
+ */
 #define ES8311_I2C_PORT I2C_NUM_0
-#define ES8311_I2C_CLK_HZ (100000) /* Standard mode is enough */
+#define ES8311_I2C_ADDR (0x18)
+#define ES8311_I2C_CLK_HZ (400000) /* Fast mode */
+#define ES8311_I2C_TIMEOUT_MS (50)
 #define ES8311_MCLK_MULTIPLE (256)
 
-static es8311_handle_t s_es8311 = NULL;
+#define ES8311_REG_RESET (0x00)
+#define ES8311_REG_CLK_MANAGER (0x01) /* 0x01..0x08: clock manager */
+#define ES8311_REG_SDP_IN (0x09)
+#define ES8311_REG_SDP_OUT (0x0A)
+#define ES8311_REG_SYSTEM_0D (0x0D)
+#define ES8311_REG_SYSTEM_0E (0x0E)
+#define ES8311_REG_SYSTEM_12 (0x12)
+#define ES8311_REG_SYSTEM_13 (0x13)
+#define ES8311_REG_SYSTEM_14 (0x14)
+#define ES8311_REG_ADC_17 (0x17)
+#define ES8311_REG_ADC_1C (0x1C)
+#define ES8311_REG_DAC_VOLUME (0x32)
+#define ES8311_REG_DAC_37 (0x37)
+#define ES8311_REG_COUNT (0x46)
+
+#define ES8311_CODEC_TASK_STACK (2048)
+#define ES8311_CODEC_TASK_PRIO (3)
+
+/* Clock manager coefficients, as in the es8311 component's coeff_div table */
+typedef struct
+{
+    uint32_t mclk;
+    uint32_t rate;
+    uint8_t pre_div;
+    uint8_t pre_multi;
+    uint8_t adc_div;
+    uint8_t dac_div;
+    uint8_t fs_mode;
+    uint8_t lrck_h;
+    uint8_t lrck_l;
+    uint8_t bclk_div;
+    uint8_t adc_osr;
+    uint8_t dac_osr;
+} es8311_coeff_t;
+
+static const es8311_coeff_t s_coeffs[] = {
+    /* MCLK = 256 fs */
+    {2048000, 8000, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {2822400, 11025, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {4096000, 16000, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {5644800, 22050, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {6144000, 24000, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {8192000, 32000, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {11289600, 44100, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+    {12288000, 48000, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
+};
+
+typedef struct
+{
+    uint8_t val[ES8311_REG_COUNT];
+    uint8_t valid[(ES8311_REG_COUNT + 7) / 8];
+} es8311_shadow_t;
+
+static i2c_master_bus_handle_t s_bus = NULL;
+static i2c_master_dev_handle_t s_dev = NULL;
+static SemaphoreHandle_t s_lock = NULL;
+static QueueHandle_t s_volume_queue = NULL;
+static TaskHandle_t s_codec_task = NULL;
+static es8311_shadow_t s_shadow;
+static uint32_t s_transactions;
+static uint32_t s_skipped;
+static new_codec_i2c_trace_cb s_trace_cb;
+static void *s_trace_ctx;
 static int s_volume = 60;
 static bool s_muted = false;
-static bool s_i2c_started = false;
+/* Format the chip is currently clocked for */
+static int s_rate = 0;
+static audio_hal_iface_bits_t s_bits = 0;
 
 static int hal_samples_to_rate(audio_hal_iface_samples_t samples)
 {
@@ -120,53 +154,241 @@ static int hal_samples_to_rate(audio_hal_iface_samples_t samples)
     }
 }
 
-static es8311_resolution_t hal_bits_to_resolution(audio_hal_iface_bits_t bits)
+/* Word length field of the SDP registers 0x09/0x0A */
+static uint8_t hal_bits_to_sdp(audio_hal_iface_bits_t bits)
 {
     switch (bits)
     {
     case AUDIO_HAL_BIT_LENGTH_24BITS:
-        return ES8311_RESOLUTION_24;
+        return 0x00 << 2;
     case AUDIO_HAL_BIT_LENGTH_32BITS:
-        return ES8311_RESOLUTION_32;
+        return 0x04 << 2;
     case AUDIO_HAL_BIT_LENGTH_16BITS:
     default:
-        return ES8311_RESOLUTION_16;
+        return 0x03 << 2;
     }
 }
 
-static esp_err_t es8311_setup_clock(int sample_rate, es8311_resolution_t res)
+static bool shadow_matches(uint8_t reg, uint8_t val)
 {
-    const es8311_clock_config_t clk_cfg = {
-        .mclk_inverted = false,
-        .sclk_inverted = false,
-        .mclk_from_mclk_pin = true,
-        .mclk_frequency = sample_rate * ES8311_MCLK_MULTIPLE,
-        .sample_frequency = sample_rate,
-    };
+    return (s_shadow.valid[reg / 8] & (1 << (reg % 8))) && s_shadow.val[reg] == val;
+}
+
+static void shadow_store(uint8_t reg, uint8_t val)
+{
+    s_shadow.val[reg] = val;
+    s_shadow.valid[reg / 8] |= 1 << (reg % 8);
+}
+
+static void shadow_invalidate(void)
+{
+    memset(&s_shadow, 0, sizeof(s_shadow));
+}
+
+/* Write `n` consecutive registers starting at `reg`; caller holds s_lock */
+static esp_err_t es8311_write_regs(uint8_t reg, const uint8_t *vals, int n)
+{
+    uint8_t buf[1 + ES8311_REG_COUNT];
+    int i = 0;
+    while (i < n)
+    {
+        /* Skip what the chip already holds, then send the next dirty run in one go */
+        while (i < n && shadow_matches(reg + i, vals[i]))
+        {
+            s_skipped++;
+            i++;
+        }
+        if (i == n)
+        {
+            break;
+        }
+        const int start = i;
+        while (i < n && !shadow_matches(reg + i, vals[i]))
+        {
+            i++;
+        }
+        buf[0] = reg + start;
+        memcpy(&buf[1], &vals[start], i - start);
+        if (s_trace_cb)
+        {
+            s_trace_cb(true, buf[0], i - start, ESP_OK, s_trace_ctx);
+        }
+        const esp_err_t ret = i2c_master_transmit(s_dev, buf, 1 + i - start, ES8311_I2C_TIMEOUT_MS);
+        if (s_trace_cb)
+        {
+            s_trace_cb(false, buf[0], i - start, ret, s_trace_ctx);
+        }
+        ESP_RETURN_ON_ERROR(ret, TAG, "write 0x%02x..0x%02x failed", reg + start, reg + i - 1);
+        s_transactions++;
+        for (int k = start; k < i; k++)
+        {
+            shadow_store(reg + k, vals[k]);
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t es8311_write_reg(uint8_t reg, uint8_t val)
+{
+    return es8311_write_regs(reg, &val, 1);
+}
+
+/* Divider registers 0x02..0x08 for a sample rate at MCLK = ES8311_MCLK_MULTIPLE * rate */
+static esp_err_t es8311_divider_regs(int sample_rate, uint8_t regs[7])
+{
+    const uint32_t mclk = (uint32_t)sample_rate * ES8311_MCLK_MULTIPLE;
+    const es8311_coeff_t *c = NULL;
+    for (size_t i = 0; i < sizeof(s_coeffs) / sizeof(s_coeffs[0]); i++)
+    {
+        if (s_coeffs[i].mclk == mclk && s_coeffs[i].rate == (uint32_t)sample_rate)
+        {
+            c = &s_coeffs[i];
+            break;
+        }
+    }
+    ESP_RETURN_ON_FALSE(c, ESP_ERR_NOT_SUPPORTED, TAG, "no dividers for %d Hz", sample_rate);
+
+    regs[0] = ((c->pre_div - 1) << 5) | (c->pre_multi << 3);
+    regs[1] = (c->fs_mode << 6) | c->adc_osr;
+    regs[2] = c->dac_osr;
+    regs[3] = ((c->adc_div - 1) << 4) | (c->dac_div - 1);
+    regs[4] = c->bclk_div < 19 ? c->bclk_div - 1 : c->bclk_div; /* SCLK not inverted */
+    regs[5] = c->lrck_h;
+    regs[6] = c->lrck_l;
+    return ESP_OK;
+}
+
+/* Same register sequence as es8311_init() + es8311_microphone_config(false) of the es8311 component */
+static esp_err_t es8311_setup(int sample_rate, audio_hal_iface_bits_t bits)
+{
+    uint8_t clocks[8] = {0x3F}; /* all clocks on, MCLK from the MCLK pin, not inverted */
+    ESP_RETURN_ON_ERROR(es8311_divider_regs(sample_rate, &clocks[1]), TAG, "clock config failed");
+
+    /* Reset: the chip reverts to defaults the shadow does not know */
+    shadow_invalidate();
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_RESET, 0x1F), TAG, "reset failed");
+    vTaskDelay(pdMS_TO_TICKS(20));
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_RESET, 0x00), TAG, "reset failed");
+    /* Power on, slave mode */
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_RESET, 0x80), TAG, "power on failed");
+
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_CLK_MANAGER, clocks, sizeof(clocks)), TAG, "clock config failed");
+
+    /* 0x09/0x0A: I2S, word length */
+    const uint8_t sdp[] = {hal_bits_to_sdp(bits), hal_bits_to_sdp(bits)};
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_SDP_IN, sdp, sizeof(sdp)), TAG, "format config failed");
+
+    /* 0x0D/0x0E: power up analog, enable PGA and ADC modulator */
+    const uint8_t system[] = {0x01, 0x02};
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_SYSTEM_0D, system, sizeof(system)), TAG, "power up failed");
+    /* 0x12/0x13: power up DAC, enable the headphone driver output; 0x14: analog mic, max PGA */
+    const uint8_t output[] = {0x00, 0x10, 0x1A};
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_SYSTEM_12, output, sizeof(output)), TAG, "output config failed");
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_ADC_17, 0xC8), TAG, "adc gain failed");
+    /* ADC equalizer bypass and DC offset cancel, DAC equalizer bypass */
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_ADC_1C, 0x6A), TAG, "adc config failed");
+    ESP_RETURN_ON_ERROR(es8311_write_reg(ES8311_REG_DAC_37, 0x08), TAG, "dac config failed");
+    s_rate = sample_rate;
+    s_bits = bits;
+    return ESP_OK;
+}
+
+/*
+ * Format change without a reset: only the divider and word length registers are
+ * rewritten, and the shadow drops the ones that do not change. With MCLK at a
+ * fixed multiple of fs the dividers are the same for every rate, so a rate
+ * switch normally costs no I2C traffic at all.
+ */
+static esp_err_t es8311_reclock(int sample_rate, audio_hal_iface_bits_t bits)
+{
+    if (sample_rate == s_rate && bits == s_bits)
+    {
+        return ESP_OK;
+    }
+    uint8_t dividers[7];
+    ESP_RETURN_ON_ERROR(es8311_divider_regs(sample_rate, dividers), TAG, "clock config failed");
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_CLK_MANAGER + 1, dividers, sizeof(dividers)), TAG, "clock config failed");
+    const uint8_t sdp[] = {hal_bits_to_sdp(bits), hal_bits_to_sdp(bits)};
+    ESP_RETURN_ON_ERROR(es8311_write_regs(ES8311_REG_SDP_IN, sdp, sizeof(sdp)), TAG, "format config failed");
+    s_rate = sample_rate;
+    s_bits = bits;
+    return ESP_OK;
+}
+
+static uint8_t volume_to_reg(int volume, bool muted)
+{
+    if (muted || volume <= 0)
+    {
+        return 0;
+    }
+    return (uint8_t)(volume * 256 / 100 - 1);
+}
 
-    ESP_RETURN_ON_ERROR(es8311_init(s_es8311, &clk_cfg, res, res), TAG, "es8311 init failed");
-    return es8311_sample_frequency_config(s_es8311, clk_cfg.mclk_frequency, sample_rate);
+static esp_err_t es8311_apply_volume(uint8_t reg)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t ret = es8311_write_reg(ES8311_REG_DAC_VOLUME, reg);
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+/* Applies the latest requested volume; requests queued meanwhile are overwritten */
+static void es8311_codec_task(void *arg)
+{
+    uint8_t reg;
+    while (1)
+    {
+        if (xQueueReceive(s_volume_queue, &reg, portMAX_DELAY) == pdTRUE)
+        {
+            es8311_apply_volume(reg);
+        }
+    }
+}
+
+static esp_err_t es8311_request_volume(void)
+{
+    const uint8_t reg = volume_to_reg(s_volume, s_muted);
+    if (s_volume_queue == NULL)
+    {
+        return ESP_OK;
+    }
+    xQueueOverwrite(s_volume_queue, &reg);
+    return ESP_OK;
 }
 
 static esp_err_t es8311_i2c_bus_init(void)
 {
-    if (s_i2c_started)
+    if (s_dev)
     {
         return ESP_OK;
     }
 
-    i2c_config_t i2c_cfg = {
-        .mode = I2C_MODE_MASTER,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = ES8311_I2C_CLK_HZ,
+    i2c_config_t pins = {0};
+    ESP_RETURN_ON_ERROR(get_i2c_pins(ES8311_I2C_PORT, &pins), TAG, "get i2c pins failed");
+
+    i2c_master_bus_config_t bus_cfg = {
+        .i2c_port = ES8311_I2C_PORT,
+        .sda_io_num = pins.sda_io_num,
+        .scl_io_num = pins.scl_io_num,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = 7,
+        .flags.enable_internal_pullup = true,
     };
+    ESP_RETURN_ON_ERROR(i2c_new_master_bus(&bus_cfg, &s_bus), TAG, "i2c bus create failed");
 
-    ESP_RETURN_ON_ERROR(get_i2c_pins(ES8311_I2C_PORT, &i2c_cfg), TAG, "get i2c pins failed");
-    ESP_RETURN_ON_ERROR(i2c_param_config(ES8311_I2C_PORT, &i2c_cfg), TAG, "i2c param config failed");
-    ESP_RETURN_ON_ERROR(i2c_driver_install(ES8311_I2C_PORT, I2C_MODE_MASTER, 0, 0, 0), TAG, "i2c driver install failed");
-    s_i2c_started = true;
-    return ESP_OK;
+    const i2c_device_config_t dev_cfg = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = ES8311_I2C_ADDR,
+        .scl_speed_hz = ES8311_I2C_CLK_HZ,
+    };
+    esp_err_t ret = i2c_master_bus_add_device(s_bus, &dev_cfg, &s_dev);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "i2c device add failed");
+        i2c_del_master_bus(s_bus);
+        s_bus = NULL;
+    }
+    return ret;
 }
 
 audio_hal_func_t AUDIO_NEW_CODEC_DEFAULT_HANDLE = {
@@ -181,55 +403,70 @@ audio_hal_func_t AUDIO_NEW_CODEC_DEFAULT_HANDLE = {
 
 bool new_codec_initialized()
 {
-    return s_es8311 != NULL;
+    return s_dev != NULL;
 }
 
 esp_err_t new_codec_init(audio_hal_codec_config_t *cfg)
 {
     ESP_LOGI(TAG, "Initializing ES8311");
 
-    ESP_RETURN_ON_ERROR(es8311_i2c_bus_init(), TAG, "i2c init failed");
-
-    if (!s_es8311)
+    if (s_lock == NULL)
     {
-        s_es8311 = es8311_create(ES8311_I2C_PORT, ES8311_ADDRRES_0);
-        ESP_RETURN_ON_FALSE(s_es8311, ESP_FAIL, TAG, "es8311 handle create failed");
+        s_lock = xSemaphoreCreateMutex();
+        s_volume_queue = xQueueCreate(1, sizeof(uint8_t));
+        ESP_RETURN_ON_FALSE(s_lock && s_volume_queue, ESP_ERR_NO_MEM, TAG, "no memory for codec control");
     }
+    ESP_RETURN_ON_ERROR(es8311_i2c_bus_init(), TAG, "i2c init failed");
 
     const int sample_rate = hal_samples_to_rate(cfg->i2s_iface.samples);
-    const es8311_resolution_t res = hal_bits_to_resolution(cfg->i2s_iface.bits);
-
-    ESP_RETURN_ON_ERROR(es8311_setup_clock(sample_rate, res), TAG, "clock setup failed");
-
-    /* Configure microphone path off for playback-only use case */
-    ESP_RETURN_ON_ERROR(es8311_microphone_config(s_es8311, false), TAG, "mic config failed");
 
-    /* Set an initial volume */
-    ESP_RETURN_ON_ERROR(es8311_voice_volume_set(s_es8311, s_volume, NULL), TAG, "volume set failed");
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t ret = es8311_setup(sample_rate, cfg->i2s_iface.bits);
+    /* Initial volume */
     s_muted = false;
+    if (ret == ESP_OK)
+    {
+        ret = es8311_write_reg(ES8311_REG_DAC_VOLUME, volume_to_reg(s_volume, s_muted));
+    }
+    xSemaphoreGive(s_lock);
+    ESP_RETURN_ON_ERROR(ret, TAG, "codec setup failed");
 
-    ESP_LOGI(TAG, "ES8311 ready: %d Hz, %d bits", sample_rate, cfg->i2s_iface.bits);
+    if (s_codec_task == NULL &&
+        xTaskCreate(es8311_codec_task, "es8311_ctrl", ES8311_CODEC_TASK_STACK, NULL, ES8311_CODEC_TASK_PRIO, &s_codec_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create codec task");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "ES8311 ready: %d Hz, %d bits, %u I2C writes", sample_rate, cfg->i2s_iface.bits, (unsigned)s_transactions);
     return ESP_OK;
 }
 
 esp_err_t new_codec_deinit(void)
 {
-    if (s_es8311)
+    if (s_codec_task)
+    {
+        vTaskDelete(s_codec_task);
+        s_codec_task = NULL;
+    }
+    if (s_dev)
     {
-        es8311_delete(s_es8311);
-        s_es8311 = NULL;
+        i2c_master_bus_rm_device(s_dev);
+        s_dev = NULL;
     }
-    if (s_i2c_started)
+    if (s_bus)
     {
-        i2c_driver_delete(ES8311_I2C_PORT);
-        s_i2c_started = false;
+        i2c_del_master_bus(s_bus);
+        s_bus = NULL;
     }
+    shadow_invalidate();
+    s_rate = 0;
     return ESP_OK;
 }
 
 esp_err_t new_codec_ctrl_state(audio_hal_codec_mode_t mode, audio_hal_ctrl_t ctrl_state)
 {
-    if (!s_es8311)
+    if (!s_dev)
     {
         return ESP_ERR_INVALID_STATE;
     }
@@ -247,26 +484,37 @@ esp_err_t new_codec_ctrl_state(audio_hal_codec_mode_t mode, audio_hal_ctrl_t ctr
 
 esp_err_t new_codec_config_i2s(audio_hal_codec_mode_t mode, audio_hal_codec_i2s_iface_t *iface)
 {
-    if (!s_es8311 || !iface)
+    if (!s_dev || !iface)
     {
         return ESP_ERR_INVALID_ARG;
     }
 
     const int sample_rate = hal_samples_to_rate(iface->samples);
-    const es8311_resolution_t res = hal_bits_to_resolution(iface->bits);
-    return es8311_setup_clock(sample_rate, res);
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    esp_err_t ret = es8311_reclock(sample_rate, iface->bits);
+    xSemaphoreGive(s_lock);
+    return ret;
 }
 
 esp_err_t new_codec_set_voice_mute(bool mute)
 {
     s_muted = mute;
-    if (!s_es8311)
+    if (!s_dev)
     {
         return ESP_OK;
     }
+    /* Written before returning: callers mute around clock switches and rely on it */
+    return es8311_apply_volume(volume_to_reg(s_volume, s_muted));
+}
 
-    const int target = mute ? 0 : s_volume;
-    return es8311_voice_volume_set(s_es8311, target, NULL);
+esp_err_t new_codec_get_voice_mute(bool *mute)
+{
+    if (!mute)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *mute = s_muted;
+    return ESP_OK;
 }
 
 esp_err_t new_codec_set_voice_volume(int volume)
@@ -281,12 +529,7 @@ esp_err_t new_codec_set_voice_volume(int volume)
     }
 
     s_volume = volume;
-    if (s_muted || !s_es8311)
-    {
-        return ESP_OK;
-    }
-
-    return es8311_voice_volume_set(s_es8311, volume, NULL);
+    return es8311_request_volume();
 }
 
 esp_err_t new_codec_get_voice_volume(int *volume)
@@ -298,3 +541,30 @@ esp_err_t new_codec_get_voice_volume(int *volume)
     *volume = s_muted ? 0 : s_volume;
     return ESP_OK;
 }
+
+void new_codec_get_i2c_stats(uint32_t *transactions, uint32_t *skipped)
+{
+    if (transactions)
+    {
+        *transactions = s_transactions;
+    }
+    if (skipped)
+    {
+        *skipped = s_skipped;
+    }
+}
+
+void new_codec_set_i2c_trace(new_codec_i2c_trace_cb cb, void *ctx)
+{
+    /* Transactions run under s_lock, so none sees half of the pair */
+    if (s_lock)
+    {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+    }
+    s_trace_cb = cb;
+    s_trace_ctx = ctx;
+    if (s_lock)
+    {
+        xSemaphoreGive(s_lock);
+    }
+}
@@ -53,14 +53,7 @@ extern "C"
     esp_err_t new_codec_deinit(void);
 
     /**
-     * The functions new_codec_ctrl_state and new_codec_config_i2s are not used by this driver.
-     * They are kept here to maintain the uniformity and convenience of the interface
-     * of the ADF project.
-     * These settings for new_codec are burned in firmware and configuration files.
-     * Default i2s configuration: 48000Hz, 16bit, Left-Right channels.
-     * Use resampling to be compatible with different file types.
-     *
-     * @brief Control new_codec chip
+     * @brief Control new_codec chip. Start/resume unmutes, stop/pause mutes.
      *
      * @param mode codec mode
      * @param ctrl_state start or stop decode or encode progress
@@ -72,7 +65,9 @@ extern "C"
     esp_err_t new_codec_ctrl_state(audio_hal_codec_mode_t mode, audio_hal_ctrl_t ctrl_state);
 
     /**
-     * @brief Configure new_codec codec mode and I2S interface
+     * @brief Configure new_codec codec mode and I2S interface.
+     *        Only the clock divider and word length registers are updated; a format
+     *        equal to the current one is a no-op.
      *
      * @param mode codec mode
      * @param iface I2S config
@@ -84,7 +79,7 @@ extern "C"
     esp_err_t new_codec_config_i2s(audio_hal_codec_mode_t mode, audio_hal_codec_i2s_iface_t *iface);
 
     /**
-     * @brief mute or unmute the codec
+     * @brief mute or unmute the codec. Takes effect before the call returns.
      *
      * @param mute:  true, false
      *
@@ -95,7 +90,19 @@ extern "C"
     esp_err_t new_codec_set_voice_mute(bool mute);
 
     /**
-     * @brief  Set voice volume
+     * @brief Get the mute state last set with new_codec_set_voice_mute()
+     *
+     * @param[out] *mute:  true when muted
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t new_codec_get_voice_mute(bool *mute);
+
+    /**
+     * @brief  Set voice volume. Queued to the codec task, returns without touching the bus;
+     *         only the latest of several quick requests reaches the chip.
      *
      * @param volume:  voice volume (0~100)
      *
@@ -116,6 +123,28 @@ extern "C"
      */
     esp_err_t new_codec_get_voice_volume(int *volume);
 
+    /**
+     * @brief Get I2C traffic counters of the register cache
+     *
+     * @param[out] transactions  I2C write transactions issued
+     * @param[out] skipped       register writes dropped because the chip already held the value
+     */
+    void new_codec_get_i2c_stats(uint32_t *transactions, uint32_t *skipped);
+
+    /**
+     * @brief Called around every I2C transaction, from the task issuing it
+     * @param begin  true before the transfer, false after it
+     * @param reg    first register written
+     * @param len    registers written
+     * @param ret    result of the transfer, ESP_OK before it
+     */
+    typedef void (*new_codec_i2c_trace_cb)(bool begin, uint8_t reg, int len, esp_err_t ret, void *ctx);
+
+    /**
+     * @brief Install an I2C trace callback, NULL to remove it
+     */
+    void new_codec_set_i2c_trace(new_codec_i2c_trace_cb cb, void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,206 @@
+/* Host benchmark of the file->mp3->i2s pipeline built by app_main()
+
+   The pipeline is the same three-element chain as the firmware, with the
+   fatfs_stream reading from a plain POSIX directory and i2s_stream replaced
+   by pcm_file_sink. Inputs come from the environment because the linux
+   target calls app_main() without arguments:
+
+       BENCH_DIR   directory holding the track (default "/sdcard"). fatfs_stream
+                   only accepts URIs containing "/sdcard" and opens the path from
+                   there on, so mount or symlink the test directory at /sdcard
+       BENCH_FILE  track name inside BENCH_DIR (default "1.mp3")
+       BENCH_OUT   raw PCM output file (default: discard)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "audio_mem.h"
+#include "audio_event_iface.h"
+#include "mp3_decoder.h"
+#include "fatfs_stream.h"
+#include "pcm_file_sink.h"
+
+static const char *TAG = "PIPELINE_BENCH";
+
+static const char *env_or(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return (value && value[0]) ? value : fallback;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double da = *(const double *)a;
+    const double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, int count, double pct)
+{
+    if (count <= 0)
+    {
+        return 0;
+    }
+    int idx = (int)(pct / 100.0 * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void report(const pcm_file_sink_stats_t *stats, const audio_element_info_t *info,
+                   int64_t t_start, int64_t run_us, size_t heap_baseline)
+{
+    const int bytes_per_sample = (info->bits / 8) * info->channels;
+    if (bytes_per_sample <= 0 || info->sample_rates <= 0 || stats->chunk_count == 0)
+    {
+        ESP_LOGE(TAG, "No PCM reached the sink");
+        return;
+    }
+
+    /* MPEG-1 Layer III carries 1152 samples per frame, MPEG-2/2.5 carry 576 */
+    const int frame_samples = info->sample_rates >= 32000 ? 1152 : 576;
+    const double frame_bytes = (double)frame_samples * bytes_per_sample;
+    const double audio_s = (double)stats->total_bytes / bytes_per_sample / info->sample_rates;
+    const double wall_s = run_us / 1e6;
+
+    /* The sink never blocks, so the arrival interval of each chunk is the time the
+       decoder (plus the reader feeding it) spent producing it. Normalise to one frame. */
+    int samples = 0;
+    double *frame_us = malloc(sizeof(double) * (stats->logged_chunks > 0 ? stats->logged_chunks : 1));
+    for (int i = 1; i < stats->logged_chunks; i++)
+    {
+        const pcm_file_sink_chunk_t *c = &stats->chunks[i];
+        if (c->bytes <= 0)
+        {
+            continue;
+        }
+        frame_us[samples++] = (double)(c->t_us - stats->chunks[i - 1].t_us) * frame_bytes / c->bytes;
+    }
+    qsort(frame_us, samples, sizeof(double), compare_double);
+
+    printf("track          : %s\n", info->uri ? info->uri : "?");
+    printf("format         : %d Hz, %d ch, %d bit\n", info->sample_rates, info->channels, info->bits);
+    printf("audio decoded  : %.3f s (%lld bytes, %d chunks)\n", audio_s,
+           (long long)stats->total_bytes, stats->chunk_count);
+    printf("wall time      : %.3f s (first sample after %.1f ms)\n", wall_s,
+           (stats->first_us - t_start) / 1000.0);
+    printf("real-time x    : %.2f (RTF %.4f)\n", audio_s / wall_s, wall_s / audio_s);
+    printf("frame decode us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (%d frames, %d samples/frame)\n",
+           percentile(frame_us, samples, 50), percentile(frame_us, samples, 90),
+           percentile(frame_us, samples, 99), percentile(frame_us, samples, 100),
+           samples, frame_samples);
+    printf("peak heap      : %zu bytes above baseline (%zu absolute)\n",
+           stats->peak_heap_bytes > heap_baseline ? stats->peak_heap_bytes - heap_baseline : 0,
+           stats->peak_heap_bytes);
+    free(frame_us);
+}
+
+void app_main(void)
+{
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "%s/%s", env_or("BENCH_DIR", "/sdcard"), env_or("BENCH_FILE", "1.mp3"));
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    const size_t heap_baseline = pcm_file_sink_heap_in_use();
+
+    ESP_LOGI(TAG, "[ 1 ] Create audio pipeline file->mp3->pcm_sink");
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    audio_pipeline_handle_t pipeline = audio_pipeline_init(&pipeline_cfg);
+    mem_assert(pipeline);
+
+    fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
+    fatfs_cfg.type = AUDIO_STREAM_READER;
+    audio_element_handle_t file_stream = fatfs_stream_init(&fatfs_cfg);
+    audio_element_set_uri(file_stream, file_path);
+
+    mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    audio_element_handle_t mp3_decoder = mp3_decoder_init(&mp3_cfg);
+
+    pcm_file_sink_cfg_t sink_cfg = PCM_FILE_SINK_CFG_DEFAULT();
+    sink_cfg.path = getenv("BENCH_OUT");
+    audio_element_handle_t pcm_sink = pcm_file_sink_init(&sink_cfg);
+    mem_assert(pcm_sink);
+
+    /* Same tags as the firmware so the two logs line up */
+    audio_pipeline_register(pipeline, file_stream, "file");
+    audio_pipeline_register(pipeline, mp3_decoder, "mp3");
+    audio_pipeline_register(pipeline, pcm_sink, "i2s");
+    const char *link_tag[3] = {"file", "mp3", "i2s"};
+    audio_pipeline_link(pipeline, link_tag, 3);
+
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    audio_pipeline_set_listener(pipeline, evt);
+
+    ESP_LOGI(TAG, "[ 2 ] Decode %s", file_path);
+    audio_element_info_t music_info = {0};
+    const int64_t t_start = pcm_file_sink_now_us();
+    audio_pipeline_run(pipeline);
+
+    while (1)
+    {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(evt, &msg, portMAX_DELAY) != ESP_OK)
+        {
+            continue;
+        }
+        if (msg.source_type != AUDIO_ELEMENT_TYPE_ELEMENT)
+        {
+            continue;
+        }
+        if (msg.source == (void *)mp3_decoder && msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO)
+        {
+            audio_element_getinfo(mp3_decoder, &music_info);
+            audio_element_setinfo(pcm_sink, &music_info);
+            continue;
+        }
+        if (msg.cmd != AEL_MSG_CMD_REPORT_STATUS)
+        {
+            continue;
+        }
+        if (msg.source == (void *)pcm_sink && (int)(intptr_t)msg.data == AEL_STATUS_STATE_FINISHED)
+        {
+            break;
+        }
+        if ((int)(intptr_t)msg.data == AEL_STATUS_ERROR_OPEN || (int)(intptr_t)msg.data == AEL_STATUS_ERROR_PROCESS)
+        {
+            ESP_LOGE(TAG, "Element reported error %d, aborting", (int)(intptr_t)msg.data);
+            break;
+        }
+    }
+    const int64_t run_us = pcm_file_sink_now_us() - t_start;
+
+    pcm_file_sink_stats_t stats;
+    pcm_file_sink_get_stats(pcm_sink, &stats);
+    music_info.uri = file_path;
+    report(&stats, &music_info, t_start, run_us, heap_baseline);
+
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_terminate(pipeline);
+    audio_pipeline_remove_listener(pipeline);
+    audio_event_iface_destroy(evt);
+    audio_pipeline_unregister(pipeline, file_stream);
+    audio_pipeline_unregister(pipeline, mp3_decoder);
+    audio_pipeline_unregister(pipeline, pcm_sink);
+    audio_pipeline_deinit(pipeline);
+    audio_element_deinit(file_stream);
+    audio_element_deinit(mp3_decoder);
+    audio_element_deinit(pcm_sink);
+
+    exit(stats.chunk_count > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,186 @@
+/* File-backed PCM sink that stands in for i2s_stream on the host
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "pcm_file_sink.h"
+
+static const char *TAG = "PCM_FILE_SINK";
+
+typedef struct
+{
+    char *path;
+    FILE *file;
+    int max_chunks;
+    pcm_file_sink_chunk_t *chunks;
+    pcm_file_sink_stats_t stats;
+} pcm_file_sink_t;
+
+int64_t pcm_file_sink_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t pcm_file_sink_heap_in_use(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static esp_err_t _sink_open(audio_element_handle_t self)
+{
+    pcm_file_sink_t *sink = (pcm_file_sink_t *)audio_element_getdata(self);
+
+    memset(&sink->stats, 0, sizeof(sink->stats));
+    sink->stats.chunks = sink->chunks;
+    sink->stats.peak_heap_bytes = pcm_file_sink_heap_in_use();
+
+    if (sink->path)
+    {
+        sink->file = fopen(sink->path, "wb");
+        if (sink->file == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to open %s", sink->path);
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+static int _sink_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    pcm_file_sink_t *sink = (pcm_file_sink_t *)audio_element_getdata(self);
+    const int64_t now = pcm_file_sink_now_us();
+
+    if (sink->stats.chunk_count == 0)
+    {
+        sink->stats.first_us = now;
+    }
+    sink->stats.last_us = now;
+    sink->stats.total_bytes += len;
+    if (sink->stats.logged_chunks < sink->max_chunks)
+    {
+        sink->chunks[sink->stats.logged_chunks].t_us = now;
+        sink->chunks[sink->stats.logged_chunks].bytes = len;
+        sink->stats.logged_chunks++;
+    }
+    sink->stats.chunk_count++;
+
+    const size_t heap = pcm_file_sink_heap_in_use();
+    if (heap > sink->stats.peak_heap_bytes)
+    {
+        sink->stats.peak_heap_bytes = heap;
+    }
+
+    if (sink->file && fwrite(buffer, 1, len, sink->file) != (size_t)len)
+    {
+        ESP_LOGE(TAG, "Short write to %s", sink->path);
+        return AEL_IO_FAIL;
+    }
+    return len;
+}
+
+static audio_element_err_t _sink_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    int w_size = 0;
+    if (r_size > 0)
+    {
+        w_size = audio_element_output(self, in_buffer, r_size);
+        if (w_size > 0)
+        {
+            audio_element_update_byte_pos(self, w_size);
+        }
+    }
+    else
+    {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _sink_close(audio_element_handle_t self)
+{
+    pcm_file_sink_t *sink = (pcm_file_sink_t *)audio_element_getdata(self);
+    if (sink->file)
+    {
+        fclose(sink->file);
+        sink->file = NULL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _sink_destroy(audio_element_handle_t self)
+{
+    pcm_file_sink_t *sink = (pcm_file_sink_t *)audio_element_getdata(self);
+    audio_free(sink->chunks);
+    audio_free(sink->path);
+    audio_free(sink);
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_file_sink_init(pcm_file_sink_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, config, return NULL);
+
+    pcm_file_sink_t *sink = audio_calloc(1, sizeof(pcm_file_sink_t));
+    AUDIO_MEM_CHECK(TAG, sink, return NULL);
+
+    sink->max_chunks = config->max_chunks;
+    sink->chunks = audio_calloc(config->max_chunks, sizeof(pcm_file_sink_chunk_t));
+    AUDIO_MEM_CHECK(TAG, sink->chunks, goto _sink_init_failed);
+    if (config->path)
+    {
+        sink->path = audio_strdup(config->path);
+        AUDIO_MEM_CHECK(TAG, sink->path, goto _sink_init_failed);
+    }
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _sink_open;
+    cfg.close = _sink_close;
+    cfg.process = _sink_process;
+    cfg.destroy = _sink_destroy;
+    cfg.write = _sink_write;
+    cfg.buffer_len = config->buffer_len;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.out_rb_size = 0;
+    cfg.tag = "pcm_sink";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _sink_init_failed);
+    audio_element_setdata(el, sink);
+    return el;
+
+_sink_init_failed:
+    audio_free(sink->chunks);
+    audio_free(sink->path);
+    audio_free(sink);
+    return NULL;
+}
+
+esp_err_t pcm_file_sink_get_stats(audio_element_handle_t el, pcm_file_sink_stats_t *stats)
+{
+    if (!el || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pcm_file_sink_t *sink = (pcm_file_sink_t *)audio_element_getdata(el);
+    *stats = sink->stats;
+    return ESP_OK;
+}
@@ -0,0 +1,108 @@
+/* File-backed PCM sink that stands in for i2s_stream on the host
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PCM_FILE_SINK_H__
+#define __PCM_FILE_SINK_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief PCM file sink configuration
+     */
+    typedef struct
+    {
+        const char *path;   /*!< Output file for the raw PCM, NULL to discard the data */
+        int buffer_len;     /*!< Bytes pulled from the input ringbuffer per process call */
+        int max_chunks;     /*!< Capacity of the timestamp log, chunks beyond it are counted but not logged */
+        int task_stack;     /*!< Task stack size */
+        int task_core;      /*!< Task running in core */
+        int task_prio;      /*!< Task priority */
+    } pcm_file_sink_cfg_t;
+
+#define PCM_FILE_SINK_BUF_SIZE (4608) /* One 1152-sample stereo 16-bit MPEG-1 Layer III frame */
+
+#define PCM_FILE_SINK_CFG_DEFAULT()          \
+    {                                        \
+        .path = NULL,                        \
+        .buffer_len = PCM_FILE_SINK_BUF_SIZE, \
+        .max_chunks = 65536,                 \
+        .task_stack = 4096,                  \
+        .task_core = 0,                      \
+        .task_prio = 23,                     \
+    }
+
+    /**
+     * @brief One chunk received by the sink
+     */
+    typedef struct
+    {
+        int64_t t_us; /*!< Monotonic arrival time of the chunk */
+        int32_t bytes; /*!< Bytes in the chunk */
+    } pcm_file_sink_chunk_t;
+
+    /**
+     * @brief Statistics collected by the sink
+     */
+    typedef struct
+    {
+        int64_t first_us;                   /*!< Arrival time of the first chunk */
+        int64_t last_us;                    /*!< Arrival time of the last chunk */
+        int64_t total_bytes;                /*!< PCM bytes received */
+        int chunk_count;                    /*!< Chunks received */
+        int logged_chunks;                  /*!< Entries valid in `chunks` */
+        const pcm_file_sink_chunk_t *chunks; /*!< Per-chunk log, owned by the sink */
+        size_t peak_heap_bytes;             /*!< Peak in-use heap sampled on every chunk */
+    } pcm_file_sink_stats_t;
+
+    /**
+     * @brief Create a writer element that stores raw PCM in a file and timestamps every chunk
+     *
+     * @param config the configuration
+     *
+     * @return The audio element handle
+     */
+    audio_element_handle_t pcm_file_sink_init(pcm_file_sink_cfg_t *config);
+
+    /**
+     * @brief Get the statistics gathered since the element was last opened
+     *
+     * @param el    the sink element
+     * @param stats filled with the statistics, the chunk log stays owned by the sink
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t pcm_file_sink_get_stats(audio_element_handle_t el, pcm_file_sink_stats_t *stats);
+
+    /**
+     * @brief Monotonic clock shared by the sink and the benchmark
+     *
+     * @return microseconds
+     */
+    int64_t pcm_file_sink_now_us(void);
+
+    /**
+     * @brief Heap bytes currently in use by the process
+     *
+     * @return bytes
+     */
+    size_t pcm_file_sink_heap_in_use(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,263 @@
+/* Host benchmark of prompt trigger-to-first-sample latency
+
+   prompt_player runs unchanged against the emulated flash; the output is a
+   model of i2s_direct_sink with the firmware's prompt DMA setup (4 buffers of
+   200 frames at 44.1 kHz, 16 bit stereo):
+
+     - a "DMA" task hands one buffer back per buffer period;
+     - a "music" task plays the pipeline, writing one buffer at a time under
+       the sink lock and blocking for free buffers, as _sink_write() does;
+     - begin() claims the lock and drops the queued buffers like
+       i2s_direct_sink_preempt(); its return is the first prompt sample.
+
+   Prompts are triggered at random points of the DMA cycle, half of them
+   while a previous prompt is still playing. Inputs come from the environment:
+
+       BENCH_PROMPTS   packed image (default: the one built with the bench)
+       BENCH_CLIP      clip to trigger (default "beep")
+       BENCH_TRIGGERS  number of triggers (default 200)
+       BENCH_MUSIC     0 to leave the output idle between prompts (default 1)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "prompt_player.h"
+
+static const char *TAG = "PROMPT_BENCH";
+
+#define BENCH_RATE (44100)
+#define BENCH_FRAME_BYTES (4)
+#define BENCH_DMA_DESC (4)
+#define BENCH_DMA_FRAMES (200)
+#define BENCH_DMA_BYTES (BENCH_DMA_FRAMES * BENCH_FRAME_BYTES)
+#define BENCH_DMA_PERIOD_US (BENCH_DMA_FRAMES * 1000000LL / BENCH_RATE)
+
+typedef struct
+{
+    SemaphoreHandle_t lock;      /* Recursive, as in i2s_direct_sink */
+    SemaphoreHandle_t free_bufs; /* DMA buffers handed back by the "hardware" */
+    SemaphoreHandle_t started;   /* Given on each first prompt sample */
+    volatile int64_t first_us;
+    volatile bool running;
+    volatile bool music;
+    bool claimed;
+    uint32_t music_bufs;
+} bench_sink_t;
+
+static bench_sink_t s_sink;
+
+static const char *env_or(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return (value && value[0]) ? value : fallback;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double da = *(const double *)a;
+    const double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, int count, double pct)
+{
+    if (count <= 0)
+    {
+        return 0;
+    }
+    int idx = (int)(pct / 100.0 * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void delay_until_us(int64_t deadline)
+{
+    const int64_t left = deadline - esp_timer_get_time();
+    vTaskDelay(left > 0 ? pdMS_TO_TICKS((left + 999) / 1000) : 1);
+}
+
+static void dma_task(void *arg)
+{
+    int64_t next = esp_timer_get_time();
+    while (s_sink.running)
+    {
+        next += BENCH_DMA_PERIOD_US;
+        delay_until_us(next);
+        xSemaphoreGive(s_sink.free_bufs);
+    }
+    vTaskDelete(NULL);
+}
+
+static void music_task(void *arg)
+{
+    while (s_sink.running)
+    {
+        if (!s_sink.music)
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        xSemaphoreTakeRecursive(s_sink.lock, portMAX_DELAY);
+        if (xSemaphoreTake(s_sink.free_bufs, pdMS_TO_TICKS(100)) == pdTRUE)
+        {
+            s_sink.music_bufs++;
+        }
+        xSemaphoreGiveRecursive(s_sink.lock);
+    }
+    vTaskDelete(NULL);
+}
+
+static int bench_begin(void *ctx, int rate, int bits, int ch, const void *head, size_t len)
+{
+    if (!s_sink.claimed)
+    {
+        xSemaphoreTakeRecursive(s_sink.lock, portMAX_DELAY);
+        s_sink.claimed = true;
+    }
+    /* Drop the queue: every buffer is free again, then preload up to all of them */
+    while (xSemaphoreGive(s_sink.free_bufs) == pdTRUE)
+    {
+    }
+    size_t loaded = 0;
+    while (loaded < len && xSemaphoreTake(s_sink.free_bufs, 0) == pdTRUE)
+    {
+        loaded += len - loaded < BENCH_DMA_BYTES ? len - loaded : BENCH_DMA_BYTES;
+    }
+    s_sink.first_us = esp_timer_get_time();
+    xSemaphoreGive(s_sink.started);
+    return loaded;
+}
+
+static int bench_write(void *ctx, const void *buf, size_t len, TickType_t ticks)
+{
+    if (xSemaphoreTake(s_sink.free_bufs, ticks) != pdTRUE)
+    {
+        return -1;
+    }
+    return len < BENCH_DMA_BYTES ? len : BENCH_DMA_BYTES;
+}
+
+static void bench_end(void *ctx)
+{
+    s_sink.claimed = false;
+    xSemaphoreGiveRecursive(s_sink.lock);
+}
+
+static esp_err_t flash_image(const char *path)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "assets");
+    if (part == NULL)
+    {
+        ESP_LOGE(TAG, "No assets partition in the emulated flash");
+        return ESP_ERR_NOT_FOUND;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Cannot open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *image = malloc(size > 0 ? size : 1);
+    const bool ok = image && size > 0 && (size_t)size <= part->size && fread(image, 1, size, f) == (size_t)size;
+    fclose(f);
+    esp_err_t ret = ok ? esp_partition_erase_range(part, 0, part->size) : ESP_ERR_INVALID_SIZE;
+    if (ret == ESP_OK)
+    {
+        ret = esp_partition_write(part, 0, image, size);
+    }
+    free(image);
+    ESP_LOGI(TAG, "Flashed %ld bytes of %s into \"assets\": %s", size, path, esp_err_to_name(ret));
+    return ret;
+}
+
+void app_main(void)
+{
+    const char *clip = env_or("BENCH_CLIP", "beep");
+    const int triggers = atoi(env_or("BENCH_TRIGGERS", "200"));
+    s_sink.music = atoi(env_or("BENCH_MUSIC", "1")) != 0;
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    if (triggers <= 0 || flash_image(env_or("BENCH_PROMPTS", BENCH_PROMPTS_BIN)) != ESP_OK)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    s_sink.lock = xSemaphoreCreateRecursiveMutex();
+    s_sink.free_bufs = xSemaphoreCreateCounting(BENCH_DMA_DESC, BENCH_DMA_DESC);
+    s_sink.started = xSemaphoreCreateBinary();
+    s_sink.running = true;
+    xTaskCreate(dma_task, "dma", 4096, NULL, 24, NULL);
+    xTaskCreate(music_task, "music", 4096, NULL, 5, NULL);
+
+    prompt_player_cfg_t cfg = PROMPT_PLAYER_CFG_DEFAULT();
+    cfg.output = (prompt_output_t){
+        .begin = bench_begin,
+        .write = bench_write,
+        .end = bench_end,
+    };
+    prompt_player_handle_t player = prompt_player_init(&cfg);
+    if (player == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    double *lat_us = malloc(sizeof(double) * triggers);
+    int samples = 0;
+    srand(1);
+    for (int i = 0; i < triggers; i++)
+    {
+        /* Even triggers land after the previous prompt has ended, odd ones cut into it */
+        const int64_t gap_us = (i & 1) ? rand() % 20000 : 150000 + rand() % (BENCH_DMA_PERIOD_US * 4);
+        delay_until_us(esp_timer_get_time() + gap_us);
+        xSemaphoreTake(s_sink.started, 0);
+        const int64_t t0 = esp_timer_get_time();
+        if (prompt_player_play(player, clip) != ESP_OK)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (xSemaphoreTake(s_sink.started, pdMS_TO_TICKS(1000)) != pdTRUE)
+        {
+            ESP_LOGE(TAG, "Prompt %d never started", i);
+            continue;
+        }
+        lat_us[samples++] = (double)(s_sink.first_us - t0);
+    }
+    qsort(lat_us, samples, sizeof(double), compare_double);
+
+    prompt_player_stats_t stats;
+    prompt_player_get_stats(player, &stats);
+    printf("clip           : %s, %d triggers, music %s\n", clip, triggers, s_sink.music ? "playing" : "idle");
+    printf("DMA            : %d x %d frames, %lld us per buffer\n", BENCH_DMA_DESC, BENCH_DMA_FRAMES,
+           (long long)BENCH_DMA_PERIOD_US);
+    printf("trigger->first : p50 %.0f  p90 %.0f  p99 %.0f  max %.0f us (%d samples)\n", percentile(lat_us, samples, 50),
+           percentile(lat_us, samples, 90), percentile(lat_us, samples, 99), percentile(lat_us, samples, 100), samples);
+    printf("player stats   : %u played, %u interrupted, avg %llu us, max %u us\n", (unsigned)stats.played,
+           (unsigned)stats.interrupted, (unsigned long long)(stats.played ? stats.total_us / stats.played : 0),
+           (unsigned)stats.max_us);
+    printf("music buffers  : %u\n", (unsigned)s_sink.music_bufs);
+    const bool within = samples == triggers && percentile(lat_us, samples, 100) < 5000;
+    free(lat_us);
+
+    prompt_player_deinit(player);
+    s_sink.running = false;
+    exit(within ? EXIT_SUCCESS : EXIT_FAILURE);
+}
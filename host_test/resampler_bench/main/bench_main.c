@@ -0,0 +1,192 @@
+/* Host benchmark of the polyphase resampler element
+
+   pcm_resampler runs unchanged, fed by a read callback and drained by a
+   write callback, so only the element's own task does any work. Every
+   quality tier converts every MPEG audio rate to both output rates the
+   codec is normally locked at; equal rates are the pass-through case.
+
+   The input is a full-scale-minus-6 dB 1 kHz tone. Cycles per output sample
+   come from the element's stats, counted around the filter loop only, with
+   the bench's esp_cpu.h reading the host time-stamp counter. The wall time
+   covers the whole element, ringbuffer-free callbacks included. Inputs come
+   from the environment:
+
+       BENCH_SECONDS  audio fed per conversion (default 2)
+       BENCH_CH       input channels, 1 or 2 (default 2)
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "pcm_resampler.h"
+
+static const char *TAG = "RESAMPLER_BENCH";
+
+#define BENCH_TONE_HZ (1000)
+
+static const int s_src_rates[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+static const int s_out_rates[] = {44100, 48000};
+static const char *const s_quality_name[] = {"low", "medium", "high"};
+
+typedef struct
+{
+    int rate;
+    int ch;
+    int64_t frames_left;
+    int64_t frame;
+    int64_t out_bytes;
+} bench_io_t;
+
+static const char *env_or(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return (value && value[0]) ? value : fallback;
+}
+
+static int bench_read(audio_element_handle_t el, char *buf, int len, TickType_t ticks, void *ctx)
+{
+    bench_io_t *io = (bench_io_t *)ctx;
+    if (io->frames_left <= 0)
+    {
+        return AEL_IO_DONE;
+    }
+    int16_t *out = (int16_t *)buf;
+    int frames = len / (io->ch * (int)sizeof(int16_t));
+    if (frames > io->frames_left)
+    {
+        frames = (int)io->frames_left;
+    }
+    for (int i = 0; i < frames; i++, io->frame++)
+    {
+        const int16_t v = (int16_t)lrint(16384.0 * sin(2.0 * M_PI * BENCH_TONE_HZ * io->frame / io->rate));
+        for (int c = 0; c < io->ch; c++)
+        {
+            out[i * io->ch + c] = v;
+        }
+    }
+    io->frames_left -= frames;
+    return frames * io->ch * sizeof(int16_t);
+}
+
+static int bench_write(audio_element_handle_t el, char *buf, int len, TickType_t ticks, void *ctx)
+{
+    bench_io_t *io = (bench_io_t *)ctx;
+    io->out_bytes += len;
+    return len;
+}
+
+/* Run one conversion; false if the element failed or produced the wrong amount of audio */
+static bool run_one(pcm_resampler_quality_t quality, int src_rate, int out_rate, int ch, int seconds)
+{
+    pcm_resampler_cfg_t cfg = PCM_RESAMPLER_CFG_DEFAULT();
+    cfg.out_rate = out_rate;
+    cfg.src_rate = src_rate;
+    cfg.src_ch = ch;
+    cfg.quality = quality;
+    audio_element_handle_t rsp = pcm_resampler_init(&cfg);
+    if (rsp == NULL)
+    {
+        return false;
+    }
+
+    bench_io_t io = {
+        .rate = src_rate,
+        .ch = ch,
+        .frames_left = (int64_t)src_rate * seconds,
+    };
+    audio_element_set_read_cb(rsp, bench_read, &io);
+    audio_element_set_write_cb(rsp, bench_write, &io);
+
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    audio_element_msg_set_listener(rsp, evt);
+
+    const int64_t t0 = esp_timer_get_time();
+    audio_element_run(rsp);
+    audio_element_resume(rsp, 0, portMAX_DELAY);
+    int status = 0;
+    while (status != AEL_STATUS_STATE_FINISHED && status != AEL_STATUS_ERROR_OPEN && status != AEL_STATUS_ERROR_PROCESS)
+    {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(evt, &msg, pdMS_TO_TICKS(30000)) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "%d -> %d Hz timed out", src_rate, out_rate);
+            break;
+        }
+        if (msg.source == (void *)rsp && msg.cmd == AEL_MSG_CMD_REPORT_STATUS)
+        {
+            status = (int)(intptr_t)msg.data;
+        }
+    }
+    const int64_t wall_us = esp_timer_get_time() - t0;
+
+    pcm_resampler_stats_t stats;
+    pcm_resampler_get_stats(rsp, &stats);
+    audio_element_terminate(rsp);
+    audio_element_msg_remove_listener(rsp, evt);
+    audio_event_iface_destroy(evt);
+    audio_element_deinit(rsp);
+
+    /* Output is 16-bit stereo; the filter holds back at most one window of input */
+    const int64_t out_frames = io.out_bytes / (2 * sizeof(int16_t));
+    const int64_t expect = (int64_t)out_rate * seconds;
+    const int64_t slack = (int64_t)out_rate * 64 / src_rate + 2;
+    const bool ok = status == AEL_STATUS_STATE_FINISHED && llabs(out_frames - expect) <= slack;
+
+    if (stats.phases == 0)
+    {
+        printf("%-6s %5d -> %5d  pass through                      %8.1f ns/frame  %s\n", s_quality_name[quality],
+               src_rate, out_rate, out_frames ? wall_us * 1000.0 / out_frames : 0.0, ok ? "ok" : "FAIL");
+    }
+    else
+    {
+        printf("%-6s %5d -> %5d  %4d phases x %2d taps  %6u cyc/sample  %8.1f ns/frame  %s\n", s_quality_name[quality],
+               src_rate, out_rate, stats.phases, stats.taps, (unsigned)stats.cycles_per_sample,
+               out_frames ? wall_us * 1000.0 / out_frames : 0.0, ok ? "ok" : "FAIL");
+    }
+    return ok;
+}
+
+void app_main(void)
+{
+    const int seconds = atoi(env_or("BENCH_SECONDS", "2"));
+    const int ch = atoi(env_or("BENCH_CH", "2"));
+
+    esp_log_level_set("*", ESP_LOG_WARN);
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    if (seconds <= 0 || ch < 1 || ch > 2)
+    {
+        ESP_LOGE(TAG, "BENCH_SECONDS must be positive and BENCH_CH 1 or 2");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d s of %d ch input per conversion, cycles counted per output sample, two per stereo frame\n", seconds, ch);
+    int failed = 0;
+    for (int q = PCM_RESAMPLER_QUALITY_LOW; q <= PCM_RESAMPLER_QUALITY_HIGH; q++)
+    {
+        for (size_t o = 0; o < sizeof(s_out_rates) / sizeof(s_out_rates[0]); o++)
+        {
+            for (size_t s = 0; s < sizeof(s_src_rates) / sizeof(s_src_rates[0]); s++)
+            {
+                failed += !run_one((pcm_resampler_quality_t)q, s_src_rates[s], s_out_rates[o], ch, seconds);
+            }
+        }
+    }
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
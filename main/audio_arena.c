@@ -0,0 +1,476 @@
+/* Arena allocation for the audio pipeline, with per-owner peak usage
+
+   Elements, ringbuffers and event queues are allocated through ADF's
+   audio_malloc() family and FreeRTOS' xQueueGenericCreate(). With
+   CONFIG_PLAYER_ARENA the link wraps those (-Wl,--wrap, see
+   CMakeLists.txt), so allocations made by a task inside an owner scope
+   come from two regions allocated once at boot, one in internal
+   DMA-capable RAM and one in PSRAM, instead of the heap:
+
+     - each region is a bump allocator with a 16-byte header per block.
+       Freeing the top block moves the top back, across blocks freed
+       earlier, so objects torn down in reverse order give their space
+       back; other frees are only bookkeeping;
+     - audio_arena_reset() drops everything at once, so rebuilding the
+       pipeline never touches, and never fragments, the heap;
+     - queues are created static, their storage in the internal region;
+     - a request that does not fit goes to the heap and is counted, so
+       the report shows how much bigger the arena should be.
+
+   Allocations by tasks outside an owner scope, e.g. the URI strdup of a
+   running element, go to the heap as before.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "audio_mem.h"
+#include "audio_arena.h"
+
+static const char *TAG = "AUDIO_ARENA";
+
+#define ARENA_ALIGN (16)
+#define ARENA_BLOCK_MAGIC (0xA7E4)
+#define ARENA_NONE (UINT32_MAX)
+/* Tasks that can be inside an owner scope at the same time */
+#define ARENA_SCOPES (8)
+
+typedef struct
+{
+    uint32_t size; /* Payload bytes, a multiple of ARENA_ALIGN */
+    uint32_t prev; /* Offset of the previous block's header, ARENA_NONE for the first */
+    uint16_t magic;
+    uint8_t owner;
+    uint8_t freed;
+    uint32_t reserved;
+} arena_block_t;
+
+_Static_assert(sizeof(arena_block_t) == ARENA_ALIGN, "block header must keep payloads aligned");
+
+typedef struct
+{
+    uint8_t *base;
+    uint32_t size;
+    uint32_t top;
+    uint32_t last; /* Offset of the top block's header */
+    uint32_t peak;
+} arena_region_t;
+
+typedef struct
+{
+    TaskHandle_t task;
+    uint8_t owner;
+    audio_arena_region_t region;
+} arena_scope_t;
+
+typedef enum
+{
+    REGION_INTERNAL = 0,
+    REGION_PSRAM,
+    REGION_COUNT,
+} region_id_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_ready;
+static arena_region_t s_regions[REGION_COUNT];
+static arena_scope_t s_scopes[ARENA_SCOPES];
+static audio_arena_owner_stats_t s_owners[AUDIO_ARENA_MAX_OWNERS];
+static int s_owner_count;
+static uint32_t s_heap_fallback;
+
+#if CONFIG_PLAYER_ARENA
+
+static void region_free_block(arena_region_t *r, arena_block_t *blk)
+{
+    blk->freed = 1;
+    /* Give back the top and everything freed directly below it */
+    while (r->last != ARENA_NONE)
+    {
+        arena_block_t *top = (arena_block_t *)(r->base + r->last);
+        if (!top->freed)
+        {
+            break;
+        }
+        r->top = r->last;
+        r->last = top->prev;
+    }
+}
+
+static int region_of(const void *ptr)
+{
+    for (int i = 0; i < REGION_COUNT; i++)
+    {
+        const arena_region_t *r = &s_regions[i];
+        if (r->base && (const uint8_t *)ptr >= r->base && (const uint8_t *)ptr < r->base + r->size)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void owner_count(int owner, int region, int32_t bytes)
+{
+    audio_arena_owner_stats_t *o = &s_owners[owner];
+    if (region == REGION_INTERNAL)
+    {
+        o->internal_bytes += bytes;
+    }
+    else
+    {
+        o->psram_bytes += bytes;
+    }
+    if (o->internal_bytes + o->psram_bytes > o->peak_bytes)
+    {
+        o->peak_bytes = o->internal_bytes + o->psram_bytes;
+    }
+}
+
+/* Owner and region of the calling task's scope; false outside one. Called with the lock held. */
+static bool scope_get(int *owner, audio_arena_region_t *region)
+{
+    if (!s_ready)
+    {
+        return false;
+    }
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < ARENA_SCOPES; i++)
+    {
+        if (s_scopes[i].task == self)
+        {
+            *owner = s_scopes[i].owner;
+            *region = s_scopes[i].region;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* NULL when the caller is outside a scope or the block does not fit: the caller then uses the heap */
+static void *arena_alloc(size_t size, bool inner)
+{
+    void *ptr = NULL;
+    int owner;
+    audio_arena_region_t want;
+    portENTER_CRITICAL(&s_lock);
+    if (!scope_get(&owner, &want) || size > UINT32_MAX - 2 * ARENA_ALIGN)
+    {
+        goto _exit;
+    }
+    region_id_t id = REGION_INTERNAL;
+    if (!inner && want != AUDIO_ARENA_INTERNAL && s_regions[REGION_PSRAM].size)
+    {
+        id = REGION_PSRAM;
+    }
+    arena_region_t *r = &s_regions[id];
+    const uint32_t payload = (size + ARENA_ALIGN - 1) & ~(uint32_t)(ARENA_ALIGN - 1);
+    if (r->size - r->top < sizeof(arena_block_t) + payload)
+    {
+        s_owners[owner].heap_bytes += size;
+        s_heap_fallback += size;
+        goto _exit;
+    }
+    arena_block_t *blk = (arena_block_t *)(r->base + r->top);
+    blk->size = payload;
+    blk->prev = r->last;
+    blk->magic = ARENA_BLOCK_MAGIC;
+    blk->owner = owner;
+    blk->freed = 0;
+    r->last = r->top;
+    r->top += sizeof(arena_block_t) + payload;
+    if (r->top > r->peak)
+    {
+        r->peak = r->top;
+    }
+    s_owners[owner].allocs++;
+    owner_count(owner, id, payload);
+    ptr = blk + 1;
+
+_exit:
+    portEXIT_CRITICAL(&s_lock);
+    return ptr;
+}
+
+/* Payload size of an arena block, 0 if `ptr` is not one */
+static size_t arena_size(void *ptr)
+{
+    if (region_of(ptr) < 0)
+    {
+        return 0;
+    }
+    return ((arena_block_t *)ptr - 1)->size;
+}
+
+static bool arena_free(void *ptr)
+{
+    bool ours = false;
+    portENTER_CRITICAL(&s_lock);
+    const int id = region_of(ptr);
+    if (id >= 0)
+    {
+        ours = true;
+        arena_block_t *blk = (arena_block_t *)ptr - 1;
+        if (blk->magic != ARENA_BLOCK_MAGIC || blk->freed)
+        {
+            portEXIT_CRITICAL(&s_lock);
+            ESP_LOGE(TAG, "Bad or double free of %p", ptr);
+            return true;
+        }
+        owner_count(blk->owner, id, -(int32_t)blk->size);
+        region_free_block(&s_regions[id], blk);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ours;
+}
+
+void *__real_audio_malloc(size_t size);
+void *__real_audio_calloc(size_t nmemb, size_t size);
+void *__real_audio_calloc_inner(size_t nmemb, size_t size);
+void *__real_audio_realloc(void *ptr, size_t size);
+void __real_audio_free(void *ptr);
+QueueHandle_t __real_xQueueGenericCreate(const UBaseType_t len, const UBaseType_t item_size, const uint8_t type);
+
+void *__wrap_audio_malloc(size_t size)
+{
+    void *ptr = arena_alloc(size, false);
+    return ptr ? ptr : __real_audio_malloc(size);
+}
+
+void *__wrap_audio_calloc(size_t nmemb, size_t size)
+{
+    if (size && nmemb > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+    void *ptr = arena_alloc(nmemb * size, false);
+    if (ptr == NULL)
+    {
+        return __real_audio_calloc(nmemb, size);
+    }
+    memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void *__wrap_audio_calloc_inner(size_t nmemb, size_t size)
+{
+    if (size && nmemb > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+    void *ptr = arena_alloc(nmemb * size, true);
+    if (ptr == NULL)
+    {
+        return __real_audio_calloc_inner(nmemb, size);
+    }
+    memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+void __wrap_audio_free(void *ptr)
+{
+    if (ptr && !arena_free(ptr))
+    {
+        __real_audio_free(ptr);
+    }
+}
+
+void *__wrap_audio_realloc(void *ptr, size_t size)
+{
+    const size_t old = ptr ? arena_size(ptr) : 0;
+    if (ptr && old == 0)
+    {
+        return __real_audio_realloc(ptr, size);
+    }
+    if (ptr && size <= old)
+    {
+        return ptr;
+    }
+    void *grown = __wrap_audio_malloc(size);
+    if (grown && ptr)
+    {
+        memcpy(grown, ptr, old);
+        arena_free(ptr);
+    }
+    return grown;
+}
+
+QueueHandle_t __wrap_xQueueGenericCreate(const UBaseType_t len, const UBaseType_t item_size, const uint8_t type)
+{
+    /* Storage after the control block, both internal: queues are used from ISRs */
+    const size_t control = (sizeof(StaticQueue_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    uint8_t *mem = arena_alloc(control + (size_t)len * item_size, true);
+    if (mem == NULL)
+    {
+        return __real_xQueueGenericCreate(len, item_size, type);
+    }
+    QueueHandle_t q = xQueueGenericCreateStatic(len, item_size, item_size ? mem + control : NULL, (StaticQueue_t *)mem, type);
+    if (q == NULL)
+    {
+        arena_free(mem);
+    }
+    return q;
+}
+
+#endif /* CONFIG_PLAYER_ARENA */
+
+esp_err_t audio_arena_init(const audio_arena_cfg_t *cfg)
+{
+#if !CONFIG_PLAYER_ARENA
+    ESP_LOGE(TAG, "Built without CONFIG_PLAYER_ARENA");
+    return ESP_ERR_INVALID_STATE;
+#else
+    if (cfg == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_ready)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint8_t *internal = heap_caps_aligned_alloc(ARENA_ALIGN, cfg->internal_size,
+                                                MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    uint8_t *psram = cfg->psram_size ? heap_caps_aligned_alloc(ARENA_ALIGN, cfg->psram_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+                                     : NULL;
+    if (internal == NULL || (cfg->psram_size && psram == NULL))
+    {
+        ESP_LOGE(TAG, "Cannot allocate %u KB internal + %u KB PSRAM", (unsigned)(cfg->internal_size / 1024),
+                 (unsigned)(cfg->psram_size / 1024));
+        heap_caps_free(internal);
+        heap_caps_free(psram);
+        return ESP_ERR_NO_MEM;
+    }
+    portENTER_CRITICAL(&s_lock);
+    s_regions[REGION_INTERNAL] = (arena_region_t){.base = internal, .size = cfg->internal_size, .last = ARENA_NONE};
+    s_regions[REGION_PSRAM] = (arena_region_t){.base = psram, .size = psram ? cfg->psram_size : 0, .last = ARENA_NONE};
+    s_ready = true;
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGI(TAG, "%u KB internal, %u KB PSRAM", (unsigned)(cfg->internal_size / 1024), (unsigned)(cfg->psram_size / 1024));
+    return ESP_OK;
+#endif
+}
+
+void audio_arena_owner_begin(const char *owner, audio_arena_region_t region)
+{
+    if (!s_ready || owner == NULL)
+    {
+        return;
+    }
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    bool placed = false;
+    portENTER_CRITICAL(&s_lock);
+    int idx = 0;
+    while (idx < s_owner_count && strcmp(s_owners[idx].name, owner) != 0)
+    {
+        idx++;
+    }
+    if (idx == s_owner_count && s_owner_count < AUDIO_ARENA_MAX_OWNERS)
+    {
+        s_owners[s_owner_count++].name = owner;
+    }
+    int slot = -1;
+    for (int i = 0; i < ARENA_SCOPES && idx < s_owner_count; i++)
+    {
+        if (s_scopes[i].task == self || (slot < 0 && s_scopes[i].task == NULL))
+        {
+            slot = i;
+        }
+    }
+    if (slot >= 0)
+    {
+        s_scopes[slot] = (arena_scope_t){.task = self, .owner = idx, .region = region};
+        placed = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (!placed)
+    {
+        ESP_LOGW(TAG, "No room to track owner %s, its allocations use the heap", owner);
+    }
+}
+
+void audio_arena_owner_end(void)
+{
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < ARENA_SCOPES; i++)
+    {
+        if (s_scopes[i].task == self)
+        {
+            s_scopes[i].task = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void audio_arena_reset(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < REGION_COUNT; i++)
+    {
+        s_regions[i].top = 0;
+        s_regions[i].last = ARENA_NONE;
+    }
+    for (int i = 0; i < s_owner_count; i++)
+    {
+        s_owners[i].internal_bytes = 0;
+        s_owners[i].psram_bytes = 0;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+esp_err_t audio_arena_get_stats(audio_arena_stats_t *stats, audio_arena_owner_stats_t *owners, int *n_owners)
+{
+    if (stats == NULL || (owners && n_owners == NULL))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&s_lock);
+    stats->internal_size = s_regions[REGION_INTERNAL].size;
+    stats->psram_size = s_regions[REGION_PSRAM].size;
+    stats->internal_used = s_regions[REGION_INTERNAL].top;
+    stats->psram_used = s_regions[REGION_PSRAM].top;
+    stats->internal_peak = s_regions[REGION_INTERNAL].peak;
+    stats->psram_peak = s_regions[REGION_PSRAM].peak;
+    stats->heap_fallback = s_heap_fallback;
+    stats->owners = s_owner_count;
+    if (owners)
+    {
+        const int n = *n_owners < s_owner_count ? *n_owners : s_owner_count;
+        memcpy(owners, s_owners, n * sizeof(*owners));
+        *n_owners = n;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    stats->heap_internal_min = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    stats->heap_dma_min = heap_caps_get_minimum_free_size(MALLOC_CAP_DMA);
+    stats->heap_dma_largest = heap_caps_get_largest_free_block(MALLOC_CAP_DMA);
+    stats->heap_psram_min = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    return ESP_OK;
+}
+
+void audio_arena_report(void)
+{
+    audio_arena_stats_t st;
+    audio_arena_owner_stats_t owners[AUDIO_ARENA_MAX_OWNERS];
+    int n = AUDIO_ARENA_MAX_OWNERS;
+    audio_arena_get_stats(&st, owners, &n);
+    ESP_LOGI(TAG, "%-12s %9s %9s %9s %9s %6s", "owner", "internal", "psram", "peak", "heap", "allocs");
+    for (int i = 0; i < n; i++)
+    {
+        ESP_LOGI(TAG, "%-12s %9u %9u %9u %9u %6u", owners[i].name, (unsigned)owners[i].internal_bytes,
+                 (unsigned)owners[i].psram_bytes, (unsigned)owners[i].peak_bytes, (unsigned)owners[i].heap_bytes,
+                 (unsigned)owners[i].allocs);
+    }
+    ESP_LOGI(TAG, "internal: %u used, %u peak of %u; PSRAM: %u used, %u peak of %u; %u bytes fell back to the heap",
+             (unsigned)st.internal_used, (unsigned)st.internal_peak, (unsigned)st.internal_size, (unsigned)st.psram_used,
+             (unsigned)st.psram_peak, (unsigned)st.psram_size, (unsigned)st.heap_fallback);
+    ESP_LOGI(TAG, "heap low-water: internal %u, DMA %u (largest block now %u), PSRAM %u", (unsigned)st.heap_internal_min,
+             (unsigned)st.heap_dma_min, (unsigned)st.heap_dma_largest, (unsigned)st.heap_psram_min);
+}
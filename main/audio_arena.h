@@ -0,0 +1,129 @@
+/* Arena allocation for the audio pipeline, with per-owner peak usage
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __AUDIO_ARENA_H__
+#define __AUDIO_ARENA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define AUDIO_ARENA_MAX_OWNERS (16)
+
+    /**
+     * @brief Where an owner's allocations are carved from
+     */
+    typedef enum
+    {
+        AUDIO_ARENA_AUTO = 0, /*!< As ADF would: audio_calloc_inner() internal, the rest PSRAM when there is a PSRAM portion */
+        AUDIO_ARENA_INTERNAL, /*!< Internal, DMA-capable RAM */
+        AUDIO_ARENA_PSRAM,    /*!< PSRAM, falling back to internal without a PSRAM portion */
+    } audio_arena_region_t;
+
+    /**
+     * @brief Arena sizes, both allocated once at init
+     */
+    typedef struct
+    {
+        size_t internal_size; /*!< Internal, DMA-capable portion */
+        size_t psram_size;    /*!< PSRAM portion, 0 for none */
+    } audio_arena_cfg_t;
+
+#define AUDIO_ARENA_CFG_DEFAULT()   \
+    {                               \
+        .internal_size = 96 * 1024, \
+        .psram_size = 1024 * 1024,  \
+    }
+
+    /**
+     * @brief Usage of one owner
+     */
+    typedef struct
+    {
+        const char *name;        /*!< As passed to audio_arena_owner_begin() */
+        uint32_t internal_bytes; /*!< Now in the internal portion */
+        uint32_t psram_bytes;    /*!< Now in the PSRAM portion */
+        uint32_t peak_bytes;     /*!< Highest internal + PSRAM total, kept across resets */
+        uint32_t heap_bytes;     /*!< Requests that did not fit and went to the heap, since init */
+        uint32_t allocs;         /*!< Allocations served by the arena, since init */
+    } audio_arena_owner_stats_t;
+
+    /**
+     * @brief Arena and heap usage
+     */
+    typedef struct
+    {
+        uint32_t internal_size;     /*!< Portion sizes */
+        uint32_t psram_size;
+        uint32_t internal_used;     /*!< Bytes below the top of each portion, headers included */
+        uint32_t psram_used;
+        uint32_t internal_peak;     /*!< Highest top since init: the size this build needs */
+        uint32_t psram_peak;
+        uint32_t heap_fallback;     /*!< Bytes that went to the heap because a portion was full */
+        uint32_t heap_internal_min; /*!< heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL) */
+        uint32_t heap_dma_min;      /*!< Same, MALLOC_CAP_DMA */
+        uint32_t heap_dma_largest;  /*!< Largest free DMA-capable block now; shrinks as the heap fragments */
+        uint32_t heap_psram_min;    /*!< Same as heap_internal_min, MALLOC_CAP_SPIRAM */
+        int owners;                 /*!< Owners seen */
+    } audio_arena_stats_t;
+
+    /**
+     * @brief Allocate the arena. Until then, and for tasks outside an owner scope, the
+     *        allocation functions behave as without the arena.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_STATE  already initialised, or the build does not wrap the allocators
+     *     - ESP_ERR_NO_MEM
+     */
+    esp_err_t audio_arena_init(const audio_arena_cfg_t *cfg);
+
+    /**
+     * @brief From now on, audio_malloc() & co. and queue creations made by the calling task are
+     *        carved from the arena and counted against `owner`, until audio_arena_owner_end()
+     *        or the next begin. A no-op without the arena.
+     *
+     * @param owner  name, kept by pointer: use a literal
+     * @param region where to place them
+     */
+    void audio_arena_owner_begin(const char *owner, audio_arena_region_t region);
+
+    /**
+     * @brief End the calling task's owner scope
+     */
+    void audio_arena_owner_end(void);
+
+    /**
+     * @brief Forget every arena allocation at once. Everything allocated from it must be
+     *        unused by now, e.g. the pipeline and its elements torn down. Frees of arena
+     *        blocks are otherwise only bookkeeping, so teardown order does not matter.
+     */
+    void audio_arena_reset(void);
+
+    /**
+     * @brief Get the usage; `owners` may be NULL, else it receives up to `*n_owners` entries
+     *        and `*n_owners` is set to how many were written
+     */
+    esp_err_t audio_arena_get_stats(audio_arena_stats_t *stats, audio_arena_owner_stats_t *owners, int *n_owners);
+
+    /**
+     * @brief Log the usage per owner and the heap high-water marks, for sizing the arena
+     */
+    void audio_arena_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/* Chainable hooks on the ringbuffer links between pipeline elements
+
+   An element has a single read and a single write callback. Several features
+   (gapless trimming, telemetry, ...) want to see the same link, so the
+   callback is owned here and dispatches to a chain of hooks whose innermost
+   link is the ringbuffer the element would otherwise have used.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "esp_log.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+
+static const char *TAG = "AUDIO_IO_HOOK";
+
+typedef struct
+{
+    audio_element_handle_t el;
+    audio_io_hook_dir_t dir;
+    audio_io_hook_t *head;
+} audio_io_chain_t;
+
+static audio_io_chain_t s_chains[AUDIO_IO_HOOK_MAX_CHAINS];
+
+static int _chain_read_cb(audio_element_handle_t el, char *buf, int len, TickType_t ticks, void *ctx)
+{
+    audio_io_chain_t *chain = (audio_io_chain_t *)ctx;
+    if (chain->head)
+    {
+        return chain->head->fn(chain->head, el, buf, len, ticks);
+    }
+    return rb_read(audio_element_get_input_ringbuf(el), buf, len, ticks);
+}
+
+static int _chain_write_cb(audio_element_handle_t el, char *buf, int len, TickType_t ticks, void *ctx)
+{
+    audio_io_chain_t *chain = (audio_io_chain_t *)ctx;
+    if (chain->head)
+    {
+        return chain->head->fn(chain->head, el, buf, len, ticks);
+    }
+    return rb_write(audio_element_get_output_ringbuf(el), buf, len, ticks);
+}
+
+static void install_chain(audio_io_chain_t *chain)
+{
+    if (chain->dir == AUDIO_IO_HOOK_READ)
+    {
+        audio_element_set_read_cb(chain->el, _chain_read_cb, chain);
+    }
+    else
+    {
+        audio_element_set_write_cb(chain->el, _chain_write_cb, chain);
+    }
+}
+
+static audio_io_chain_t *find_chain(audio_element_handle_t el, audio_io_hook_dir_t dir)
+{
+    for (int i = 0; i < AUDIO_IO_HOOK_MAX_CHAINS; i++)
+    {
+        if (s_chains[i].el == el && s_chains[i].dir == dir)
+        {
+            return &s_chains[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t get_chain(audio_element_handle_t el, audio_io_hook_dir_t dir, bool need_rb, audio_io_chain_t **out)
+{
+    audio_io_chain_t *chain = find_chain(el, dir);
+    if (chain == NULL)
+    {
+        ringbuf_handle_t rb = dir == AUDIO_IO_HOOK_READ ? audio_element_get_input_ringbuf(el) : audio_element_get_output_ringbuf(el);
+        if (need_rb && rb == NULL)
+        {
+            ESP_LOGE(TAG, "[%s] has no %s ringbuffer to hook", audio_element_get_tag(el), dir == AUDIO_IO_HOOK_READ ? "input" : "output");
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (int i = 0; i < AUDIO_IO_HOOK_MAX_CHAINS && chain == NULL; i++)
+        {
+            if (s_chains[i].el == NULL)
+            {
+                chain = &s_chains[i];
+            }
+        }
+        if (chain == NULL)
+        {
+            ESP_LOGE(TAG, "No free hook chain");
+            return ESP_ERR_NO_MEM;
+        }
+        chain->el = el;
+        chain->dir = dir;
+        chain->head = NULL;
+        install_chain(chain);
+    }
+    *out = chain;
+    return ESP_OK;
+}
+
+esp_err_t audio_io_hook_add(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *hook)
+{
+    AUDIO_NULL_CHECK(TAG, el && hook && hook->fn, return ESP_ERR_INVALID_ARG);
+
+    /* A chain that already exists ends in a ringbuffer or a sink */
+    audio_io_chain_t *chain;
+    esp_err_t ret = get_chain(el, dir, true, &chain);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    hook->dir = dir;
+    hook->next = chain->head;
+    chain->head = hook;
+    return ESP_OK;
+}
+
+esp_err_t audio_io_hook_set_sink(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *sink)
+{
+    AUDIO_NULL_CHECK(TAG, el && sink && sink->fn, return ESP_ERR_INVALID_ARG);
+
+    audio_io_chain_t *chain;
+    esp_err_t ret = get_chain(el, dir, false, &chain);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    audio_io_hook_t **pp = &chain->head;
+    while (*pp)
+    {
+        pp = &(*pp)->next;
+    }
+    sink->dir = dir;
+    sink->next = NULL;
+    *pp = sink;
+    return ESP_OK;
+}
+
+esp_err_t audio_io_hook_remove(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *hook)
+{
+    audio_io_chain_t *chain = find_chain(el, dir);
+    if (chain == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    for (audio_io_hook_t **pp = &chain->head; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == hook)
+        {
+            *pp = hook->next;
+            hook->next = NULL;
+            /* The chain stays installed and falls through to the ringbuffer when empty */
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t audio_io_hook_reinstall(audio_element_handle_t el)
+{
+    AUDIO_NULL_CHECK(TAG, el, return ESP_ERR_INVALID_ARG);
+
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    for (int i = 0; i < AUDIO_IO_HOOK_MAX_CHAINS; i++)
+    {
+        if (s_chains[i].el == el)
+        {
+            install_chain(&s_chains[i]);
+            ret = ESP_OK;
+        }
+    }
+    return ret;
+}
+
+int audio_io_hook_next(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    if (hook->next)
+    {
+        return hook->next->fn(hook->next, el, buf, len, ticks);
+    }
+    if (hook->dir == AUDIO_IO_HOOK_READ)
+    {
+        return rb_read(audio_element_get_input_ringbuf(el), buf, len, ticks);
+    }
+    return rb_write(audio_element_get_output_ringbuf(el), buf, len, ticks);
+}
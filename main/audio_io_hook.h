@@ -0,0 +1,104 @@
+/* Chainable hooks on the ringbuffer links between pipeline elements
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __AUDIO_IO_HOOK_H__
+#define __AUDIO_IO_HOOK_H__
+
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Elements x directions that can carry a hook chain at once */
+#define AUDIO_IO_HOOK_MAX_CHAINS (8)
+
+    /**
+     * @brief Which side of an element a hook sits on
+     */
+    typedef enum
+    {
+        AUDIO_IO_HOOK_READ = 0, /*!< audio_element_input() of an element fed by a ringbuffer */
+        AUDIO_IO_HOOK_WRITE,    /*!< audio_element_output() of an element feeding a ringbuffer */
+    } audio_io_hook_dir_t;
+
+    typedef struct audio_io_hook audio_io_hook_t;
+
+    /**
+     * @brief Hook function. Same contract as a stream callback: return bytes moved or an AEL_IO_* code.
+     *        Call audio_io_hook_next() to pass (possibly different) data further along the chain.
+     */
+    typedef int (*audio_io_hook_fn)(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks);
+
+    /**
+     * @brief A hook, normally embedded in its owner's state. Must outlive its registration.
+     */
+    struct audio_io_hook
+    {
+        audio_io_hook_fn fn;     /*!< Called from the element task */
+        void *ctx;               /*!< Owner context */
+        audio_io_hook_t *next;   /*!< Managed by the chain */
+        audio_io_hook_dir_t dir; /*!< Managed by the chain */
+    };
+
+    /**
+     * @brief Add a hook in front of the chain of `el`, so the last hook added runs first.
+     *        The innermost link is the element's ringbuffer, which therefore must exist,
+     *        or a sink set with audio_io_hook_set_sink(): do this after audio_pipeline_link()
+     *        and while the pipeline is stopped.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NO_MEM  all chains are in use
+     */
+    esp_err_t audio_io_hook_add(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *hook);
+
+    /**
+     * @brief Terminate the chain of `el` with `sink` instead of a ringbuffer, for an element
+     *        whose output (or input) is not linked to another element. The sink is the innermost
+     *        link and never calls audio_io_hook_next(); hooks added later run before it.
+     *        Install it before any audio_io_hook_add() on the same side.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NO_MEM  all chains are in use
+     */
+    esp_err_t audio_io_hook_set_sink(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *sink);
+
+    /**
+     * @brief Unlink a hook. The pipeline must be stopped.
+     */
+    esp_err_t audio_io_hook_remove(audio_element_handle_t el, audio_io_hook_dir_t dir, audio_io_hook_t *hook);
+
+    /**
+     * @brief Give the callbacks of `el` back to its chains. Setting a ringbuffer on an element
+     *        switches it back to ringbuffer I/O, which bypasses its hooks, and
+     *        audio_pipeline_relink() does that to every element it links: call this on each of
+     *        them afterwards, with the pipeline still stopped.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NOT_FOUND  no hooks on `el`
+     */
+    esp_err_t audio_io_hook_reinstall(audio_element_handle_t el);
+
+    /**
+     * @brief Pass data to the next hook, or to the ringbuffer at the end of the chain
+     */
+    int audio_io_hook_next(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+/* Interrupt-driven GPIO buttons
+
+   Every key interrupts on both edges. The handler only stamps the first
+   edge and notifies the button task, which reads the level and runs a
+   small state machine per key:
+
+     - stable: a level different from the debounced state is accepted at
+       once, a press is reported with the time of its first edge, and the
+       key becomes settling;
+     - settling: edges are contact bounce and ignored until debounce_ms
+       after the accepted change; then the level is read again, so a
+       bounce that ended on the other level is not missed.
+
+   A press is therefore acted on within the interrupt latency and one task
+   switch, instead of a poll period plus a debounce window.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "button_input.h"
+
+static const char *TAG = "BUTTON_INPUT";
+
+#define BUTTON_INPUT_EXIT_BIT (1UL << 31)
+
+typedef struct button_input button_input_t;
+
+typedef struct
+{
+    button_input_t *btn;
+    int gpio;
+    int id;
+    uint32_t bit;
+    int64_t edge_us;      /* First edge since the task last looked, 0 if none; under `lock` */
+    bool pressed;         /* Debounced state, button task only */
+    int64_t settle_until; /* End of the bounce window, 0 when stable; button task only */
+} button_key_t;
+
+struct button_input
+{
+    button_input_cfg_t cfg;
+    button_key_t keys[BUTTON_INPUT_MAX_KEYS];
+    int key_count;
+    TaskHandle_t task;
+    SemaphoreHandle_t exited;
+    portMUX_TYPE lock;
+    volatile uint32_t edges;
+    button_input_stats_t stats;
+};
+
+static void IRAM_ATTR _gpio_isr(void *arg)
+{
+    button_key_t *k = (button_key_t *)arg;
+    button_input_t *btn = k->btn;
+    const int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&btn->lock);
+    if (k->edge_us == 0)
+    {
+        k->edge_us = now;
+    }
+    btn->edges++;
+    portEXIT_CRITICAL_ISR(&btn->lock);
+
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(btn->task, k->bit, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static bool key_level_pressed(const button_input_t *btn, const button_key_t *k)
+{
+    return gpio_get_level(k->gpio) == (btn->cfg.active_low ? 0 : 1);
+}
+
+static void key_update(button_input_t *btn, button_key_t *k, int64_t now)
+{
+    portENTER_CRITICAL(&btn->lock);
+    int64_t edge_us = k->edge_us;
+    k->edge_us = 0;
+    portEXIT_CRITICAL(&btn->lock);
+
+    if (k->settle_until)
+    {
+        if (now < k->settle_until)
+        {
+            return;
+        }
+        k->settle_until = 0;
+    }
+
+    const bool pressed = key_level_pressed(btn, k);
+    if (pressed == k->pressed)
+    {
+        return;
+    }
+    k->pressed = pressed;
+    k->settle_until = now + (int64_t)btn->cfg.debounce_ms * 1000;
+    if (!pressed)
+    {
+        btn->stats.releases++;
+        return;
+    }
+
+    /* Found at the end of a bounce window: the edge that started it was discarded */
+    if (edge_us == 0)
+    {
+        edge_us = now;
+    }
+    if (btn->cfg.on_press)
+    {
+        btn->cfg.on_press(k->id, edge_us, btn->cfg.ctx);
+    }
+    const int64_t took = esp_timer_get_time() - edge_us;
+    btn->stats.presses++;
+    btn->stats.last_us = took > UINT32_MAX ? UINT32_MAX : (uint32_t)took;
+    if (btn->stats.last_us > btn->stats.max_us)
+    {
+        btn->stats.max_us = btn->stats.last_us;
+    }
+    ESP_LOGD(TAG, "Key %d pressed, %u us after its edge", k->id, (unsigned)btn->stats.last_us);
+}
+
+static void button_input_task(void *arg)
+{
+    button_input_t *btn = (button_input_t *)arg;
+    TickType_t wait = portMAX_DELAY;
+
+    while (1)
+    {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+        if (bits & BUTTON_INPUT_EXIT_BIT)
+        {
+            break;
+        }
+
+        const int64_t now = esp_timer_get_time();
+        int64_t next_settle = INT64_MAX;
+        for (int i = 0; i < btn->key_count; i++)
+        {
+            button_key_t *k = &btn->keys[i];
+            if ((bits & k->bit) || (k->settle_until && now >= k->settle_until))
+            {
+                key_update(btn, k, now);
+            }
+            if (k->settle_until && k->settle_until < next_settle)
+            {
+                next_settle = k->settle_until;
+            }
+        }
+
+        /* Wake at the end of the earliest bounce window to read its level again */
+        wait = portMAX_DELAY;
+        if (next_settle != INT64_MAX)
+        {
+            const int64_t left_us = next_settle - esp_timer_get_time();
+            const int64_t tick_us = (int64_t)portTICK_PERIOD_MS * 1000;
+            wait = left_us > 0 ? (TickType_t)((left_us + tick_us - 1) / tick_us) : 0;
+        }
+    }
+    xSemaphoreGive(btn->exited);
+    vTaskDelete(NULL);
+}
+
+static void release(button_input_t *btn)
+{
+    for (int i = 0; i < btn->key_count; i++)
+    {
+        gpio_isr_handler_remove(btn->keys[i].gpio);
+        gpio_set_intr_type(btn->keys[i].gpio, GPIO_INTR_DISABLE);
+    }
+    if (btn->exited)
+    {
+        vSemaphoreDelete(btn->exited);
+    }
+    audio_free(btn);
+}
+
+button_input_handle_t button_input_init(const button_input_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->key_count >= 0 && cfg->key_count <= BUTTON_INPUT_MAX_KEYS && cfg->debounce_ms > 0,
+                     return NULL);
+
+    /* Touched by the interrupt handler: keep it in internal RAM */
+    button_input_t *btn = audio_calloc_inner(1, sizeof(button_input_t));
+    AUDIO_MEM_CHECK(TAG, btn, return NULL);
+    btn->cfg = *cfg;
+    btn->lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+
+    uint64_t mask = 0;
+    for (int i = 0; i < cfg->key_count; i++)
+    {
+        if (cfg->keys[i].gpio >= 0)
+        {
+            button_key_t *k = &btn->keys[btn->key_count];
+            k->btn = btn;
+            k->gpio = cfg->keys[i].gpio;
+            k->id = cfg->keys[i].id;
+            k->bit = 1UL << btn->key_count;
+            btn->key_count++;
+            mask |= 1ULL << k->gpio;
+        }
+    }
+    if (btn->key_count == 0)
+    {
+        ESP_LOGW(TAG, "No button has a GPIO");
+        audio_free(btn);
+        return NULL;
+    }
+
+    gpio_config_t io_conf = {
+        .pin_bit_mask = mask,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = cfg->active_low ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE,
+        .pull_down_en = cfg->active_low ? GPIO_PULLDOWN_DISABLE : GPIO_PULLDOWN_ENABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    esp_err_t ret = gpio_config(&io_conf);
+    /* Shared with other drivers; already installed is fine */
+    if (ret == ESP_OK)
+    {
+        ret = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+        ret = ret == ESP_ERR_INVALID_STATE ? ESP_OK : ret;
+    }
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "GPIO setup failed: %s", esp_err_to_name(ret));
+        audio_free(btn);
+        return NULL;
+    }
+    /* Whatever is held down at boot is not a press */
+    for (int i = 0; i < btn->key_count; i++)
+    {
+        btn->keys[i].pressed = key_level_pressed(btn, &btn->keys[i]);
+    }
+
+    btn->exited = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, btn->exited, {
+        audio_free(btn);
+        return NULL;
+    });
+    if (xTaskCreatePinnedToCore(button_input_task, "buttons", cfg->task_stack, btn, cfg->task_prio, &btn->task,
+                                cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create button task");
+        vSemaphoreDelete(btn->exited);
+        audio_free(btn);
+        return NULL;
+    }
+    for (int i = 0; i < btn->key_count; i++)
+    {
+        if (gpio_isr_handler_add(btn->keys[i].gpio, _gpio_isr, &btn->keys[i]) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to hook GPIO %d", btn->keys[i].gpio);
+            button_input_deinit(btn);
+            return NULL;
+        }
+    }
+    ESP_LOGI(TAG, "%d buttons, active %s, %d ms debounce", btn->key_count, cfg->active_low ? "low" : "high",
+             cfg->debounce_ms);
+    return btn;
+}
+
+esp_err_t button_input_get_stats(button_input_handle_t btn, button_input_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, btn && stats, return ESP_ERR_INVALID_ARG);
+    *stats = btn->stats;
+    stats->edges = btn->edges;
+    return ESP_OK;
+}
+
+void button_input_deinit(button_input_handle_t btn)
+{
+    if (btn == NULL)
+    {
+        return;
+    }
+    /* No interrupt may notify a deleted task */
+    for (int i = 0; i < btn->key_count; i++)
+    {
+        gpio_isr_handler_remove(btn->keys[i].gpio);
+    }
+    xTaskNotify(btn->task, BUTTON_INPUT_EXIT_BIT, eSetBits);
+    xSemaphoreTake(btn->exited, portMAX_DELAY);
+    release(btn);
+}
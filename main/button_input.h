@@ -0,0 +1,110 @@
+/* Interrupt-driven GPIO buttons with leading-edge debounce
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __BUTTON_INPUT_H__
+#define __BUTTON_INPUT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define BUTTON_INPUT_MAX_KEYS (8)
+
+    /**
+     * @brief Called from the button task on a debounced press
+     *
+     * @param id      the key's `id`
+     * @param edge_us esp_timer_get_time() of the interrupt that started the press
+     */
+    typedef void (*button_input_press_cb)(int id, int64_t edge_us, void *ctx);
+
+    /**
+     * @brief One button
+     */
+    typedef struct
+    {
+        int gpio; /*!< Input GPIO, -1 for a button the board does not have */
+        int id;   /*!< Passed to `on_press` */
+    } button_input_key_t;
+
+    /**
+     * @brief Button configuration
+     */
+    typedef struct
+    {
+        button_input_key_t keys[BUTTON_INPUT_MAX_KEYS];
+        int key_count;
+        bool active_low;                /*!< Pressed reads 0; the internal pull-up is enabled, else the pull-down */
+        int debounce_ms;                /*!< Edges within this of an accepted change are contact bounce */
+        button_input_press_cb on_press; /*!< Press handler */
+        void *ctx;                      /*!< Passed to `on_press` */
+        int task_stack;                 /*!< Stack of the button task */
+        int task_core;                  /*!< Its core */
+        int task_prio;                  /*!< Its priority, above the audio tasks: it only posts commands */
+    } button_input_cfg_t;
+
+#define BUTTON_INPUT_TASK_STACK (3072)
+#define BUTTON_INPUT_TASK_CORE (0)
+#define BUTTON_INPUT_TASK_PRIO (22)
+
+#define BUTTON_INPUT_CFG_DEFAULT()             \
+    {                                          \
+        .keys = {{0}},                         \
+        .key_count = 0,                        \
+        .active_low = true,                    \
+        .debounce_ms = 20,                     \
+        .on_press = NULL,                      \
+        .ctx = NULL,                           \
+        .task_stack = BUTTON_INPUT_TASK_STACK, \
+        .task_core = BUTTON_INPUT_TASK_CORE,   \
+        .task_prio = BUTTON_INPUT_TASK_PRIO,   \
+    }
+
+    /**
+     * @brief Counters since init
+     */
+    typedef struct
+    {
+        uint32_t presses;  /*!< Debounced presses reported */
+        uint32_t releases; /*!< Debounced releases */
+        uint32_t edges;    /*!< Interrupts taken, bounces included */
+        uint32_t last_us;  /*!< Interrupt to `on_press` return, last press */
+        uint32_t max_us;   /*!< Worst of those */
+    } button_input_stats_t;
+
+    typedef struct button_input *button_input_handle_t;
+
+    /**
+     * @brief Configure the GPIOs, hook their interrupts and start the button task.
+     *        Keys with a negative GPIO are skipped.
+     *
+     * @return The handle, NULL on failure or when no key has a GPIO
+     */
+    button_input_handle_t button_input_init(const button_input_cfg_t *cfg);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t button_input_get_stats(button_input_handle_t btn, button_input_stats_t *stats);
+
+    /**
+     * @brief Unhook the interrupts and stop the task
+     */
+    void button_input_deinit(button_input_handle_t btn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,852 @@
+/* Crossfades between playlist tracks, decoded by two alternating decks
+
+   A deck is a pipeline of its own: a FATFS reader, an mp3 decoder and a
+   resampler to the mixer rate, whose output is a sink writing into one of
+   the mixer's streams. The mixer runs without pipeline input, so the
+   output pipeline is only mixer and I2S, and the decks take turns: while
+   one plays a track the other is idle, with its tasks deleted, and it
+   starts the following track shortly before the fade.
+
+   Each deck's sink counts the frames it has written. Against the track
+   length from the probe, that gives the time left, and two cues:
+
+     - lead_ms before the fade, the other deck is started on the next
+       track, with its mixer stream held: it decodes ahead until the
+       stream's queue is full and then waits, so a slow card is absorbed
+       before anything is heard;
+     - fade_ms before the end, pcm_mixer_crossfade() releases the held
+       stream and the mixer fades one stream out and the other in with
+       equal-power gains.
+
+   A fade is at most half of either track. Without a known length (no
+   Xing frame count and no constant bitrate) the next track starts when
+   the current one ends, back to back.
+
+   The second running deck is what a crossfade costs: its task stacks and
+   the decoder's working buffers exist only while it decodes. The first
+   track measures one deck: the lowest free heap, from
+   heap_caps_monitor_local_minimum_free_size_start(), against the free
+   heap before it started. Every overlap is measured the same way, and
+   with the FreeRTOS run-time counters of the two decoder tasks and of the
+   idle tasks. A transition whose expected cost, the larger of the deck
+   and the last overlap, exceeds the internal or PSRAM budget, or the free
+   heap, is played back to back instead.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "fatfs_stream.h"
+#include "mp3_decoder.h"
+#include "mp3_parser.h"
+#include "pcm_mixer.h"
+#include "audio_io_hook.h"
+#include "crossfade_player.h"
+
+static const char *TAG = "CROSSFADE";
+
+#define XF_PATH_MAX (256)
+#define XF_PROBE_RETRIES (8)
+#define XF_FRAME_BYTES ((int)(2 * sizeof(int16_t)))
+/* A blocked sink looks at `stopping` this often */
+#define XF_WRITE_POLL_MS (50)
+/* Cues are also polled, in case one was lost to a full queue */
+#define XF_CUE_POLL_MS (100)
+#define XF_NEVER (UINT64_MAX)
+/* Back to back, the last of a stream's queue fades under the next track instead of overlapping it */
+#define XF_TAIL_MS (50)
+/* Warn when the controller's stack gets closer to the end than this, bytes */
+#define XF_STACK_MARGIN (512)
+
+/* Internal commands on the controller's own listener */
+enum
+{
+    XF_CMD_START = 100,
+    XF_CMD_CUE,
+    XF_CMD_EXIT,
+};
+
+static const char *const s_tags[CROSSFADE_PLAYER_DECKS][3] = {
+    {"file_a", "mp3_a", "rsp_a"},
+    {"file_b", "mp3_b", "rsp_b"},
+};
+
+typedef struct
+{
+    char path[XF_PATH_MAX];
+    mp3_stream_info_t info;
+    uint64_t frames; /* At the mixer rate, 0 when unknown */
+} xf_track_t;
+
+typedef struct
+{
+    crossfade_player_handle_t xf;
+    int id;
+    int stream;
+    audio_pipeline_handle_t pipeline;
+    audio_element_handle_t reader;
+    audio_element_handle_t decoder;
+    audio_element_handle_t resampler;
+    audio_io_hook_t sink;
+    xf_track_t track;
+    int fade_ms;   /* Of the transition out of this track */
+    bool playing;  /* Controller */
+    bool started;  /* Controller: the next deck was started, or skipped, for this track */
+    bool faded;    /* Controller: the fade out of this track was requested */
+    volatile bool stopping;
+    /* Written by the controller before the pipeline runs, then read by the sink */
+    uint64_t start_at;
+    uint64_t fade_at;
+    /* Sink */
+    uint64_t written;
+    volatile bool start_cued;
+    volatile bool fade_cued;
+} xf_deck_t;
+
+/* One measurement window: a deck alone, or an overlap */
+typedef struct
+{
+    bool active;
+    bool overlap;
+    int outgoing; /* Deck whose end closes an overlap */
+    int64_t t0;
+    size_t base_internal;
+    size_t base_psram;
+    TaskStatus_t *tasks;
+    UBaseType_t count;
+    configRUN_TIME_COUNTER_TYPE total;
+} xf_window_t;
+
+struct crossfade_player
+{
+    crossfade_player_cfg_t cfg;
+    xf_deck_t decks[CROSSFADE_PLAYER_DECKS];
+    audio_event_iface_handle_t evt; /* Deck pipelines and cues */
+    audio_event_iface_handle_t cue; /* Sinks and API calls into `evt` */
+    audio_event_iface_handle_t out; /* Reports to cfg.listener */
+    SemaphoreHandle_t lock;         /* stats */
+    SemaphoreHandle_t exited;
+    volatile bool stop;
+    int cur; /* Deck being heard, -1 before the first track */
+    xf_track_t next;
+    bool has_next;
+    bool playlist_done;
+    xf_window_t win;
+    crossfade_player_overlap_t report;
+    crossfade_player_stats_t stats;
+};
+
+static uint64_t track_frames(const mp3_stream_info_t *info, int rate)
+{
+    uint64_t samples = info->total_samples;
+    if (samples == 0 && info->header.bitrate_kbps && info->audio_end > info->audio_start)
+    {
+        /* No Xing frame count: CBR estimate */
+        samples = (uint64_t)(info->audio_end - info->audio_start) * 8 * info->header.sample_rate /
+                  ((uint64_t)info->header.bitrate_kbps * 1000);
+    }
+    return info->header.sample_rate ? samples * rate / info->header.sample_rate : 0;
+}
+
+static uint32_t frames_ms(crossfade_player_handle_t xf, uint64_t frames)
+{
+    return (uint32_t)(frames * 1000 / xf->cfg.rate);
+}
+
+/* Probe the next playable track into `next` */
+static bool prime_next(crossfade_player_handle_t xf)
+{
+    if (xf->has_next || xf->playlist_done)
+    {
+        return xf->has_next;
+    }
+    for (int attempt = 0; attempt < XF_PROBE_RETRIES; attempt++)
+    {
+        const char *path = xf->cfg.next_track(xf->cfg.ctx);
+        if (path == NULL)
+        {
+            xf->playlist_done = true;
+            return false;
+        }
+        if (mp3_probe_file(path, &xf->next.info) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "Skipping unplayable track %s", path);
+            continue;
+        }
+        strlcpy(xf->next.path, path, sizeof(xf->next.path));
+        xf->next.frames = track_frames(&xf->next.info, xf->cfg.rate);
+        xf->has_next = true;
+        return true;
+    }
+    return false;
+}
+
+static void post(crossfade_player_handle_t xf, audio_event_iface_handle_t iface, int cmd, void *data)
+{
+    audio_event_iface_msg_t msg = {
+        .cmd = cmd,
+        .data = data,
+        .data_len = 0,
+        .source = xf,
+        .source_type = CROSSFADE_PLAYER_SOURCE_TYPE,
+        .need_free_data = false,
+    };
+    audio_event_iface_sendout(iface, &msg);
+}
+
+static int _deck_sink(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    xf_deck_t *d = (xf_deck_t *)hook->ctx;
+    int done = 0;
+    while (done < len)
+    {
+        const int w = pcm_mixer_write(d->xf->cfg.mixer, d->stream, buf + done, len - done, pdMS_TO_TICKS(XF_WRITE_POLL_MS));
+        if (w > 0)
+        {
+            done += w;
+        }
+        else if (w != RB_TIMEOUT || d->stopping)
+        {
+            return AEL_IO_ABORT;
+        }
+    }
+    d->written += len / XF_FRAME_BYTES;
+    bool cue = false;
+    if (!d->start_cued && d->written >= d->start_at)
+    {
+        d->start_cued = cue = true;
+    }
+    if (!d->fade_cued && d->written >= d->fade_at)
+    {
+        d->fade_cued = cue = true;
+    }
+    if (cue)
+    {
+        post(d->xf, d->xf->cue, XF_CMD_CUE, NULL);
+    }
+    return len;
+}
+
+/* ---- Measurement ---- */
+
+static void window_begin(crossfade_player_handle_t xf, bool overlap, int outgoing)
+{
+    xf_window_t *w = &xf->win;
+    audio_free(w->tasks);
+    const UBaseType_t cap = uxTaskGetNumberOfTasks() + 8;
+    w->tasks = audio_calloc(cap, sizeof(TaskStatus_t));
+    w->count = w->tasks ? uxTaskGetSystemState(w->tasks, cap, &w->total) : 0;
+    w->base_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    w->base_psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    heap_caps_monitor_local_minimum_free_size_start();
+    w->t0 = esp_timer_get_time();
+    w->overlap = overlap;
+    w->outgoing = outgoing;
+    w->active = true;
+}
+
+static bool is_decoder(const char *name)
+{
+    for (int i = 0; i < CROSSFADE_PLAYER_DECKS; i++)
+    {
+        if (strcmp(name, s_tags[i][1]) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void window_end(crossfade_player_handle_t xf, crossfade_player_overlap_t *r)
+{
+    xf_window_t *w = &xf->win;
+    const size_t min_internal = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    const size_t min_psram = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    heap_caps_monitor_local_minimum_free_size_stop();
+    w->active = false;
+
+    memset(r, 0, sizeof(*r));
+    r->overlap_ms = (uint32_t)((esp_timer_get_time() - w->t0) / 1000);
+    r->internal_bytes = w->base_internal > min_internal ? w->base_internal - min_internal : 0;
+    r->psram_bytes = w->base_psram > min_psram ? w->base_psram - min_psram : 0;
+    r->internal_free = min_internal;
+    r->psram_free = min_psram;
+
+    const UBaseType_t cap = uxTaskGetNumberOfTasks() + 8;
+    TaskStatus_t *now = w->tasks ? audio_calloc(cap, sizeof(TaskStatus_t)) : NULL;
+    if (now)
+    {
+        configRUN_TIME_COUNTER_TYPE total = 0;
+        const UBaseType_t count = uxTaskGetSystemState(now, cap, &total);
+        const configRUN_TIME_COUNTER_TYPE elapsed = total - w->total;
+        uint64_t decoders = 0, idle = 0;
+        for (UBaseType_t i = 0; i < count && elapsed > 0; i++)
+        {
+            configRUN_TIME_COUNTER_TYPE before = 0;
+            for (UBaseType_t j = 0; j < w->count; j++)
+            {
+                if (w->tasks[j].xHandle == now[i].xHandle)
+                {
+                    before = w->tasks[j].ulRunTimeCounter;
+                    break;
+                }
+            }
+            const uint64_t ran = now[i].ulRunTimeCounter - before;
+            if (is_decoder(now[i].pcTaskName))
+            {
+                decoders += ran;
+            }
+            for (int core = 0; core < portNUM_PROCESSORS; core++)
+            {
+                if (now[i].xHandle == xTaskGetIdleTaskHandleForCore(core))
+                {
+                    idle += ran;
+                }
+            }
+        }
+        if (elapsed > 0)
+        {
+            const uint64_t capacity = (uint64_t)elapsed * portNUM_PROCESSORS;
+            r->decoder_permille = (uint32_t)(decoders * 1000 / elapsed);
+            r->busy_permille = idle < capacity ? (uint32_t)((capacity - idle) * 1000 / capacity) : 0;
+        }
+        audio_free(now);
+    }
+    audio_free(w->tasks);
+    w->tasks = NULL;
+}
+
+static bool within_budget(crossfade_player_handle_t xf)
+{
+    const uint32_t internal = xf->stats.deck_internal > xf->report.internal_bytes ? xf->stats.deck_internal
+                                                                                  : xf->report.internal_bytes;
+    const uint32_t psram = xf->stats.deck_psram > xf->report.psram_bytes ? xf->stats.deck_psram : xf->report.psram_bytes;
+    if (internal > (uint32_t)xf->cfg.internal_budget_kb * 1024 || psram > (uint32_t)xf->cfg.psram_budget_kb * 1024)
+    {
+        ESP_LOGW(TAG, "Overlap would take %u KB internal, %u KB PSRAM: over the %d/%d KB budget, playing back to back",
+                 (unsigned)(internal / 1024), (unsigned)(psram / 1024), xf->cfg.internal_budget_kb, xf->cfg.psram_budget_kb);
+        return false;
+    }
+    if (internal > heap_caps_get_free_size(MALLOC_CAP_INTERNAL) || psram > heap_caps_get_free_size(MALLOC_CAP_SPIRAM))
+    {
+        ESP_LOGW(TAG, "Not enough free heap for an overlap, playing back to back");
+        return false;
+    }
+    return true;
+}
+
+static void report(crossfade_player_handle_t xf, bool faded)
+{
+    xf->report.faded = faded;
+    xSemaphoreTake(xf->lock, portMAX_DELAY);
+    if (faded)
+    {
+        xf->stats.crossfades++;
+        if (xf->report.internal_bytes > xf->stats.internal_peak)
+        {
+            xf->stats.internal_peak = xf->report.internal_bytes;
+        }
+        if (xf->report.psram_bytes > xf->stats.psram_peak)
+        {
+            xf->stats.psram_peak = xf->report.psram_bytes;
+        }
+        if (xf->report.decoder_permille > xf->stats.decoder_peak)
+        {
+            xf->stats.decoder_peak = xf->report.decoder_permille;
+        }
+    }
+    else
+    {
+        xf->stats.back_to_back++;
+    }
+    xSemaphoreGive(xf->lock);
+    if (faded && (xf->report.internal_bytes > (uint32_t)xf->cfg.internal_budget_kb * 1024 ||
+                  xf->report.psram_bytes > (uint32_t)xf->cfg.psram_budget_kb * 1024))
+    {
+        ESP_LOGW(TAG, "Overlap took %u KB internal, %u KB PSRAM, over budget: the next ones play back to back",
+                 (unsigned)(xf->report.internal_bytes / 1024), (unsigned)(xf->report.psram_bytes / 1024));
+    }
+    post(xf, xf->out, CROSSFADE_PLAYER_CMD_OVERLAP, &xf->report);
+}
+
+/* ---- Decks ---- */
+
+/* Cue points of the transition out of the track `d` starts, against the next track */
+static void plan(crossfade_player_handle_t xf, xf_deck_t *d)
+{
+    d->start_at = d->fade_at = XF_NEVER;
+    d->fade_ms = 0;
+    if (!prime_next(xf) || d->track.frames == 0 || xf->next.frames == 0)
+    {
+        return;
+    }
+    uint64_t fade = (uint64_t)xf->cfg.fade_ms * xf->cfg.rate / 1000;
+    fade = fade < d->track.frames / 2 ? fade : d->track.frames / 2;
+    fade = fade < xf->next.frames / 2 ? fade : xf->next.frames / 2;
+    const uint64_t lead = (uint64_t)xf->cfg.lead_ms * xf->cfg.rate / 1000;
+    d->fade_ms = (int)frames_ms(xf, fade);
+    d->fade_at = d->track.frames - fade;
+    d->start_at = d->fade_at > lead ? d->fade_at - lead : 0;
+}
+
+/* Start deck `d` on the primed track; `held` keeps its stream quiet until a fade releases it */
+static void deck_start(crossfade_player_handle_t xf, xf_deck_t *d, bool held)
+{
+    d->track = xf->next;
+    xf->has_next = false;
+    d->written = 0;
+    d->start_cued = d->fade_cued = false;
+    d->started = d->faded = false;
+    d->stopping = false;
+    plan(xf, d);
+
+    pcm_mixer_flush(xf->cfg.mixer, d->stream);
+    pcm_mixer_set_hold(xf->cfg.mixer, d->stream, held);
+    audio_element_set_uri(d->reader, d->track.path);
+    audio_element_set_byte_pos(d->reader, d->track.info.audio_start);
+    pcm_resampler_set_src_info(d->resampler, d->track.info.header.sample_rate, d->track.info.header.channels);
+    d->playing = audio_pipeline_run(d->pipeline) == ESP_OK;
+    if (!d->playing)
+    {
+        ESP_LOGE(TAG, "Deck %c failed to start %s", 'A' + d->id, d->track.path);
+        return;
+    }
+    xSemaphoreTake(xf->lock, portMAX_DELAY);
+    xf->stats.tracks++;
+    xSemaphoreGive(xf->lock);
+    ESP_LOGI(TAG, "Deck %c: %s, %u ms, fade out %d ms", 'A' + d->id, d->track.path,
+             (unsigned)frames_ms(xf, d->track.frames), d->fade_ms);
+}
+
+/* Stop the deck and delete its tasks, so an idle deck costs only its buffers */
+static void deck_halt(crossfade_player_handle_t xf, xf_deck_t *d)
+{
+    d->stopping = true;
+    audio_pipeline_stop(d->pipeline);
+    audio_pipeline_wait_for_stop(d->pipeline);
+    audio_pipeline_terminate(d->pipeline);
+    audio_pipeline_reset_ringbuffer(d->pipeline);
+    audio_pipeline_reset_elements(d->pipeline);
+    audio_pipeline_change_state(d->pipeline, AEL_STATE_INIT);
+    pcm_mixer_stream_end(xf->cfg.mixer, d->stream);
+    d->playing = false;
+}
+
+/* Close the window of the first track: the cost of one running deck */
+static void solo_end(crossfade_player_handle_t xf)
+{
+    if (!xf->win.active || xf->win.overlap)
+    {
+        return;
+    }
+    crossfade_player_overlap_t solo;
+    window_end(xf, &solo);
+    xSemaphoreTake(xf->lock, portMAX_DELAY);
+    xf->stats.deck_internal = solo.internal_bytes;
+    xf->stats.deck_psram = solo.psram_bytes;
+    xSemaphoreGive(xf->lock);
+    ESP_LOGI(TAG, "One deck takes %u KB internal, %u KB PSRAM while decoding", (unsigned)(solo.internal_bytes / 1024),
+             (unsigned)(solo.psram_bytes / 1024));
+}
+
+/* Act on the cues the deck being heard has passed */
+static void poll_cues(crossfade_player_handle_t xf)
+{
+    if (xf->cur < 0)
+    {
+        return;
+    }
+    xf_deck_t *d = &xf->decks[xf->cur];
+    xf_deck_t *o = &xf->decks[!xf->cur];
+    /* The other deck may still be draining the previous track */
+    if (d->start_cued && !d->started && d->playing && !o->playing)
+    {
+        d->started = true;
+        solo_end(xf);
+        /* plan() primed the next track, or left the cue unreachable */
+        if (within_budget(xf))
+        {
+            window_begin(xf, true, d->id);
+            deck_start(xf, o, true);
+        }
+        else
+        {
+            xSemaphoreTake(xf->lock, portMAX_DELAY);
+            xf->stats.over_budget++;
+            xSemaphoreGive(xf->lock);
+        }
+    }
+    if (d->fade_cued && !d->faded && o->playing)
+    {
+        d->faded = true;
+        pcm_mixer_crossfade(xf->cfg.mixer, d->stream, o->stream, d->fade_ms);
+        xf->cur = o->id;
+        /* The incoming track may be short enough to have passed its own cues already */
+        poll_cues(xf);
+    }
+}
+
+static void finished(crossfade_player_handle_t xf)
+{
+    ESP_LOGI(TAG, "Playlist finished");
+    post(xf, xf->out, CROSSFADE_PLAYER_CMD_FINISHED, NULL);
+}
+
+/* The deck has decoded its whole track, or failed */
+static void deck_done(crossfade_player_handle_t xf, xf_deck_t *d)
+{
+    deck_halt(xf, d);
+    if (xf->cur != d->id)
+    {
+        /* Faded out: the overlap is over */
+        if (xf->win.active && xf->win.overlap && xf->win.outgoing == d->id)
+        {
+            window_end(xf, &xf->report);
+            xf->report.fade_ms = d->fade_ms;
+            report(xf, true);
+        }
+        poll_cues(xf);
+        return;
+    }
+
+    /* Ended while still heard, before its fade: a shorter track than probed, or no next one yet */
+    xf_deck_t *o = &xf->decks[!d->id];
+    memset(&xf->report, 0, sizeof(xf->report));
+    if (xf->win.active)
+    {
+        if (xf->win.overlap)
+        {
+            window_end(xf, &xf->report);
+        }
+        else
+        {
+            solo_end(xf);
+        }
+    }
+    if (!o->playing && prime_next(xf))
+    {
+        deck_start(xf, o, true);
+    }
+    if (o->playing)
+    {
+        /* What is left of this track's queue fades out under the start of the next */
+        pcm_mixer_crossfade(xf->cfg.mixer, d->stream, o->stream, XF_TAIL_MS);
+        xf->cur = o->id;
+        report(xf, false);
+        poll_cues(xf);
+    }
+    else
+    {
+        finished(xf);
+    }
+}
+
+static void handle_deck_event(crossfade_player_handle_t xf, const audio_event_iface_msg_t *msg)
+{
+    for (int i = 0; i < CROSSFADE_PLAYER_DECKS; i++)
+    {
+        xf_deck_t *d = &xf->decks[i];
+        if (!d->playing)
+        {
+            continue;
+        }
+        if (msg->source == (void *)d->decoder && msg->cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO)
+        {
+            audio_element_info_t info = {0};
+            audio_element_getinfo(d->decoder, &info);
+            pcm_resampler_set_src_info(d->resampler, info.sample_rates, info.channels);
+            return;
+        }
+        if (msg->cmd != AEL_MSG_CMD_REPORT_STATUS ||
+            (msg->source != (void *)d->reader && msg->source != (void *)d->decoder && msg->source != (void *)d->resampler))
+        {
+            continue;
+        }
+        const int status = (int)msg->data;
+        if (msg->source == (void *)d->resampler && status == AEL_STATUS_STATE_FINISHED)
+        {
+            deck_done(xf, d);
+        }
+        else if (status >= AEL_STATUS_ERROR_OPEN && status <= AEL_STATUS_ERROR_UNKNOWN)
+        {
+            ESP_LOGE(TAG, "Deck %c [%s] stopped on error %d, skipping %s", 'A' + i,
+                     audio_element_get_tag((audio_element_handle_t)msg->source), status, d->track.path);
+            deck_done(xf, d);
+        }
+        return;
+    }
+}
+
+/* Record the controller's stack low point; it probes tracks on its own stack */
+static void note_stack(crossfade_player_handle_t xf)
+{
+    const uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+    xSemaphoreTake(xf->lock, portMAX_DELAY);
+    const bool lower = stack_free != xf->stats.stack_free;
+    xf->stats.stack_free = stack_free;
+    xSemaphoreGive(xf->lock);
+    if (lower && stack_free < XF_STACK_MARGIN)
+    {
+        ESP_LOGW(TAG, "Controller stack down to %u bytes free, raise task_stack", (unsigned)stack_free);
+    }
+}
+
+static void _crossfade_task(void *arg)
+{
+    crossfade_player_handle_t xf = (crossfade_player_handle_t)arg;
+    while (!xf->stop)
+    {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(xf->evt, &msg, pdMS_TO_TICKS(XF_CUE_POLL_MS)) != ESP_OK)
+        {
+            poll_cues(xf);
+            continue;
+        }
+        if (msg.source_type != CROSSFADE_PLAYER_SOURCE_TYPE)
+        {
+            if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT)
+            {
+                handle_deck_event(xf, &msg);
+                note_stack(xf);
+            }
+            continue;
+        }
+        if (msg.cmd == XF_CMD_START)
+        {
+            xf_deck_t *d = &xf->decks[0];
+            window_begin(xf, false, -1);
+            deck_start(xf, d, false);
+            pcm_mixer_crossfade(xf->cfg.mixer, -1, d->stream, 0);
+            xf->cur = d->id;
+        }
+        poll_cues(xf);
+        note_stack(xf);
+    }
+
+    for (int i = 0; i < CROSSFADE_PLAYER_DECKS; i++)
+    {
+        if (xf->decks[i].playing)
+        {
+            deck_halt(xf, &xf->decks[i]);
+            pcm_mixer_flush(xf->cfg.mixer, xf->decks[i].stream);
+        }
+    }
+    if (xf->win.active)
+    {
+        crossfade_player_overlap_t unused;
+        window_end(xf, &unused);
+    }
+    xSemaphoreGive(xf->exited);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t deck_init(crossfade_player_handle_t xf, xf_deck_t *d, int id)
+{
+    const crossfade_player_cfg_t *cfg = &xf->cfg;
+    const size_t internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    const size_t psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    d->xf = xf;
+    d->id = id;
+    d->stream = cfg->streams[id];
+
+    audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    d->pipeline = audio_pipeline_init(&pipeline_cfg);
+    AUDIO_MEM_CHECK(TAG, d->pipeline, return ESP_ERR_NO_MEM);
+
+    fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
+    fatfs_cfg.type = AUDIO_STREAM_READER;
+    mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    pcm_resampler_cfg_t rsp_cfg = PCM_RESAMPLER_CFG_DEFAULT();
+    rsp_cfg.out_rate = cfg->rate;
+    rsp_cfg.quality = cfg->quality;
+    if (cfg->sched)
+    {
+        SCHED_PROFILE_APPLY(fatfs_cfg, cfg->sched->reader, ext_stack);
+        SCHED_PROFILE_APPLY(mp3_cfg, cfg->sched->decoder, stack_in_ext);
+        SCHED_PROFILE_APPLY(rsp_cfg, cfg->sched->resampler, ext_stack);
+    }
+    d->reader = fatfs_stream_init(&fatfs_cfg);
+    d->decoder = mp3_decoder_init(&mp3_cfg);
+    d->resampler = pcm_resampler_init(&rsp_cfg);
+    AUDIO_MEM_CHECK(TAG, d->reader && d->decoder && d->resampler, return ESP_ERR_NO_MEM);
+
+    audio_pipeline_register(d->pipeline, d->reader, s_tags[id][0]);
+    audio_pipeline_register(d->pipeline, d->decoder, s_tags[id][1]);
+    audio_pipeline_register(d->pipeline, d->resampler, s_tags[id][2]);
+    const char *link[3] = {s_tags[id][0], s_tags[id][1], s_tags[id][2]};
+    audio_pipeline_link(d->pipeline, link, 3);
+    d->sink = (audio_io_hook_t){.fn = _deck_sink, .ctx = d};
+    if (audio_io_hook_set_sink(d->resampler, AUDIO_IO_HOOK_WRITE, &d->sink) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    audio_pipeline_set_listener(d->pipeline, xf->evt);
+
+    const size_t internal_after = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    const size_t psram_after = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    ESP_LOGI(TAG, "Deck %c into mixer stream %d: %u KB internal, %u KB PSRAM while idle", 'A' + id, d->stream,
+             (unsigned)((internal > internal_after ? internal - internal_after : 0) / 1024),
+             (unsigned)((psram > psram_after ? psram - psram_after : 0) / 1024));
+    return ESP_OK;
+}
+
+static void deck_deinit(xf_deck_t *d)
+{
+    if (d->pipeline == NULL)
+    {
+        /* Elements not registered yet are freed on their own */
+        if (d->reader)
+        {
+            audio_element_deinit(d->reader);
+        }
+        if (d->decoder)
+        {
+            audio_element_deinit(d->decoder);
+        }
+        if (d->resampler)
+        {
+            audio_element_deinit(d->resampler);
+        }
+        return;
+    }
+    if (d->sink.fn)
+    {
+        audio_io_hook_remove(d->resampler, AUDIO_IO_HOOK_WRITE, &d->sink);
+    }
+    audio_pipeline_remove_listener(d->pipeline);
+    audio_pipeline_deinit(d->pipeline);
+}
+
+static void release(crossfade_player_handle_t xf)
+{
+    for (int i = 0; i < CROSSFADE_PLAYER_DECKS; i++)
+    {
+        deck_deinit(&xf->decks[i]);
+    }
+    if (xf->cue)
+    {
+        audio_event_iface_destroy(xf->cue);
+    }
+    if (xf->out)
+    {
+        audio_event_iface_destroy(xf->out);
+    }
+    if (xf->evt)
+    {
+        audio_event_iface_destroy(xf->evt);
+    }
+    if (xf->exited)
+    {
+        vSemaphoreDelete(xf->exited);
+    }
+    if (xf->lock)
+    {
+        vSemaphoreDelete(xf->lock);
+    }
+    audio_free(xf);
+}
+
+/* ---- API ---- */
+
+crossfade_player_handle_t crossfade_player_init(const crossfade_player_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->mixer && cfg->next_track, return NULL);
+    if (cfg->fade_ms < 1000 || cfg->fade_ms > 10000 || cfg->lead_ms < 0 || cfg->rate <= 0 ||
+        cfg->streams[0] == cfg->streams[1] || cfg->internal_budget_kb < 0 || cfg->psram_budget_kb < 0)
+    {
+        ESP_LOGE(TAG, "Invalid crossfade configuration");
+        return NULL;
+    }
+
+    crossfade_player_handle_t xf = audio_calloc(1, sizeof(struct crossfade_player));
+    AUDIO_MEM_CHECK(TAG, xf, return NULL);
+    xf->cfg = *cfg;
+    xf->cur = -1;
+    xf->lock = xSemaphoreCreateMutex();
+    xf->exited = xSemaphoreCreateBinary();
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    xf->evt = audio_event_iface_init(&evt_cfg);
+    xf->cue = audio_event_iface_init(&evt_cfg);
+    xf->out = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, xf->lock && xf->exited && xf->evt && xf->cue && xf->out, goto _fail);
+    audio_event_iface_set_listener(xf->cue, xf->evt);
+    if (cfg->listener)
+    {
+        audio_event_iface_set_listener(xf->out, cfg->listener);
+    }
+
+    for (int i = 0; i < CROSSFADE_PLAYER_DECKS; i++)
+    {
+        if (deck_init(xf, &xf->decks[i], i) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to create deck %c", 'A' + i);
+            goto _fail;
+        }
+        /* Silent until faded in */
+        pcm_mixer_set_hold(cfg->mixer, xf->decks[i].stream, true);
+    }
+    if (xTaskCreatePinnedToCore(_crossfade_task, "crossfade", cfg->task_stack, xf, cfg->task_prio, NULL, cfg->task_core) !=
+        pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the crossfade task");
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "%d ms crossfades, next deck started %d ms ahead, overlap budget %d KB internal, %d KB PSRAM",
+             cfg->fade_ms, cfg->lead_ms, cfg->internal_budget_kb, cfg->psram_budget_kb);
+    return xf;
+
+_fail:
+    release(xf);
+    return NULL;
+}
+
+esp_err_t crossfade_player_start(crossfade_player_handle_t xf)
+{
+    AUDIO_NULL_CHECK(TAG, xf, return ESP_ERR_INVALID_ARG);
+    /* The task touches the playlist only once told to start */
+    if (!prime_next(xf))
+    {
+        ESP_LOGE(TAG, "Playlist has no playable track");
+        return ESP_ERR_NOT_FOUND;
+    }
+    post(xf, xf->cue, XF_CMD_START, NULL);
+    return ESP_OK;
+}
+
+esp_err_t crossfade_player_get_stats(crossfade_player_handle_t xf, crossfade_player_stats_t *stats)
+{
+    if (!xf || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(xf->lock, portMAX_DELAY);
+    *stats = xf->stats;
+    xSemaphoreGive(xf->lock);
+    return ESP_OK;
+}
+
+void crossfade_player_deinit(crossfade_player_handle_t xf)
+{
+    if (xf == NULL)
+    {
+        return;
+    }
+    xf->stop = true;
+    post(xf, xf->cue, XF_CMD_EXIT, NULL);
+    xSemaphoreTake(xf->exited, portMAX_DELAY);
+    release(xf);
+}
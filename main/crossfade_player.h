@@ -0,0 +1,146 @@
+/* Crossfades between playlist tracks, decoded by two alternating decks
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __CROSSFADE_PLAYER_H__
+#define __CROSSFADE_PLAYER_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "gapless_player.h"
+#include "pcm_resampler.h"
+#include "sched_profile.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of crossfade messages */
+#define CROSSFADE_PLAYER_SOURCE_TYPE (0x58464144) /* "XFAD" */
+/* audio_event_iface_msg_t.cmd after each transition; data points to a crossfade_player_overlap_t valid until the next */
+#define CROSSFADE_PLAYER_CMD_OVERLAP (1)
+/* audio_event_iface_msg_t.cmd once the last track has played */
+#define CROSSFADE_PLAYER_CMD_FINISHED (2)
+
+#define CROSSFADE_PLAYER_DECKS (2)
+
+    /**
+     * @brief Crossfade player configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t mixer;             /*!< pcm_mixer element created without pipeline input */
+        int streams[CROSSFADE_PLAYER_DECKS];      /*!< Mixer stream each deck writes */
+        int rate;                                 /*!< Mixer rate, every deck resamples to it */
+        pcm_resampler_quality_t quality;          /*!< Deck resampler quality */
+        gapless_next_track_cb next_track;         /*!< Playlist source */
+        void *ctx;                                /*!< Passed to `next_track` */
+        audio_event_iface_handle_t listener;      /*!< Receives the overlap reports and the end of the playlist */
+        int fade_ms;                              /*!< Crossfade length, 1 to 10 s */
+        int lead_ms;                              /*!< How long before its fade a deck starts decoding */
+        int internal_budget_kb;                   /*!< Internal RAM an overlap may take on top of one deck */
+        int psram_budget_kb;                      /*!< PSRAM an overlap may take on top of one deck */
+        const sched_profile_t *sched;             /*!< Deck task placement, NULL for the ADF defaults */
+        int task_stack;                           /*!< Controller task stack size */
+        int task_core;                            /*!< Controller task running in core */
+        int task_prio;                            /*!< Controller task priority, above the decks' readers */
+    } crossfade_player_cfg_t;
+
+#define CROSSFADE_PLAYER_TASK_STACK (4096)
+#define CROSSFADE_PLAYER_TASK_CORE (0)
+#define CROSSFADE_PLAYER_TASK_PRIO (6)
+
+#define CROSSFADE_PLAYER_CFG_DEFAULT()                    \
+    {                                                     \
+        .mixer = NULL,                                    \
+        .streams = {2, 3},                                \
+        .rate = 48000,                                    \
+        .quality = PCM_RESAMPLER_QUALITY_MEDIUM,          \
+        .next_track = NULL,                               \
+        .ctx = NULL,                                      \
+        .listener = NULL,                                 \
+        .fade_ms = 4000,                                  \
+        .lead_ms = 1500,                                  \
+        .internal_budget_kb = 96,                         \
+        .psram_budget_kb = 256,                           \
+        .sched = NULL,                                    \
+        .task_stack = CROSSFADE_PLAYER_TASK_STACK,        \
+        .task_core = CROSSFADE_PLAYER_TASK_CORE,          \
+        .task_prio = CROSSFADE_PLAYER_TASK_PRIO,          \
+    }
+
+    /**
+     * @brief One track transition, from the start of the incoming deck to the end of the outgoing one
+     */
+    typedef struct
+    {
+        bool faded;                /*!< false: played back to back, over budget or without a known duration */
+        uint32_t fade_ms;          /*!< Fade length used */
+        uint32_t overlap_ms;       /*!< Both decks decoding */
+        uint32_t internal_bytes;   /*!< Peak internal RAM taken during the overlap */
+        uint32_t psram_bytes;      /*!< Peak PSRAM taken during the overlap */
+        uint32_t internal_free;    /*!< Lowest free internal RAM during the overlap */
+        uint32_t psram_free;       /*!< Lowest free PSRAM during the overlap */
+        uint32_t decoder_permille; /*!< Both decoder tasks, of one core */
+        uint32_t busy_permille;    /*!< Every task, of all cores */
+    } crossfade_player_overlap_t;
+
+    /**
+     * @brief Counters since init
+     */
+    typedef struct
+    {
+        uint32_t tracks;          /*!< Tracks started */
+        uint32_t crossfades;      /*!< Transitions faded */
+        uint32_t back_to_back;    /*!< Transitions not faded */
+        uint32_t over_budget;     /*!< Of those, skipped because the overlap would exceed a budget */
+        uint32_t deck_internal;   /*!< Internal RAM one running deck takes, measured on the first track */
+        uint32_t deck_psram;      /*!< PSRAM one running deck takes */
+        uint32_t internal_peak;   /*!< Highest internal_bytes of any overlap */
+        uint32_t psram_peak;      /*!< Highest psram_bytes of any overlap */
+        uint32_t decoder_peak;    /*!< Highest decoder_permille of any overlap */
+        uint32_t stack_free;      /*!< Least stack the controller task has had left, bytes */
+    } crossfade_player_stats_t;
+
+    typedef struct crossfade_player *crossfade_player_handle_t;
+
+    /**
+     * @brief Create both decks (file reader, mp3 decoder, resampler writing into a mixer stream)
+     *        and the controller task. Nothing plays until crossfade_player_start().
+     *
+     * @return The player handle, NULL on failure
+     */
+    crossfade_player_handle_t crossfade_player_init(const crossfade_player_cfg_t *cfg);
+
+    /**
+     * @brief Start the first track. The mixer's pipeline must be running.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_NOT_FOUND  the playlist has no playable track
+     */
+    esp_err_t crossfade_player_start(crossfade_player_handle_t xf);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t crossfade_player_get_stats(crossfade_player_handle_t xf, crossfade_player_stats_t *stats);
+
+    /**
+     * @brief Stop both decks and the task, and free them. Call while the mixer still runs.
+     */
+    void crossfade_player_deinit(crossfade_player_handle_t xf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,534 @@
+/* Gapless track transitions on a single file->mp3->i2s pipeline
+
+   The reader->decoder and decoder->writer links are taken over with write
+   hooks, so end-of-file on the reader no longer propagates down the
+   pipeline. When the reader finishes a track it is pointed at the next file and
+   resumed; the decoder simply sees one continuous MPEG stream and the writer,
+   together with its I2S DMA buffers, never stops.
+
+   Every track gets a PCM plan computed when it is primed: how many decoded
+   bytes belong to it, and which of them survive LAME encoder-delay/padding
+   trimming. The decoder->writer callback walks those plans, so joins are
+   sample-accurate whenever the file carries a Xing/Info frame count.
+
+   A track whose length cannot be planned ends where its compressed input
+   ends: when the reader switches files, the bytes still queued for the
+   decoder mark the boundary, and the decoder moves on once it has read past
+   it. That join is exact to within the decoder's input block.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "i2s_stream.h"
+#include "mp3_parser.h"
+#include "mp3_seek.h"
+#include "audio_io_hook.h"
+#include "gapless_player.h"
+
+static const char *TAG = "GAPLESS";
+
+typedef enum
+{
+    PRIME_READY = 0, /* the track after in_idx is primed */
+    PRIME_BUSY,      /* every slot still holds a track the decoder has not finished */
+    PRIME_END,       /* the playlist has no further playable track */
+} prime_result_t;
+
+/* Playing, being fed and being primed; a fourth never exists at once */
+#define GAPLESS_TRACK_SLOTS (3)
+#define GAPLESS_PATH_MAX (256)
+#define GAPLESS_PROBE_RETRIES (8)
+#define GAPLESS_PCM_BYTES (2) /* mp3_decoder always emits 16-bit PCM */
+
+typedef struct
+{
+    char path[GAPLESS_PATH_MAX];
+    mp3_stream_info_t info;
+    mp3_seek_index_handle_t seek;
+    int64_t total_bytes; /* decoded bytes attributed to this track */
+    int64_t skip_bytes;  /* leading bytes dropped (encoder delay + decoder delay) */
+    int64_t keep_bytes;  /* bytes passed to the writer after the skip */
+    uint32_t in_end;     /* decoder input position where this track's data ends, set when the reader leaves it */
+} gapless_track_t;
+
+struct gapless_player
+{
+    gapless_player_cfg_t cfg;
+    ringbuf_handle_t decoder_in;
+    audio_io_hook_t reader_hook;
+    audio_io_hook_t decoder_hook;
+    audio_io_hook_t decoder_in_hook;
+    gapless_track_t tracks[GAPLESS_TRACK_SLOTS];
+    /* Monotonic track counters, slot = counter % GAPLESS_TRACK_SLOTS */
+    volatile uint32_t in_idx;  /* track the reader feeds, written by the event task while the reader is idle */
+    volatile uint32_t out_idx; /* track whose PCM the decoder emits, owned by the decoder task */
+    uint32_t primed_cnt;       /* tracks probed so far */
+    int64_t in_remaining;      /* compressed bytes of in_idx still to forward, owned by the reader task */
+    int64_t out_pos;           /* PCM bytes of out_idx seen so far, owned by the decoder task */
+    volatile uint32_t in_pos;  /* compressed bytes the decoder has read since the pipeline started, wraps */
+    uint32_t started;          /* out_idx + 1 once its start was reported, 0 to report it again */
+    bool restart_pending;      /* the primed track needs a different I2S clock */
+    bool playlist_done;
+    volatile bool reader_waiting; /* the reader finished a track and waits for a slot to prime the next */
+    audio_event_iface_handle_t evt;
+};
+
+static gapless_track_t *slot(gapless_player_handle_t p, uint32_t idx)
+{
+    return &p->tracks[idx % GAPLESS_TRACK_SLOTS];
+}
+
+static void track_plan(gapless_track_t *t)
+{
+    const mp3_stream_info_t *info = &t->info;
+    const int64_t bytes_per_sample = (int64_t)info->header.channels * GAPLESS_PCM_BYTES;
+    uint64_t samples = info->total_samples;
+
+    if (samples == 0)
+    {
+        /* No Xing frame count: CBR estimate, exact to within a frame */
+        const uint64_t avg_frame_x1000 = (uint64_t)info->header.samples_per_frame / 8 * info->header.bitrate_kbps * 1000 * 1000 /
+                                         info->header.sample_rate;
+        if (avg_frame_x1000 > 0 && info->audio_end > info->audio_start)
+        {
+            const uint64_t frames = ((uint64_t)(info->audio_end - info->audio_start) * 1000 + avg_frame_x1000 / 2) / avg_frame_x1000;
+            samples = frames * info->header.samples_per_frame;
+        }
+    }
+
+    int64_t skip = 0;
+    int64_t keep = samples;
+    if (info->xing.has_lame)
+    {
+        skip = info->xing.enc_delay + MP3_DECODER_DELAY_SAMPLES;
+        keep = (int64_t)samples - info->xing.enc_delay - info->xing.enc_padding;
+    }
+    if (skip > (int64_t)samples)
+    {
+        skip = samples;
+    }
+    if (keep < 0)
+    {
+        keep = 0;
+    }
+    if (skip + keep > (int64_t)samples)
+    {
+        keep = samples - skip;
+    }
+
+    t->total_bytes = samples > 0 ? (int64_t)samples * bytes_per_sample : -1;
+    t->skip_bytes = skip * bytes_per_sample;
+    t->keep_bytes = samples > 0 ? keep * bytes_per_sample : INT64_MAX;
+}
+
+static bool same_format(const gapless_track_t *a, const gapless_track_t *b)
+{
+    return a->info.header.sample_rate == b->info.header.sample_rate &&
+           a->info.header.channels == b->info.header.channels;
+}
+
+/* Probe the next playable track into the next free slot */
+static prime_result_t prime_next(gapless_player_handle_t p)
+{
+    if (p->primed_cnt > p->in_idx + 1)
+    {
+        return PRIME_READY;
+    }
+    if (p->playlist_done)
+    {
+        return PRIME_END;
+    }
+    if (p->primed_cnt - p->out_idx >= GAPLESS_TRACK_SLOTS)
+    {
+        return PRIME_BUSY; /* the decoder still drains the slot we would reuse */
+    }
+
+    gapless_track_t *t = slot(p, p->primed_cnt);
+    for (int attempt = 0; attempt < GAPLESS_PROBE_RETRIES; attempt++)
+    {
+        const char *path = p->cfg.next_track(p->cfg.ctx);
+        if (path == NULL)
+        {
+            p->playlist_done = true;
+            return PRIME_END;
+        }
+        if (mp3_probe_file(path, &t->info) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "Skipping unplayable track %s", path);
+            continue;
+        }
+        strlcpy(t->path, path, sizeof(t->path));
+        track_plan(t);
+        /* Loads the sidecar or TOC now so a seek is a table lookup; queues a sidecar build otherwise */
+        mp3_seek_index_close(t->seek);
+        t->seek = mp3_seek_index_open(t->path, &t->info);
+        p->primed_cnt++;
+        ESP_LOGI(TAG, "Primed %s: %d Hz, %d ch, %lld samples, delay %d, padding %d", t->path,
+                 (int)t->info.header.sample_rate, t->info.header.channels,
+                 (long long)t->info.total_samples, t->info.xing.enc_delay, t->info.xing.enc_padding);
+        return PRIME_READY;
+    }
+    return PRIME_END;
+}
+
+static void point_reader(gapless_player_handle_t p, const gapless_track_t *t)
+{
+    p->in_remaining = (int64_t)t->info.audio_end - t->info.audio_start;
+    audio_element_set_uri(p->cfg.reader, t->path);
+    audio_element_set_byte_pos(p->cfg.reader, t->info.audio_start);
+}
+
+static int _reader_write_hook(audio_io_hook_t *hook, audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait)
+{
+    gapless_player_handle_t p = (gapless_player_handle_t)hook->ctx;
+    int n = len;
+    if (n > p->in_remaining)
+    {
+        n = p->in_remaining > 0 ? (int)p->in_remaining : 0;
+    }
+    if (n > 0)
+    {
+        int w = audio_io_hook_next(hook, self, buffer, n, ticks_to_wait);
+        if (w < 0)
+        {
+            return w;
+        }
+        p->in_remaining -= w;
+    }
+    /* Trailing ID3v1/APE bytes are swallowed so the decoder never sees them */
+    return len;
+}
+
+/* Decoder task: a slot came free, wake the event task if the finished reader waits for one */
+static void slot_freed(gapless_player_handle_t p)
+{
+    if (!p->reader_waiting || p->evt == NULL)
+    {
+        return;
+    }
+    audio_event_iface_msg_t msg = {
+        .cmd = GAPLESS_PLAYER_CMD_SLOT_FREE,
+        .source = p,
+        .source_type = GAPLESS_PLAYER_SOURCE_TYPE,
+        .need_free_data = false,
+    };
+    audio_event_iface_sendout(p->evt, &msg);
+}
+
+static int _decoder_read_hook(audio_io_hook_t *hook, audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait)
+{
+    gapless_player_handle_t p = (gapless_player_handle_t)hook->ctx;
+    int r = audio_io_hook_next(hook, self, buffer, len, ticks_to_wait);
+    if (r > 0)
+    {
+        p->in_pos += r;
+    }
+    return r;
+}
+
+static int _decoder_write_hook(audio_io_hook_t *hook, audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait)
+{
+    gapless_player_handle_t p = (gapless_player_handle_t)hook->ctx;
+    int consumed = 0;
+
+    while (consumed < len)
+    {
+        const gapless_track_t *t = slot(p, p->out_idx);
+        int64_t n = len - consumed;
+        if (t->total_bytes >= 0)
+        {
+            int64_t left = t->total_bytes - p->out_pos;
+            if (left <= 0 && p->out_idx != p->in_idx)
+            {
+                p->out_idx++;
+                p->out_pos = 0;
+                slot_freed(p);
+                continue;
+            }
+            if (left > 0 && n > left)
+            {
+                n = left;
+            }
+        }
+        else if (p->out_idx != p->in_idx && (int32_t)(p->in_pos - t->in_end) >= 0)
+        {
+            /* Unknown length: the decoder has read past the track's last byte */
+            p->out_idx++;
+            p->out_pos = 0;
+            slot_freed(p);
+            continue;
+        }
+
+        /* Forward the part of [out_pos, out_pos + n) that lies inside [skip, skip + keep) */
+        const int64_t keep_end = t->keep_bytes == INT64_MAX ? INT64_MAX : t->skip_bytes + t->keep_bytes;
+        const int64_t from = p->out_pos > t->skip_bytes ? p->out_pos : t->skip_bytes;
+        const int64_t to = p->out_pos + n < keep_end ? p->out_pos + n : keep_end;
+        if (to > from)
+        {
+            if (p->started != p->out_idx + 1 && p->cfg.track_start)
+            {
+                p->started = p->out_idx + 1;
+                p->cfg.track_start(t->path, p->cfg.track_ctx);
+            }
+            int w = audio_io_hook_next(hook, self, buffer + consumed + (from - p->out_pos), (int)(to - from), ticks_to_wait);
+            if (w < 0)
+            {
+                return w;
+            }
+        }
+        p->out_pos += n;
+        consumed += n;
+    }
+    return len;
+}
+
+static void stop_pipeline(gapless_player_handle_t p)
+{
+    audio_pipeline_stop(p->cfg.pipeline);
+    audio_pipeline_wait_for_stop(p->cfg.pipeline);
+    audio_pipeline_reset_ringbuffer(p->cfg.pipeline);
+    audio_pipeline_reset_elements(p->cfg.pipeline);
+    audio_pipeline_change_state(p->cfg.pipeline, AEL_STATE_INIT);
+    p->started = 0;
+    p->in_pos = 0;
+    p->reader_waiting = false;
+}
+
+static void set_format(gapless_player_handle_t p, const gapless_track_t *t)
+{
+    if (p->cfg.set_format)
+    {
+        p->cfg.set_format(t->info.header.sample_rate, 16, t->info.header.channels, p->cfg.format_ctx);
+        return;
+    }
+    i2s_stream_set_clk(p->cfg.writer, t->info.header.sample_rate, 16, t->info.header.channels);
+}
+
+static void restart_with_next(gapless_player_handle_t p)
+{
+    const gapless_track_t *t = slot(p, p->in_idx + 1);
+    ESP_LOGI(TAG, "Format change to %d Hz, %d ch, restarting pipeline", (int)t->info.header.sample_rate, t->info.header.channels);
+
+    stop_pipeline(p);
+
+    p->in_idx++;
+    p->out_idx = p->in_idx;
+    p->out_pos = 0;
+    p->restart_pending = false;
+    point_reader(p, t);
+    set_format(p, t);
+    audio_pipeline_run(p->cfg.pipeline);
+}
+
+static void advance_reader(gapless_player_handle_t p)
+{
+    /* Set first: the decoder may free the slot between the check and the flag */
+    p->reader_waiting = true;
+    const prime_result_t primed = prime_next(p);
+    if (primed == PRIME_BUSY)
+    {
+        /* The reader stays finished until the decoder leaves a slot; slot_freed() retries */
+        ESP_LOGD(TAG, "All track slots busy, reader waits");
+        return;
+    }
+    p->reader_waiting = false;
+    if (primed == PRIME_END)
+    {
+        /* Nothing left: let end-of-stream flow down the pipeline as usual */
+        p->playlist_done = true;
+        rb_done_write(p->decoder_in);
+        return;
+    }
+
+    const gapless_track_t *next = slot(p, p->in_idx + 1);
+    if (!same_format(slot(p, p->in_idx), next))
+    {
+        p->restart_pending = true;
+        rb_done_write(p->decoder_in);
+        return;
+    }
+
+    /* The reader is idle, so everything it sent for this track is already queued for the decoder */
+    gapless_track_t *done = slot(p, p->in_idx);
+    done->in_end = p->in_pos + rb_bytes_filled(p->decoder_in);
+    point_reader(p, next);
+    p->in_idx++;
+    audio_element_resume(p->cfg.reader, 0, 0);
+    ESP_LOGI(TAG, "Reader switched to %s", next->path);
+}
+
+gapless_player_handle_t gapless_player_init(const gapless_player_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->pipeline && cfg->reader && cfg->decoder && cfg->writer && cfg->next_track, return NULL);
+
+    gapless_player_handle_t p = audio_calloc(1, sizeof(struct gapless_player));
+    AUDIO_MEM_CHECK(TAG, p, return NULL);
+    p->cfg = *cfg;
+    p->decoder_in = audio_element_get_input_ringbuf(cfg->decoder);
+    p->reader_hook.fn = _reader_write_hook;
+    p->reader_hook.ctx = p;
+    p->decoder_hook.fn = _decoder_write_hook;
+    p->decoder_hook.ctx = p;
+    p->decoder_in_hook.fn = _decoder_read_hook;
+    p->decoder_in_hook.ctx = p;
+    if (p->decoder_in == NULL || audio_io_hook_add(cfg->reader, AUDIO_IO_HOOK_WRITE, &p->reader_hook) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Pipeline must be linked before gapless_player_init");
+        audio_free(p);
+        return NULL;
+    }
+    if (audio_io_hook_add(cfg->decoder, AUDIO_IO_HOOK_WRITE, &p->decoder_hook) != ESP_OK)
+    {
+        audio_io_hook_remove(cfg->reader, AUDIO_IO_HOOK_WRITE, &p->reader_hook);
+        audio_free(p);
+        return NULL;
+    }
+    if (audio_io_hook_add(cfg->decoder, AUDIO_IO_HOOK_READ, &p->decoder_in_hook) != ESP_OK)
+    {
+        audio_io_hook_remove(cfg->reader, AUDIO_IO_HOOK_WRITE, &p->reader_hook);
+        audio_io_hook_remove(cfg->decoder, AUDIO_IO_HOOK_WRITE, &p->decoder_hook);
+        audio_free(p);
+        return NULL;
+    }
+    if (cfg->listener)
+    {
+        audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+        p->evt = audio_event_iface_init(&evt_cfg);
+        AUDIO_MEM_CHECK(TAG, p->evt, {
+            gapless_player_deinit(p);
+            return NULL;
+        });
+        audio_event_iface_set_listener(p->evt, cfg->listener);
+    }
+    return p;
+}
+
+esp_err_t gapless_player_start(gapless_player_handle_t p)
+{
+    AUDIO_NULL_CHECK(TAG, p, return ESP_ERR_INVALID_ARG);
+    if (prime_next(p) != PRIME_READY)
+    {
+        ESP_LOGE(TAG, "Playlist has no playable track");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const gapless_track_t *t = slot(p, p->in_idx);
+    point_reader(p, t);
+    set_format(p, t);
+    return audio_pipeline_run(p->cfg.pipeline);
+}
+
+esp_err_t gapless_player_restart(gapless_player_handle_t p)
+{
+    AUDIO_NULL_CHECK(TAG, p, return ESP_ERR_INVALID_ARG);
+    stop_pipeline(p);
+
+    /* Counters stay monotonic: the next track primed becomes the one playing */
+    p->in_idx = p->primed_cnt;
+    p->out_idx = p->primed_cnt;
+    p->out_pos = 0;
+    p->restart_pending = false;
+    p->playlist_done = false;
+    return gapless_player_start(p);
+}
+
+bool gapless_player_handle_event(gapless_player_handle_t p, const audio_event_iface_msg_t *msg)
+{
+    if (p->reader_waiting && (p->evt == NULL || (msg->source == (void *)p && msg->cmd == GAPLESS_PLAYER_CMD_SLOT_FREE)))
+    {
+        advance_reader(p);
+    }
+    if (msg->source_type != AUDIO_ELEMENT_TYPE_ELEMENT || msg->cmd != AEL_MSG_CMD_REPORT_STATUS)
+    {
+        return false;
+    }
+
+    const int status = (int)msg->data;
+    if (msg->source == (void *)p->cfg.reader)
+    {
+        if (status == AEL_STATUS_STATE_RUNNING)
+        {
+            prime_next(p);
+        }
+        else if (status == AEL_STATUS_STATE_FINISHED)
+        {
+            advance_reader(p);
+        }
+        return false;
+    }
+
+    if (msg->source == (void *)p->cfg.writer && status == AEL_STATUS_STATE_FINISHED)
+    {
+        if (p->restart_pending)
+        {
+            restart_with_next(p);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+esp_err_t gapless_player_seek(gapless_player_handle_t p, uint32_t time_ms)
+{
+    AUDIO_NULL_CHECK(TAG, p, return ESP_ERR_INVALID_ARG);
+    gapless_track_t *t = slot(p, p->out_idx);
+    if (t->seek == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mp3_seek_point_t point;
+    esp_err_t ret = mp3_seek_index_lookup(t->seek, time_ms, &point);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    stop_pipeline(p);
+
+    /* Anything already fed from the following track is discarded; it stays primed */
+    p->in_idx = p->out_idx;
+    p->out_pos = (int64_t)point.frame * t->info.header.samples_per_frame * t->info.header.channels * GAPLESS_PCM_BYTES;
+    p->restart_pending = false;
+    p->in_remaining = (int64_t)t->info.audio_end - point.byte_offset;
+    audio_element_set_uri(p->cfg.reader, t->path);
+    audio_element_set_byte_pos(p->cfg.reader, point.byte_offset);
+    ESP_LOGI(TAG, "Seek to %u ms: offset %u, frame %u (source %d)", (unsigned)point.time_ms, (unsigned)point.byte_offset,
+             (unsigned)point.frame, mp3_seek_index_source(t->seek));
+    return audio_pipeline_run(p->cfg.pipeline);
+}
+
+const char *gapless_player_current_track(gapless_player_handle_t p)
+{
+    return slot(p, p->out_idx)->path;
+}
+
+void gapless_player_deinit(gapless_player_handle_t p)
+{
+    if (p)
+    {
+        audio_io_hook_remove(p->cfg.reader, AUDIO_IO_HOOK_WRITE, &p->reader_hook);
+        audio_io_hook_remove(p->cfg.decoder, AUDIO_IO_HOOK_WRITE, &p->decoder_hook);
+        audio_io_hook_remove(p->cfg.decoder, AUDIO_IO_HOOK_READ, &p->decoder_in_hook);
+        for (int i = 0; i < GAPLESS_TRACK_SLOTS; i++)
+        {
+            mp3_seek_index_close(p->tracks[i].seek);
+        }
+        if (p->evt)
+        {
+            audio_event_iface_remove_listener(p->cfg.listener, p->evt);
+            audio_event_iface_destroy(p->evt);
+        }
+        audio_free(p);
+    }
+}
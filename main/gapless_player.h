@@ -0,0 +1,132 @@
+/* Gapless track transitions on a single file->mp3->i2s pipeline
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __GAPLESS_PLAYER_H__
+#define __GAPLESS_PLAYER_H__
+
+#include <stdbool.h>
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "audio_event_iface.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of the player's own messages, fed back through
+   gapless_player_handle_event() */
+#define GAPLESS_PLAYER_SOURCE_TYPE (0x47415050) /* "GAPP" */
+/* audio_event_iface_msg_t.cmd sent when the decoder frees a track slot the finished reader waits for */
+#define GAPLESS_PLAYER_CMD_SLOT_FREE (1)
+
+    /**
+     * @brief Returns the next track to play, or NULL when the playlist is exhausted.
+     *        The string must stay valid until the next call.
+     */
+    typedef const char *(*gapless_next_track_cb)(void *ctx);
+
+    /**
+     * @brief Reclocks the output for a track. Called with the pipeline stopped, or before the first run.
+     */
+    typedef esp_err_t (*gapless_format_cb)(int rate, int bits, int ch, void *ctx);
+
+    /**
+     * @brief A track's PCM is about to be written. Called from the decoder task before its
+     *        first sample, and again before the first sample after a restart or seek.
+     */
+    typedef void (*gapless_track_cb)(const char *path, void *ctx);
+
+    /**
+     * @brief Gapless player configuration
+     */
+    typedef struct
+    {
+        audio_pipeline_handle_t pipeline; /*!< Pipeline holding the three elements, already linked */
+        audio_element_handle_t reader;    /*!< "file" element, any reader honouring URI and byte_pos */
+        audio_element_handle_t decoder;   /*!< "mp3" element */
+        audio_element_handle_t writer;    /*!< Last element, normally "i2s"; its FINISHED ends playback */
+        gapless_next_track_cb next_track; /*!< Playlist source */
+        void *ctx;                        /*!< Passed to `next_track` */
+        gapless_format_cb set_format;     /*!< Output reclock, NULL to only call i2s_stream_set_clk() on `writer` */
+        void *format_ctx;                 /*!< Passed to `set_format` */
+        gapless_track_cb track_start;     /*!< Track boundary in the decoder output, may be NULL */
+        void *track_ctx;                  /*!< Passed to `track_start` */
+        audio_event_iface_handle_t listener; /*!< Queue read by the task calling gapless_player_handle_event(),
+                                                  normally the pipeline listener. Without it a reader waiting
+                                                  for a free slot is only retried on the next pipeline event */
+    } gapless_player_cfg_t;
+
+    typedef struct gapless_player *gapless_player_handle_t;
+
+    /**
+     * @brief Take over the reader->decoder and decoder->writer links of a linked pipeline
+     *
+     * @param cfg the configuration
+     *
+     * @return The gapless player handle, NULL on failure
+     */
+    gapless_player_handle_t gapless_player_init(const gapless_player_cfg_t *cfg);
+
+    /**
+     * @brief Probe the first track, point the reader at it and run the pipeline
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_NOT_FOUND  the playlist is empty or no track could be probed
+     */
+    esp_err_t gapless_player_start(gapless_player_handle_t player);
+
+    /**
+     * @brief Stop the pipeline, forget the tracks already primed and start again from the
+     *        track `next_track` returns now, e.g. after moving the playlist position.
+     *        Call from the task that feeds gapless_player_handle_event(), also once the
+     *        playlist has finished.
+     *
+     * @return Same as gapless_player_start()
+     */
+    esp_err_t gapless_player_restart(gapless_player_handle_t player);
+
+    /**
+     * @brief Feed a pipeline event; drives priming and the in-place track switch
+     *
+     * @param msg event received from the pipeline listener
+     *
+     * @return true once the last track has finished playing
+     */
+    bool gapless_player_handle_event(gapless_player_handle_t player, const audio_event_iface_msg_t *msg);
+
+    /**
+     * @brief Jump within the track currently being heard. Call from the task that feeds
+     *        gapless_player_handle_event(); the pipeline is restarted at the indexed offset.
+     *
+     * @param time_ms position from the start of the track
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG    position is past the end of the track
+     *     - ESP_ERR_INVALID_STATE  no seek index for the track
+     */
+    esp_err_t gapless_player_seek(gapless_player_handle_t player, uint32_t time_ms);
+
+    /**
+     * @brief Path of the track currently being heard
+     */
+    const char *gapless_player_current_track(gapless_player_handle_t player);
+
+    /**
+     * @brief Release the player. The pipeline must already be stopped.
+     */
+    void gapless_player_deinit(gapless_player_handle_t player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
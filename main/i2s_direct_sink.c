@@ -0,0 +1,407 @@
+/* I2S sink that takes PCM straight from the last pipeline element
+
+   With i2s_stream, decoded PCM is copied into a ringbuffer by the decoder,
+   out of it by the i2s_stream task, and then into the DMA buffers by
+   i2s_channel_write(). Here the producing element's write callback is
+   i2s_channel_write() itself: its output buffer is copied once, into the
+   next DMA buffer the driver has handed back, and the ringbuffer and the
+   i2s_stream task with its buffer are gone. The write blocks while all DMA
+   buffers are owned by the hardware, which is the backpressure the ring
+   used to provide.
+
+   Another task can claim the channel, e.g. to play a prompt: the pipeline
+   writes in pieces of one DMA buffer under a lock, so a claim waits at most
+   one buffer period, after which the pipeline blocks until the release.
+   i2s_direct_sink_preempt() drops the DMA queue and preloads the claimer's
+   audio, so it is heard at once instead of behind the queued buffers.
+
+   The DMA buffers can be resized while the sink is in use: the audio
+   already queued is played out, then the channel is deleted and created
+   again with the new sizes and the current format. Only the I2S channel
+   restarts, the codec is not touched, so the output is silent for the few
+   hundred microseconds that takes. The bytes queued in the DMA buffers are
+   tracked from the writes and the sent interrupts; their low-water mark is
+   how close the output came to running dry.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_attr.h"
+#include "driver/i2s_std.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "board.h"
+#include "audio_io_hook.h"
+#include "i2s_direct_sink.h"
+
+static const char *TAG = "I2S_DIRECT_SINK";
+
+/* Largest DMA buffer the driver accepts */
+#define I2S_DMA_BUF_MAX_BYTES (4092)
+
+struct i2s_direct_sink
+{
+    i2s_chan_handle_t tx;
+    int port;
+    i2s_std_clk_config_t clk_cfg;
+    i2s_std_slot_config_t slot_cfg;
+    i2s_std_gpio_config_t gpio_cfg;
+    int rate;
+    int bits;
+    int ch;
+    int dma_desc_num;
+    int dma_frames; /* Frames per DMA buffer, the pipeline write unit */
+    SemaphoreHandle_t lock; /* Recursive: held per pipeline write, and across a claim */
+    audio_element_handle_t el;
+    audio_io_hook_t hook;
+    volatile uint64_t bytes;
+    volatile uint32_t dma_done;
+    volatile uint32_t underruns;
+    volatile uint32_t resizes;
+    volatile int32_t queued;   /* Bytes written and not sent yet */
+    volatile int32_t lead_min; /* Lowest `queued` after a buffer was sent */
+};
+
+static bool IRAM_ATTR _on_sent(i2s_chan_handle_t handle, i2s_event_data_t *event, void *ctx)
+{
+    i2s_direct_sink_handle_t sink = (i2s_direct_sink_handle_t)ctx;
+    sink->dma_done++;
+    /* Saturates: a cleared buffer replayed during an underrun takes nothing off */
+    int32_t q = __atomic_load_n(&sink->queued, __ATOMIC_RELAXED);
+    int32_t left = 0;
+    while (q > 0)
+    {
+        left = q > (int32_t)event->size ? q - (int32_t)event->size : 0;
+        if (__atomic_compare_exchange_n(&sink->queued, &q, left, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        left = 0;
+    }
+    if (left < sink->lead_min)
+    {
+        sink->lead_min = left;
+    }
+    return false;
+}
+
+/* Every DMA buffer went out without a new write in between: the hardware is replaying (cleared) buffers */
+static bool IRAM_ATTR _on_send_q_ovf(i2s_chan_handle_t handle, i2s_event_data_t *event, void *ctx)
+{
+    ((i2s_direct_sink_handle_t)ctx)->underruns++;
+    return false;
+}
+
+static int channel_write(i2s_direct_sink_handle_t sink, const void *buf, size_t len, TickType_t ticks)
+{
+    size_t written = 0;
+    const uint32_t timeout_ms = ticks == portMAX_DELAY ? portMAX_DELAY : pdTICKS_TO_MS(ticks);
+    esp_err_t ret = i2s_channel_write(sink->tx, buf, len, &written, timeout_ms);
+    if (written > 0)
+    {
+        sink->bytes += written;
+        __atomic_fetch_add(&sink->queued, (int32_t)written, __ATOMIC_RELAXED);
+        return written;
+    }
+    return ret == ESP_ERR_TIMEOUT ? AEL_IO_TIMEOUT : AEL_IO_FAIL;
+}
+
+static int _sink_write(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    i2s_direct_sink_handle_t sink = (i2s_direct_sink_handle_t)hook->ctx;
+    int done = 0;
+    while (done < len)
+    {
+        if (xSemaphoreTakeRecursive(sink->lock, ticks) != pdTRUE)
+        {
+            break;
+        }
+        const int piece = sink->dma_frames * sink->ch * (sink->bits / 8);
+        const int ret = channel_write(sink, buf + done, len - done < piece ? len - done : piece, ticks);
+        xSemaphoreGiveRecursive(sink->lock);
+        if (ret <= 0)
+        {
+            return done > 0 ? done : ret;
+        }
+        done += ret;
+    }
+    return done > 0 ? done : AEL_IO_TIMEOUT;
+}
+
+static void fill_slot_cfg(i2s_direct_sink_handle_t sink, int bits, int ch)
+{
+    const i2s_std_slot_config_t slot = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG((i2s_data_bit_width_t)bits,
+                                                                          ch == 1 ? I2S_SLOT_MODE_MONO : I2S_SLOT_MODE_STEREO);
+    sink->slot_cfg = slot;
+}
+
+/* Create and start the TX channel in the sink's current format */
+static esp_err_t open_channel(i2s_direct_sink_handle_t sink, int desc_num, int frame_num)
+{
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(sink->port, I2S_ROLE_MASTER);
+    chan_cfg.dma_desc_num = desc_num;
+    chan_cfg.dma_frame_num = frame_num;
+    /* An underrun plays silence instead of repeating the last buffer */
+    chan_cfg.auto_clear = true;
+    const i2s_std_config_t std_cfg = {
+        .clk_cfg = sink->clk_cfg,
+        .slot_cfg = sink->slot_cfg,
+        .gpio_cfg = sink->gpio_cfg,
+    };
+    const i2s_event_callbacks_t cbs = {
+        .on_sent = _on_sent,
+        .on_send_q_ovf = _on_send_q_ovf,
+    };
+
+    esp_err_t ret = i2s_new_channel(&chan_cfg, &sink->tx, NULL);
+    if (ret != ESP_OK)
+    {
+        sink->tx = NULL;
+        return ret;
+    }
+    ret = i2s_channel_init_std_mode(sink->tx, &std_cfg);
+    if (ret == ESP_OK)
+    {
+        ret = i2s_channel_register_event_callback(sink->tx, &cbs, sink);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = i2s_channel_enable(sink->tx);
+    }
+    if (ret != ESP_OK)
+    {
+        i2s_del_channel(sink->tx);
+        sink->tx = NULL;
+        return ret;
+    }
+    sink->dma_desc_num = desc_num;
+    sink->dma_frames = frame_num;
+    sink->queued = 0;
+    sink->lead_min = INT32_MAX;
+    return ESP_OK;
+}
+
+i2s_direct_sink_handle_t i2s_direct_sink_init(const i2s_direct_sink_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg, return NULL);
+    i2s_direct_sink_handle_t sink = audio_calloc(1, sizeof(struct i2s_direct_sink));
+    AUDIO_MEM_CHECK(TAG, sink, return NULL);
+
+    board_i2s_pin_t pins = {0};
+    get_i2s_pins(cfg->port, &pins);
+    sink->port = cfg->port;
+    sink->gpio_cfg = (i2s_std_gpio_config_t){
+        .mclk = pins.mck_io_num,
+        .bclk = pins.bck_io_num,
+        .ws = pins.ws_io_num,
+        .dout = pins.data_out_num,
+        .din = I2S_GPIO_UNUSED,
+    };
+    const i2s_std_clk_config_t clk = I2S_STD_CLK_DEFAULT_CONFIG(cfg->sample_rate);
+    sink->clk_cfg = clk;
+    /* The codec dividers assume MCLK = 256 fs */
+    sink->clk_cfg.mclk_multiple = I2S_MCLK_MULTIPLE_256;
+    fill_slot_cfg(sink, cfg->bits, cfg->channels);
+    sink->rate = cfg->sample_rate;
+    sink->bits = cfg->bits;
+    sink->ch = cfg->channels;
+
+    sink->lock = xSemaphoreCreateRecursiveMutex();
+    AUDIO_MEM_CHECK(TAG, sink->lock, {
+        audio_free(sink);
+        return NULL;
+    });
+    if (open_channel(sink, cfg->dma_desc_num, cfg->dma_frame_num) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start I2S%d", cfg->port);
+        vSemaphoreDelete(sink->lock);
+        audio_free(sink);
+        return NULL;
+    }
+    sink->hook = (audio_io_hook_t){.fn = _sink_write, .ctx = sink};
+    ESP_LOGI(TAG, "I2S%d: %d x %d frame DMA buffers, written directly", cfg->port, cfg->dma_desc_num, cfg->dma_frame_num);
+    return sink;
+}
+
+esp_err_t i2s_direct_sink_attach(i2s_direct_sink_handle_t sink, audio_element_handle_t el)
+{
+    AUDIO_NULL_CHECK(TAG, sink && el, return ESP_ERR_INVALID_ARG);
+    ESP_RETURN_ON_ERROR(audio_io_hook_set_sink(el, AUDIO_IO_HOOK_WRITE, &sink->hook), TAG, "attach failed");
+    sink->el = el;
+    return ESP_OK;
+}
+
+esp_err_t i2s_direct_sink_set_clk(i2s_direct_sink_handle_t sink, int rate, int bits, int ch)
+{
+    AUDIO_NULL_CHECK(TAG, sink, return ESP_ERR_INVALID_ARG);
+    if (rate == sink->rate && bits == sink->bits && ch == sink->ch)
+    {
+        return ESP_OK;
+    }
+
+    /* Waits for a pipeline write in progress, or for the claimer to release the channel */
+    xSemaphoreTakeRecursive(sink->lock, portMAX_DELAY);
+    esp_err_t ret = i2s_channel_disable(sink->tx);
+    if (ret == ESP_OK)
+    {
+        sink->queued = 0;
+        sink->clk_cfg.sample_rate_hz = rate;
+        fill_slot_cfg(sink, bits, ch);
+        ret = i2s_channel_reconfig_std_clock(sink->tx, &sink->clk_cfg);
+        if (ret == ESP_OK)
+        {
+            ret = i2s_channel_reconfig_std_slot(sink->tx, &sink->slot_cfg);
+        }
+        i2s_channel_enable(sink->tx);
+    }
+    if (ret == ESP_OK)
+    {
+        sink->rate = rate;
+        sink->bits = bits;
+        sink->ch = ch;
+    }
+    xSemaphoreGiveRecursive(sink->lock);
+    ESP_RETURN_ON_ERROR(ret, TAG, "reconfig to %d Hz, %d bits, %d ch failed", rate, bits, ch);
+    return ESP_OK;
+}
+
+esp_err_t i2s_direct_sink_claim(i2s_direct_sink_handle_t sink, TickType_t ticks)
+{
+    AUDIO_NULL_CHECK(TAG, sink, return ESP_ERR_INVALID_ARG);
+    return xSemaphoreTakeRecursive(sink->lock, ticks) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+int i2s_direct_sink_preempt(i2s_direct_sink_handle_t sink, const void *head, size_t len)
+{
+    AUDIO_NULL_CHECK(TAG, sink, return AEL_IO_FAIL);
+    size_t loaded = 0;
+    /* Disabling resets the DMA: whatever was queued is never played */
+    esp_err_t ret = i2s_channel_disable(sink->tx);
+    sink->queued = 0;
+    if (ret == ESP_OK && len > 0)
+    {
+        ret = i2s_channel_preload_data(sink->tx, head, len, &loaded);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = i2s_channel_enable(sink->tx);
+    }
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Preempt failed: %s", esp_err_to_name(ret));
+        i2s_channel_enable(sink->tx);
+        return AEL_IO_FAIL;
+    }
+    sink->bytes += loaded;
+    __atomic_fetch_add(&sink->queued, (int32_t)loaded, __ATOMIC_RELAXED);
+    return loaded;
+}
+
+int i2s_direct_sink_write(i2s_direct_sink_handle_t sink, const void *buf, size_t len, TickType_t ticks)
+{
+    AUDIO_NULL_CHECK(TAG, sink && buf, return AEL_IO_FAIL);
+    return channel_write(sink, buf, len, ticks);
+}
+
+void i2s_direct_sink_release(i2s_direct_sink_handle_t sink)
+{
+    if (sink)
+    {
+        xSemaphoreGiveRecursive(sink->lock);
+    }
+}
+
+esp_err_t i2s_direct_sink_set_dma(i2s_direct_sink_handle_t sink, int desc_num, int frame_num)
+{
+    AUDIO_NULL_CHECK(TAG, sink, return ESP_ERR_INVALID_ARG);
+    if (desc_num < 2 || frame_num < 1 || frame_num * sink->ch * (sink->bits / 8) > I2S_DMA_BUF_MAX_BYTES)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (desc_num == sink->dma_desc_num && frame_num == sink->dma_frames)
+    {
+        return ESP_OK;
+    }
+
+    xSemaphoreTakeRecursive(sink->lock, portMAX_DELAY);
+    /* Nothing is written while locked: let the queue play out, for at most its length */
+    const int bytes_per_ms = sink->rate / 1000 * sink->ch * (sink->bits / 8);
+    int wait_ms = sink->dma_desc_num * sink->dma_frames * 1000 / sink->rate + 2;
+    while (sink->queued > 0 && wait_ms > 0)
+    {
+        const int ms = bytes_per_ms > 0 ? sink->queued / bytes_per_ms + 1 : 1;
+        vTaskDelay(pdMS_TO_TICKS(ms) > 0 ? pdMS_TO_TICKS(ms) : 1);
+        wait_ms -= ms;
+    }
+    const int old_desc = sink->dma_desc_num;
+    const int old_frames = sink->dma_frames;
+    i2s_channel_disable(sink->tx);
+    i2s_del_channel(sink->tx);
+    esp_err_t ret = open_channel(sink, desc_num, frame_num);
+    if (ret != ESP_OK && open_channel(sink, old_desc, old_frames) != ESP_OK)
+    {
+        /* The old buffers were just freed, so this only fails on a broken heap */
+        ESP_LOGE(TAG, "I2S%d lost its channel", sink->port);
+    }
+    if (ret == ESP_OK)
+    {
+        sink->resizes++;
+    }
+    xSemaphoreGiveRecursive(sink->lock);
+    ESP_RETURN_ON_ERROR(ret, TAG, "%d x %d frame DMA buffers failed", desc_num, frame_num);
+    ESP_LOGI(TAG, "I2S%d: %d x %d frame DMA buffers (was %d x %d)", sink->port, desc_num, frame_num, old_desc, old_frames);
+    return ESP_OK;
+}
+
+int i2s_direct_sink_take_lead_min(i2s_direct_sink_handle_t sink)
+{
+    if (sink == NULL)
+    {
+        return -1;
+    }
+    const int32_t lead = __atomic_exchange_n(&sink->lead_min, INT32_MAX, __ATOMIC_RELAXED);
+    return lead == INT32_MAX ? -1 : lead / (sink->ch * (sink->bits / 8));
+}
+
+esp_err_t i2s_direct_sink_get_stats(i2s_direct_sink_handle_t sink, i2s_direct_sink_stats_t *stats)
+{
+    if (!sink || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    stats->bytes = sink->bytes;
+    stats->dma_done = sink->dma_done;
+    stats->underruns = sink->underruns;
+    stats->dma_desc_num = sink->dma_desc_num;
+    stats->dma_frame_num = sink->dma_frames;
+    stats->resizes = sink->resizes;
+    return ESP_OK;
+}
+
+void i2s_direct_sink_deinit(i2s_direct_sink_handle_t sink)
+{
+    if (sink == NULL)
+    {
+        return;
+    }
+    if (sink->el)
+    {
+        audio_io_hook_remove(sink->el, AUDIO_IO_HOOK_WRITE, &sink->hook);
+    }
+    if (sink->tx)
+    {
+        i2s_channel_disable(sink->tx);
+        i2s_del_channel(sink->tx);
+    }
+    vSemaphoreDelete(sink->lock);
+    audio_free(sink);
+}
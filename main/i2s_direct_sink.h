@@ -0,0 +1,148 @@
+/* I2S sink that takes PCM straight from the last pipeline element
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __I2S_DIRECT_SINK_H__
+#define __I2S_DIRECT_SINK_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief I2S direct sink configuration
+     */
+    typedef struct
+    {
+        int port;          /*!< I2S port, pins come from get_i2s_pins() */
+        int sample_rate;   /*!< Initial sample rate */
+        int bits;          /*!< Initial bits per sample */
+        int channels;      /*!< Initial channel count */
+        int dma_desc_num;  /*!< DMA buffers */
+        int dma_frame_num; /*!< Frames per DMA buffer */
+    } i2s_direct_sink_cfg_t;
+
+#define I2S_DIRECT_SINK_CFG_DEFAULT()   \
+    {                                   \
+        .port = 0,                      \
+        .sample_rate = 44100,           \
+        .bits = 16,                     \
+        .channels = 2,                  \
+        .dma_desc_num = 3,              \
+        .dma_frame_num = 312,           \
+    }
+
+    /**
+     * @brief Sink counters since init
+     */
+    typedef struct
+    {
+        uint64_t bytes;     /*!< PCM bytes handed to the DMA buffers */
+        uint32_t dma_done;  /*!< DMA buffers sent */
+        uint32_t underruns; /*!< DMA buffers that had to be sent again (as silence) because nothing new was written */
+        int dma_desc_num;   /*!< Current DMA buffers */
+        int dma_frame_num;  /*!< Current frames per DMA buffer */
+        uint32_t resizes;   /*!< i2s_direct_sink_set_dma() calls that changed the sizes */
+    } i2s_direct_sink_stats_t;
+
+    typedef struct i2s_direct_sink *i2s_direct_sink_handle_t;
+
+    /**
+     * @brief Create and enable the I2S TX channel
+     *
+     * @return The sink handle, NULL on failure
+     */
+    i2s_direct_sink_handle_t i2s_direct_sink_init(const i2s_direct_sink_cfg_t *cfg);
+
+    /**
+     * @brief Make the sink the output of `el`, which must be the last element of its pipeline.
+     *        Call after audio_pipeline_link() and before other write hooks on `el`.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NO_MEM
+     */
+    esp_err_t i2s_direct_sink_attach(i2s_direct_sink_handle_t sink, audio_element_handle_t el);
+
+    /**
+     * @brief Reclock the channel. A format equal to the current one is a no-op.
+     */
+    esp_err_t i2s_direct_sink_set_clk(i2s_direct_sink_handle_t sink, int rate, int bits, int ch);
+
+    /**
+     * @brief Take the channel from the pipeline, whose writes then block until
+     *        i2s_direct_sink_release(). Waits for at most one DMA buffer of pipeline audio.
+     *        May be nested; set_clk can be called while claimed.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_TIMEOUT
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t i2s_direct_sink_claim(i2s_direct_sink_handle_t sink, TickType_t ticks);
+
+    /**
+     * @brief Drop the audio queued in the DMA buffers and load `head` to be played next,
+     *        without waiting for a buffer. Only while claimed.
+     *
+     * @return Bytes of `head` loaded (up to all DMA buffers), AEL_IO_FAIL on error
+     */
+    int i2s_direct_sink_preempt(i2s_direct_sink_handle_t sink, const void *head, size_t len);
+
+    /**
+     * @brief Write while claimed, blocking for free DMA buffers
+     *
+     * @return Bytes written, AEL_IO_TIMEOUT or AEL_IO_FAIL
+     */
+    int i2s_direct_sink_write(i2s_direct_sink_handle_t sink, const void *buf, size_t len, TickType_t ticks);
+
+    /**
+     * @brief Give the channel back to the pipeline
+     */
+    void i2s_direct_sink_release(i2s_direct_sink_handle_t sink);
+
+    /**
+     * @brief Resize the DMA buffers. The audio already queued is played out first, for at most
+     *        the length of the queue, then the channel is recreated in the current format; the
+     *        codec is not touched. Output is silent while that happens, so call it at a track
+     *        boundary or in silence. On failure the old sizes are restored.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG  fewer than 2 buffers, or a buffer over 4092 bytes
+     *     - ESP_ERR_NO_MEM
+     */
+    esp_err_t i2s_direct_sink_set_dma(i2s_direct_sink_handle_t sink, int desc_num, int frame_num);
+
+    /**
+     * @brief Lowest audio queued in the DMA buffers right after one was sent, since the last call
+     *
+     * @return Frames, -1 if no buffer was sent
+     */
+    int i2s_direct_sink_take_lead_min(i2s_direct_sink_handle_t sink);
+
+    /**
+     * @brief Get the sink counters
+     */
+    esp_err_t i2s_direct_sink_get_stats(i2s_direct_sink_handle_t sink, i2s_direct_sink_stats_t *stats);
+
+    /**
+     * @brief Detach and delete the channel. The pipeline must be stopped.
+     */
+    void i2s_direct_sink_deinit(i2s_direct_sink_handle_t sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,376 @@
+/* Sizes the I2S DMA buffers of the direct sink from measured underruns and slack
+
+   The DMA buffers are the last reserve between the pipeline and the codec:
+   too few and an SD stall or a busy decoder is heard as a dropout, too many
+   and every prompt, pause and volume step lags behind by their length. No
+   fixed size suits both, so this picks one at run time, between min_ms and
+   max_ms of audio.
+
+   A hook on the element that writes into the sink measures, every period:
+     - underruns, from the sink's queue overflow interrupt;
+     - the DMA lead: the least audio the DMA buffers still held right after
+       one was sent, tracked by the sink;
+     - the ringbuffer slack: the lowest fill of the element's input ring,
+       which is what the element can still draw on when its source stalls.
+   An underrun, or a lead under an eighth of the buffers, doubles the total;
+   so does a near-empty input ring while the lead is under half of them. A
+   lead of at least half the buffers with the input ring at least half full
+   for calm_periods in a row halves it.
+
+   The sink can only be resized by recreating its channel, which stops the
+   output for a moment, so the new size waits for a point where that is not
+   heard: the first write of a track (i2s_dma_adapt_boundary()), or silence
+   long enough that all the audio queued in the DMA buffers is silent.
+   Only the I2S channel is recreated, never the codec. Buffers are kept at
+   2 or more and under the driver's 4092 bytes each.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "i2s_dma_adapt.h"
+
+static const char *TAG = "I2S_DMA_ADAPT";
+
+/* A gap between writes this long is a pause or a stop, not a stall: measuring restarts */
+#define ADAPT_IDLE_US (500 * 1000)
+#define ADAPT_DMA_BUF_MAX_BYTES (4092)
+#define ADAPT_MIN_DESC (2)
+
+struct i2s_dma_adapt
+{
+    i2s_dma_adapt_cfg_t cfg;
+    audio_io_hook_t hook;
+    ringbuf_handle_t in; /* Input ring of the element, NULL without one */
+    volatile int rate;
+    volatile int bits;
+    volatile int ch;
+    volatile bool boundary;
+    volatile uint32_t target; /* Total frames to resize to, 0 if none */
+    volatile uint8_t target_reason;
+    SemaphoreHandle_t lock; /* stats */
+    i2s_dma_adapt_stats_t stats;
+
+    /* Hook only */
+    int64_t period_start_us;
+    int64_t last_write_us;
+    uint32_t underruns_seen;
+    uint32_t ring_min;
+    int calm;
+    uint32_t silent_frames;
+};
+
+static const char *s_reason_names[] = {"underrun", "low lead", "low ring", "slack", "bounds"};
+
+const char *i2s_dma_adapt_reason_name(int reason)
+{
+    return reason >= 0 && reason < (int)(sizeof(s_reason_names) / sizeof(s_reason_names[0])) ? s_reason_names[reason] : "?";
+}
+
+/* Fewest buffers of at most 4092 bytes, at least two, holding `total` frames */
+static void layout(i2s_dma_adapt_handle_t ad, uint32_t total, int *desc, int *frames)
+{
+    const int max_frames = ADAPT_DMA_BUF_MAX_BYTES / (ad->ch * (ad->bits / 8));
+    int n = (int)((total + max_frames - 1) / max_frames);
+    n = n < ADAPT_MIN_DESC ? ADAPT_MIN_DESC : n;
+    *desc = n;
+    *frames = (int)((total + n - 1) / n);
+}
+
+static uint32_t ms_to_frames(i2s_dma_adapt_handle_t ad, int ms)
+{
+    return (uint32_t)((int64_t)ms * ad->rate / 1000);
+}
+
+/* Forget what happened while not playing or across a resize */
+static void restart_period(i2s_dma_adapt_handle_t ad, int64_t now)
+{
+    i2s_direct_sink_stats_t ss;
+    i2s_direct_sink_get_stats(ad->cfg.sink, &ss);
+    ad->underruns_seen = ss.underruns;
+    i2s_direct_sink_take_lead_min(ad->cfg.sink);
+    ad->ring_min = UINT32_MAX;
+    ad->period_start_us = now;
+}
+
+static void evaluate(i2s_dma_adapt_handle_t ad)
+{
+    i2s_direct_sink_stats_t ss;
+    i2s_direct_sink_get_stats(ad->cfg.sink, &ss);
+    const uint32_t underruns = ss.underruns - ad->underruns_seen;
+    ad->underruns_seen = ss.underruns;
+    const int lead = i2s_direct_sink_take_lead_min(ad->cfg.sink);
+    const uint32_t total = (uint32_t)(ss.dma_desc_num * ss.dma_frame_num);
+    const uint32_t ring_size = ad->in ? (uint32_t)rb_get_size(ad->in) : 0;
+    const bool ring_seen = ad->in && ad->ring_min != UINT32_MAX;
+
+    uint32_t want = 0;
+    int reason = -1;
+    if (underruns > 0)
+    {
+        want = total * 2;
+        reason = I2S_DMA_ADAPT_GROW_UNDERRUN;
+    }
+    else if (lead >= 0 && (uint32_t)lead < total / 8)
+    {
+        want = total * 2;
+        reason = I2S_DMA_ADAPT_GROW_LEAD;
+    }
+    else if (ring_seen && ad->ring_min < ring_size / 16 && lead >= 0 && (uint32_t)lead < total / 2)
+    {
+        want = total * 2;
+        reason = I2S_DMA_ADAPT_GROW_RING;
+    }
+    else if (lead >= 0 && (uint32_t)lead >= total / 2 && (!ring_seen || ad->ring_min >= ring_size / 2))
+    {
+        if (++ad->calm >= ad->cfg.calm_periods)
+        {
+            want = total / 2;
+            reason = I2S_DMA_ADAPT_SHRINK;
+        }
+    }
+    else
+    {
+        ad->calm = 0;
+    }
+
+    const uint32_t lo = ms_to_frames(ad, ad->cfg.min_ms);
+    const uint32_t hi = ms_to_frames(ad, ad->cfg.max_ms);
+    if (reason < 0 && (total < lo || total > hi))
+    {
+        want = total;
+        reason = I2S_DMA_ADAPT_BOUNDS;
+    }
+    want = want < lo ? lo : want > hi ? hi : want;
+    if (reason >= 0 && want != total)
+    {
+        const uint32_t pending = ad->target;
+        /* A grow waiting for its moment is not undone by a later calm period */
+        if (want > total || pending == 0 || pending < total)
+        {
+            ad->target_reason = (uint8_t)reason;
+            ad->target = want > total && pending > want ? pending : want;
+        }
+        ad->calm = 0;
+    }
+
+    xSemaphoreTake(ad->lock, portMAX_DELAY);
+    ad->stats.underruns += underruns;
+    memmove(&ad->stats.period_underruns[1], &ad->stats.period_underruns[0],
+            sizeof(ad->stats.period_underruns) - sizeof(ad->stats.period_underruns[0]));
+    ad->stats.period_underruns[0] = underruns;
+    ad->stats.lead_min_frames = lead;
+    xSemaphoreGive(ad->lock);
+}
+
+static void apply(i2s_dma_adapt_handle_t ad)
+{
+    i2s_direct_sink_stats_t ss;
+    i2s_direct_sink_get_stats(ad->cfg.sink, &ss);
+    const uint32_t total = (uint32_t)(ss.dma_desc_num * ss.dma_frame_num);
+    const uint32_t target = ad->target;
+    const uint8_t reason = ad->target_reason;
+    int desc, frames;
+    layout(ad, target, &desc, &frames);
+    const esp_err_t ret = i2s_direct_sink_set_dma(ad->cfg.sink, desc, frames);
+    ad->target = 0;
+    ad->silent_frames = 0;
+    ad->calm = 0;
+    const int64_t now = esp_timer_get_time();
+    restart_period(ad, now);
+
+    xSemaphoreTake(ad->lock, portMAX_DELAY);
+    if (ret != ESP_OK)
+    {
+        ad->stats.failed++;
+        xSemaphoreGive(ad->lock);
+        return;
+    }
+    if (target > total)
+    {
+        ad->stats.grows++;
+    }
+    else
+    {
+        ad->stats.shrinks++;
+    }
+    ad->stats.desc_num = desc;
+    ad->stats.frame_num = frames;
+    ad->stats.latency_us = (uint32_t)((int64_t)desc * frames * 1000000 / ad->rate);
+    memmove(&ad->stats.changes[1], &ad->stats.changes[0], sizeof(ad->stats.changes) - sizeof(ad->stats.changes[0]));
+    ad->stats.changes[0] = (i2s_dma_adapt_change_t){
+        .uptime_ms = (uint32_t)(now / 1000),
+        .desc_num = (uint16_t)desc,
+        .frame_num = (uint16_t)frames,
+        .reason = reason,
+    };
+    if (ad->stats.change_count < I2S_DMA_ADAPT_CHANGES)
+    {
+        ad->stats.change_count++;
+    }
+    xSemaphoreGive(ad->lock);
+    ESP_LOGI(TAG, "%s: %d x %d frames, %u us", i2s_dma_adapt_reason_name(reason), desc, frames,
+             (unsigned)ad->stats.latency_us);
+}
+
+/* Whether everything in the DMA buffers is silence once `buf` is queued behind it */
+static bool queue_silent(i2s_dma_adapt_handle_t ad, const char *buf, int len)
+{
+    if (ad->bits != 16)
+    {
+        return false;
+    }
+    const int16_t *pcm = (const int16_t *)buf;
+    const int n = len / 2;
+    for (int i = 0; i < n; i++)
+    {
+        if (abs(pcm[i]) > ad->cfg.silence_level)
+        {
+            ad->silent_frames = 0;
+            return false;
+        }
+    }
+    i2s_direct_sink_stats_t ss;
+    i2s_direct_sink_get_stats(ad->cfg.sink, &ss);
+    const bool all = ad->silent_frames >= (uint32_t)(ss.dma_desc_num * ss.dma_frame_num);
+    ad->silent_frames += n / ad->ch;
+    return all;
+}
+
+static int _adapt_write(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    i2s_dma_adapt_handle_t ad = (i2s_dma_adapt_handle_t)hook->ctx;
+    const int64_t now = esp_timer_get_time();
+    if (now - ad->last_write_us > ADAPT_IDLE_US)
+    {
+        restart_period(ad, now);
+    }
+    ad->last_write_us = now;
+    if (ad->in)
+    {
+        const uint32_t fill = (uint32_t)rb_bytes_filled(ad->in);
+        ad->ring_min = fill < ad->ring_min ? fill : ad->ring_min;
+    }
+    if (now - ad->period_start_us >= (int64_t)ad->cfg.period_ms * 1000)
+    {
+        evaluate(ad);
+        ad->ring_min = UINT32_MAX;
+        ad->period_start_us = now;
+    }
+    /* Scanned for silence only while a resize waits */
+    if (ad->target && (ad->boundary || queue_silent(ad, buf, len)))
+    {
+        apply(ad);
+    }
+    ad->boundary = false;
+    return audio_io_hook_next(hook, el, buf, len, ticks);
+}
+
+i2s_dma_adapt_handle_t i2s_dma_adapt_init(const i2s_dma_adapt_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->sink && cfg->el, return NULL);
+    if (cfg->min_ms <= 0 || cfg->max_ms < cfg->min_ms || cfg->period_ms <= 0 || cfg->rate <= 0 || cfg->ch <= 0 ||
+        cfg->bits < 8)
+    {
+        ESP_LOGE(TAG, "Bad config: %d..%d ms every %d ms", cfg->min_ms, cfg->max_ms, cfg->period_ms);
+        return NULL;
+    }
+    i2s_dma_adapt_handle_t ad = audio_calloc(1, sizeof(struct i2s_dma_adapt));
+    AUDIO_MEM_CHECK(TAG, ad, return NULL);
+    ad->cfg = *cfg;
+    ad->rate = cfg->rate;
+    ad->bits = cfg->bits;
+    ad->ch = cfg->ch;
+    ad->in = audio_element_get_input_ringbuf(cfg->el);
+    ad->ring_min = UINT32_MAX;
+    ad->lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, ad->lock, goto _fail);
+
+    i2s_direct_sink_stats_t ss;
+    i2s_direct_sink_get_stats(cfg->sink, &ss);
+    ad->stats.desc_num = ss.dma_desc_num;
+    ad->stats.frame_num = ss.dma_frame_num;
+    ad->stats.latency_us = (uint32_t)((int64_t)ss.dma_desc_num * ss.dma_frame_num * 1000000 / cfg->rate);
+    ad->stats.lead_min_frames = -1;
+    /* Sizes outside the bounds are corrected on the first write, before anything is queued */
+    const uint32_t total = (uint32_t)(ss.dma_desc_num * ss.dma_frame_num);
+    const uint32_t lo = ms_to_frames(ad, cfg->min_ms);
+    const uint32_t hi = ms_to_frames(ad, cfg->max_ms);
+    if (total < lo || total > hi)
+    {
+        ad->target = total < lo ? lo : hi;
+        ad->target_reason = I2S_DMA_ADAPT_BOUNDS;
+    }
+    ad->boundary = true;
+
+    ad->hook = (audio_io_hook_t){.fn = _adapt_write, .ctx = ad};
+    if (audio_io_hook_add(cfg->el, AUDIO_IO_HOOK_WRITE, &ad->hook) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to hook [%s]", audio_element_get_tag(cfg->el));
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "%d x %d frames, adapting between %d and %d ms", ss.dma_desc_num, ss.dma_frame_num, cfg->min_ms,
+             cfg->max_ms);
+    return ad;
+
+_fail:
+    if (ad->lock)
+    {
+        vSemaphoreDelete(ad->lock);
+    }
+    audio_free(ad);
+    return NULL;
+}
+
+void i2s_dma_adapt_set_format(i2s_dma_adapt_handle_t ad, int rate, int bits, int ch)
+{
+    if (ad == NULL || rate <= 0 || ch <= 0 || bits < 8)
+    {
+        return;
+    }
+    ad->rate = rate;
+    ad->bits = bits;
+    ad->ch = ch;
+    ad->silent_frames = 0;
+}
+
+void i2s_dma_adapt_boundary(i2s_dma_adapt_handle_t ad)
+{
+    if (ad)
+    {
+        ad->boundary = true;
+    }
+}
+
+esp_err_t i2s_dma_adapt_get_stats(i2s_dma_adapt_handle_t ad, i2s_dma_adapt_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, ad && stats, return ESP_ERR_INVALID_ARG);
+    xSemaphoreTake(ad->lock, portMAX_DELAY);
+    *stats = ad->stats;
+    xSemaphoreGive(ad->lock);
+    stats->pending_frames = ad->target;
+    return ESP_OK;
+}
+
+void i2s_dma_adapt_deinit(i2s_dma_adapt_handle_t ad)
+{
+    if (ad == NULL)
+    {
+        return;
+    }
+    audio_io_hook_remove(ad->cfg.el, AUDIO_IO_HOOK_WRITE, &ad->hook);
+    vSemaphoreDelete(ad->lock);
+    audio_free(ad);
+}
@@ -0,0 +1,141 @@
+/* Sizes the I2S DMA buffers of the direct sink from measured underruns and slack
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __I2S_DMA_ADAPT_H__
+#define __I2S_DMA_ADAPT_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "i2s_direct_sink.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Periods of underrun counts kept for i2s_dma_adapt_stats_t */
+#define I2S_DMA_ADAPT_PERIODS (8)
+/* Resizes kept for i2s_dma_adapt_stats_t */
+#define I2S_DMA_ADAPT_CHANGES (4)
+
+    /**
+     * @brief Why the buffers were resized
+     */
+    typedef enum
+    {
+        I2S_DMA_ADAPT_GROW_UNDERRUN = 0, /*!< The DMA queue ran dry */
+        I2S_DMA_ADAPT_GROW_LEAD,         /*!< The DMA queue came close to running dry */
+        I2S_DMA_ADAPT_GROW_RING,         /*!< The element's input ringbuffer ran low while the DMA queue was short */
+        I2S_DMA_ADAPT_SHRINK,            /*!< Enough slack in both for calm_periods */
+        I2S_DMA_ADAPT_BOUNDS,            /*!< Brought inside min_ms..max_ms */
+    } i2s_dma_adapt_reason_t;
+
+    /**
+     * @brief Adaptive sizing configuration
+     */
+    typedef struct
+    {
+        i2s_direct_sink_handle_t sink; /*!< Sink to resize */
+        audio_element_handle_t el;     /*!< Element the sink is attached to */
+        int rate;                      /*!< Initial output format, then i2s_dma_adapt_set_format() */
+        int bits;
+        int ch;
+        int min_ms;                    /*!< Lowest latency of all DMA buffers together */
+        int max_ms;                    /*!< Highest latency of all DMA buffers together */
+        int period_ms;                 /*!< Measurement period */
+        int calm_periods;              /*!< Periods with slack before shrinking */
+        int silence_level;             /*!< Peak below which 16-bit PCM is silence */
+    } i2s_dma_adapt_cfg_t;
+
+#define I2S_DMA_ADAPT_CFG_DEFAULT()     \
+    {                                   \
+        .sink = NULL,                   \
+        .el = NULL,                     \
+        .rate = 44100,                  \
+        .bits = 16,                     \
+        .ch = 2,                        \
+        .min_ms = 10,                   \
+        .max_ms = 200,                  \
+        .period_ms = 1000,              \
+        .calm_periods = 10,             \
+        .silence_level = 32,            \
+    }
+
+    /**
+     * @brief One resize
+     */
+    typedef struct
+    {
+        uint32_t uptime_ms; /*!< When it was applied */
+        uint16_t desc_num;  /*!< DMA buffers */
+        uint16_t frame_num; /*!< Frames per DMA buffer */
+        uint8_t reason;     /*!< i2s_dma_adapt_reason_t */
+    } i2s_dma_adapt_change_t;
+
+    /**
+     * @brief Current sizes and history
+     */
+    typedef struct
+    {
+        int desc_num;                                          /*!< DMA buffers */
+        int frame_num;                                         /*!< Frames per DMA buffer */
+        uint32_t latency_us;                                   /*!< Of all buffers together */
+        uint32_t pending_frames;                               /*!< Total frames waiting for a boundary or silence, 0 if none */
+        uint32_t underruns;                                    /*!< Underruns while playing, since init */
+        uint32_t period_underruns[I2S_DMA_ADAPT_PERIODS];      /*!< Of the last periods, newest first */
+        int lead_min_frames;                                   /*!< Lowest DMA queue of the last period, -1 if idle */
+        uint32_t grows;                                        /*!< Resizes up */
+        uint32_t shrinks;                                      /*!< Resizes down */
+        uint32_t failed;                                       /*!< Resizes the driver refused, the old sizes kept */
+        i2s_dma_adapt_change_t changes[I2S_DMA_ADAPT_CHANGES]; /*!< Last resizes, newest first */
+        int change_count;                                      /*!< Valid entries in `changes` */
+    } i2s_dma_adapt_stats_t;
+
+    typedef struct i2s_dma_adapt *i2s_dma_adapt_handle_t;
+
+    /**
+     * @brief Hook the element in front of the sink. Call after i2s_direct_sink_attach(), before
+     *        the other write hooks on the element, while the pipeline is stopped.
+     *
+     * @return The handle, NULL on failure
+     */
+    i2s_dma_adapt_handle_t i2s_dma_adapt_init(const i2s_dma_adapt_cfg_t *cfg);
+
+    /**
+     * @brief The output format changed: the latency bounds are in time
+     */
+    void i2s_dma_adapt_set_format(i2s_dma_adapt_handle_t ad, int rate, int bits, int ch);
+
+    /**
+     * @brief A track starts: a pending resize is applied before its first write, once the
+     *        previous track has played out
+     */
+    void i2s_dma_adapt_boundary(i2s_dma_adapt_handle_t ad);
+
+    /**
+     * @brief Get the sizes and history
+     */
+    esp_err_t i2s_dma_adapt_get_stats(i2s_dma_adapt_handle_t ad, i2s_dma_adapt_stats_t *stats);
+
+    /**
+     * @brief Name of a i2s_dma_adapt_reason_t, for logs
+     */
+    const char *i2s_dma_adapt_reason_name(int reason);
+
+    /**
+     * @brief Unhook and free. The pipeline must be stopped.
+     */
+    void i2s_dma_adapt_deinit(i2s_dma_adapt_handle_t ad);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,702 @@
+/* Background loudness analysis of the tracks on the card, kept in a persistent store
+
+   A low-priority task walks the tracks the application lists and gives
+   each one an integrated loudness and a peak:
+
+     - a ReplayGain track gain in the ID3v2 tag is taken as is, with the
+       tag's peak, so tagged libraries are done in a read of their tags;
+     - otherwise the audio between the tags is decoded by a second
+       mp3_decoder element, run standalone with a read callback on the
+       file and a write callback into loudness_meter, at the same low
+       priority.
+
+   Analysis yields to playback twice over: both tasks only get the CPU
+   when nothing that plays audio wants it, and the read callback sleeps
+   while the application's busy callback says the player needs the card.
+
+   The store is a header and 24-byte records, one per track, keyed by the
+   64-bit FNV-1a hash of the full path and checked against the size and
+   mtime of the file. A record is appended, and the file closed, as soon
+   as a track is done, so after a reboot the next pass skips every track
+   already analysed and resumes with the one that was cut short. On load
+   the records are sorted in RAM for lookups; duplicates from re-analysed
+   files and a record torn by power loss are compacted away.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "mp3_decoder.h"
+#include "mp3_parser.h"
+#include "loudness_meter.h"
+#include "loudness_analyser.h"
+
+static const char *TAG = "LOUDNESS";
+
+#define LD_MAGIC (0x5346554C) /* "LUFS" */
+#define LD_VERSION (1)
+#define LD_PATH_MAX (256)
+#define LD_TMP_EXT ".TMP"
+#define LD_FNV_OFFSET (0xCBF29CE484222325ULL)
+#define LD_FNV_PRIME (0x100000001B3ULL)
+/* A ReplayGain tag behind a large picture is not worth reading the picture for */
+#define LD_TAG_MAX (256 * 1024)
+#define LD_DECODER_POLL_MS (1000)
+#define LD_STACK_MARGIN (512) /* Warn when a pass leaves less stack than this, bytes */
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+} ld_file_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t hash;
+    uint32_t size;
+    uint32_t mtime;
+    int16_t loudness; /* LUFS x 100 */
+    int16_t peak;     /* dBTP x 100 */
+    uint8_t source;   /* loudness_source_t */
+    uint8_t reserved[3];
+} ld_record_t;
+
+_Static_assert(sizeof(ld_record_t) == 24, "store record layout changed");
+
+typedef enum
+{
+    LD_CMD_PASS = 0,
+    LD_CMD_EXIT,
+} ld_cmd_t;
+
+/* The track being decoded */
+typedef struct
+{
+    FILE *f;
+    int64_t remaining;
+    int ch;
+    uint64_t frames;
+    loudness_meter_handle_t meter;
+} ld_job_t;
+
+struct loudness_analyser
+{
+    loudness_analyser_cfg_t cfg;
+    char store_path[LD_PATH_MAX];
+    SemaphoreHandle_t lock; /* recs, count, stats */
+    SemaphoreHandle_t exited;
+    QueueHandle_t cmds;
+    audio_event_iface_handle_t evt; /* Decoder status */
+    volatile bool stop;
+    ld_record_t *recs; /* Sorted by hash */
+    int count;
+    int cap;
+    bool full_logged;
+    ld_job_t job;
+    loudness_analyser_stats_t stats;
+};
+
+static uint64_t path_hash(const char *s)
+{
+    uint64_t h = LD_FNV_OFFSET;
+    while (*s)
+    {
+        h = (h ^ (uint8_t)*s++) * LD_FNV_PRIME;
+    }
+    return h;
+}
+
+static int16_t to_x100(float v, float lo, float hi)
+{
+    v = v < lo ? lo : v > hi ? hi : v;
+    return (int16_t)lroundf(v * 100.0f);
+}
+
+/* First record with a hash >= `hash` */
+static int lower_bound(loudness_analyser_handle_t la, uint64_t hash)
+{
+    int lo = 0, hi = la->count;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (la->recs[mid].hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool recs_grow(loudness_analyser_handle_t la, int need)
+{
+    if (need <= la->cap)
+    {
+        return true;
+    }
+    int cap = la->cap ? la->cap * 2 : 256;
+    cap = cap < need ? need : cap;
+    ld_record_t *recs = audio_realloc(la->recs, cap * sizeof(ld_record_t));
+    if (recs == NULL)
+    {
+        return false;
+    }
+    la->recs = recs;
+    la->cap = cap;
+    return true;
+}
+
+/* ---- Store ---- */
+
+static int sort_by_hash(const void *a, const void *b)
+{
+    const ld_record_t *x = (const ld_record_t *)a;
+    const ld_record_t *y = (const ld_record_t *)b;
+    if (x->hash != y->hash)
+    {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    /* The newer file's analysis last, so it is the one kept */
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+static bool store_write(loudness_analyser_handle_t la)
+{
+    char tmp[LD_PATH_MAX + sizeof(LD_TMP_EXT)];
+    snprintf(tmp, sizeof(tmp), "%s", la->store_path);
+    char *ext = strrchr(tmp, '.');
+    strcpy(ext && !strchr(ext, '/') ? ext : tmp + strlen(tmp), LD_TMP_EXT);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    const ld_file_hdr_t hdr = {.magic = LD_MAGIC, .version = LD_VERSION, .record_size = sizeof(ld_record_t)};
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+              (la->count == 0 || fwrite(la->recs, sizeof(ld_record_t), la->count, f) == (size_t)la->count);
+    ok = fclose(f) == 0 && ok;
+    /* FATFS rename does not replace an existing file */
+    if (ok)
+    {
+        unlink(la->store_path);
+        ok = rename(tmp, la->store_path) == 0;
+    }
+    if (!ok)
+    {
+        unlink(tmp);
+        ESP_LOGE(TAG, "Failed to write %s", la->store_path);
+    }
+    return ok;
+}
+
+static void store_load(loudness_analyser_handle_t la)
+{
+    FILE *f = fopen(la->store_path, "rb");
+    if (f == NULL)
+    {
+        store_write(la);
+        return;
+    }
+    ld_file_hdr_t hdr;
+    bool rewrite = false;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != LD_MAGIC || hdr.version != LD_VERSION ||
+        hdr.record_size != sizeof(ld_record_t))
+    {
+        ESP_LOGW(TAG, "%s is not a loudness store, starting over", la->store_path);
+        fclose(f);
+        store_write(la);
+        return;
+    }
+    struct stat st;
+    int n = 0;
+    if (fstat(fileno(f), &st) == 0)
+    {
+        n = (st.st_size - sizeof(hdr)) / sizeof(ld_record_t);
+        /* A partial record is an append cut short */
+        rewrite = (st.st_size - sizeof(hdr)) % sizeof(ld_record_t) != 0;
+    }
+    if (n > 0 && recs_grow(la, n))
+    {
+        la->count = fread(la->recs, sizeof(ld_record_t), n, f);
+    }
+    fclose(f);
+
+    qsort(la->recs, la->count, sizeof(ld_record_t), sort_by_hash);
+    int out = 0;
+    for (int i = 0; i < la->count; i++)
+    {
+        if (out > 0 && la->recs[out - 1].hash == la->recs[i].hash)
+        {
+            la->recs[out - 1] = la->recs[i];
+            rewrite = true;
+            continue;
+        }
+        la->recs[out++] = la->recs[i];
+    }
+    la->count = out;
+    if (la->count > la->cfg.max_tracks)
+    {
+        la->count = la->cfg.max_tracks;
+        rewrite = true;
+    }
+    if (rewrite)
+    {
+        store_write(la);
+    }
+}
+
+/* Keep a track's record in RAM and on the card */
+static void store_put(loudness_analyser_handle_t la, const ld_record_t *rec)
+{
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    const int i = lower_bound(la, rec->hash);
+    const bool exists = i < la->count && la->recs[i].hash == rec->hash;
+    bool added = exists;
+    if (exists)
+    {
+        la->recs[i] = *rec;
+    }
+    else if (la->count < la->cfg.max_tracks && recs_grow(la, la->count + 1))
+    {
+        memmove(&la->recs[i + 1], &la->recs[i], (la->count - i) * sizeof(ld_record_t));
+        la->recs[i] = *rec;
+        la->count++;
+        added = true;
+    }
+    la->stats.tracks = la->count;
+    xSemaphoreGive(la->lock);
+
+    if (!added)
+    {
+        if (!la->full_logged)
+        {
+            ESP_LOGW(TAG, "Store full at %d tracks, the rest is not kept", la->cfg.max_tracks);
+            la->full_logged = true;
+        }
+        return;
+    }
+    /* Closed right away: the record survives a power cut from here on */
+    FILE *f = fopen(la->store_path, "ab");
+    if (f == NULL || fwrite(rec, sizeof(*rec), 1, f) != 1)
+    {
+        ESP_LOGE(TAG, "Failed to append to %s", la->store_path);
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+}
+
+/* ---- Analysis ---- */
+
+static void wait_while_busy(loudness_analyser_handle_t la)
+{
+    bool yielded = false;
+    while (!la->stop && la->cfg.busy && la->cfg.busy(la->cfg.ctx))
+    {
+        if (!yielded)
+        {
+            xSemaphoreTake(la->lock, portMAX_DELAY);
+            la->stats.yields++;
+            xSemaphoreGive(la->lock);
+            yielded = true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(la->cfg.busy_wait_ms));
+    }
+}
+
+static bool read_replaygain(loudness_analyser_handle_t la, const char *path, mp3_replaygain_t *rg)
+{
+    memset(rg, 0, sizeof(*rg));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    uint8_t hdr[10];
+    size_t size = 0;
+    if (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr))
+    {
+        size = mp3_id3v2_size(hdr, sizeof(hdr));
+    }
+    size = size < LD_TAG_MAX ? size : LD_TAG_MAX;
+    uint8_t *tag = size ? audio_malloc(size) : NULL;
+    if (tag)
+    {
+        wait_while_busy(la);
+        memcpy(tag, hdr, sizeof(hdr));
+        if (fread(tag + sizeof(hdr), 1, size - sizeof(hdr), f) == size - sizeof(hdr))
+        {
+            mp3_parse_id3v2_replaygain(tag, size, rg);
+        }
+        audio_free(tag);
+    }
+    fclose(f);
+    return rg->has_gain;
+}
+
+static int _decoder_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *ctx)
+{
+    loudness_analyser_handle_t la = (loudness_analyser_handle_t)ctx;
+    wait_while_busy(la);
+    if (la->stop || la->job.remaining <= 0)
+    {
+        return AEL_IO_DONE;
+    }
+    const size_t n = len < la->job.remaining ? (size_t)len : (size_t)la->job.remaining;
+    const size_t r = fread(buffer, 1, n, la->job.f);
+    if (r == 0)
+    {
+        return AEL_IO_DONE;
+    }
+    la->job.remaining -= r;
+    return r;
+}
+
+static int _decoder_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *ctx)
+{
+    loudness_analyser_handle_t la = (loudness_analyser_handle_t)ctx;
+    const int frames = len / (la->job.ch * (int)sizeof(int16_t));
+    loudness_meter_add(la->job.meter, (const int16_t *)buffer, frames);
+    la->job.frames += frames;
+    return len;
+}
+
+/* Run the decoder over the job until it finishes; false on a decoder error */
+static bool decode(loudness_analyser_handle_t la)
+{
+    mp3_decoder_cfg_t dec_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    dec_cfg.task_core = la->cfg.task_core;
+    dec_cfg.task_prio = la->cfg.task_prio;
+    dec_cfg.stack_in_ext = la->cfg.ext_stack;
+    audio_element_handle_t dec = mp3_decoder_init(&dec_cfg);
+    AUDIO_MEM_CHECK(TAG, dec, return false);
+    audio_element_set_read_cb(dec, _decoder_read, la);
+    audio_element_set_write_cb(dec, _decoder_write, la);
+    audio_element_msg_set_listener(dec, la->evt);
+
+    bool ok = false;
+    if (audio_element_run(dec) != ESP_OK || audio_element_resume(dec, 0, portMAX_DELAY) != ESP_OK)
+    {
+        goto _exit;
+    }
+    while (1)
+    {
+        audio_event_iface_msg_t msg;
+        if (audio_event_iface_listen(la->evt, &msg, pdMS_TO_TICKS(LD_DECODER_POLL_MS)) == ESP_OK)
+        {
+            if (msg.source != (void *)dec || msg.cmd != AEL_MSG_CMD_REPORT_STATUS)
+            {
+                continue;
+            }
+            const int status = (int)msg.data;
+            if (status == AEL_STATUS_STATE_FINISHED)
+            {
+                ok = true;
+                break;
+            }
+            if (status == AEL_STATUS_STATE_STOPPED || (status >= AEL_STATUS_ERROR_OPEN && status <= AEL_STATUS_ERROR_UNKNOWN))
+            {
+                break;
+            }
+        }
+        /* A status report lost to a full queue must not hang the pass */
+        const audio_element_state_t state = audio_element_get_state(dec);
+        if (state == AEL_STATE_FINISHED || state == AEL_STATE_ERROR || state == AEL_STATE_STOPPED)
+        {
+            ok = state == AEL_STATE_FINISHED;
+            break;
+        }
+    }
+
+_exit:
+    audio_element_terminate(dec);
+    audio_element_msg_remove_listener(dec, la->evt);
+    audio_element_deinit(dec);
+    return ok;
+}
+
+static loudness_source_t measure(loudness_analyser_handle_t la, const char *path, ld_record_t *rec)
+{
+    mp3_stream_info_t info;
+    if (mp3_probe_file(path, &info) != ESP_OK)
+    {
+        return LOUDNESS_SOURCE_FAILED;
+    }
+    la->job = (ld_job_t){
+        .f = fopen(path, "rb"),
+        .remaining = (int64_t)info.audio_end - info.audio_start,
+        .ch = info.header.channels,
+    };
+    la->job.meter = loudness_meter_create(info.header.sample_rate, info.header.channels);
+    loudness_source_t source = LOUDNESS_SOURCE_FAILED;
+    if (la->job.f == NULL || la->job.meter == NULL || fseek(la->job.f, info.audio_start, SEEK_SET) != 0)
+    {
+        goto _exit;
+    }
+
+    const int64_t t0 = esp_timer_get_time();
+    if (decode(la) && !la->stop && la->job.frames > 0)
+    {
+        const uint32_t took_ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+        const uint64_t audio_ms = la->job.frames * 1000 / info.header.sample_rate;
+        rec->loudness = to_x100(loudness_meter_integrated(la->job.meter), -99.0f, 20.0f);
+        rec->peak = to_x100(loudness_meter_true_peak(la->job.meter), -99.0f, 20.0f);
+        source = LOUDNESS_SOURCE_MEASURED;
+        xSemaphoreTake(la->lock, portMAX_DELAY);
+        la->stats.last_ms = took_ms;
+        la->stats.last_speed = took_ms ? (uint32_t)(audio_ms * 100 / took_ms) : 0;
+        xSemaphoreGive(la->lock);
+        ESP_LOGI(TAG, "%s: %.1f LUFS, %.1f dBTP, measured in %u ms (%u.%02ux real time)", path, rec->loudness / 100.0f,
+                 rec->peak / 100.0f, (unsigned)took_ms, (unsigned)(la->stats.last_speed / 100),
+                 (unsigned)(la->stats.last_speed % 100));
+    }
+
+_exit:
+    if (la->job.f)
+    {
+        fclose(la->job.f);
+    }
+    loudness_meter_destroy(la->job.meter);
+    memset(&la->job, 0, sizeof(la->job));
+    return source;
+}
+
+static void analyse(loudness_analyser_handle_t la, const char *path, const struct stat *st)
+{
+    ld_record_t rec = {
+        .hash = path_hash(path),
+        .size = (uint32_t)st->st_size,
+        .mtime = (uint32_t)st->st_mtime,
+    };
+    mp3_replaygain_t rg;
+    loudness_source_t source;
+    if (read_replaygain(la, path, &rg))
+    {
+        rec.loudness = to_x100(LOUDNESS_REPLAYGAIN_REF_LUFS - rg.track_gain_db, -99.0f, 20.0f);
+        rec.peak = rg.has_peak && rg.track_peak > 0 ? to_x100(20.0f * log10f(rg.track_peak), -99.0f, 20.0f) : 0;
+        source = LOUDNESS_SOURCE_REPLAYGAIN;
+        ESP_LOGI(TAG, "%s: %.1f LUFS, %.1f dB peak, from its ReplayGain tag", path, rec.loudness / 100.0f,
+                 rec.peak / 100.0f);
+    }
+    else
+    {
+        source = measure(la, path, &rec);
+    }
+    if (la->stop)
+    {
+        return;
+    }
+    if (source == LOUDNESS_SOURCE_FAILED)
+    {
+        ESP_LOGW(TAG, "Cannot measure %s", path);
+    }
+    rec.source = source;
+    store_put(la, &rec);
+
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    la->stats.measured += source == LOUDNESS_SOURCE_MEASURED;
+    la->stats.tagged += source == LOUDNESS_SOURCE_REPLAYGAIN;
+    la->stats.failed += source == LOUDNESS_SOURCE_FAILED;
+    xSemaphoreGive(la->lock);
+}
+
+static void pass(loudness_analyser_handle_t la)
+{
+    char path[LD_PATH_MAX];
+    uint32_t unchanged = 0;
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    la->stats.analysing = true;
+    xSemaphoreGive(la->lock);
+
+    for (int n = 0; !la->stop && la->cfg.track(n, path, sizeof(path), la->cfg.ctx); n++)
+    {
+        struct stat st;
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+        const uint64_t hash = path_hash(path);
+        xSemaphoreTake(la->lock, portMAX_DELAY);
+        const int i = lower_bound(la, hash);
+        const bool known = i < la->count && la->recs[i].hash == hash && la->recs[i].size == (uint32_t)st.st_size &&
+                           la->recs[i].mtime == (uint32_t)st.st_mtime;
+        xSemaphoreGive(la->lock);
+        if (known)
+        {
+            unchanged++;
+            continue;
+        }
+        analyse(la, path, &st);
+    }
+
+    const UBaseType_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    la->stats.analysing = false;
+    la->stats.unchanged = unchanged;
+    la->stats.stack_free = stack_free;
+    if (!la->stop)
+    {
+        la->stats.passes++;
+    }
+    xSemaphoreGive(la->lock);
+    if (!la->stop)
+    {
+        ESP_LOGI(TAG, "Pass done: %d tracks in the store, %u unchanged, %u bytes of stack to spare", la->count,
+                 (unsigned)unchanged, (unsigned)stack_free);
+    }
+    if (stack_free < LD_STACK_MARGIN)
+    {
+        ESP_LOGW(TAG, "Analysis task stack down to %u bytes free, raise task_stack", (unsigned)stack_free);
+    }
+}
+
+static void _analyser_task(void *arg)
+{
+    loudness_analyser_handle_t la = (loudness_analyser_handle_t)arg;
+    ld_cmd_t cmd;
+    while (xQueueReceive(la->cmds, &cmd, portMAX_DELAY) == pdTRUE && cmd != LD_CMD_EXIT)
+    {
+        pass(la);
+    }
+    xSemaphoreGive(la->exited);
+    vTaskDelete(NULL);
+}
+
+/* ---- API ---- */
+
+loudness_analyser_handle_t loudness_analyser_init(const loudness_analyser_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->store_path && cfg->track && cfg->max_tracks > 0 && cfg->busy_wait_ms > 0,
+                     return NULL);
+
+    loudness_analyser_handle_t la = audio_calloc(1, sizeof(struct loudness_analyser));
+    AUDIO_MEM_CHECK(TAG, la, return NULL);
+    la->cfg = *cfg;
+    strlcpy(la->store_path, cfg->store_path, sizeof(la->store_path));
+    la->cfg.store_path = la->store_path;
+    la->lock = xSemaphoreCreateMutex();
+    la->exited = xSemaphoreCreateBinary();
+    la->cmds = xQueueCreate(2, sizeof(ld_cmd_t));
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    la->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, la->lock && la->exited && la->cmds && la->evt, goto _fail);
+
+    store_load(la);
+    la->stats.tracks = la->count;
+    ESP_LOGI(TAG, "%d tracks in %s", la->count, la->store_path);
+    if (xTaskCreatePinnedToCore(_analyser_task, "loudness", cfg->task_stack, la, cfg->task_prio, NULL, cfg->task_core) !=
+        pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the analysis task");
+        goto _fail;
+    }
+    loudness_analyser_rescan(la);
+    return la;
+
+_fail:
+    if (la->evt)
+    {
+        audio_event_iface_destroy(la->evt);
+    }
+    if (la->cmds)
+    {
+        vQueueDelete(la->cmds);
+    }
+    if (la->exited)
+    {
+        vSemaphoreDelete(la->exited);
+    }
+    if (la->lock)
+    {
+        vSemaphoreDelete(la->lock);
+    }
+    audio_free(la->recs);
+    audio_free(la);
+    return NULL;
+}
+
+esp_err_t loudness_analyser_rescan(loudness_analyser_handle_t la)
+{
+    AUDIO_NULL_CHECK(TAG, la, return ESP_ERR_INVALID_ARG);
+    const ld_cmd_t cmd = LD_CMD_PASS;
+    /* One queued behind a running pass is enough */
+    xQueueSend(la->cmds, &cmd, 0);
+    return ESP_OK;
+}
+
+esp_err_t loudness_analyser_lookup(loudness_analyser_handle_t la, const char *path, loudness_info_t *info)
+{
+    if (!la || !path || !info)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const uint64_t hash = path_hash(path);
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    const int i = lower_bound(la, hash);
+    if (i < la->count && la->recs[i].hash == hash && la->recs[i].source != LOUDNESS_SOURCE_FAILED)
+    {
+        info->loudness_lufs = la->recs[i].loudness / 100.0f;
+        info->peak_dbtp = la->recs[i].peak / 100.0f;
+        info->source = (loudness_source_t)la->recs[i].source;
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(la->lock);
+    return ret;
+}
+
+esp_err_t loudness_analyser_get_stats(loudness_analyser_handle_t la, loudness_analyser_stats_t *stats)
+{
+    if (!la || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(la->lock, portMAX_DELAY);
+    *stats = la->stats;
+    xSemaphoreGive(la->lock);
+    return ESP_OK;
+}
+
+void loudness_analyser_deinit(loudness_analyser_handle_t la)
+{
+    if (la == NULL)
+    {
+        return;
+    }
+    la->stop = true;
+    const ld_cmd_t cmd = LD_CMD_EXIT;
+    xQueueReset(la->cmds);
+    xQueueSend(la->cmds, &cmd, portMAX_DELAY);
+    xSemaphoreTake(la->exited, portMAX_DELAY);
+    audio_event_iface_destroy(la->evt);
+    vQueueDelete(la->cmds);
+    vSemaphoreDelete(la->exited);
+    vSemaphoreDelete(la->lock);
+    audio_free(la->recs);
+    audio_free(la);
+}
@@ -0,0 +1,155 @@
+/* Background loudness analysis of the tracks on the card, kept in a persistent store
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __LOUDNESS_ANALYSER_H__
+#define __LOUDNESS_ANALYSER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Loudness ReplayGain 2 gains are relative to */
+#define LOUDNESS_REPLAYGAIN_REF_LUFS (-18.0f)
+
+    /**
+     * @brief Where a track's values come from
+     */
+    typedef enum
+    {
+        LOUDNESS_SOURCE_NONE = 0,   /*!< Not analysed */
+        LOUDNESS_SOURCE_REPLAYGAIN, /*!< ReplayGain tag; the peak is a sample peak, 0 dBTP when the tag has none */
+        LOUDNESS_SOURCE_MEASURED,   /*!< Decoded and measured: integrated loudness and true peak */
+        LOUDNESS_SOURCE_FAILED,     /*!< Could not be decoded; not retried until the file changes */
+    } loudness_source_t;
+
+    /**
+     * @brief Loudness of one track
+     */
+    typedef struct
+    {
+        float loudness_lufs;      /*!< Integrated loudness */
+        float peak_dbtp;          /*!< Peak relative to full scale */
+        loudness_source_t source; /*!< How they were obtained */
+    } loudness_info_t;
+
+    /**
+     * @brief Writes the full path of the n-th track to analyse into `path`.
+     *        Called from the analysis task with n = 0, 1, ... once per pass.
+     *
+     * @return false past the last track
+     */
+    typedef bool (*loudness_track_cb)(int n, char *path, size_t size, void *ctx);
+
+    /**
+     * @brief Whether playback needs the card or the CPU right now; polled before every read
+     */
+    typedef bool (*loudness_busy_cb)(void *ctx);
+
+    /**
+     * @brief Analyser configuration
+     */
+    typedef struct
+    {
+        const char *store_path;  /*!< Store file, normally on the card it describes */
+        int max_tracks;          /*!< Tracks kept in the store at most */
+        loudness_track_cb track; /*!< Track source */
+        loudness_busy_cb busy;   /*!< Back off while it returns true, may be NULL */
+        void *ctx;               /*!< Passed to `track` and `busy` */
+        int busy_wait_ms;        /*!< Sleep between polls of `busy` */
+        int task_stack;          /*!< Stack of the analysis task */
+        int task_core;           /*!< Its core, also the decoder's */
+        int task_prio;           /*!< Its priority, also the decoder's; below everything that plays audio */
+        bool ext_stack;          /*!< Allocate the decoder task stack in PSRAM */
+    } loudness_analyser_cfg_t;
+
+#define LOUDNESS_ANALYSER_TASK_STACK (4096)
+#define LOUDNESS_ANALYSER_TASK_CORE (0)
+#define LOUDNESS_ANALYSER_TASK_PRIO (1)
+
+#define LOUDNESS_ANALYSER_CFG_DEFAULT()             \
+    {                                               \
+        .store_path = "/sdcard/LOUDNESS.DB",        \
+        .max_tracks = 8192,                         \
+        .track = NULL,                              \
+        .busy = NULL,                               \
+        .ctx = NULL,                                \
+        .busy_wait_ms = 50,                         \
+        .task_stack = LOUDNESS_ANALYSER_TASK_STACK, \
+        .task_core = LOUDNESS_ANALYSER_TASK_CORE,   \
+        .task_prio = LOUDNESS_ANALYSER_TASK_PRIO,   \
+        .ext_stack = true,                          \
+    }
+
+    /**
+     * @brief Analysis counters since init
+     */
+    typedef struct
+    {
+        uint32_t tracks;      /*!< Tracks in the store */
+        uint32_t passes;      /*!< Completed passes over the track source */
+        uint32_t measured;    /*!< Tracks decoded and measured */
+        uint32_t tagged;      /*!< Tracks taken from their ReplayGain tag */
+        uint32_t failed;      /*!< Tracks that could not be decoded */
+        uint32_t unchanged;   /*!< Tracks the last pass found in the store */
+        uint32_t yields;      /*!< Times it backed off for playback */
+        uint32_t last_ms;     /*!< Wall time of the last measurement */
+        uint32_t last_speed;  /*!< Its audio duration over that time, x100 */
+        uint32_t stack_free;  /*!< Least stack the analysis task has had left, bytes */
+        bool analysing;       /*!< A pass is running */
+    } loudness_analyser_stats_t;
+
+    typedef struct loudness_analyser *loudness_analyser_handle_t;
+
+    /**
+     * @brief Load the store and start a pass over the track source in the background.
+     *        Tracks already in the store whose size and mtime did not change are skipped,
+     *        so a pass cut short by a reboot resumes at the track it was on.
+     *
+     * @return The analyser handle, NULL on failure
+     */
+    loudness_analyser_handle_t loudness_analyser_init(const loudness_analyser_cfg_t *cfg);
+
+    /**
+     * @brief Queue another pass, e.g. once the track source has changed
+     */
+    esp_err_t loudness_analyser_rescan(loudness_analyser_handle_t la);
+
+    /**
+     * @brief Look a track up by its full path. No I/O: safe from an audio task.
+     *        The file is not checked; a replaced file keeps its old values until the next
+     *        pass measures it again.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NOT_FOUND  not analysed yet, or it could not be decoded
+     */
+    esp_err_t loudness_analyser_lookup(loudness_analyser_handle_t la, const char *path, loudness_info_t *info);
+
+    /**
+     * @brief Get the analysis counters
+     */
+    esp_err_t loudness_analyser_get_stats(loudness_analyser_handle_t la, loudness_analyser_stats_t *stats);
+
+    /**
+     * @brief Stop the analysis task, abandoning the track being measured
+     */
+    void loudness_analyser_deinit(loudness_analyser_handle_t la);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,271 @@
+/* EBU R128 / ITU-R BS.1770 integrated loudness and true peak of 16-bit PCM
+
+   Each channel goes through the K-weighting filter (a high shelf and a
+   high pass, coefficients derived for the actual sample rate) with
+   esp-dsp's dsps_biquad_f32, and its energy is summed with
+   dsps_dotprod_f32. Energies are collected in 100 ms sub-blocks; every
+   sub-block closes a 400 ms block (75 % overlap).
+
+   Gating needs the blocks twice: once for the relative threshold, once
+   for the mean above it. Instead of keeping every block, blocks above the
+   absolute gate (-70 LUFS) go into a histogram of 0.1 LU bins that also
+   sums their energy, so a whole album costs a few KB and the result is
+   exact to within one bin at the relative gate.
+
+   Mono is weighted as dual mono: it plays on both speakers, so it is as
+   loud as the same signal in both channels of a stereo file.
+
+   True peak is the largest sample of a 4x polyphase interpolation with a
+   48-tap windowed sinc, as in BS.1770 Annex 2.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "dsps_biquad.h"
+#include "dsps_dotprod.h"
+#include "loudness_meter.h"
+
+static const char *TAG = "LOUDNESS_METER";
+
+#define LM_MAX_CH (2)
+/* Frames filtered per pass */
+#define LM_CHUNK (256)
+#define LM_SUB_BLOCKS (4) /* 100 ms sub-blocks per 400 ms block */
+#define LM_GATE_ABS (-70.0)
+#define LM_GATE_REL (-10.0)
+#define LM_BIN_LU (0.1)
+#define LM_BINS (750) /* -70 to +5 LUFS */
+#define LM_TP_PHASES (4)
+#define LM_TP_TAPS (12) /* Per phase */
+#define LM_TP_HIST (LM_TP_TAPS - 1)
+#define LM_ALIGN (16)
+
+struct loudness_meter
+{
+    int rate;
+    int ch;
+    float coef[2][5]; /* Pre-filter and RLB high pass: b0, b1, b2, a1, a2 */
+    float w[LM_MAX_CH][2][2];
+    float *x; /* One channel of a chunk */
+    float *y;
+    int sub_frames;
+    int sub_pos;
+    double sub_acc; /* Sum of squares of the open sub-block, over channels */
+    double sub_energy[LM_SUB_BLOCKS];
+    uint32_t subs;
+    uint32_t counts[LM_BINS];
+    double energy[LM_BINS];
+    double gated_sum; /* Blocks above the absolute gate */
+    uint32_t gated_blocks;
+    float tp_coef[LM_TP_PHASES][LM_TP_TAPS];
+    float tp_buf[LM_MAX_CH][LM_TP_HIST + LM_CHUNK]; /* History, then the chunk */
+    float peak;
+};
+
+static double block_lufs(double energy)
+{
+    return -0.691 + 10.0 * log10(energy);
+}
+
+/* BS.1770 K-weighting, re-derived for `rate` rather than the tabulated 48 kHz values */
+static void k_weighting(loudness_meter_handle_t m)
+{
+    double f0 = 1681.974450955533;
+    const double g = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / m->rate);
+    const double vh = pow(10.0, g / 20.0);
+    const double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    m->coef[0][0] = (vh + vb * k / q + k * k) / a0;
+    m->coef[0][1] = 2.0 * (k * k - vh) / a0;
+    m->coef[0][2] = (vh - vb * k / q + k * k) / a0;
+    m->coef[0][3] = 2.0 * (k * k - 1.0) / a0;
+    m->coef[0][4] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / m->rate);
+    a0 = 1.0 + k / q + k * k;
+    m->coef[1][0] = 1.0;
+    m->coef[1][1] = -2.0;
+    m->coef[1][2] = 1.0;
+    m->coef[1][3] = 2.0 * (k * k - 1.0) / a0;
+    m->coef[1][4] = (1.0 - k / q + k * k) / a0;
+}
+
+/* Blackman-windowed sinc cut at the input Nyquist, split into phases of unity DC gain */
+static void true_peak_filter(loudness_meter_handle_t m)
+{
+    const int n = LM_TP_PHASES * LM_TP_TAPS;
+    for (int p = 0; p < LM_TP_PHASES; p++)
+    {
+        float sum = 0;
+        for (int k = 0; k < LM_TP_TAPS; k++)
+        {
+            const int i = k * LM_TP_PHASES + p;
+            const double t = (i - (n - 1) / 2.0) / LM_TP_PHASES;
+            const double w = 0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) + 0.08 * cos(4 * M_PI * i / (n - 1));
+            m->tp_coef[p][k] = sin(M_PI * t) / (M_PI * t) * w;
+            sum += m->tp_coef[p][k];
+        }
+        for (int k = 0; k < LM_TP_TAPS; k++)
+        {
+            m->tp_coef[p][k] /= sum;
+        }
+    }
+}
+
+static void true_peak(loudness_meter_handle_t m, float *buf, int frames)
+{
+    float peak = m->peak;
+    for (int i = 0; i < frames; i++)
+    {
+        const float *h = buf + i + LM_TP_HIST; /* Newest sample */
+        for (int p = 0; p < LM_TP_PHASES; p++)
+        {
+            float acc = 0;
+            for (int k = 0; k < LM_TP_TAPS; k++)
+            {
+                acc += m->tp_coef[p][k] * h[-k];
+            }
+            acc = fabsf(acc);
+            peak = acc > peak ? acc : peak;
+        }
+    }
+    m->peak = peak;
+    memmove(buf, buf + frames, LM_TP_HIST * sizeof(float));
+}
+
+static void close_sub_block(loudness_meter_handle_t m)
+{
+    m->sub_energy[m->subs % LM_SUB_BLOCKS] = m->sub_acc / m->sub_frames;
+    m->sub_acc = 0;
+    m->sub_pos = 0;
+    if (++m->subs < LM_SUB_BLOCKS)
+    {
+        return;
+    }
+
+    double energy = 0;
+    for (int i = 0; i < LM_SUB_BLOCKS; i++)
+    {
+        energy += m->sub_energy[i];
+    }
+    energy /= LM_SUB_BLOCKS;
+    if (energy <= 0)
+    {
+        return;
+    }
+    const double lufs = block_lufs(energy);
+    if (lufs < LM_GATE_ABS)
+    {
+        return;
+    }
+    int bin = (int)((lufs - LM_GATE_ABS) / LM_BIN_LU);
+    bin = bin >= LM_BINS ? LM_BINS - 1 : bin;
+    m->counts[bin]++;
+    m->energy[bin] += energy;
+    m->gated_sum += energy;
+    m->gated_blocks++;
+}
+
+loudness_meter_handle_t loudness_meter_create(int rate, int ch)
+{
+    if (rate < 8000 || rate > 48000 || ch < 1 || ch > LM_MAX_CH)
+    {
+        ESP_LOGE(TAG, "Invalid meter configuration");
+        return NULL;
+    }
+    loudness_meter_handle_t m = audio_calloc(1, sizeof(struct loudness_meter));
+    AUDIO_MEM_CHECK(TAG, m, return NULL);
+    m->x = heap_caps_aligned_alloc(LM_ALIGN, LM_CHUNK * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    m->y = heap_caps_aligned_alloc(LM_ALIGN, LM_CHUNK * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    AUDIO_MEM_CHECK(TAG, m->x && m->y, {
+        loudness_meter_destroy(m);
+        return NULL;
+    });
+    m->rate = rate;
+    m->ch = ch;
+    m->sub_frames = (rate + 5) / 10;
+    k_weighting(m);
+    true_peak_filter(m);
+    return m;
+}
+
+void loudness_meter_add(loudness_meter_handle_t m, const int16_t *pcm, int frames)
+{
+    while (frames > 0)
+    {
+        /* Never straddle a sub-block, so its energy is exact */
+        int n = m->sub_frames - m->sub_pos;
+        n = n < LM_CHUNK ? n : LM_CHUNK;
+        n = n < frames ? n : frames;
+        for (int c = 0; c < m->ch; c++)
+        {
+            float *tp = m->tp_buf[c] + LM_TP_HIST;
+            for (int i = 0; i < n; i++)
+            {
+                tp[i] = m->x[i] = pcm[i * m->ch + c] * (1.0f / 32768.0f);
+            }
+            true_peak(m, m->tp_buf[c], n);
+            dsps_biquad_f32(m->x, m->y, n, m->coef[0], m->w[c][0]);
+            dsps_biquad_f32(m->y, m->x, n, m->coef[1], m->w[c][1]);
+            float e = 0;
+            dsps_dotprod_f32(m->x, m->x, &e, n);
+            m->sub_acc += m->ch == 1 ? 2.0 * e : e;
+        }
+        pcm += n * m->ch;
+        frames -= n;
+        m->sub_pos += n;
+        if (m->sub_pos == m->sub_frames)
+        {
+            close_sub_block(m);
+        }
+    }
+}
+
+float loudness_meter_integrated(loudness_meter_handle_t m)
+{
+    if (m->gated_blocks == 0)
+    {
+        return LOUDNESS_METER_SILENCE_LUFS;
+    }
+    const double rel = block_lufs(m->gated_sum / m->gated_blocks) + LM_GATE_REL;
+    double sum = 0;
+    uint32_t count = 0;
+    for (int b = 0; b < LM_BINS; b++)
+    {
+        if (LM_GATE_ABS + (b + 0.5) * LM_BIN_LU > rel)
+        {
+            sum += m->energy[b];
+            count += m->counts[b];
+        }
+    }
+    return count ? (float)block_lufs(sum / count) : LOUDNESS_METER_SILENCE_LUFS;
+}
+
+float loudness_meter_true_peak(loudness_meter_handle_t m)
+{
+    return m->peak > 0 ? 20.0f * log10f(m->peak) : -HUGE_VALF;
+}
+
+void loudness_meter_destroy(loudness_meter_handle_t m)
+{
+    if (m)
+    {
+        heap_caps_free(m->x);
+        heap_caps_free(m->y);
+        audio_free(m);
+    }
+}
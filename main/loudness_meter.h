@@ -0,0 +1,62 @@
+/* EBU R128 / ITU-R BS.1770 integrated loudness and true peak of 16-bit PCM
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __LOUDNESS_METER_H__
+#define __LOUDNESS_METER_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Loudness of a stream with no block above the absolute gate */
+#define LOUDNESS_METER_SILENCE_LUFS (-70.0f)
+
+    typedef struct loudness_meter *loudness_meter_handle_t;
+
+    /**
+     * @brief Create a meter for interleaved 16-bit PCM
+     *
+     * @param rate sample rate, 8 to 48 kHz
+     * @param ch   1 or 2 channels
+     *
+     * @return The meter handle, NULL on failure
+     */
+    loudness_meter_handle_t loudness_meter_create(int rate, int ch);
+
+    /**
+     * @brief Measure more PCM
+     */
+    void loudness_meter_add(loudness_meter_handle_t m, const int16_t *pcm, int frames);
+
+    /**
+     * @brief Gated integrated loudness of everything added so far, in LUFS.
+     *        LOUDNESS_METER_SILENCE_LUFS when nothing passed the absolute gate.
+     */
+    float loudness_meter_integrated(loudness_meter_handle_t m);
+
+    /**
+     * @brief Highest 4x oversampled peak so far, in dB relative to full scale (dBTP);
+     *        minus infinity while only silence was added
+     */
+    float loudness_meter_true_peak(loudness_meter_handle_t m);
+
+    /**
+     * @brief Free the meter
+     */
+    void loudness_meter_destroy(loudness_meter_handle_t m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,10 +13,15 @@
 #include <string.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <strings.h>
+#include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "audio_element.h"
 #include "audio_pipeline.h"
@@ -32,15 +37,156 @@
 #include "sd_pwr_ctrl_by_on_chip_ldo.h"
 #endif
 #include "board.h"
+#include "es8311_codec.h"
+#include "gapless_player.h"
+#include "readahead_stream.h"
+#include "mp3_seek.h"
+#include "pipeline_telemetry.h"
+#include "audio_io_hook.h"
+#include "pcm_resampler.h"
+#include "i2s_direct_sink.h"
+#include "sched_profile.h"
+#include "prompt_player.h"
+#include "pcm_mixer.h"
+#include "pcm_cache.h"
+#include "sd_tune.h"
+#include "media_library.h"
+#include "audio_arena.h"
+#include "player_control.h"
+#include "button_input.h"
+#include "mp3_frame_guard.h"
+#include "pcm_gain.h"
+#include "loudness_analyser.h"
+#include "spectrum_tap.h"
+#include "crossfade_player.h"
+#include "trace_recorder.h"
+#include "i2s_dma_adapt.h"
 
 static const char *TAG = "PLAY_SD_MP3";
 
 #define MOUNT_POINT "/sdcard"
+#define SD_ALLOCATION_UNIT (16 * 1024)
+/* Mixer input for prompts; stream 0 is the music */
+#define PROMPT_MIXER_STREAM (1)
+/* Mixer inputs of the two crossfade decks; the pipeline input is unused */
+#define CROSSFADE_MIXER_STREAM (2)
+#define PLAYER_VOLUME_DEFAULT (80)
 
-void app_main(void)
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+typedef struct
 {
-    const char *file_path = MOUNT_POINT "/1.mp3";
+    char *paths[CONFIG_PLAYER_PLAYLIST_MAX_TRACKS];
+    int count;
+    int next;
+} playlist_t;
+
+static int playlist_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void playlist_scan(playlist_t *pl, const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        ESP_LOGE(TAG, "Cannot open playlist directory %s", dir);
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL && pl->count < CONFIG_PLAYER_PLAYLIST_MAX_TRACKS)
+    {
+        const char *ext = strrchr(ent->d_name, '.');
+        if (ent->d_type == DT_DIR || ext == NULL || strcasecmp(ext, ".mp3") != 0)
+        {
+            continue;
+        }
+        const size_t len = strlen(dir) + strlen(ent->d_name) + 2;
+        char *path = audio_malloc(len);
+        AUDIO_MEM_CHECK(TAG, path, break);
+        snprintf(path, len, "%s/%s", dir, ent->d_name);
+        pl->paths[pl->count++] = path;
+    }
+    closedir(d);
+    qsort(pl->paths, pl->count, sizeof(char *), playlist_cmp);
+    ESP_LOGI(TAG, "Playlist: %d tracks in %s", pl->count, dir);
+}
+
+#if CONFIG_PLAYER_LIBRARY
+/* Same tracks and order as playlist_scan(), without listing the directory */
+static void playlist_from_library(playlist_t *pl, media_library_handle_t lib, const char *dir)
+{
+    char prefix[MEDIA_LIBRARY_PATH_MAX];
+    const int prefix_len = snprintf(prefix, sizeof(prefix), "%s/", dir);
+    int first, count;
+    media_library_entry_t *entry = audio_malloc(sizeof(media_library_entry_t));
+    AUDIO_MEM_CHECK(TAG, entry, return);
+    if (media_library_range(lib, prefix, &first, &count) == ESP_OK)
+    {
+        for (int i = first; i < first + count && pl->count < CONFIG_PLAYER_PLAYLIST_MAX_TRACKS; i++)
+        {
+            /* Subdirectories are in the range too */
+            if (media_library_get(lib, i, entry) != ESP_OK || strchr(entry->path + prefix_len, '/'))
+            {
+                continue;
+            }
+            pl->paths[pl->count] = audio_strdup(entry->path);
+            AUDIO_MEM_CHECK(TAG, pl->paths[pl->count], break);
+            pl->count++;
+        }
+    }
+    audio_free(entry);
+    ESP_LOGI(TAG, "Playlist: %d tracks in %s (library)", pl->count, dir);
+}
+#endif
+
+static const char *playlist_next(void *ctx)
+{
+    playlist_t *pl = (playlist_t *)ctx;
+    return pl->next < pl->count ? pl->paths[pl->next++] : NULL;
+}
+#endif
+
+/* Boot phases that run concurrently with pipeline construction in app_main */
+#define BOOT_SD_DONE_BIT (1 << 0)
+#define BOOT_CODEC_DONE_BIT (1 << 1)
+#define BOOT_TASK_STACK (4096)
+#define BOOT_TASK_PRIO (5)
+
+typedef struct
+{
+    EventGroupHandle_t done;
+    sdmmc_host_t host;
+    sdmmc_card_t *card;
+    esp_err_t sd_ret;
+    audio_board_handle_t board;
+    int64_t first_sample_us;
+    audio_io_hook_t first_sample_hook;
+    sd_tune_result_t sd_tune; /* read_size 0 when not tuned */
+} boot_ctx_t;
+
+static boot_ctx_t s_boot;
 
+static void boot_mark(const char *phase, int64_t start_us)
+{
+    const int64_t now = esp_timer_get_time();
+    ESP_LOGI(TAG, "[boot] %s: %lld ms (took %lld ms)", phase, (long long)(now / 1000), (long long)((now - start_us) / 1000));
+}
+
+static void boot_sd_done(boot_ctx_t *boot, const sdmmc_host_t *host, esp_err_t ret, int64_t start_us)
+{
+    boot->host = *host;
+    boot->sd_ret = ret;
+    boot_mark("SD mounted", start_us);
+    xEventGroupSetBits(boot->done, BOOT_SD_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+static void boot_sd_task(void *arg)
+{
+    boot_ctx_t *boot = (boot_ctx_t *)arg;
+    const int64_t t0 = esp_timer_get_time();
     ESP_LOGI(TAG, "[ 0 ] Init SD card and FATFS");
 
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
@@ -50,22 +196,23 @@ void app_main(void)
         .format_if_mount_failed = false,
 #endif
         .max_files = 5,
-        .allocation_unit_size = 16 * 1024,
+        .allocation_unit_size = SD_ALLOCATION_UNIT,
     };
 
-    sdmmc_card_t *card;
     sdmmc_host_t host = SDMMC_HOST_DEFAULT();
     host.max_freq_khz = SDMMC_FREQ_SDR50; // Set to 40 MHz (max supported); default is 20 MHz
+    esp_err_t ret;
 
 #if CONFIG_EXAMPLE_SD_PWR_CTRL_LDO_INTERNAL_IO
     sd_pwr_ctrl_ldo_config_t ldo_config = {
         .ldo_chan_id = CONFIG_EXAMPLE_SD_PWR_CTRL_LDO_IO_ID,
     };
     sd_pwr_ctrl_handle_t pwr_ctrl_handle = NULL;
-    esp_err_t ret = sd_pwr_ctrl_new_on_chip_ldo(&ldo_config, &pwr_ctrl_handle);
+    ret = sd_pwr_ctrl_new_on_chip_ldo(&ldo_config, &pwr_ctrl_handle);
     if (ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to create on-chip LDO power control driver");
+        boot_sd_done(boot, &host, ret, t0);
         return;
     }
     host.pwr_ctrl_handle = pwr_ctrl_handle;
@@ -93,7 +240,31 @@ void app_main(void)
     slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
 
     ESP_LOGI(TAG, "Mounting filesystem at %s", MOUNT_POINT);
-    ret = esp_vfs_fat_sdmmc_mount(MOUNT_POINT, &host, &slot_config, &mount_config, &card);
+    ret = esp_vfs_fat_sdmmc_mount(MOUNT_POINT, &host, &slot_config, &mount_config, &boot->card);
+#if CONFIG_PLAYER_SD_TUNE
+    /* Some cards or boards do not make it at SDR50: step down rather than give up */
+    while ((ret == ESP_ERR_INVALID_CRC || ret == ESP_ERR_TIMEOUT) && host.max_freq_khz > SDMMC_FREQ_DEFAULT)
+    {
+        host.max_freq_khz = host.max_freq_khz > SDMMC_FREQ_HIGHSPEED ? SDMMC_FREQ_HIGHSPEED : SDMMC_FREQ_DEFAULT;
+        ESP_LOGW(TAG, "Mount failed (%s), retrying at %d kHz", esp_err_to_name(ret), host.max_freq_khz);
+        ret = esp_vfs_fat_sdmmc_mount(MOUNT_POINT, &host, &slot_config, &mount_config, &boot->card);
+    }
+    if (ret == ESP_OK)
+    {
+        sd_tune_cfg_t tune_cfg = SD_TUNE_CFG_DEFAULT();
+        tune_cfg.min_read_size = SD_ALLOCATION_UNIT;
+#if CONFIG_PLAYER_SD_TUNE_FORCE
+        tune_cfg.force = true;
+#endif
+        if (sd_tune_apply(boot->card, &tune_cfg, &boot->sd_tune) != ESP_OK)
+        {
+            /* Left at whatever clock the benchmark stopped on; the mount clock is the safe one */
+            ESP_LOGW(TAG, "SD tuning failed, keeping the mount settings");
+            boot->card->host.set_card_clk(boot->card->host.slot, boot->card->max_freq_khz);
+            boot->sd_tune.read_size = 0;
+        }
+    }
+#endif
     if (ret != ESP_OK)
     {
         if (ret == ESP_FAIL)
@@ -104,39 +275,849 @@ void app_main(void)
         {
             ESP_LOGE(TAG, "Failed to initialize the card (%s). Check SD pin connections and pull-ups.", esp_err_to_name(ret));
         }
+    }
+    boot_sd_done(boot, &host, ret, t0);
+}
+
+static void boot_codec_task(void *arg)
+{
+    boot_ctx_t *boot = (boot_ctx_t *)arg;
+    const int64_t t0 = esp_timer_get_time();
+    ESP_LOGI(TAG, "[ 1 ] Start audio codec chip");
+    /* Outside any arena scope: the board and the codec driver's queue and task outlive
+       every pipeline, so they must not come from an arena that teardown resets */
+    boot->board = audio_board_init();
+    audio_hal_ctrl_codec(boot->board->audio_hal, AUDIO_HAL_CODEC_MODE_DECODE, AUDIO_HAL_CTRL_START);
+
+    audio_hal_set_volume(boot->board->audio_hal, PLAYER_VOLUME_DEFAULT);
+    boot_mark("codec ready", t0);
+    xEventGroupSetBits(boot->done, BOOT_CODEC_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+/* First PCM handed to the I2S driver; audible one DMA buffer later */
+static int _first_sample_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    if (ret > 0 && s_boot.first_sample_us == 0)
+    {
+        s_boot.first_sample_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "[boot] time to first sample: %lld ms", (long long)(s_boot.first_sample_us / 1000));
+    }
+    return ret;
+}
+
+/* Output format currently programmed into I2S and the codec */
+typedef struct
+{
+    audio_element_handle_t writer;
+    i2s_direct_sink_handle_t sink;    /* Replaces `writer` when the last element writes to I2S itself */
+    audio_element_handle_t resampler; /* When set, track formats go to it and the output stays put */
+    audio_element_handle_t mixer;     /* After the resampler, overlays prompts on the music */
+    int rate;
+    int bits;
+    int ch;
+    int64_t max_switch_us;
+    sched_monitor_handle_t monitor; /* Told the I2S byte rate, may be NULL */
+    spectrum_tap_handle_t spectrum; /* Told the format it analyses, may be NULL */
+    i2s_dma_adapt_handle_t dma_adapt; /* Told the format and the track starts, may be NULL */
+} output_format_t;
+
+static output_format_t s_output;
+
+/* The codec is only told the rates the HAL has a value for, 12 kHz among those it has not */
+static esp_err_t rate_to_hal_samples(int rate, audio_hal_iface_samples_t *samples)
+{
+    switch (rate)
+    {
+    case 8000:
+        *samples = AUDIO_HAL_08K_SAMPLES;
+        break;
+    case 11025:
+        *samples = AUDIO_HAL_11K_SAMPLES;
+        break;
+    case 16000:
+        *samples = AUDIO_HAL_16K_SAMPLES;
+        break;
+    case 22050:
+        *samples = AUDIO_HAL_22K_SAMPLES;
+        break;
+    case 24000:
+        *samples = AUDIO_HAL_24K_SAMPLES;
+        break;
+    case 32000:
+        *samples = AUDIO_HAL_32K_SAMPLES;
+        break;
+    case 44100:
+        *samples = AUDIO_HAL_44K_SAMPLES;
+        break;
+    case 48000:
+        *samples = AUDIO_HAL_48K_SAMPLES;
+        break;
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Reclock I2S and the codec together. The codec is muted for the switch, and left
+ * as muted as it was, so the glitch while the I2S channel restarts is not heard; the codec side only
+ * rewrites registers that differ, so the window is dominated by the I2S reclock.
+ */
+static esp_err_t output_reclock(output_format_t *out, int rate, int bits, int ch)
+{
+    if (rate == out->rate && bits == out->bits && ch == out->ch)
+    {
+        return ESP_OK;
+    }
+
+    audio_hal_codec_i2s_iface_t iface = {
+        .mode = AUDIO_HAL_MODE_SLAVE,
+        .fmt = AUDIO_HAL_I2S_NORMAL,
+        .bits = bits == 32 ? AUDIO_HAL_BIT_LENGTH_32BITS : bits == 24 ? AUDIO_HAL_BIT_LENGTH_24BITS : AUDIO_HAL_BIT_LENGTH_16BITS,
+    };
+    if (rate_to_hal_samples(rate, &iface.samples) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "The codec has no setting for %d Hz, output not reclocked", rate);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    const int64_t t0 = esp_timer_get_time();
+    audio_hal_handle_t hal = s_boot.board->audio_hal;
+    bool muted = false;
+    new_codec_get_voice_mute(&muted);
+    audio_hal_set_mute(hal, true);
+    esp_err_t ret = out->sink ? i2s_direct_sink_set_clk(out->sink, rate, bits, ch) : i2s_stream_set_clk(out->writer, rate, bits, ch);
+    if (ret == ESP_OK)
+    {
+        ret = audio_hal_codec_iface_config(hal, AUDIO_HAL_CODEC_MODE_DECODE, &iface);
+    }
+    audio_hal_set_mute(hal, muted);
+    const int64_t took = esp_timer_get_time() - t0;
+
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Format switch to %d Hz, %d bits, %d ch failed: %s", rate, bits, ch, esp_err_to_name(ret));
+        return ret;
+    }
+    if (took > out->max_switch_us)
+    {
+        out->max_switch_us = took;
+    }
+    uint32_t writes = 0, skipped = 0;
+    new_codec_get_i2c_stats(&writes, &skipped);
+    ESP_LOGI(TAG, "Output %d Hz, %d bits, %d ch: muted %lld us (max %lld), codec I2C %u writes, %u skipped",
+             rate, bits, ch, (long long)took, (long long)out->max_switch_us, (unsigned)writes, (unsigned)skipped);
+    out->rate = rate;
+    out->bits = bits;
+    out->ch = ch;
+    sched_monitor_set_format(out->monitor, rate, bits, ch);
+    spectrum_tap_set_format(out->spectrum, rate, bits, ch);
+    i2s_dma_adapt_set_format(out->dma_adapt, rate, bits, ch);
+    return ESP_OK;
+}
+
+static esp_err_t output_set_format(int rate, int bits, int ch, void *ctx)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    if (out->sink == NULL)
+    {
+        return output_reclock(out, rate, bits, ch);
+    }
+    /* A prompt holding the sink ends, and puts back the format it found, before this one applies */
+    i2s_direct_sink_claim(out->sink, portMAX_DELAY);
+    esp_err_t ret = output_reclock(out, rate, bits, ch);
+    i2s_direct_sink_release(out->sink);
+    return ret;
+}
+
+/* Format of the decoded track, from the decoder or the gapless player */
+static esp_err_t track_set_format(int rate, int bits, int ch, void *ctx)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    /* A track starts: a DMA resize can go in here. Gapless transitions within one format
+       never come through, they are left to silence */
+    i2s_dma_adapt_boundary(out->dma_adapt);
+    if (out->resampler)
+    {
+        return pcm_resampler_set_src_info(out->resampler, rate, ch);
+    }
+    return output_set_format(rate, bits, ch, out);
+}
+
+#if CONFIG_PLAYER_LOUDNESS
+/* The gain stage on the decoded PCM and where it takes each track's loudness from */
+typedef struct
+{
+    pcm_gain_handle_t gain;
+    loudness_analyser_handle_t analyser; /* NULL until the card is mounted */
+    audio_element_handle_t reader;       /* Playback's reader, which the analysis gives way to */
+#if CONFIG_PLAYER_LIBRARY
+    media_library_handle_t library;
+#endif
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+    const playlist_t *playlist;
+#else
+    const char *path;
+#endif
+} loudness_ctx_t;
+
+static loudness_ctx_t s_loudness;
+
+/* Gain for the track about to be heard. No I/O: the gapless player calls it from the decoder task. */
+static void loudness_apply(const char *path)
+{
+    loudness_info_t info;
+    if (s_loudness.analyser && loudness_analyser_lookup(s_loudness.analyser, path, &info) == ESP_OK)
+    {
+        const pcm_gain_track_t track = {.loudness_lufs = info.loudness_lufs, .peak_dbtp = info.peak_dbtp};
+        pcm_gain_set_track(s_loudness.gain, &track);
         return;
     }
+    pcm_gain_set_track(s_loudness.gain, NULL);
+}
+
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+static void loudness_track_start(const char *path, void *ctx)
+{
+    loudness_apply(path);
+}
+#endif
+
+/* Analysis order: the whole library when it has been scanned, else what the player plays */
+static bool loudness_track(int n, char *path, size_t size, void *ctx)
+{
+    const loudness_ctx_t *ld = (const loudness_ctx_t *)ctx;
+#if CONFIG_PLAYER_LIBRARY
+    if (media_library_count(ld->library) > 0)
+    {
+        /* Only the analysis task calls this */
+        static media_library_entry_t entry;
+        if (media_library_get(ld->library, n, &entry) != ESP_OK)
+        {
+            return false;
+        }
+        strlcpy(path, entry.path, size);
+        return true;
+    }
+#endif
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+    if (n >= ld->playlist->count)
+    {
+        return false;
+    }
+    strlcpy(path, ld->playlist->paths[n], size);
+#else
+    if (n > 0)
+    {
+        return false;
+    }
+    strlcpy(path, ld->path, size);
+#endif
+    return true;
+}
 
-    sdmmc_card_print_info(stdout, card);
+/* Playback's reader is running with less than half its output buffered: the card is its */
+static bool loudness_busy(void *ctx)
+{
+    const loudness_ctx_t *ld = (const loudness_ctx_t *)ctx;
+    ringbuf_handle_t rb = audio_element_get_output_ringbuf(ld->reader);
+    return audio_element_get_state(ld->reader) == AEL_STATE_RUNNING && rb && rb_bytes_filled(rb) < rb_get_size(rb) / 2;
+}
 
+#if CONFIG_PLAYER_LIBRARY
+/* A new index may list tracks the store has not seen */
+static void loudness_library_updated(void *ctx)
+{
+    loudness_ctx_t *ld = (loudness_ctx_t *)ctx;
+    if (ld->analyser)
+    {
+        loudness_analyser_rescan(ld->analyser);
+    }
+}
+#endif
+
+/* Loads the store, so tracks measured before play at their gain from the first sample */
+static void loudness_start(const sched_profile_t *sched)
+{
+    loudness_analyser_cfg_t cfg = LOUDNESS_ANALYSER_CFG_DEFAULT();
+    cfg.store_path = MOUNT_POINT "/LOUDNESS.DB";
+    cfg.track = loudness_track;
+    cfg.busy = loudness_busy;
+    cfg.ctx = &s_loudness;
+#if CONFIG_PLAYER_LIBRARY
+    cfg.max_tracks = CONFIG_PLAYER_LIBRARY_MAX_TRACKS;
+#endif
+    if (sched)
+    {
+        /* Placement only: it stays below everything that plays */
+        cfg.task_core = sched->aux.core;
+    }
+    s_loudness.analyser = loudness_analyser_init(&cfg);
+    if (s_loudness.analyser == NULL)
+    {
+        ESP_LOGW(TAG, "No loudness analysis, tracks play at %d LUFS less the assumed level",
+                 CONFIG_PLAYER_LOUDNESS_TARGET_LUFS);
+    }
+}
+#endif
+
+#if CONFIG_PLAYER_PCM_CACHE
+/* Which head the pipeline is linked with: file->mp3->..., or pcm->... for a cached track */
+typedef struct
+{
     audio_pipeline_handle_t pipeline;
     audio_event_iface_handle_t evt;
-    audio_element_handle_t i2s_stream_writer, mp3_decoder, file_stream;
+    pcm_cache_handle_t cache;
+    audio_element_handle_t reader; /* "pcm" */
+    const char *tags[5];           /* file, mp3, then the output side */
+    int tag_count;
+    bool cached;
+} track_route_t;
+
+/* Decoded size of a track; a CBR estimate when there is no frame count */
+static uint32_t mp3_pcm_bytes(const mp3_stream_info_t *info)
+{
+    uint64_t samples = info->total_samples;
+    if (samples == 0 && info->header.bitrate_kbps > 0)
+    {
+        samples = (uint64_t)(info->audio_end - info->audio_start) * 8 * info->header.sample_rate /
+                  ((uint64_t)info->header.bitrate_kbps * 1000);
+    }
+    const uint64_t bytes = samples * info->header.channels * sizeof(int16_t);
+    return bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes;
+}
+
+/* Call with the pipeline stopped. A miss is decoded and recorded as it plays. */
+static void track_route(track_route_t *route, const char *path, const mp3_stream_info_t *info)
+{
+    const bool hit = pcm_cache_lookup(route->cache, path);
+    if (hit != route->cached)
+    {
+        const char *tags[5] = {hit ? "pcm" : "file"};
+        int n = 1;
+        for (int i = hit ? 2 : 1; i < route->tag_count; i++)
+        {
+            tags[n++] = route->tags[i];
+        }
+        audio_pipeline_breakup_elements(route->pipeline, NULL);
+        audio_pipeline_relink(route->pipeline, tags, n);
+        /* Relinking puts every element back on plain ringbuffer I/O, past its hooks */
+        for (int i = 0; i < n; i++)
+        {
+            audio_io_hook_reinstall(audio_pipeline_get_el_by_tag(route->pipeline, tags[i]));
+        }
+        audio_pipeline_set_listener(route->pipeline, route->evt);
+        route->cached = hit;
+#if CONFIG_PLAYER_LOUDNESS
+        /* The recording is the decoder output before the gain; the pcm reader only has an output once relinked */
+        if (hit)
+        {
+            pcm_gain_attach(s_loudness.gain, route->reader);
+        }
+#endif
+    }
+    if (hit)
+    {
+        audio_element_set_uri(route->reader, path);
+        return;
+    }
+    if (info)
+    {
+        pcm_cache_record_start(route->cache, path, info->header.sample_rate, info->header.channels, mp3_pcm_bytes(info));
+    }
+}
+#endif
+
+#if CONFIG_PLAYER_REPEAT || (CONFIG_PLAYER_CONTROL && !CONFIG_PLAYER_GAPLESS_PLAYLIST)
+static void pipeline_rewind(audio_pipeline_handle_t pipeline)
+{
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_reset_ringbuffer(pipeline);
+    audio_pipeline_reset_elements(pipeline);
+    audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
+}
+#endif
+
+#if CONFIG_PLAYER_CONTROL
+typedef enum
+{
+    PLAYER_STOPPED = 0,
+    PLAYER_PLAYING,
+    PLAYER_PAUSED,
+    PLAYER_FINISHED, /* Ran to the end; PLAY starts from the first track */
+} player_state_t;
+
+/* What the commands act on; app_main is the player task and the only one touching it */
+typedef struct
+{
+    audio_pipeline_handle_t pipeline;
+    player_state_t state;
+    int volume;
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+    gapless_player_handle_t gapless;
+    playlist_t *playlist;
+#else
+    const char *path;
+    audio_element_handle_t reader;
+    mp3_seek_index_handle_t seek_index;
+    const mp3_stream_info_t *info; /* NULL when the track could not be probed */
+#if CONFIG_PLAYER_PCM_CACHE
+    track_route_t *route;
+#endif
+#endif
+} player_t;
+
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+/* Playlist position of the track being heard, -1 if it is not in the playlist */
+static int playlist_find(const playlist_t *pl, const char *path)
+{
+    const char *const *found = bsearch(&path, pl->paths, pl->count, sizeof(pl->paths[0]), playlist_cmp);
+    return found ? (int)(found - (const char *const *)pl->paths) : -1;
+}
+
+/* Restart the gapless player at playlist position `n` */
+static esp_err_t player_play_from(player_t *pl, int n)
+{
+    if (n < 0 || n >= pl->playlist->count)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pl->playlist->next = n;
+    return gapless_player_restart(pl->gapless);
+}
+
+static esp_err_t player_skip(player_t *pl, int delta)
+{
+    const int n = playlist_find(pl->playlist, gapless_player_current_track(pl->gapless));
+    return player_play_from(pl, n < 0 ? 0 : n + delta);
+}
+
+static esp_err_t player_seek(player_t *pl, uint32_t time_ms)
+{
+    return gapless_player_seek(pl->gapless, time_ms);
+}
+
+static esp_err_t player_restart(player_t *pl)
+{
+    if (pl->state == PLAYER_FINISHED)
+    {
+        return player_play_from(pl, 0);
+    }
+    return player_skip(pl, 0);
+}
+#else
+/* Back to the start of the track */
+static esp_err_t player_restart(player_t *pl)
+{
+    pipeline_rewind(pl->pipeline);
+#if CONFIG_PLAYER_LOUDNESS
+    /* It may have been measured since */
+    loudness_apply(pl->path);
+#endif
+#if CONFIG_PLAYER_PCM_CACHE
+    /* A recording cut short is dropped */
+    pcm_cache_record_finish(pl->route->cache, false);
+    track_route(pl->route, pl->path, pl->info);
+    if (pl->route->cached)
+    {
+        return audio_pipeline_run(pl->pipeline);
+    }
+#endif
+    audio_element_set_uri(pl->reader, pl->path);
+    audio_element_set_byte_pos(pl->reader, 0);
+    return audio_pipeline_run(pl->pipeline);
+}
+
+static esp_err_t player_skip(player_t *pl, int delta)
+{
+    /* One track: previous starts it over, there is no next */
+    return delta < 0 ? player_restart(pl) : ESP_ERR_NOT_SUPPORTED;
+}
+
+static esp_err_t player_seek(player_t *pl, uint32_t time_ms)
+{
+    if (pl->seek_index == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+#if CONFIG_PLAYER_PCM_CACHE
+    if (pl->route->cached)
+    {
+        /* The recording has no seek index */
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+    mp3_seek_point_t point;
+    esp_err_t ret = mp3_seek_index_lookup(pl->seek_index, time_ms, &point);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+#if CONFIG_PLAYER_PCM_CACHE
+    pcm_cache_record_finish(pl->route->cache, false);
+#endif
+    return mp3_seek_pipeline(pl->pipeline, pl->reader, &point);
+}
+#endif
+
+static esp_err_t player_set_volume(player_t *pl, int volume)
+{
+    volume = volume < 0 ? 0 : volume > 100 ? 100 : volume;
+    esp_err_t ret = audio_hal_set_volume(s_boot.board->audio_hal, volume);
+    if (ret == ESP_OK)
+    {
+        pl->volume = volume;
+    }
+    return ret;
+}
+
+/* Run one command; `audible` is set when its effect is the next PCM reaching I2S */
+static esp_err_t player_execute(player_t *pl, const player_cmd_t *cmd, bool *audible)
+{
+    esp_err_t ret = ESP_OK;
+    *audible = false;
+    if (cmd->type == PLAYER_CMD_PLAY_PAUSE)
+    {
+        /* Counted under PLAY_PAUSE, run as the command it stands for */
+        player_cmd_t toggled = *cmd;
+        toggled.type = pl->state == PLAYER_PLAYING ? PLAYER_CMD_PAUSE : PLAYER_CMD_PLAY;
+        return player_execute(pl, &toggled, audible);
+    }
+    switch (cmd->type)
+    {
+    case PLAYER_CMD_PLAY:
+    case PLAYER_CMD_RESUME:
+        if (pl->state == PLAYER_PLAYING)
+        {
+            return ESP_OK;
+        }
+        if (pl->state == PLAYER_PAUSED)
+        {
+            ret = audio_pipeline_resume(pl->pipeline);
+        }
+        else if (cmd->type == PLAYER_CMD_PLAY)
+        {
+            ret = player_restart(pl);
+        }
+        else
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        *audible = true;
+        break;
+    case PLAYER_CMD_PAUSE:
+        if (pl->state != PLAYER_PLAYING)
+        {
+            return pl->state == PLAYER_PAUSED ? ESP_OK : ESP_ERR_INVALID_STATE;
+        }
+        ret = audio_pipeline_pause(pl->pipeline);
+        if (ret == ESP_OK)
+        {
+            pl->state = PLAYER_PAUSED;
+        }
+        return ret;
+    case PLAYER_CMD_STOP:
+        if (pl->state == PLAYER_PLAYING || pl->state == PLAYER_PAUSED)
+        {
+            audio_pipeline_stop(pl->pipeline);
+            audio_pipeline_wait_for_stop(pl->pipeline);
+#if !CONFIG_PLAYER_GAPLESS_PLAYLIST && CONFIG_PLAYER_PCM_CACHE
+            pcm_cache_record_finish(pl->route->cache, false);
+#endif
+            pl->state = PLAYER_STOPPED;
+        }
+        return ESP_OK;
+    case PLAYER_CMD_SEEK:
+        if (pl->state == PLAYER_FINISHED)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        ret = player_seek(pl, (uint32_t)cmd->arg);
+        *audible = true;
+        break;
+    case PLAYER_CMD_NEXT:
+    case PLAYER_CMD_PREV:
+        ret = player_skip(pl, cmd->type == PLAYER_CMD_NEXT ? 1 : -1);
+        *audible = true;
+        break;
+    case PLAYER_CMD_VOLUME:
+        return player_set_volume(pl, cmd->arg);
+    case PLAYER_CMD_VOLUME_STEP:
+        return player_set_volume(pl, pl->volume + cmd->arg);
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+    /* Seeking or skipping restarts the pipeline, so a paused player plays on */
+    if (ret == ESP_OK)
+    {
+        pl->state = PLAYER_PLAYING;
+    }
+    return ret;
+}
+
+#if CONFIG_PLAYER_BUTTONS
+/* What each board button posts, indexed by its button_input id */
+static const struct
+{
+    player_cmd_type_t cmd;
+    int32_t arg;
+} s_button_actions[] = {
+    {PLAYER_CMD_PLAY_PAUSE, 0},
+    {PLAYER_CMD_NEXT, 0},
+    {PLAYER_CMD_PREV, 0},
+    {PLAYER_CMD_VOLUME_STEP, CONFIG_PLAYER_BUTTON_VOLUME_STEP},
+    {PLAYER_CMD_VOLUME_STEP, -CONFIG_PLAYER_BUTTON_VOLUME_STEP},
+    {PLAYER_CMD_STOP, 0},
+};
+
+/* Button task: latency is measured from the interrupt, so it covers the press end to end */
+static void _button_press(int id, int64_t edge_us, void *ctx)
+{
+    player_control_post_at((player_control_handle_t)ctx, s_button_actions[id].cmd, s_button_actions[id].arg, edge_us);
+}
+#endif
+
+static void player_run_commands(player_t *pl, player_control_handle_t ctl)
+{
+    player_cmd_t cmd;
+    while (player_control_receive(ctl, &cmd))
+    {
+        bool audible;
+        esp_err_t ret = player_execute(pl, &cmd, &audible);
+        ESP_LOGI(TAG, "Command %s(%d): %s", player_control_cmd_name(cmd.type), (int)cmd.arg, esp_err_to_name(ret));
+        player_control_done(ctl, &cmd, ret, audible);
+    }
+}
+#endif
+
+#if CONFIG_PLAYER_PROMPTS && CONFIG_PLAYER_MIXER
+/* Prompts go to their own mixer stream; the music keeps playing, ducked */
+static int prompt_out_begin(void *ctx, int rate, int bits, int ch, const void *head, size_t len)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    if (rate != CONFIG_PLAYER_RESAMPLE_RATE || bits != 16 || ch != 2)
+    {
+        ESP_LOGE(TAG, "Prompts are %d Hz, %d bits, %d ch; the mixer runs at %d Hz, 16 bits, 2 ch", rate, bits, ch,
+                 CONFIG_PLAYER_RESAMPLE_RATE);
+        return AEL_IO_FAIL;
+    }
+    /* A prompt cutting into another replaces what is left of it */
+    pcm_mixer_flush(out->mixer, PROMPT_MIXER_STREAM);
+    return pcm_mixer_write(out->mixer, PROMPT_MIXER_STREAM, head, len, 0);
+}
+
+static int prompt_out_write(void *ctx, const void *buf, size_t len, TickType_t ticks)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    return pcm_mixer_write(out->mixer, PROMPT_MIXER_STREAM, buf, len, ticks);
+}
+
+static void prompt_out_end(void *ctx)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    pcm_mixer_stream_end(out->mixer, PROMPT_MIXER_STREAM);
+}
+
+/* The mixer writes straight into the DMA buffers: its first block with the prompt is when it is heard */
+static int64_t prompt_out_started_us(void *ctx)
+{
+    output_format_t *out = (output_format_t *)ctx;
+    return pcm_mixer_started_us(out->mixer, PROMPT_MIXER_STREAM);
+}
+#elif CONFIG_PLAYER_PROMPTS
+/* Prompts hold the direct sink while they play; the pipeline waits in its next write */
+typedef struct
+{
+    output_format_t *out;
+    bool claimed;
+    int rate; /* Format to put back when the prompt ends */
+    int bits;
+    int ch;
+} prompt_out_t;
+
+static int prompt_out_begin(void *ctx, int rate, int bits, int ch, const void *head, size_t len)
+{
+    prompt_out_t *po = (prompt_out_t *)ctx;
+    if (!po->claimed)
+    {
+        i2s_direct_sink_claim(po->out->sink, portMAX_DELAY);
+        po->claimed = true;
+        po->rate = po->out->rate;
+        po->bits = po->out->bits;
+        po->ch = po->out->ch;
+    }
+    if (output_reclock(po->out, rate, bits, ch) != ESP_OK)
+    {
+        return AEL_IO_FAIL;
+    }
+    return i2s_direct_sink_preempt(po->out->sink, head, len);
+}
+
+static int prompt_out_write(void *ctx, const void *buf, size_t len, TickType_t ticks)
+{
+    prompt_out_t *po = (prompt_out_t *)ctx;
+    return i2s_direct_sink_write(po->out->sink, buf, len, ticks);
+}
+
+static void prompt_out_end(void *ctx)
+{
+    prompt_out_t *po = (prompt_out_t *)ctx;
+    if (po->rate)
+    {
+        output_reclock(po->out, po->rate, po->bits, po->ch);
+    }
+    po->claimed = false;
+    i2s_direct_sink_release(po->out->sink);
+}
+#endif
+
+void app_main(void)
+{
+    const char *file_path = MOUNT_POINT "/1.mp3";
+    const int64_t boot_start = esp_timer_get_time();
 
     esp_log_level_set("*", ESP_LOG_WARN);
     esp_log_level_set(TAG, ESP_LOG_INFO);
+#if CONFIG_PLAYER_ARENA
+    /* Before the first element is created. Scopes are per task: the boot tasks open none and stay on the heap */
+    esp_log_level_set("AUDIO_ARENA", ESP_LOG_INFO);
+    audio_arena_cfg_t arena_cfg = AUDIO_ARENA_CFG_DEFAULT();
+    arena_cfg.internal_size = CONFIG_PLAYER_ARENA_INTERNAL_KB * 1024;
+    arena_cfg.psram_size = CONFIG_PLAYER_ARENA_PSRAM_KB * 1024;
+    if (audio_arena_init(&arena_cfg) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "No arena, the pipeline is allocated from the heap");
+    }
+#endif
 
-    ESP_LOGI(TAG, "[ 1 ] Start audio codec chip");
-    audio_board_handle_t board_handle = audio_board_init();
-    audio_hal_ctrl_codec(board_handle->audio_hal, AUDIO_HAL_CODEC_MODE_DECODE, AUDIO_HAL_CTRL_START);
+    /* SD and codec bring-up block on their buses; run them while the pipeline is built */
+    s_boot.done = xEventGroupCreate();
+    mem_assert(s_boot.done);
+    if (xTaskCreate(boot_sd_task, "boot_sd", BOOT_TASK_STACK, &s_boot, BOOT_TASK_PRIO, NULL) != pdPASS ||
+        xTaskCreate(boot_codec_task, "boot_codec", BOOT_TASK_STACK, &s_boot, BOOT_TASK_PRIO, NULL) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create boot tasks");
+        return;
+    }
 
-    audio_hal_set_volume(board_handle->audio_hal, 80);
+    audio_pipeline_handle_t pipeline;
+    audio_event_iface_handle_t evt;
+    audio_element_handle_t i2s_stream_writer, mp3_decoder = NULL, file_stream = NULL;
 
     ESP_LOGI(TAG, "[ 2 ] Create audio pipeline, add all elements to pipeline");
+    const sched_profile_t *sched = sched_profile_get();
+    if (sched)
+    {
+        ESP_LOGI(TAG, "Scheduling profile: %s", sched->name);
+    }
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+    /* Everything built from here to the boot join is carved from the arena, if there is one */
+    audio_arena_owner_begin("pipeline", AUDIO_ARENA_AUTO);
     pipeline = audio_pipeline_init(&pipeline_cfg);
     mem_assert(pipeline);
 
+#if CONFIG_PLAYER_CROSSFADE
+    /* Each crossfade deck brings its own reader, decoder and resampler */
+    (void)file_path;
+#elif CONFIG_PLAYER_READAHEAD
+    ESP_LOGI(TAG, "[2.1] Create read-ahead SD stream reader");
+    audio_arena_owner_begin("reader", AUDIO_ARENA_AUTO);
+    readahead_stream_cfg_t ra_cfg = READAHEAD_STREAM_CFG_DEFAULT();
+    ra_cfg.ring_size = CONFIG_PLAYER_READAHEAD_RING_KB * 1024;
+    ra_cfg.read_size = CONFIG_PLAYER_READAHEAD_READ_KB * 1024;
+    ra_cfg.high_watermark = CONFIG_PLAYER_READAHEAD_HIGH_PCT;
+    ra_cfg.low_watermark = CONFIG_PLAYER_READAHEAD_LOW_PCT;
+    ra_cfg.task_prio = CONFIG_PLAYER_READAHEAD_TASK_PRIO;
+    if (sched)
+    {
+        /* Placement only: the refill keeps its low priority */
+        ra_cfg.task_core = sched->reader.core;
+        ra_cfg.ext_stack = sched->reader.ext_stack;
+    }
+    if (ra_cfg.read_size % SD_ALLOCATION_UNIT)
+    {
+        ESP_LOGW(TAG, "Read size is not a multiple of the %d KB allocation unit", SD_ALLOCATION_UNIT / 1024);
+    }
+    file_stream = readahead_stream_init(&ra_cfg);
+#else
     ESP_LOGI(TAG, "[2.1] Create FATFS stream reader");
+    audio_arena_owner_begin("reader", AUDIO_ARENA_AUTO);
     fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
     fatfs_cfg.type = AUDIO_STREAM_READER;
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(fatfs_cfg, sched->reader, ext_stack);
+    }
     file_stream = fatfs_stream_init(&fatfs_cfg);
+#endif
+#if !CONFIG_PLAYER_CROSSFADE
+    mem_assert(file_stream);
     audio_element_set_uri(file_stream, file_path);
 
     ESP_LOGI(TAG, "[2.2] Create mp3 decoder");
+    /* Its frame buffers are hot on every frame */
+    audio_arena_owner_begin("decoder", AUDIO_ARENA_INTERNAL);
     mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(mp3_cfg, sched->decoder, stack_in_ext);
+    }
     mp3_decoder = mp3_decoder_init(&mp3_cfg);
 
+#if CONFIG_PLAYER_RESAMPLE
+    ESP_LOGI(TAG, "[2.2] Create resampler to %d Hz", CONFIG_PLAYER_RESAMPLE_RATE);
+    audio_arena_owner_begin("resampler", AUDIO_ARENA_AUTO);
+    pcm_resampler_cfg_t rsp_cfg = PCM_RESAMPLER_CFG_DEFAULT();
+    rsp_cfg.out_rate = CONFIG_PLAYER_RESAMPLE_RATE;
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(rsp_cfg, sched->resampler, ext_stack);
+    }
+#if CONFIG_PLAYER_RESAMPLE_QUALITY_LOW
+    rsp_cfg.quality = PCM_RESAMPLER_QUALITY_LOW;
+#elif CONFIG_PLAYER_RESAMPLE_QUALITY_HIGH
+    rsp_cfg.quality = PCM_RESAMPLER_QUALITY_HIGH;
+#endif
+    s_output.resampler = pcm_resampler_init(&rsp_cfg);
+    mem_assert(s_output.resampler);
+#endif
+#endif
+
+#if CONFIG_PLAYER_MIXER
+    ESP_LOGI(TAG, "[2.2] Create mixer, music ducked by %d dB under prompts", CONFIG_PLAYER_MIXER_DUCK_DB);
+    audio_arena_owner_begin("mixer", AUDIO_ARENA_AUTO);
+    pcm_mixer_cfg_t mix_cfg = PCM_MIXER_CFG_DEFAULT();
+    mix_cfg.rate = CONFIG_PLAYER_RESAMPLE_RATE;
+#if CONFIG_PLAYER_CROSSFADE
+    mix_cfg.streams = CROSSFADE_MIXER_STREAM + CROSSFADE_PLAYER_DECKS;
+    mix_cfg.pipeline_input = false;
+#endif
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(mix_cfg, sched->mixer, ext_stack);
+    }
+    s_output.mixer = pcm_mixer_init(&mix_cfg);
+    mem_assert(s_output.mixer);
+    pcm_mixer_set_ducking(s_output.mixer, PROMPT_MIXER_STREAM, powf(10.0f, -CONFIG_PLAYER_MIXER_DUCK_DB / 20.0f), 10, 250);
+#endif
+
+    audio_arena_owner_begin("i2s", AUDIO_ARENA_INTERNAL);
+#if CONFIG_PLAYER_I2S_DIRECT
+    ESP_LOGI(TAG, "[2.3] Open I2S for direct writes from the last element");
+    i2s_direct_sink_cfg_t sink_cfg = I2S_DIRECT_SINK_CFG_DEFAULT();
+#if CONFIG_PLAYER_PROMPTS
+    /* Written in place of the music, a prompt waits for at most one buffer: under 5 ms at 44.1 kHz.
+       Mixed over it, it waits for all four and a mixer block, about 25 ms. */
+    sink_cfg.dma_desc_num = 4;
+    sink_cfg.dma_frame_num = 200;
+#endif
+    s_output.sink = i2s_direct_sink_init(&sink_cfg);
+    mem_assert(s_output.sink);
+    i2s_stream_writer = NULL;
+#else
     ESP_LOGI(TAG, "[2.3] Create i2s stream to write data to codec chip");
 #if defined CONFIG_ESP32_C3_LYRA_V2_BOARD
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_PDM_TX_CFG_DEFAULT();
@@ -144,26 +1125,460 @@ void app_main(void)
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
 #endif
     i2s_cfg.type = AUDIO_STREAM_WRITER;
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(i2s_cfg, sched->writer, stack_in_ext);
+    }
     i2s_stream_writer = i2s_stream_init(&i2s_cfg);
+    s_output.writer = i2s_stream_writer;
+#endif
 
     ESP_LOGI(TAG, "[2.4] Register all elements to audio pipeline");
-    audio_pipeline_register(pipeline, file_stream, "file");
-    audio_pipeline_register(pipeline, mp3_decoder, "mp3");
-    audio_pipeline_register(pipeline, i2s_stream_writer, "i2s");
+    /* Linking creates the ringbuffers between the elements */
+    audio_arena_owner_begin("ringbuf", AUDIO_ARENA_AUTO);
+    const char *link_tag[5];
+    int link_len = 0;
+    /* Last element: its FINISHED is the end of playback */
+    audio_element_handle_t pcm_out = mp3_decoder;
+    if (file_stream)
+    {
+        audio_pipeline_register(pipeline, file_stream, "file");
+        link_tag[link_len++] = "file";
+        audio_pipeline_register(pipeline, mp3_decoder, "mp3");
+        link_tag[link_len++] = "mp3";
+    }
+    if (s_output.resampler)
+    {
+        audio_pipeline_register(pipeline, s_output.resampler, "rsp");
+        link_tag[link_len++] = "rsp";
+        pcm_out = s_output.resampler;
+    }
+    if (s_output.mixer)
+    {
+        audio_pipeline_register(pipeline, s_output.mixer, "mix");
+        link_tag[link_len++] = "mix";
+        pcm_out = s_output.mixer;
+    }
+    if (i2s_stream_writer)
+    {
+        audio_pipeline_register(pipeline, i2s_stream_writer, "i2s");
+        link_tag[link_len++] = "i2s";
+        pcm_out = i2s_stream_writer;
+    }
+
+    ESP_LOGI(TAG, "[2.5] Link it together %s->...->%s", link_tag[0], link_tag[link_len - 1]);
+    audio_pipeline_link(pipeline, link_tag, link_len);
+    s_boot.first_sample_hook.fn = _first_sample_hook;
+    if (s_output.sink)
+    {
+        i2s_direct_sink_attach(s_output.sink, pcm_out);
+#if CONFIG_PLAYER_I2S_ADAPT
+        /* First, so it runs last and sees the PCM as it goes out */
+        i2s_dma_adapt_cfg_t adapt_cfg = I2S_DMA_ADAPT_CFG_DEFAULT();
+        adapt_cfg.sink = s_output.sink;
+        adapt_cfg.el = pcm_out;
+        adapt_cfg.rate = sink_cfg.sample_rate;
+        adapt_cfg.bits = sink_cfg.bits;
+        adapt_cfg.ch = sink_cfg.channels;
+        adapt_cfg.min_ms = CONFIG_PLAYER_I2S_ADAPT_MIN_MS;
+        adapt_cfg.max_ms = CONFIG_PLAYER_I2S_ADAPT_MAX_MS;
+        s_output.dma_adapt = i2s_dma_adapt_init(&adapt_cfg);
+        mem_assert(s_output.dma_adapt);
+#endif
+        audio_io_hook_add(pcm_out, AUDIO_IO_HOOK_WRITE, &s_boot.first_sample_hook);
+    }
+    else
+    {
+        audio_io_hook_add(i2s_stream_writer, AUDIO_IO_HOOK_READ, &s_boot.first_sample_hook);
+    }
+
+#if CONFIG_PLAYER_LOUDNESS
+    /* Before the gapless and cache hooks, so it runs after them: on the trimmed PCM, and unrecorded */
+    ESP_LOGI(TAG, "[2.5] Normalise loudness to %d LUFS", CONFIG_PLAYER_LOUDNESS_TARGET_LUFS);
+    audio_arena_owner_begin("loudness", AUDIO_ARENA_AUTO);
+    pcm_gain_cfg_t gain_cfg = PCM_GAIN_CFG_DEFAULT();
+    gain_cfg.target_lufs = CONFIG_PLAYER_LOUDNESS_TARGET_LUFS;
+    gain_cfg.max_boost_db = CONFIG_PLAYER_LOUDNESS_MAX_BOOST_DB;
+    s_loudness.gain = pcm_gain_init(&gain_cfg);
+    mem_assert(s_loudness.gain);
+    if (pcm_gain_attach(s_loudness.gain, mp3_decoder) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Loudness gain not attached, tracks play unscaled");
+    }
+    s_loudness.reader = file_stream;
+#endif
 
-    ESP_LOGI(TAG, "[2.5] Link it together file->mp3->i2s");
-    const char *link_tag[3] = {"file", "mp3", "i2s"};
-    audio_pipeline_link(pipeline, link_tag, 3);
+#if CONFIG_PLAYER_SCHED_MEASURE
+    /* Before the gapless hooks, so it counts the PCM that actually reaches I2S */
+    audio_arena_owner_begin("monitor", AUDIO_ARENA_AUTO);
+    sched_monitor_cfg_t mon_cfg = SCHED_MONITOR_CFG_DEFAULT();
+    mon_cfg.feeder = s_output.mixer ? s_output.mixer : s_output.resampler ? s_output.resampler : mp3_decoder;
+    mon_cfg.period_ms = CONFIG_PLAYER_SCHED_MEASURE_PERIOD_MS;
+    if (sched)
+    {
+        mon_cfg.task_core = sched->aux.core;
+        mon_cfg.task_prio = sched->aux.prio;
+    }
+    s_output.monitor = sched_monitor_init(&mon_cfg);
+    mem_assert(s_output.monitor);
+#endif
 
     ESP_LOGI(TAG, "[2.6] Set up event listener for end-of-stream");
+    audio_arena_owner_begin("events", AUDIO_ARENA_INTERNAL);
     audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
     evt = audio_event_iface_init(&evt_cfg);
     audio_pipeline_set_listener(pipeline, evt);
 
+#if CONFIG_PLAYER_FRAME_GUARD
+    /* Before the gapless hooks, so it runs after them and sees only the audio of each file */
+    ESP_LOGI(TAG, "[2.6] Guard the decoder input against damaged frames");
+    audio_arena_owner_begin("guard", AUDIO_ARENA_AUTO);
+    mp3_frame_guard_cfg_t guard_cfg = MP3_FRAME_GUARD_CFG_DEFAULT();
+    guard_cfg.reader = file_stream;
+    guard_cfg.listener = evt;
+    guard_cfg.max_gap_ms = CONFIG_PLAYER_FRAME_GUARD_MAX_GAP_MS;
+    mp3_frame_guard_handle_t guard = mp3_frame_guard_init(&guard_cfg);
+    mem_assert(guard);
+#endif
+
+#if CONFIG_PLAYER_CROSSFADE
+    static playlist_t playlist;
+
+    ESP_LOGI(TAG, "[2.6] Create crossfade decks, %d s fades", CONFIG_PLAYER_CROSSFADE_SECONDS);
+    audio_arena_owner_begin("crossfade", AUDIO_ARENA_AUTO);
+    crossfade_player_cfg_t xf_cfg = CROSSFADE_PLAYER_CFG_DEFAULT();
+    xf_cfg.mixer = s_output.mixer;
+    xf_cfg.streams[0] = CROSSFADE_MIXER_STREAM;
+    xf_cfg.streams[1] = CROSSFADE_MIXER_STREAM + 1;
+    xf_cfg.rate = CONFIG_PLAYER_RESAMPLE_RATE;
+#if CONFIG_PLAYER_RESAMPLE_QUALITY_LOW
+    xf_cfg.quality = PCM_RESAMPLER_QUALITY_LOW;
+#elif CONFIG_PLAYER_RESAMPLE_QUALITY_HIGH
+    xf_cfg.quality = PCM_RESAMPLER_QUALITY_HIGH;
+#endif
+    xf_cfg.next_track = playlist_next;
+    xf_cfg.ctx = &playlist;
+    xf_cfg.listener = evt;
+    xf_cfg.fade_ms = CONFIG_PLAYER_CROSSFADE_SECONDS * 1000;
+    xf_cfg.internal_budget_kb = CONFIG_PLAYER_CROSSFADE_INTERNAL_KB;
+    xf_cfg.psram_budget_kb = CONFIG_PLAYER_CROSSFADE_PSRAM_KB;
+    xf_cfg.sched = sched;
+    if (sched)
+    {
+        xf_cfg.task_core = sched->aux.core;
+    }
+    crossfade_player_handle_t crossfade = crossfade_player_init(&xf_cfg);
+    mem_assert(crossfade);
+#elif CONFIG_PLAYER_GAPLESS_PLAYLIST
+    static playlist_t playlist;
+
+    audio_arena_owner_begin("gapless", AUDIO_ARENA_AUTO);
+    gapless_player_cfg_t gapless_cfg = {
+        .pipeline = pipeline,
+        .reader = file_stream,
+        .decoder = mp3_decoder,
+        .writer = pcm_out,
+        .next_track = playlist_next,
+        .ctx = &playlist,
+        .set_format = track_set_format,
+        .format_ctx = &s_output,
+        .listener = evt,
+#if CONFIG_PLAYER_LOUDNESS
+        .track_start = loudness_track_start,
+        .track_ctx = &s_loudness,
+#endif
+    };
+    gapless_player_handle_t gapless = gapless_player_init(&gapless_cfg);
+    mem_assert(gapless);
+#endif
+
+#if CONFIG_PLAYER_TELEMETRY
+    /* After the gapless hooks, so the counters see the untrimmed streams */
+    ESP_LOGI(TAG, "[2.7] Attach pipeline telemetry");
+    audio_arena_owner_begin("telemetry", AUDIO_ARENA_AUTO);
+    pipeline_telemetry_cfg_t tele_cfg = PIPELINE_TELEMETRY_CFG_DEFAULT();
+    tele_cfg.reader = file_stream;
+    tele_cfg.decoder = mp3_decoder;
+    tele_cfg.writer = i2s_stream_writer;
+    tele_cfg.sink = s_output.sink;
+    tele_cfg.listener = evt;
+    tele_cfg.period_ms = CONFIG_PLAYER_TELEMETRY_PERIOD_MS;
+    if (sched)
+    {
+        tele_cfg.task_core = sched->aux.core;
+        tele_cfg.task_prio = sched->aux.prio;
+    }
+#if CONFIG_PLAYER_I2S_DIRECT
+    tele_cfg.i2s_dma_frames = sink_cfg.dma_desc_num * sink_cfg.dma_frame_num;
+#else
+    tele_cfg.i2s_dma_frames = i2s_cfg.chan_cfg.dma_desc_num * i2s_cfg.chan_cfg.dma_frame_num;
+#endif
+    pipeline_telemetry_handle_t telemetry = pipeline_telemetry_init(&tele_cfg);
+    mem_assert(telemetry);
+#endif
+
+#if CONFIG_PLAYER_CONTROL
+    ESP_LOGI(TAG, "[2.8] Attach player control");
+    audio_arena_owner_begin("control", AUDIO_ARENA_INTERNAL);
+    player_control_cfg_t ctl_cfg = PLAYER_CONTROL_CFG_DEFAULT();
+    ctl_cfg.listener = evt;
+    /* Where the first sample is observed, so an audible effect ends where boot's does */
+    ctl_cfg.output = s_output.sink ? pcm_out : i2s_stream_writer;
+    ctl_cfg.output_dir = s_output.sink ? AUDIO_IO_HOOK_WRITE : AUDIO_IO_HOOK_READ;
+    player_control_handle_t control = player_control_init(&ctl_cfg);
+    mem_assert(control);
+#endif
+#if CONFIG_PLAYER_SPECTRUM
+    ESP_LOGI(TAG, "[2.8] Attach spectrum analysis");
+    audio_arena_owner_begin("spectrum", AUDIO_ARENA_AUTO);
+    spectrum_tap_cfg_t spec_cfg = SPECTRUM_TAP_CFG_DEFAULT();
+    /* The PCM as it reaches I2S, prompts and gain included */
+    spec_cfg.el = s_output.sink ? pcm_out : i2s_stream_writer;
+    spec_cfg.dir = s_output.sink ? AUDIO_IO_HOOK_WRITE : AUDIO_IO_HOOK_READ;
+    spec_cfg.fft_size = CONFIG_PLAYER_SPECTRUM_FFT_SIZE;
+    spec_cfg.bands = CONFIG_PLAYER_SPECTRUM_BANDS;
+    spec_cfg.frame_hz = CONFIG_PLAYER_SPECTRUM_FPS;
+    if (sched)
+    {
+        spec_cfg.task_core = sched->aux.core;
+        spec_cfg.task_prio = sched->aux.prio;
+    }
+    /* Nothing draws it yet: spectrum_tap_get() is there for a display task */
+    s_output.spectrum = spectrum_tap_init(&spec_cfg);
+    mem_assert(s_output.spectrum);
+#endif
+#if CONFIG_PLAYER_BUTTONS
+    /* Same order as s_button_actions; the GPIOs come from the board config */
+    button_input_cfg_t btn_cfg = BUTTON_INPUT_CFG_DEFAULT();
+    const int8_t btn_gpios[] = {
+        get_input_play_id(), get_input_set_id(), get_input_mode_id(),
+        get_input_volup_id(), get_input_voldown_id(), get_input_mute_id(),
+    };
+    for (int i = 0; i < (int)(sizeof(btn_gpios) / sizeof(btn_gpios[0])); i++)
+    {
+        btn_cfg.keys[btn_cfg.key_count++] = (button_input_key_t){.gpio = btn_gpios[i], .id = i};
+    }
+    btn_cfg.active_low = BUTTON_ACTIVE_LEVEL == 0;
+    btn_cfg.debounce_ms = CONFIG_PLAYER_BUTTON_DEBOUNCE_MS;
+    btn_cfg.on_press = _button_press;
+    btn_cfg.ctx = control;
+    /* NULL on a board without buttons */
+    button_input_handle_t buttons = button_input_init(&btn_cfg);
+#endif
+    /* Services started after the join outlive the pipeline: keep them on the heap */
+    audio_arena_owner_end();
+
+    boot_mark("pipeline built", boot_start);
+    xEventGroupWaitBits(s_boot.done, BOOT_SD_DONE_BIT | BOOT_CODEC_DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    boot_mark("boot joined", boot_start);
+    if (s_boot.sd_ret != ESP_OK)
+    {
+        return;
+    }
+#if CONFIG_PLAYER_TRACE
+    /* Needs the card and the codec; before anything runs, so the first track is on the timeline */
+    trace_recorder_cfg_t trace_cfg = TRACE_RECORDER_CFG_DEFAULT();
+    trace_cfg.reader = file_stream;
+    trace_cfg.decoder = mp3_decoder;
+    trace_cfg.writer = i2s_stream_writer;
+    trace_cfg.path = MOUNT_POINT "/TRACE.BIN";
+    trace_cfg.ring_kb = CONFIG_PLAYER_TRACE_RING_KB;
+    trace_cfg.flush_ms = CONFIG_PLAYER_TRACE_FLUSH_MS;
+    if (sched)
+    {
+        trace_cfg.task_core = sched->aux.core;
+    }
+    /* Playback goes on without it */
+    trace_recorder_handle_t trace = trace_recorder_init(&trace_cfg);
+#endif
+#if CONFIG_PLAYER_SD_TUNE && CONFIG_PLAYER_READAHEAD && !CONFIG_PLAYER_CROSSFADE
+    if (s_boot.sd_tune.read_size)
+    {
+        readahead_stream_set_read_size(file_stream, s_boot.sd_tune.read_size);
+    }
+#endif
+#if CONFIG_PLAYER_RESAMPLE
+    /* The only reclock: every track is resampled to this */
+    output_set_format(CONFIG_PLAYER_RESAMPLE_RATE, 16, 2, &s_output);
+#endif
+
+#if CONFIG_PLAYER_PROMPTS
+#if CONFIG_PLAYER_MIXER
+    void *prompt_ctx = &s_output;
+#else
+    static prompt_out_t prompt_out = {.out = &s_output};
+    void *prompt_ctx = &prompt_out;
+#endif
+    prompt_player_cfg_t prompt_cfg = PROMPT_PLAYER_CFG_DEFAULT();
+    prompt_cfg.output = (prompt_output_t){
+        .begin = prompt_out_begin,
+        .write = prompt_out_write,
+        .end = prompt_out_end,
+#if CONFIG_PLAYER_MIXER
+        .started_us = prompt_out_started_us,
+#endif
+        .ctx = prompt_ctx,
+    };
+    if (sched)
+    {
+        prompt_cfg.task_core = sched->writer.core;
+    }
+    /* Without a flashed image there are no prompts; playback is unaffected */
+    prompt_player_handle_t prompts = prompt_player_init(&prompt_cfg);
+    if (prompts)
+    {
+        prompt_player_play(prompts, "boot");
+    }
+#endif
+
+#if CONFIG_PLAYER_LIBRARY
+    media_library_cfg_t lib_cfg = MEDIA_LIBRARY_CFG_DEFAULT();
+    lib_cfg.root = MOUNT_POINT;
+    lib_cfg.index_path = MOUNT_POINT "/LIBRARY.IDX";
+    lib_cfg.max_tracks = CONFIG_PLAYER_LIBRARY_MAX_TRACKS;
+    if (sched)
+    {
+        lib_cfg.task_core = sched->aux.core;
+        lib_cfg.task_prio = sched->aux.prio;
+    }
+#if CONFIG_PLAYER_LOUDNESS
+    lib_cfg.on_update = loudness_library_updated;
+    lib_cfg.ctx = &s_loudness;
+#endif
+    /* Rescans in the background; until the first scan of a card is done the index is empty */
+    media_library_handle_t library = media_library_init(&lib_cfg);
+#if CONFIG_PLAYER_LOUDNESS
+    s_loudness.library = library;
+#endif
+#endif
+
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+#if CONFIG_PLAYER_LIBRARY
+    if (media_library_count(library) > 0)
+    {
+        playlist_from_library(&playlist, library, CONFIG_PLAYER_PLAYLIST_DIR);
+    }
+    else
+#endif
+    {
+        playlist_scan(&playlist, CONFIG_PLAYER_PLAYLIST_DIR);
+    }
+#if CONFIG_PLAYER_LOUDNESS
+    s_loudness.playlist = &playlist;
+    loudness_start(sched);
+#endif
+
+#if CONFIG_PLAYER_CROSSFADE
+    ESP_LOGI(TAG, "[ 3 ] Start crossfading playlist from SD: %s", CONFIG_PLAYER_PLAYLIST_DIR);
+    audio_pipeline_run(pipeline);
+    if (crossfade_player_start(crossfade) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Nothing to play");
+        return;
+    }
+#else
+    ESP_LOGI(TAG, "[ 3 ] Start gapless playlist from SD: %s", CONFIG_PLAYER_PLAYLIST_DIR);
+    if (gapless_player_start(gapless) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Nothing to play");
+        return;
+    }
+#endif
+#else
+    /* Opening the index on first play queues the sidecar build for files without a TOC */
+    mp3_seek_index_handle_t seek_index = NULL;
+    mp3_stream_info_t stream_info;
+    audio_element_handle_t pcm_reader = NULL;
+    const bool probed = mp3_probe_file(file_path, &stream_info) == ESP_OK;
+    if (probed)
+    {
+        seek_index = mp3_seek_index_open(file_path, &stream_info);
+    }
+#if CONFIG_PLAYER_LOUDNESS
+    s_loudness.path = file_path;
+    loudness_start(sched);
+    loudness_apply(file_path);
+#endif
+
+#if CONFIG_PLAYER_PCM_CACHE
+    /* Needs the card, so it joins the pipeline after boot */
+    pcm_cache_cfg_t cache_cfg = PCM_CACHE_CFG_DEFAULT();
+    cache_cfg.dir = MOUNT_POINT "/PCMCACHE";
+    cache_cfg.sd_budget_kb = CONFIG_PLAYER_PCM_CACHE_SD_MB * 1024;
+    cache_cfg.psram_budget_kb = CONFIG_PLAYER_PCM_CACHE_PSRAM_KB;
+    cache_cfg.max_entries = CONFIG_PLAYER_PCM_CACHE_ENTRIES;
+    if (sched)
+    {
+        cache_cfg.task_core = sched->aux.core;
+        cache_cfg.task_prio = sched->aux.prio;
+    }
+    static track_route_t route;
+    route.pipeline = pipeline;
+    route.evt = evt;
+    route.cache = pcm_cache_init(&cache_cfg);
+    mem_assert(route.cache);
+    pcm_cache_stream_cfg_t pcm_cfg = PCM_CACHE_STREAM_CFG_DEFAULT();
+    if (s_boot.sd_tune.read_size)
+    {
+        pcm_cfg.read_size = s_boot.sd_tune.read_size;
+    }
+    if (sched)
+    {
+        SCHED_PROFILE_APPLY(pcm_cfg, sched->reader, ext_stack);
+    }
+    route.reader = pcm_cache_stream_init(route.cache, &pcm_cfg);
+    mem_assert(route.reader);
+    pcm_reader = route.reader;
+    audio_pipeline_register(pipeline, route.reader, "pcm");
+    pcm_cache_attach_decoder(route.cache, mp3_decoder);
+    memcpy(route.tags, link_tag, sizeof(link_tag[0]) * link_len);
+    route.tag_count = link_len;
+    track_route(&route, file_path, probed ? &stream_info : NULL);
+#endif
+
+#if CONFIG_PLAYER_LIBRARY
+    static media_library_entry_t now_playing;
+    if (media_library_find(library, file_path, &now_playing, NULL) == ESP_OK)
+    {
+        ESP_LOGI(TAG, "%s - %s, %u:%02u, %u kbps", now_playing.artist[0] ? now_playing.artist : "?",
+                 now_playing.title[0] ? now_playing.title : "?", (unsigned)(now_playing.duration_ms / 60000),
+                 (unsigned)(now_playing.duration_ms / 1000 % 60), (unsigned)now_playing.bitrate_kbps);
+    }
+#endif
+
     ESP_LOGI(TAG, "[ 3 ] Start audio_pipeline from SD: %s", file_path);
     audio_pipeline_run(pipeline);
+#endif
+
+    /* Printed once audio is on its way rather than on the boot path */
+    sdmmc_card_print_info(stdout, s_boot.card);
+
+#if CONFIG_PLAYER_ARENA
+    audio_arena_report();
+#endif
 
+#if CONFIG_PLAYER_CONTROL
+    player_t player = {
+        .pipeline = pipeline,
+        .state = PLAYER_PLAYING,
+        .volume = PLAYER_VOLUME_DEFAULT,
+#if CONFIG_PLAYER_GAPLESS_PLAYLIST
+        .gapless = gapless,
+        .playlist = &playlist,
+#else
+        .path = file_path,
+        .reader = file_stream,
+        .seek_index = seek_index,
+        .info = probed ? &stream_info : NULL,
+#if CONFIG_PLAYER_PCM_CACHE
+        .route = &route,
+#endif
+#endif
+    };
+    ESP_LOGI(TAG, "[ 4 ] Playing from SD, taking commands");
+#else
     ESP_LOGI(TAG, "[ 4 ] Playing from SD (wait for completion)");
+#endif
 
     while (1)
     {
@@ -174,26 +1589,324 @@ void app_main(void)
             continue;
         }
 
-        if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT &&
+#if CONFIG_PLAYER_CONTROL
+        /* Whatever woke us up, commands go first */
+        player_run_commands(&player, control);
+        if (msg.source_type == PLAYER_CONTROL_SOURCE_TYPE)
+        {
+            continue;
+        }
+#endif
+
+#if CONFIG_PLAYER_FRAME_GUARD
+        if (msg.source_type == MP3_FRAME_GUARD_SOURCE_TYPE)
+        {
+            const mp3_frame_guard_report_t *r = (const mp3_frame_guard_report_t *)msg.data;
+            if (r->truncated)
+            {
+                ESP_LOGW(TAG, "Stream cut short at %lld: %u bytes dropped", (long long)r->offset, (unsigned)r->skipped_bytes);
+                continue;
+            }
+            ESP_LOGW(TAG, "Damaged stream at %lld: skipped %u bytes (~%u frames), %u silent frames, next frame found in %u us",
+                     (long long)r->offset, (unsigned)r->skipped_bytes, (unsigned)r->skipped_frames,
+                     (unsigned)r->silent_frames, (unsigned)r->search_us);
+            continue;
+        }
+#endif
+
+#if CONFIG_PLAYER_TELEMETRY
+        if (msg.source_type == PIPELINE_TELEMETRY_SOURCE_TYPE)
+        {
+            const pipeline_telemetry_snapshot_t *s = (const pipeline_telemetry_snapshot_t *)msg.data;
+            ESP_LOGI(TAG, "SD %u B/s, decode %u us/frame (max %u, %u frames), i2s %u B/s, underruns %u (+%u), "
+                          "mp3 in %u/%u",
+                     (unsigned)s->read_bytes_per_s, (unsigned)s->decode_us_avg, (unsigned)s->decode_us_max,
+                     (unsigned)s->frames, (unsigned)s->pcm_bytes_per_s, (unsigned)s->i2s_underruns,
+                     (unsigned)s->i2s_underruns_new, (unsigned)s->elements[1].in_fill, (unsigned)s->elements[1].in_size);
+            if (s->elements[2].in_size)
+            {
+                ESP_LOGI(TAG, "i2s in %u/%u", (unsigned)s->elements[2].in_fill, (unsigned)s->elements[2].in_size);
+            }
+            audio_free(msg.data);
+            if (s_output.sink)
+            {
+                i2s_direct_sink_stats_t sink_stats;
+                i2s_direct_sink_get_stats(s_output.sink, &sink_stats);
+                ESP_LOGI(TAG, "I2S direct: %u DMA buffers sent, %u underruns, %d x %d frame buffers",
+                         (unsigned)sink_stats.dma_done, (unsigned)sink_stats.underruns, sink_stats.dma_desc_num,
+                         sink_stats.dma_frame_num);
+            }
+#if CONFIG_PLAYER_I2S_ADAPT
+            i2s_dma_adapt_stats_t adapt_stats;
+            if (i2s_dma_adapt_get_stats(s_output.dma_adapt, &adapt_stats) == ESP_OK)
+            {
+                const uint32_t *u = adapt_stats.period_underruns;
+                ESP_LOGI(TAG, "I2S DMA: %d x %d frames (%u us), pending %u frames, lead min %d frames, %u grows, "
+                              "%u shrinks, %u failed; underruns %u, last periods %u %u %u %u %u %u %u %u",
+                         adapt_stats.desc_num, adapt_stats.frame_num, (unsigned)adapt_stats.latency_us,
+                         (unsigned)adapt_stats.pending_frames, adapt_stats.lead_min_frames,
+                         (unsigned)adapt_stats.grows, (unsigned)adapt_stats.shrinks, (unsigned)adapt_stats.failed,
+                         (unsigned)adapt_stats.underruns, (unsigned)u[0], (unsigned)u[1], (unsigned)u[2],
+                         (unsigned)u[3], (unsigned)u[4], (unsigned)u[5], (unsigned)u[6], (unsigned)u[7]);
+                if (adapt_stats.change_count)
+                {
+                    const i2s_dma_adapt_change_t *c = &adapt_stats.changes[0];
+                    ESP_LOGI(TAG, "I2S DMA last resized at %u ms to %u x %u frames (%s)", (unsigned)c->uptime_ms,
+                             (unsigned)c->desc_num, (unsigned)c->frame_num, i2s_dma_adapt_reason_name(c->reason));
+                }
+            }
+#endif
+#if CONFIG_PLAYER_MIXER
+            pcm_mixer_stats_t mix_stats;
+            pcm_mixer_get_stats(s_output.mixer, &mix_stats);
+            ESP_LOGI(TAG, "Mixer: %llu frames out, %llu stream frames in, %u cycles per stream frame (%s sums)",
+                     (unsigned long long)mix_stats.frames, (unsigned long long)mix_stats.stream_frames,
+                     (unsigned)mix_stats.cycles_per_stream_frame, mix_stats.dsp_sum ? "esp-dsp" : "C");
+#endif
+#if CONFIG_PLAYER_PCM_CACHE
+            pcm_cache_stats_t cache_stats;
+            pcm_cache_get_stats(route.cache, &cache_stats);
+            ESP_LOGI(TAG, "PCM cache: %u hits, %u misses, %u tracks (%llu KB card, %llu KB PSRAM), decoder CPU saved %llu ms",
+                     (unsigned)cache_stats.hits, (unsigned)cache_stats.misses, (unsigned)cache_stats.entries,
+                     (unsigned long long)(cache_stats.sd_bytes / 1024), (unsigned long long)(cache_stats.psram_bytes / 1024),
+                     (unsigned long long)(cache_stats.decode_us_saved / 1000));
+#endif
+#if CONFIG_PLAYER_PROMPTS
+            prompt_player_stats_t prompt_stats;
+            if (prompt_player_get_stats(prompts, &prompt_stats) == ESP_OK && prompt_stats.played)
+            {
+                ESP_LOGI(TAG, "Prompts: %u played, trigger to first sample last %u us, avg %u us, max %u us",
+                         (unsigned)prompt_stats.played, (unsigned)prompt_stats.last_us,
+                         (unsigned)(prompt_stats.total_us / prompt_stats.played), (unsigned)prompt_stats.max_us);
+            }
+#endif
+#if CONFIG_PLAYER_CONTROL
+            for (int i = 0; i < PLAYER_CMD_MAX; i++)
+            {
+                player_control_stats_t ctl_stats;
+                player_control_get_stats(control, i, &ctl_stats);
+                if (ctl_stats.measured)
+                {
+                    ESP_LOGI(TAG, "Control %s: %u posted, %u dropped, %u failed, to effect last %u us, avg %u us, max %u us",
+                             player_control_cmd_name(i), (unsigned)ctl_stats.posted, (unsigned)ctl_stats.dropped,
+                             (unsigned)ctl_stats.failed, (unsigned)ctl_stats.last_us,
+                             (unsigned)(ctl_stats.total_us / ctl_stats.measured), (unsigned)ctl_stats.max_us);
+                }
+            }
+#endif
+#if CONFIG_PLAYER_FRAME_GUARD
+            mp3_frame_guard_stats_t guard_stats;
+            if (mp3_frame_guard_get_stats(guard, &guard_stats) == ESP_OK && guard_stats.resyncs)
+            {
+                ESP_LOGI(TAG, "Frame guard: %u resyncs, %u bytes (%u frames) skipped, %u silent frames, search max %u us",
+                         (unsigned)guard_stats.resyncs, (unsigned)guard_stats.skipped_bytes,
+                         (unsigned)guard_stats.skipped_frames, (unsigned)guard_stats.silent_frames,
+                         (unsigned)guard_stats.max_search_us);
+            }
+#endif
+#if CONFIG_PLAYER_LOUDNESS
+            pcm_gain_stats_t gain_stats;
+            pcm_gain_get_stats(s_loudness.gain, &gain_stats);
+            ESP_LOGI(TAG, "Loudness gain: %+.1f dB, %llu samples scaled (%llu esp-dsp, %llu limited), %u cycles per 1000",
+                     gain_stats.gain_db, (unsigned long long)gain_stats.samples,
+                     (unsigned long long)gain_stats.dsp_samples, (unsigned long long)gain_stats.limited_samples,
+                     (unsigned)gain_stats.cycles_per_ksample);
+            loudness_analyser_stats_t ld_stats;
+            if (s_loudness.analyser && loudness_analyser_get_stats(s_loudness.analyser, &ld_stats) == ESP_OK &&
+                ld_stats.analysing)
+            {
+                ESP_LOGI(TAG, "Loudness analysis: %u tracks stored, %u measured, %u tagged, %u failed, last at %u.%02ux "
+                              "real time, %u yields to playback",
+                         (unsigned)ld_stats.tracks, (unsigned)ld_stats.measured, (unsigned)ld_stats.tagged,
+                         (unsigned)ld_stats.failed, (unsigned)(ld_stats.last_speed / 100),
+                         (unsigned)(ld_stats.last_speed % 100), (unsigned)ld_stats.yields);
+            }
+#endif
+#if CONFIG_PLAYER_SPECTRUM
+            spectrum_tap_stats_t spec_stats;
+            spectrum_tap_frame_t spec;
+            spectrum_tap_get_stats(s_output.spectrum, &spec_stats);
+            if (spectrum_tap_get(s_output.spectrum, &spec) == ESP_OK)
+            {
+                ESP_LOGI(TAG, "Spectrum: %u frames, %u dropped, %u us each (max %u), %u.%u%% CPU, hook %u cycles/frame; "
+                              "peak %.1f dBFS, RMS %.1f dBFS",
+                         (unsigned)spec_stats.frames, (unsigned)spec_stats.dropped, (unsigned)spec_stats.analyse_us_avg,
+                         (unsigned)spec_stats.analyse_us_max, (unsigned)(spec_stats.load_permille / 10),
+                         (unsigned)(spec_stats.load_permille % 10), (unsigned)spec_stats.hook_cycles_per_frame,
+                         spec.peak_db[0], spec.rms_db[0]);
+            }
+#endif
+#if CONFIG_PLAYER_TRACE
+            trace_recorder_stats_t trace_stats;
+            if (trace && trace_recorder_get_stats(trace, &trace_stats) == ESP_OK)
+            {
+                ESP_LOGI(TAG, "Trace: %llu events, %u dropped, %u KB written, %u cycles per event, flush max %u us",
+                         (unsigned long long)trace_stats.events, (unsigned)trace_stats.dropped,
+                         (unsigned)(trace_stats.bytes / 1024), (unsigned)trace_stats.cycles_per_event,
+                         (unsigned)trace_stats.flush_us_max);
+            }
+#endif
+#if CONFIG_PLAYER_BUTTONS
+            button_input_stats_t btn_stats;
+            if (button_input_get_stats(buttons, &btn_stats) == ESP_OK && btn_stats.presses)
+            {
+                ESP_LOGI(TAG, "Buttons: %u presses, %u edges, interrupt to command last %u us, max %u us",
+                         (unsigned)btn_stats.presses, (unsigned)btn_stats.edges, (unsigned)btn_stats.last_us,
+                         (unsigned)btn_stats.max_us);
+            }
+#endif
+            continue;
+        }
+#endif
+
+        /* Damaged frames never reach the decoder; an element that still fails stops, so say which */
+        if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.cmd == AEL_MSG_CMD_REPORT_STATUS &&
+            (int)msg.data >= AEL_STATUS_ERROR_OPEN && (int)msg.data <= AEL_STATUS_ERROR_UNKNOWN)
+        {
+            ESP_LOGE(TAG, "[%s] stopped on error %d", audio_element_get_tag((audio_element_handle_t)msg.source), (int)msg.data);
+        }
+
+#if CONFIG_PLAYER_CROSSFADE
+        if (msg.source_type == CROSSFADE_PLAYER_SOURCE_TYPE)
+        {
+            if (msg.cmd == CROSSFADE_PLAYER_CMD_FINISHED)
+            {
+                ESP_LOGI(TAG, "Playlist finished");
+                break;
+            }
+            const crossfade_player_overlap_t *r = (const crossfade_player_overlap_t *)msg.data;
+            if (!r->faded)
+            {
+                ESP_LOGI(TAG, "Tracks played back to back");
+                continue;
+            }
+            ESP_LOGI(TAG, "Crossfade %u ms, decks overlapped %u ms: +%u KB internal (%u KB left), +%u KB PSRAM "
+                          "(%u KB left), decoders %u.%u%% of a core, CPU %u.%u%% busy",
+                     (unsigned)r->fade_ms, (unsigned)r->overlap_ms, (unsigned)(r->internal_bytes / 1024),
+                     (unsigned)(r->internal_free / 1024), (unsigned)(r->psram_bytes / 1024),
+                     (unsigned)(r->psram_free / 1024), (unsigned)(r->decoder_permille / 10),
+                     (unsigned)(r->decoder_permille % 10), (unsigned)(r->busy_permille / 10),
+                     (unsigned)(r->busy_permille % 10));
+            continue;
+        }
+#elif CONFIG_PLAYER_GAPLESS_PLAYLIST
+        if (gapless_player_handle_event(gapless, &msg))
+        {
+#if CONFIG_PLAYER_CONTROL
+            ESP_LOGI(TAG, "Playlist finished, waiting for play");
+            player.state = PLAYER_FINISHED;
+            continue;
+#else
+            ESP_LOGI(TAG, "Playlist finished");
+            break;
+#endif
+        }
+#else
+        /* The "pcm" reader of a cached track reports the format like the decoder */
+        if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO &&
+            (msg.source == (void *)mp3_decoder || msg.source == (void *)pcm_reader))
+        {
+            audio_element_info_t music_info = {0};
+            audio_element_getinfo((audio_element_handle_t)msg.source, &music_info);
+            track_set_format(music_info.sample_rates, music_info.bits, music_info.channels, &s_output);
+            continue;
+        }
+
+        /* The last element: everything before it, the decoder included, has finished too */
+        if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg.source == (void *)pcm_out &&
             msg.cmd == AEL_MSG_CMD_REPORT_STATUS &&
             (int)msg.data == AEL_STATUS_STATE_FINISHED)
         {
+#if CONFIG_PLAYER_PCM_CACHE
+            pcm_cache_record_finish(route.cache, true);
+#endif
+#if CONFIG_PLAYER_REPEAT
+            ESP_LOGI(TAG, "Playback finished, repeating");
+            pipeline_rewind(pipeline);
+#if CONFIG_PLAYER_LOUDNESS
+            loudness_apply(file_path);
+#endif
+#if CONFIG_PLAYER_PCM_CACHE
+            track_route(&route, file_path, probed ? &stream_info : NULL);
+#endif
+            audio_pipeline_run(pipeline);
+            continue;
+#elif CONFIG_PLAYER_CONTROL
+            ESP_LOGI(TAG, "Playback finished, waiting for play");
+            player.state = PLAYER_FINISHED;
+            continue;
+#else
             ESP_LOGI(TAG, "Playback finished");
             break;
+#endif
         }
+#endif
     }
 
     ESP_LOGI(TAG, "[ 5 ] Stopping pipeline");
+#if CONFIG_PLAYER_PROMPTS
+    /* First, so no prompt is left writing to the mixer or holding the sink */
+    prompt_player_deinit(prompts);
+#endif
+#if CONFIG_PLAYER_LOUDNESS
+    /* Off the card before it is unmounted */
+    loudness_analyser_deinit(s_loudness.analyser);
+    s_loudness.analyser = NULL;
+#endif
+#if CONFIG_PLAYER_CROSSFADE
+    /* Its decks write into the mixer: stop them while it still reads */
+    crossfade_player_deinit(crossfade);
+#endif
     audio_pipeline_stop(pipeline);
     audio_pipeline_wait_for_stop(pipeline);
+#if CONFIG_PLAYER_TRACE
+    /* Unhooks before the elements go; the file is closed before the card is unmounted */
+    trace_recorder_deinit(trace);
+#endif
+#if CONFIG_PLAYER_TELEMETRY
+    pipeline_telemetry_deinit(telemetry);
+#endif
+    spectrum_tap_deinit(s_output.spectrum);
+    i2s_dma_adapt_deinit(s_output.dma_adapt);
+#if CONFIG_PLAYER_BUTTONS
+    /* Before the queue it posts to */
+    button_input_deinit(buttons);
+#endif
+#if CONFIG_PLAYER_CONTROL
+    player_control_deinit(control);
+#endif
+    sched_monitor_deinit(s_output.monitor);
     audio_pipeline_terminate(pipeline);
     audio_pipeline_remove_listener(pipeline);
+#if CONFIG_PLAYER_FRAME_GUARD
+    mp3_frame_guard_deinit(guard);
+#endif
+#if CONFIG_PLAYER_LOUDNESS
+    pcm_gain_deinit(s_loudness.gain);
+#endif
     audio_event_iface_destroy(evt);
+#if CONFIG_PLAYER_CROSSFADE
+    /* Decks freed above */
+#elif CONFIG_PLAYER_GAPLESS_PLAYLIST
+    gapless_player_deinit(gapless);
+#else
+    mp3_seek_index_close(seek_index);
+#if CONFIG_PLAYER_PCM_CACHE
+    pcm_cache_deinit(route.cache);
+#endif
+#endif
+    i2s_direct_sink_deinit(s_output.sink);
+#if CONFIG_PLAYER_ARENA
+    /* Peaks survive the reset; the next pipeline starts from an empty arena. The board
+       and codec were allocated from the heap and stay up for it. */
+    audio_arena_report();
+    audio_arena_reset();
+#endif
 
     ESP_LOGI(TAG, "[ 6 ] Unmount SD card");
-    esp_vfs_fat_sdcard_unmount(MOUNT_POINT, card);
+    esp_vfs_fat_sdcard_unmount(MOUNT_POINT, s_boot.card);
 #if CONFIG_EXAMPLE_SD_PWR_CTRL_LDO_INTERNAL_IO
-    sd_pwr_ctrl_del_on_chip_ldo(host.pwr_ctrl_handle);
+    sd_pwr_ctrl_del_on_chip_ldo(s_boot.host.pwr_ctrl_handle);
 #endif
 
     ESP_LOGI(TAG, "[ 7 ] Done");
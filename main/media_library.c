@@ -0,0 +1,1072 @@
+/* Persistent index of the MP3 files on the card
+
+   Walking a card with thousands of tracks through FATFS takes seconds, and
+   opening every file for its duration and tags much longer, so a background
+   task does it once and writes the result to one index file. Later boots
+   open that file and only keep its header and a small fence table in RAM.
+
+   The index file:
+
+     header | fences | records | order | dirs | strings
+
+     - records: 48 bytes per track (path hash, string offsets, size and
+       mtime of the file, duration, bitrate, format), sorted by the 64-bit
+       FNV-1a hash of the path relative to the root;
+     - fences: the hash of the first record of each block of 64 records.
+       A lookup bisects the fences in RAM, reads that one block and bisects
+       it, so it costs O(log n) comparisons and a single read;
+     - order: record numbers in path order, for listing and for ranges such
+       as "everything below MUSIC/";
+     - dirs: each scanned directory with its mtime;
+     - strings: NUL-terminated UTF-8, offset 0 is the empty string.
+
+   A rescan starts from the previous index. A directory whose mtime did not
+   change keeps its tracks and subdirectories without being read; in a
+   directory that changed, only files whose size or mtime changed are
+   parsed again. Parsing is mp3_probe_file_tags(): ID3 text, Xing/VBRI and
+   the first frame header, no decoding. Hosts update a directory's mtime
+   when they add or remove entries; FATFS on the device does not, which is
+   fine as the player never writes music.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "mp3_parser.h"
+#include "media_library.h"
+
+static const char *TAG = "MEDIA_LIBRARY";
+
+#define LIB_MAGIC (0x42494C4D) /* "MLIB" */
+#define LIB_VERSION (1)
+#define LIB_BLOCK_RECORDS (64)
+#define LIB_TMP_EXT ".TMP"
+#define LIB_FNV_OFFSET (0xCBF29CE484222325ULL)
+#define LIB_FNV_PRIME (0x100000001B3ULL)
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_records;
+    uint32_t tracks;
+    uint32_t dirs;
+    uint32_t fences;
+    uint32_t records_offset;
+    uint32_t order_offset;
+    uint32_t dirs_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} lib_file_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t hash;
+    uint32_t path; /* String offsets */
+    uint32_t title;
+    uint32_t artist;
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t duration_ms;
+    uint32_t sample_rate;
+    uint32_t order; /* Position in path order */
+    uint16_t bitrate_kbps;
+    uint16_t dir;
+    uint8_t channels;
+    uint8_t reserved[3];
+} lib_record_t;
+
+_Static_assert(sizeof(lib_record_t) == 48, "index record layout changed");
+
+typedef struct __attribute__((packed))
+{
+    uint64_t hash;
+    uint32_t path;
+    uint32_t mtime; /* 0: always listed */
+} lib_dir_t;
+
+typedef enum
+{
+    LIB_CMD_SCAN = 0,
+    LIB_CMD_EXIT,
+} lib_cmd_t;
+
+struct media_library
+{
+    media_library_cfg_t cfg;
+    char root[MEDIA_LIBRARY_PATH_MAX];
+    char index_path[MEDIA_LIBRARY_PATH_MAX];
+    SemaphoreHandle_t lock; /* Everything below, and the index file */
+    SemaphoreHandle_t exited;
+    QueueHandle_t cmds;
+    volatile bool stop;
+    FILE *file;
+    lib_file_hdr_t hdr;
+    uint64_t *fences;
+    lib_record_t block[LIB_BLOCK_RECORDS];
+    int block_idx; /* Block in `block`, -1 for none */
+    media_library_stats_t stats;
+};
+
+/* Index being built, and the previous one it reuses from */
+typedef struct
+{
+    lib_record_t *recs;
+    int nrecs;
+    int cap_recs;
+    lib_dir_t *dirs;
+    int ndirs;
+    int cap_dirs;
+    char *strings;
+    uint32_t str_len;
+    uint32_t str_cap;
+    struct
+    {
+        uint32_t path;
+        int depth;
+    } *pending; /* Directories still to visit */
+    int npending;
+    int cap_pending;
+    bool truncated;
+
+    lib_file_hdr_t old_hdr;
+    lib_record_t *old_recs;
+    lib_dir_t *old_dirs;
+    char *old_strings;
+} lib_scan_t;
+
+static uint64_t path_hash(const char *s)
+{
+    uint64_t h = LIB_FNV_OFFSET;
+    while (*s)
+    {
+        h = (h ^ (uint8_t)*s++) * LIB_FNV_PRIME;
+    }
+    return h;
+}
+
+/* Path relative to the root, NULL if `path` is not below it */
+static const char *path_rel(media_library_handle_t lib, const char *path)
+{
+    const size_t n = strlen(lib->root);
+    if (strncmp(path, lib->root, n) != 0 || path[n] != '/')
+    {
+        return NULL;
+    }
+    return path + n + 1;
+}
+
+/* ---- Reading the index in use ---- */
+
+static bool read_at(media_library_handle_t lib, uint32_t offset, void *buf, size_t len)
+{
+    return fseek(lib->file, offset, SEEK_SET) == 0 && fread(buf, 1, len, lib->file) == len;
+}
+
+static bool read_string(media_library_handle_t lib, uint32_t offset, char *out, size_t size)
+{
+    out[0] = '\0';
+    if (offset >= lib->hdr.strings_size)
+    {
+        return false;
+    }
+    size_t len = lib->hdr.strings_size - offset;
+    len = len < size - 1 ? len : size - 1;
+    if (fseek(lib->file, lib->hdr.strings_offset + offset, SEEK_SET) != 0)
+    {
+        return false;
+    }
+    len = fread(out, 1, len, lib->file);
+    out[len] = '\0';
+    return true;
+}
+
+static const lib_record_t *read_block(media_library_handle_t lib, int block, int *count)
+{
+    const int first = block * LIB_BLOCK_RECORDS;
+    const int n = (int)lib->hdr.tracks - first < LIB_BLOCK_RECORDS ? (int)lib->hdr.tracks - first : LIB_BLOCK_RECORDS;
+    if (block != lib->block_idx)
+    {
+        lib->block_idx = -1;
+        if (!read_at(lib, lib->hdr.records_offset + first * sizeof(lib_record_t), lib->block, n * sizeof(lib_record_t)))
+        {
+            return NULL;
+        }
+        lib->block_idx = block;
+    }
+    *count = n;
+    return lib->block;
+}
+
+static bool read_record(media_library_handle_t lib, uint32_t idx, lib_record_t *rec)
+{
+    int n;
+    const lib_record_t *block = read_block(lib, idx / LIB_BLOCK_RECORDS, &n);
+    if (block == NULL)
+    {
+        return false;
+    }
+    *rec = block[idx % LIB_BLOCK_RECORDS];
+    return true;
+}
+
+static bool read_ordered(media_library_handle_t lib, int n, lib_record_t *rec)
+{
+    uint32_t idx;
+    return read_at(lib, lib->hdr.order_offset + n * sizeof(uint32_t), &idx, sizeof(idx)) && idx < lib->hdr.tracks &&
+           read_record(lib, idx, rec);
+}
+
+static bool fill_entry(media_library_handle_t lib, const lib_record_t *rec, media_library_entry_t *entry)
+{
+    const int n = snprintf(entry->path, sizeof(entry->path), "%s/", lib->root);
+    if (!read_string(lib, rec->path, entry->path + n, sizeof(entry->path) - n) ||
+        !read_string(lib, rec->title, entry->title, sizeof(entry->title)) ||
+        !read_string(lib, rec->artist, entry->artist, sizeof(entry->artist)))
+    {
+        return false;
+    }
+    entry->duration_ms = rec->duration_ms;
+    entry->bitrate_kbps = rec->bitrate_kbps;
+    entry->sample_rate = rec->sample_rate;
+    entry->channels = rec->channels;
+    entry->size = rec->size;
+    return true;
+}
+
+static void index_close(media_library_handle_t lib)
+{
+    if (lib->file)
+    {
+        fclose(lib->file);
+        lib->file = NULL;
+    }
+    audio_free(lib->fences);
+    lib->fences = NULL;
+    memset(&lib->hdr, 0, sizeof(lib->hdr));
+    lib->block_idx = -1;
+    lib->stats.tracks = 0;
+    lib->stats.dirs = 0;
+}
+
+static bool hdr_valid(const lib_file_hdr_t *hdr, long file_size)
+{
+    const uint64_t fences = (hdr->tracks + LIB_BLOCK_RECORDS - 1) / LIB_BLOCK_RECORDS;
+    return hdr->magic == LIB_MAGIC && hdr->version == LIB_VERSION && hdr->block_records == LIB_BLOCK_RECORDS &&
+           hdr->fences == fences && hdr->strings_size > 0 &&
+           (uint64_t)hdr->strings_offset + hdr->strings_size == (uint64_t)file_size;
+}
+
+/* Make the index file the one in use; called with the lock held */
+static bool index_open(media_library_handle_t lib)
+{
+    index_close(lib);
+    FILE *f = fopen(lib->index_path, "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+    lib_file_hdr_t hdr;
+    bool ok = fread(&hdr, 1, sizeof(hdr), f) == sizeof(hdr) && fseek(f, 0, SEEK_END) == 0 && hdr_valid(&hdr, ftell(f));
+    uint64_t *fences = NULL;
+    if (ok && hdr.fences)
+    {
+        fences = audio_malloc(hdr.fences * sizeof(uint64_t));
+        ok = fences && fseek(f, sizeof(hdr), SEEK_SET) == 0 &&
+             fread(fences, sizeof(uint64_t), hdr.fences, f) == hdr.fences;
+    }
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Ignoring invalid index %s", lib->index_path);
+        audio_free(fences);
+        fclose(f);
+        return false;
+    }
+    lib->file = f;
+    lib->hdr = hdr;
+    lib->fences = fences;
+    lib->stats.tracks = hdr.tracks;
+    lib->stats.dirs = hdr.dirs;
+    return true;
+}
+
+/* ---- Scanning ---- */
+
+static uint32_t scan_string(lib_scan_t *s, const char *str)
+{
+    if (str[0] == '\0')
+    {
+        return 0;
+    }
+    const uint32_t len = strlen(str) + 1;
+    if (s->str_len + len > s->str_cap)
+    {
+        uint32_t cap = s->str_cap * 2;
+        while (cap < s->str_len + len)
+        {
+            cap *= 2;
+        }
+        char *grown = audio_realloc(s->strings, cap);
+        if (grown == NULL)
+        {
+            return UINT32_MAX;
+        }
+        s->strings = grown;
+        s->str_cap = cap;
+    }
+    const uint32_t off = s->str_len;
+    memcpy(s->strings + off, str, len);
+    s->str_len += len;
+    return off;
+}
+
+/* Make room for one more element of a growing array */
+static bool scan_grow(void **arr, int count, int *cap, size_t elem)
+{
+    if (count < *cap)
+    {
+        return true;
+    }
+    const int n = *cap ? *cap * 2 : 64;
+    void *grown = audio_realloc(*arr, n * elem);
+    if (grown == NULL)
+    {
+        return false;
+    }
+    *arr = grown;
+    *cap = n;
+    return true;
+}
+
+static bool scan_push_dir(lib_scan_t *s, const char *rel, int depth)
+{
+    const uint32_t path = scan_string(s, rel);
+    if (path == UINT32_MAX || !scan_grow((void **)&s->pending, s->npending, &s->cap_pending, sizeof(*s->pending)))
+    {
+        return false;
+    }
+    s->pending[s->npending].path = path;
+    s->pending[s->npending].depth = depth;
+    s->npending++;
+    return true;
+}
+
+static const char *old_string(const lib_scan_t *s, uint32_t off)
+{
+    return off < s->old_hdr.strings_size ? s->old_strings + off : "";
+}
+
+/* Load the whole previous index for reuse; an invalid or missing one just means a full scan */
+static void scan_load_old(media_library_handle_t lib, lib_scan_t *s)
+{
+    FILE *f = fopen(lib->index_path, "rb");
+    if (f == NULL)
+    {
+        return;
+    }
+    lib_file_hdr_t hdr;
+    bool ok = fread(&hdr, 1, sizeof(hdr), f) == sizeof(hdr) && fseek(f, 0, SEEK_END) == 0 && hdr_valid(&hdr, ftell(f));
+    if (ok)
+    {
+        s->old_recs = audio_malloc(hdr.tracks * sizeof(lib_record_t) + 1);
+        s->old_dirs = audio_malloc(hdr.dirs * sizeof(lib_dir_t) + 1);
+        s->old_strings = audio_malloc(hdr.strings_size + 1);
+        ok = s->old_recs && s->old_dirs && s->old_strings && fseek(f, hdr.records_offset, SEEK_SET) == 0 &&
+             fread(s->old_recs, sizeof(lib_record_t), hdr.tracks, f) == hdr.tracks &&
+             fseek(f, hdr.dirs_offset, SEEK_SET) == 0 && fread(s->old_dirs, sizeof(lib_dir_t), hdr.dirs, f) == hdr.dirs &&
+             fseek(f, hdr.strings_offset, SEEK_SET) == 0 &&
+             fread(s->old_strings, 1, hdr.strings_size, f) == hdr.strings_size;
+    }
+    fclose(f);
+    if (!ok)
+    {
+        audio_free(s->old_recs);
+        audio_free(s->old_dirs);
+        audio_free(s->old_strings);
+        s->old_recs = NULL;
+        s->old_dirs = NULL;
+        s->old_strings = NULL;
+        return;
+    }
+    s->old_strings[hdr.strings_size] = '\0';
+    s->old_hdr = hdr;
+}
+
+static const lib_record_t *old_find(const lib_scan_t *s, uint64_t hash, const char *rel)
+{
+    int lo = 0;
+    int hi = (int)s->old_hdr.tracks;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (s->old_recs[mid].hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    for (; lo < (int)s->old_hdr.tracks && s->old_recs[lo].hash == hash; lo++)
+    {
+        if (strcmp(old_string(s, s->old_recs[lo].path), rel) == 0)
+        {
+            return &s->old_recs[lo];
+        }
+    }
+    return NULL;
+}
+
+/* Copy a record of the previous index, with its strings */
+static bool scan_reuse(lib_scan_t *s, const lib_record_t *old, uint16_t dir)
+{
+    if (!scan_grow((void **)&s->recs, s->nrecs, &s->cap_recs, sizeof(lib_record_t)))
+    {
+        return false;
+    }
+    lib_record_t rec = *old;
+    rec.path = scan_string(s, old_string(s, old->path));
+    rec.title = scan_string(s, old_string(s, old->title));
+    rec.artist = scan_string(s, old_string(s, old->artist));
+    rec.dir = dir;
+    if (rec.path == UINT32_MAX || rec.title == UINT32_MAX || rec.artist == UINT32_MAX)
+    {
+        return false;
+    }
+    s->recs[s->nrecs++] = rec;
+    return true;
+}
+
+static bool scan_probe(lib_scan_t *s, const char *full, const char *rel, const struct stat *st, uint16_t dir)
+{
+    mp3_stream_info_t info;
+    mp3_tag_text_t text;
+    if (mp3_probe_file_tags(full, &info, &text) != ESP_OK || info.header.sample_rate == 0)
+    {
+        return true; /* Not playable, not indexed */
+    }
+    if (!scan_grow((void **)&s->recs, s->nrecs, &s->cap_recs, sizeof(lib_record_t)))
+    {
+        return false;
+    }
+    lib_record_t rec = {
+        .hash = path_hash(rel),
+        .path = scan_string(s, rel),
+        .title = scan_string(s, text.title),
+        .artist = scan_string(s, text.artist),
+        .size = (uint32_t)st->st_size,
+        .mtime = (uint32_t)st->st_mtime,
+        .sample_rate = info.header.sample_rate,
+        .dir = dir,
+        .channels = info.header.channels,
+    };
+    if (rec.path == UINT32_MAX || rec.title == UINT32_MAX || rec.artist == UINT32_MAX)
+    {
+        return false;
+    }
+    const uint64_t audio_bytes = info.audio_end > info.audio_start ? info.audio_end - info.audio_start : 0;
+    if (info.total_samples)
+    {
+        rec.duration_ms = (uint32_t)(info.total_samples * 1000 / info.header.sample_rate);
+        rec.bitrate_kbps = rec.duration_ms ? (uint16_t)(audio_bytes * 8 / rec.duration_ms) : 0;
+    }
+    else if (info.header.bitrate_kbps)
+    {
+        /* CBR without a Xing frame: bytes * 8 / kbps is milliseconds */
+        rec.bitrate_kbps = info.header.bitrate_kbps;
+        rec.duration_ms = (uint32_t)(audio_bytes * 8 / info.header.bitrate_kbps);
+    }
+    s->recs[s->nrecs++] = rec;
+    return true;
+}
+
+static bool is_mp3(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && strcasecmp(ext, ".mp3") == 0;
+}
+
+/* Visit one directory: take it from the previous index if unchanged, list it otherwise */
+static bool scan_dir(media_library_handle_t lib, lib_scan_t *s, const char *rel, uint32_t rel_off, int depth)
+{
+    char full[MEDIA_LIBRARY_PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s%s", lib->root, rel[0] ? "/" : "", rel);
+    struct stat st;
+    /* The root has no directory entry, hence no mtime */
+    const uint32_t mtime = rel[0] && stat(full, &st) == 0 ? (uint32_t)st.st_mtime : 0;
+    if (s->ndirs >= UINT16_MAX || !scan_grow((void **)&s->dirs, s->ndirs, &s->cap_dirs, sizeof(lib_dir_t)))
+    {
+        return false;
+    }
+    const uint16_t dir = s->ndirs++;
+    const uint64_t hash = path_hash(rel);
+    s->dirs[dir] = (lib_dir_t){.hash = hash, .path = rel_off, .mtime = mtime};
+
+    int old = -1;
+    for (int i = 0; i < (int)s->old_hdr.dirs && old < 0; i++)
+    {
+        if (s->old_dirs[i].hash == hash && strcmp(old_string(s, s->old_dirs[i].path), rel) == 0)
+        {
+            old = i;
+        }
+    }
+
+    if (old >= 0 && mtime && s->old_dirs[old].mtime == mtime)
+    {
+        for (int i = 0; i < (int)s->old_hdr.tracks; i++)
+        {
+            if (s->old_recs[i].dir == old && !s->truncated)
+            {
+                if (s->nrecs >= lib->cfg.max_tracks)
+                {
+                    s->truncated = true;
+                    break;
+                }
+                if (!scan_reuse(s, &s->old_recs[i], dir))
+                {
+                    return false;
+                }
+                lib->stats.reused++;
+            }
+        }
+        const size_t rel_len = strlen(rel);
+        for (int i = 0; i < (int)s->old_hdr.dirs && depth < lib->cfg.max_depth; i++)
+        {
+            /* Direct children: "<rel>/<name>", or "<name>" below the root */
+            const char *p = old_string(s, s->old_dirs[i].path);
+            const char *name = rel_len ? (strncmp(p, rel, rel_len) == 0 && p[rel_len] == '/' ? p + rel_len + 1 : NULL) : p;
+            if (name && name[0] && strchr(name, '/') == NULL && !scan_push_dir(s, p, depth + 1))
+            {
+                return false;
+            }
+        }
+        lib->stats.dirs_skipped++;
+        return true;
+    }
+
+    DIR *d = opendir(full);
+    if (d == NULL)
+    {
+        ESP_LOGW(TAG, "Cannot open %s", full);
+        return true;
+    }
+    lib->stats.dirs_listed++;
+    bool ok = true;
+    char child_rel[MEDIA_LIBRARY_PATH_MAX];
+    char child[MEDIA_LIBRARY_PATH_MAX];
+    struct dirent *ent;
+    while (ok && !lib->stop && (ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.' ||
+            snprintf(child_rel, sizeof(child_rel), "%s%s%s", rel, rel[0] ? "/" : "", ent->d_name) >= (int)sizeof(child_rel) ||
+            snprintf(child, sizeof(child), "%s/%s", lib->root, child_rel) >= (int)sizeof(child))
+        {
+            continue;
+        }
+        if (ent->d_type == DT_DIR)
+        {
+            if (depth < lib->cfg.max_depth)
+            {
+                ok = scan_push_dir(s, child_rel, depth + 1);
+            }
+            continue;
+        }
+        if (!is_mp3(ent->d_name) || s->truncated || stat(child, &st) != 0)
+        {
+            continue;
+        }
+        if (s->nrecs >= lib->cfg.max_tracks)
+        {
+            s->truncated = true;
+            continue;
+        }
+        const lib_record_t *prev = s->old_recs ? old_find(s, path_hash(child_rel), child_rel) : NULL;
+        if (prev && prev->size == (uint32_t)st.st_size && prev->mtime == (uint32_t)st.st_mtime)
+        {
+            ok = scan_reuse(s, prev, dir);
+            lib->stats.reused++;
+        }
+        else
+        {
+            ok = scan_probe(s, child, child_rel, &st, dir);
+            lib->stats.probed++;
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+typedef struct
+{
+    const char *path;
+    int rec;
+} lib_sort_path_t;
+
+static int sort_by_path(const void *a, const void *b)
+{
+    return strcmp(((const lib_sort_path_t *)a)->path, ((const lib_sort_path_t *)b)->path);
+}
+
+static int sort_by_hash(const void *a, const void *b)
+{
+    const uint64_t ha = ((const lib_record_t *)a)->hash;
+    const uint64_t hb = ((const lib_record_t *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+static bool scan_write(media_library_handle_t lib, lib_scan_t *s, const char *tmp)
+{
+    /* Path order first, as it needs the record numbers before the hash sort moves them */
+    lib_sort_path_t *by_path = audio_malloc(s->nrecs * sizeof(lib_sort_path_t) + 1);
+    uint32_t *order = audio_malloc(s->nrecs * sizeof(uint32_t) + 1);
+    const uint32_t fences = (s->nrecs + LIB_BLOCK_RECORDS - 1) / LIB_BLOCK_RECORDS;
+    uint64_t *fence = audio_malloc(fences * sizeof(uint64_t) + 1);
+    FILE *f = NULL;
+    bool ok = by_path && order && fence;
+    if (ok)
+    {
+        for (int i = 0; i < s->nrecs; i++)
+        {
+            by_path[i].path = s->strings + s->recs[i].path;
+            by_path[i].rec = i;
+        }
+        qsort(by_path, s->nrecs, sizeof(lib_sort_path_t), sort_by_path);
+        for (int i = 0; i < s->nrecs; i++)
+        {
+            s->recs[by_path[i].rec].order = i;
+        }
+        qsort(s->recs, s->nrecs, sizeof(lib_record_t), sort_by_hash);
+        for (int i = 0; i < s->nrecs; i++)
+        {
+            order[s->recs[i].order] = i;
+        }
+        for (uint32_t i = 0; i < fences; i++)
+        {
+            fence[i] = s->recs[i * LIB_BLOCK_RECORDS].hash;
+        }
+
+        lib_file_hdr_t hdr = {
+            .magic = LIB_MAGIC,
+            .version = LIB_VERSION,
+            .block_records = LIB_BLOCK_RECORDS,
+            .tracks = s->nrecs,
+            .dirs = s->ndirs,
+            .fences = fences,
+        };
+        hdr.records_offset = sizeof(hdr) + fences * sizeof(uint64_t);
+        hdr.order_offset = hdr.records_offset + s->nrecs * sizeof(lib_record_t);
+        hdr.dirs_offset = hdr.order_offset + s->nrecs * sizeof(uint32_t);
+        hdr.strings_offset = hdr.dirs_offset + s->ndirs * sizeof(lib_dir_t);
+        hdr.strings_size = s->str_len;
+
+        f = fopen(tmp, "wb");
+        ok = f && fwrite(&hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+             fwrite(fence, sizeof(uint64_t), fences, f) == fences &&
+             fwrite(s->recs, sizeof(lib_record_t), s->nrecs, f) == (size_t)s->nrecs &&
+             fwrite(order, sizeof(uint32_t), s->nrecs, f) == (size_t)s->nrecs &&
+             fwrite(s->dirs, sizeof(lib_dir_t), s->ndirs, f) == (size_t)s->ndirs &&
+             fwrite(s->strings, 1, s->str_len, f) == s->str_len;
+    }
+    if (f && fclose(f) != 0)
+    {
+        ok = false;
+    }
+    audio_free(by_path);
+    audio_free(order);
+    audio_free(fence);
+    return ok;
+}
+
+static void scan_free(lib_scan_t *s)
+{
+    audio_free(s->recs);
+    audio_free(s->dirs);
+    audio_free(s->strings);
+    audio_free(s->pending);
+    audio_free(s->old_recs);
+    audio_free(s->old_dirs);
+    audio_free(s->old_strings);
+}
+
+static void scan(media_library_handle_t lib)
+{
+    const int64_t t0 = esp_timer_get_time();
+    lib_scan_t s = {0};
+    char rel[MEDIA_LIBRARY_PATH_MAX];
+    char tmp[MEDIA_LIBRARY_PATH_MAX + sizeof(LIB_TMP_EXT)];
+    bool ok = false;
+
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    lib->stats.scanning = true;
+    lib->stats.probed = 0;
+    lib->stats.reused = 0;
+    lib->stats.dirs_listed = 0;
+    lib->stats.dirs_skipped = 0;
+    xSemaphoreGive(lib->lock);
+
+    scan_load_old(lib, &s);
+    s.str_cap = 4096;
+    s.strings = audio_malloc(s.str_cap);
+    AUDIO_MEM_CHECK(TAG, s.strings, goto _exit);
+    s.strings[0] = '\0';
+    s.str_len = 1;
+    if (!scan_push_dir(&s, "", 0))
+    {
+        goto _exit;
+    }
+    while (s.npending > 0 && !lib->stop)
+    {
+        s.npending--;
+        const uint32_t off = s.pending[s.npending].path;
+        const int depth = s.pending[s.npending].depth;
+        /* The table may move while the directory is scanned */
+        strlcpy(rel, s.strings + off, sizeof(rel));
+        if (!scan_dir(lib, &s, rel, off, depth))
+        {
+            ESP_LOGE(TAG, "Out of memory after %d tracks", s.nrecs);
+            goto _exit;
+        }
+    }
+    if (lib->stop)
+    {
+        goto _exit;
+    }
+    if (s.truncated)
+    {
+        ESP_LOGW(TAG, "More than %d tracks, the rest is not indexed", lib->cfg.max_tracks);
+    }
+
+    /* Replaces the index in use; "<name>.TMP" next to it until complete */
+    snprintf(tmp, sizeof(tmp), "%s", lib->index_path);
+    char *ext = strrchr(tmp, '.');
+    strcpy(ext && !strchr(ext, '/') ? ext : tmp + strlen(tmp), LIB_TMP_EXT);
+    ok = scan_write(lib, &s, tmp);
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    if (ok)
+    {
+        index_close(lib);
+        /* FATFS rename does not replace an existing file */
+        unlink(lib->index_path);
+        ok = rename(tmp, lib->index_path) == 0 && index_open(lib);
+    }
+    if (!ok)
+    {
+        unlink(tmp);
+        ESP_LOGE(TAG, "Failed to write %s", lib->index_path);
+        index_open(lib);
+    }
+    xSemaphoreGive(lib->lock);
+
+_exit:
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    lib->stats.scanning = false;
+    lib->stats.scan_ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+    if (ok)
+    {
+        lib->stats.scans++;
+    }
+    xSemaphoreGive(lib->lock);
+    if (ok)
+    {
+        ESP_LOGI(TAG, "%d tracks in %d directories, %u parsed, %u reused, %u directories unchanged, %u ms", s.nrecs,
+                 s.ndirs, (unsigned)lib->stats.probed, (unsigned)lib->stats.reused, (unsigned)lib->stats.dirs_skipped,
+                 (unsigned)lib->stats.scan_ms);
+    }
+    scan_free(&s);
+    if (ok && lib->cfg.on_update)
+    {
+        lib->cfg.on_update(lib->cfg.ctx);
+    }
+}
+
+static void _scan_task(void *arg)
+{
+    media_library_handle_t lib = (media_library_handle_t)arg;
+    lib_cmd_t cmd;
+    while (xQueueReceive(lib->cmds, &cmd, portMAX_DELAY) == pdTRUE && cmd != LIB_CMD_EXIT)
+    {
+        scan(lib);
+    }
+    xSemaphoreGive(lib->exited);
+    vTaskDelete(NULL);
+}
+
+/* ---- API ---- */
+
+media_library_handle_t media_library_init(const media_library_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->root && cfg->index_path && cfg->max_tracks > 0, return NULL);
+
+    media_library_handle_t lib = audio_calloc(1, sizeof(struct media_library));
+    AUDIO_MEM_CHECK(TAG, lib, return NULL);
+    lib->cfg = *cfg;
+    strlcpy(lib->root, cfg->root, sizeof(lib->root));
+    strlcpy(lib->index_path, cfg->index_path, sizeof(lib->index_path));
+    lib->cfg.root = lib->root;
+    lib->cfg.index_path = lib->index_path;
+    lib->block_idx = -1;
+    lib->lock = xSemaphoreCreateMutex();
+    lib->exited = xSemaphoreCreateBinary();
+    lib->cmds = xQueueCreate(2, sizeof(lib_cmd_t));
+    AUDIO_MEM_CHECK(TAG, lib->lock && lib->exited && lib->cmds, goto _fail);
+
+    if (index_open(lib))
+    {
+        ESP_LOGI(TAG, "%u tracks in %s", (unsigned)lib->hdr.tracks, lib->index_path);
+    }
+    if (xTaskCreatePinnedToCore(_scan_task, "media_lib", cfg->task_stack, lib, cfg->task_prio, NULL, cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the scan task");
+        goto _fail;
+    }
+    media_library_rescan(lib);
+    return lib;
+
+_fail:
+    index_close(lib);
+    if (lib->cmds)
+    {
+        vQueueDelete(lib->cmds);
+    }
+    if (lib->exited)
+    {
+        vSemaphoreDelete(lib->exited);
+    }
+    if (lib->lock)
+    {
+        vSemaphoreDelete(lib->lock);
+    }
+    audio_free(lib);
+    return NULL;
+}
+
+esp_err_t media_library_rescan(media_library_handle_t lib)
+{
+    AUDIO_NULL_CHECK(TAG, lib, return ESP_ERR_INVALID_ARG);
+    const lib_cmd_t cmd = LIB_CMD_SCAN;
+    /* One queued behind a running scan is enough */
+    xQueueSend(lib->cmds, &cmd, 0);
+    return ESP_OK;
+}
+
+int media_library_count(media_library_handle_t lib)
+{
+    if (lib == NULL)
+    {
+        return 0;
+    }
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    const int n = lib->file ? (int)lib->hdr.tracks : 0;
+    xSemaphoreGive(lib->lock);
+    return n;
+}
+
+esp_err_t media_library_get(media_library_handle_t lib, int n, media_library_entry_t *entry)
+{
+    if (!lib || !entry)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    if (lib->file && n >= 0 && n < (int)lib->hdr.tracks)
+    {
+        lib_record_t rec;
+        ret = read_ordered(lib, n, &rec) && fill_entry(lib, &rec, entry) ? ESP_OK : ESP_FAIL;
+    }
+    xSemaphoreGive(lib->lock);
+    return ret;
+}
+
+esp_err_t media_library_find(media_library_handle_t lib, const char *path, media_library_entry_t *entry, int *n)
+{
+    if (!lib || !path)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const char *rel = path_rel(lib, path);
+    if (rel == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const uint64_t hash = path_hash(rel);
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    if (lib->file == NULL || lib->hdr.fences == 0 || hash < lib->fences[0])
+    {
+        goto _exit;
+    }
+    /* Last block starting at or below the hash */
+    int lo = 0;
+    int hi = lib->hdr.fences;
+    while (hi - lo > 1)
+    {
+        const int mid = (lo + hi) / 2;
+        if (lib->fences[mid] <= hash)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    int count;
+    const lib_record_t *block = read_block(lib, lo, &count);
+    if (block == NULL)
+    {
+        ret = ESP_FAIL;
+        goto _exit;
+    }
+    int i = 0;
+    int j = count;
+    while (i < j)
+    {
+        const int mid = (i + j) / 2;
+        if (block[mid].hash < hash)
+        {
+            i = mid + 1;
+        }
+        else
+        {
+            j = mid;
+        }
+    }
+    if (i == count || block[i].hash != hash)
+    {
+        goto _exit;
+    }
+    /* The block buffer is reused by the string reads below */
+    const lib_record_t rec = block[i];
+    char stored[MEDIA_LIBRARY_PATH_MAX];
+    if (!read_string(lib, rec.path, stored, sizeof(stored)))
+    {
+        ret = ESP_FAIL;
+        goto _exit;
+    }
+    if (strcmp(stored, rel) != 0)
+    {
+        goto _exit;
+    }
+    if (entry && !fill_entry(lib, &rec, entry))
+    {
+        ret = ESP_FAIL;
+        goto _exit;
+    }
+    if (n)
+    {
+        *n = rec.order;
+    }
+    ret = ESP_OK;
+
+_exit:
+    xSemaphoreGive(lib->lock);
+    return ret;
+}
+
+/* Bisect the path order for the first track whose path compares >= (or >, when `after`) the prefix */
+static int bound(media_library_handle_t lib, const char *prefix, bool after, bool *failed)
+{
+    const size_t len = strlen(prefix);
+    char path[MEDIA_LIBRARY_PATH_MAX];
+    int lo = 0;
+    int hi = lib->hdr.tracks;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        lib_record_t rec;
+        if (!read_ordered(lib, mid, &rec) || !read_string(lib, rec.path, path, sizeof(path)))
+        {
+            *failed = true;
+            return 0;
+        }
+        const int c = strncmp(path, prefix, len);
+        if (c < 0 || (after && c == 0))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+esp_err_t media_library_range(media_library_handle_t lib, const char *prefix, int *first, int *count)
+{
+    if (!lib || !prefix || !first || !count)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *first = 0;
+    *count = 0;
+    /* The root itself, with or without the slash, matches everything */
+    const char *rel = path_rel(lib, prefix);
+    if (rel == NULL && strncmp(prefix, lib->root, strlen(prefix)) == 0)
+    {
+        rel = "";
+    }
+    if (rel == NULL)
+    {
+        return ESP_OK;
+    }
+    bool failed = false;
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    if (lib->file)
+    {
+        *first = bound(lib, rel, false, &failed);
+        *count = bound(lib, rel, true, &failed) - *first;
+    }
+    xSemaphoreGive(lib->lock);
+    return failed ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t media_library_get_stats(media_library_handle_t lib, media_library_stats_t *stats)
+{
+    if (!lib || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(lib->lock, portMAX_DELAY);
+    *stats = lib->stats;
+    xSemaphoreGive(lib->lock);
+    return ESP_OK;
+}
+
+void media_library_deinit(media_library_handle_t lib)
+{
+    if (lib == NULL)
+    {
+        return;
+    }
+    lib->stop = true;
+    const lib_cmd_t cmd = LIB_CMD_EXIT;
+    xQueueReset(lib->cmds);
+    xQueueSend(lib->cmds, &cmd, portMAX_DELAY);
+    xSemaphoreTake(lib->exited, portMAX_DELAY);
+    index_close(lib);
+    vQueueDelete(lib->cmds);
+    vSemaphoreDelete(lib->exited);
+    vSemaphoreDelete(lib->lock);
+    audio_free(lib);
+}
@@ -0,0 +1,153 @@
+/* Persistent index of the MP3 files on the card
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __MEDIA_LIBRARY_H__
+#define __MEDIA_LIBRARY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mp3_parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MEDIA_LIBRARY_PATH_MAX (256)
+
+    /**
+     * @brief Library configuration
+     */
+    typedef struct
+    {
+        const char *root;             /*!< Directory scanned, recursively */
+        const char *index_path;       /*!< Index file, normally on the card it describes */
+        int max_tracks;               /*!< Tracks indexed at most; the scan stops adding beyond this */
+        int max_depth;                /*!< Directory levels below `root` that are scanned */
+        void (*on_update)(void *ctx); /*!< Called from the scan task once a new index is in use, may be NULL */
+        void *ctx;                    /*!< Passed to `on_update` */
+        int task_stack;               /*!< Stack of the scan task */
+        int task_core;                /*!< Its core */
+        int task_prio;                /*!< Its priority, below everything that plays audio */
+    } media_library_cfg_t;
+
+#define MEDIA_LIBRARY_TASK_STACK (6144)
+#define MEDIA_LIBRARY_TASK_CORE (0)
+#define MEDIA_LIBRARY_TASK_PRIO (1)
+
+#define MEDIA_LIBRARY_CFG_DEFAULT()             \
+    {                                           \
+        .root = "/sdcard",                      \
+        .index_path = "/sdcard/LIBRARY.IDX",    \
+        .max_tracks = 8192,                     \
+        .max_depth = 8,                         \
+        .on_update = NULL,                      \
+        .ctx = NULL,                            \
+        .task_stack = MEDIA_LIBRARY_TASK_STACK, \
+        .task_core = MEDIA_LIBRARY_TASK_CORE,   \
+        .task_prio = MEDIA_LIBRARY_TASK_PRIO,   \
+    }
+
+    /**
+     * @brief One indexed track
+     */
+    typedef struct
+    {
+        char path[MEDIA_LIBRARY_PATH_MAX]; /*!< Full path */
+        char title[MP3_TAG_TEXT_SIZE];     /*!< From ID3, empty if none */
+        char artist[MP3_TAG_TEXT_SIZE];    /*!< From ID3, empty if none */
+        uint32_t duration_ms;              /*!< From Xing/VBRI frame counts, estimated from the bitrate for CBR */
+        uint32_t bitrate_kbps;             /*!< Average */
+        uint32_t sample_rate;
+        uint8_t channels;
+        uint32_t size;                     /*!< File size when indexed */
+    } media_library_entry_t;
+
+    /**
+     * @brief Scan counters since init
+     */
+    typedef struct
+    {
+        uint32_t tracks;       /*!< Tracks in the index in use */
+        uint32_t dirs;         /*!< Directories in it */
+        uint32_t scans;        /*!< Completed scans */
+        uint32_t probed;       /*!< Files parsed by the last scan */
+        uint32_t reused;       /*!< Files the last scan took from the previous index */
+        uint32_t dirs_listed;  /*!< Directories the last scan read */
+        uint32_t dirs_skipped; /*!< Directories it took whole from the previous index */
+        uint32_t scan_ms;      /*!< Duration of the last scan */
+        bool scanning;         /*!< A scan is running */
+    } media_library_stats_t;
+
+    typedef struct media_library *media_library_handle_t;
+
+    /**
+     * @brief Open the index if there is one, and start a background rescan. Lookups answer from the
+     *        existing index until the rescan replaces it.
+     *
+     * @return The library handle, NULL on failure
+     */
+    media_library_handle_t media_library_init(const media_library_cfg_t *cfg);
+
+    /**
+     * @brief Queue another incremental rescan, e.g. after the card was written to over USB
+     */
+    esp_err_t media_library_rescan(media_library_handle_t lib);
+
+    /**
+     * @brief Tracks in the index in use, 0 before the first scan of a card finishes
+     */
+    int media_library_count(media_library_handle_t lib);
+
+    /**
+     * @brief Get the n-th track, in path order
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NOT_FOUND  n is out of range
+     *     - ESP_FAIL  the index could not be read
+     */
+    esp_err_t media_library_get(media_library_handle_t lib, int n, media_library_entry_t *entry);
+
+    /**
+     * @brief Look a track up by its full path, reading one block of the index
+     *
+     * @param entry filled on success, may be NULL
+     * @param n     its position in path order, may be NULL
+     *
+     * @return ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_ARG or ESP_FAIL
+     */
+    esp_err_t media_library_find(media_library_handle_t lib, const char *path, media_library_entry_t *entry, int *n);
+
+    /**
+     * @brief Tracks whose full path starts with `prefix`, e.g. a directory with a trailing '/'.
+     *        They are contiguous in path order.
+     *
+     * @param first position of the first one
+     * @param count how many, 0 when there are none
+     */
+    esp_err_t media_library_range(media_library_handle_t lib, const char *prefix, int *first, int *count);
+
+    /**
+     * @brief Get the scan counters
+     */
+    esp_err_t media_library_get_stats(media_library_handle_t lib, media_library_stats_t *stats);
+
+    /**
+     * @brief Stop the scan task, abandoning a running scan, and close the index
+     */
+    void media_library_deinit(media_library_handle_t lib);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,514 @@
+/* MPEG frame validation and resynchronisation on the reader->decoder link
+
+   A bad sector or a partially copied file puts bytes in front of mp3_decoder
+   that are not frames, and the decoder gives up on the stream. This hook
+   sits on the reader's output and passes a frame on only once the header
+   after it agrees with the stream (version, layer, rate, mono or stereo),
+   so the decoder only ever sees whole frames:
+
+     - the frame waiting for its successor, plus a header, is all that is
+       held back, in a small work buffer;
+     - when the successor does not parse, that frame and what follows are
+       dropped and the next sync word is searched four bytes per step; a
+       candidate counts only if the header one frame length further agrees
+       with it;
+     - the gap is filled with silent frames of the stream's format, as many
+       as the dropped bytes held, so the decoded length is kept and the
+       gapless player's per-track plans stay aligned.
+
+   Recovery takes a search through the buffered bytes in the reader task,
+   with no pipeline restart, and is reported to the listener. ID3v2, ID3v1
+   and APE tags are dropped without a report.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "mp3_parser.h"
+#include "mp3_frame_guard.h"
+
+static const char *TAG = "MP3_FRAME_GUARD";
+
+/* Largest frame of any layer at a bitrate we can size, padding included: Layer II, 384 kbps, 32 kHz */
+#define MP3_GUARD_MAX_FRAME (1729)
+#define MP3_GUARD_HDR_BYTES (4)
+#define MP3_GUARD_ID3V2_HDR_BYTES (10)
+/* Reports the listener may still be reading while newer ones are written */
+#define MP3_GUARD_REPORTS (4)
+
+struct mp3_frame_guard
+{
+    mp3_frame_guard_cfg_t cfg;
+    audio_io_hook_t hook;
+    audio_event_iface_handle_t evt;
+    uint8_t *buf;
+    int len;              /* Bytes in buf, buf[0] being the next to forward or drop */
+    int64_t base;         /* Reader position of buf[0] */
+    int64_t next_pos;     /* Reader position the next write continues from, -1 before the first */
+    uint32_t tag_left;    /* Bytes of an ID3v2 tag still to drop */
+    bool locked;          /* A frame chain was found since the stream started; `lock` is valid */
+    bool synced;          /* buf[0] starts a frame of that chain */
+    bool in_tag;          /* The chain ended at a tag: what is dropped until it resumes is not damage */
+    mp3_frame_header_t lock;
+    uint64_t chain_bytes; /* Frame bytes forwarded since the stream started, for the average */
+    uint32_t chain_frames;
+    bool in_gap;          /* Dropping damaged bytes */
+    int64_t gap_offset;
+    uint32_t gap_bytes;
+    uint32_t gap_search_us;
+    uint8_t silence[MP3_GUARD_MAX_FRAME];
+    int silence_len;
+    mp3_frame_guard_report_t reports[MP3_GUARD_REPORTS];
+    uint32_t report_seq;
+    mp3_frame_guard_stats_t stats;
+};
+
+static bool is_tag(const uint8_t *p)
+{
+    return memcmp(p, "TAG", 3) == 0 || memcmp(p, "ID3", 3) == 0 || memcmp(p, "APET", 4) == 0;
+}
+
+static bool is_sync(const uint8_t *p)
+{
+    return p[0] == 0xFF && (p[1] & 0xE0) == 0xE0;
+}
+
+/* First offset in [from, to - 1) holding an 11-bit sync word, or -1. Whole words are
+   tested for a 0xFF byte at once: a zero byte of the inverted word is found by the
+   borrow it causes when 0x01 is subtracted from every byte. */
+static int find_sync(const uint8_t *buf, int from, int to)
+{
+    int i = from;
+    while (i + 1 < to && ((uintptr_t)(buf + i) & 3))
+    {
+        if (is_sync(buf + i))
+        {
+            return i;
+        }
+        i++;
+    }
+    /* A candidate in the last byte of a word needs the byte after it */
+    for (; i + 4 < to; i += 4)
+    {
+        uint32_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        w = ~w;
+        if (((w - 0x01010101u) & ~w & 0x80808080u) == 0)
+        {
+            continue;
+        }
+        for (int k = 0; k < 4; k++)
+        {
+            if (is_sync(buf + i + k))
+            {
+                return i + k;
+            }
+        }
+    }
+    for (; i + 1 < to; i++)
+    {
+        if (is_sync(buf + i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void stream_restart(mp3_frame_guard_handle_t g, int64_t pos)
+{
+    g->len = 0;
+    g->base = pos;
+    g->tag_left = 0;
+    g->locked = false;
+    g->synced = false;
+    g->in_tag = false;
+    g->in_gap = false;
+    g->chain_bytes = 0;
+    g->chain_frames = 0;
+}
+
+static int forward(mp3_frame_guard_handle_t g, audio_element_handle_t el, const uint8_t *p, int n, TickType_t ticks)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+    int w = audio_io_hook_next(&g->hook, el, (char *)p, n, ticks);
+    return w < 0 ? w : 0;
+}
+
+static void drop(mp3_frame_guard_handle_t g, int n)
+{
+    if (g->in_gap)
+    {
+        g->gap_bytes += n;
+    }
+    else
+    {
+        g->stats.ignored_bytes += n;
+    }
+}
+
+/* The first frame's header without CRC or padding, and an all-zero body: no side
+   information and no main data, which every layer decodes as silence */
+static void make_silence(mp3_frame_guard_handle_t g, const uint8_t *hdr)
+{
+    mp3_frame_header_t h;
+    memcpy(g->silence, hdr, MP3_GUARD_HDR_BYTES);
+    g->silence[1] |= 0x01;
+    g->silence[2] &= ~0x02;
+    g->silence_len = mp3_parse_frame_header(g->silence, &h) ? h.frame_bytes : 0;
+    if (g->silence_len > MP3_GUARD_HDR_BYTES)
+    {
+        memset(g->silence + MP3_GUARD_HDR_BYTES, 0, g->silence_len - MP3_GUARD_HDR_BYTES);
+    }
+}
+
+static void lose_sync(mp3_frame_guard_handle_t g, int p)
+{
+    g->synced = false;
+    g->in_tag = g->len - p >= MP3_GUARD_HDR_BYTES && is_tag(g->buf + p);
+    if (!g->in_tag && !g->in_gap)
+    {
+        g->in_gap = true;
+        g->gap_offset = g->base + p;
+        g->gap_bytes = 0;
+        g->gap_search_us = 0;
+    }
+}
+
+/* Report the gap and, unless the stream ended in it, fill it with silence */
+static int end_gap(mp3_frame_guard_handle_t g, audio_element_handle_t el, bool truncated, TickType_t ticks)
+{
+    const uint32_t avg = g->chain_frames ? (uint32_t)(g->chain_bytes / g->chain_frames) : g->lock.frame_bytes;
+    const uint32_t frames = (g->gap_bytes + avg / 2) / avg;
+    const uint32_t max_frames = (uint32_t)((int64_t)g->cfg.max_gap_ms * g->lock.sample_rate / 1000 / g->lock.samples_per_frame);
+    uint32_t silent = frames < max_frames ? frames : max_frames;
+    if (truncated || g->silence_len == 0)
+    {
+        silent = 0;
+    }
+    g->in_gap = false;
+
+    mp3_frame_guard_report_t *r = &g->reports[g->report_seq % MP3_GUARD_REPORTS];
+    r->seq = g->report_seq++;
+    r->offset = g->gap_offset;
+    r->skipped_bytes = g->gap_bytes;
+    r->skipped_frames = frames;
+    r->silent_frames = silent;
+    r->search_us = g->gap_search_us;
+    r->truncated = truncated;
+    g->stats.resyncs++;
+    g->stats.skipped_bytes += g->gap_bytes;
+    g->stats.skipped_frames += frames;
+    g->stats.silent_frames += silent;
+    if (g->gap_search_us > g->stats.max_search_us)
+    {
+        g->stats.max_search_us = g->gap_search_us;
+    }
+    ESP_LOGD(TAG, "Resync at %lld: %u bytes skipped, %u silent frames", (long long)r->offset, (unsigned)r->skipped_bytes,
+             (unsigned)silent);
+    if (g->cfg.listener)
+    {
+        audio_event_iface_msg_t msg = {
+            .cmd = MP3_FRAME_GUARD_CMD_RESYNC,
+            .data = r,
+            .data_len = sizeof(mp3_frame_guard_report_t),
+            .source = g,
+            .source_type = MP3_FRAME_GUARD_SOURCE_TYPE,
+            .need_free_data = false,
+        };
+        audio_event_iface_sendout(g->evt, &msg);
+    }
+
+    int ret = 0;
+    for (uint32_t i = 0; i < silent && ret >= 0; i++)
+    {
+        ret = forward(g, el, g->silence, g->silence_len, ticks);
+    }
+    return ret;
+}
+
+/* Walk the buffer: forward frames vouched for by their successor, drop what does not
+   belong to the chain, and keep what needs more data. `eof`: nothing follows the buffer. */
+static int guard_pass(mp3_frame_guard_handle_t g, audio_element_handle_t el, bool eof, TickType_t ticks)
+{
+    const uint8_t *buf = g->buf;
+    int p = 0;   /* Next byte to look at */
+    int out = 0; /* buf[out, p) is vouched for and not forwarded yet */
+    int ret = 0;
+    int64_t t0 = g->synced ? 0 : esp_timer_get_time();
+    mp3_frame_header_t h, next;
+
+    while (ret >= 0)
+    {
+        const int avail = g->len - p;
+        if (g->tag_left)
+        {
+            const int n = avail < (int)g->tag_left ? avail : (int)g->tag_left;
+            g->stats.ignored_bytes += n;
+            g->tag_left -= n;
+            p += n;
+            out = p;
+            if (g->tag_left)
+            {
+                break;
+            }
+            continue;
+        }
+        if (avail < MP3_GUARD_HDR_BYTES)
+        {
+            break;
+        }
+
+        if (g->synced)
+        {
+            int end = -1;
+            if (mp3_parse_frame_header(buf + p, &h) && mp3_headers_consistent(&h, &g->lock))
+            {
+                end = p + h.frame_bytes;
+                if (end + MP3_GUARD_HDR_BYTES > g->len && !(eof && end <= g->len))
+                {
+                    break; /* its successor has not arrived yet */
+                }
+                /* The last frame of the stream, or of the audio before a tag, has no successor to check */
+                if (end + MP3_GUARD_HDR_BYTES <= g->len && !is_tag(buf + end) &&
+                    !(mp3_parse_frame_header(buf + end, &next) && mp3_headers_consistent(&next, &g->lock)))
+                {
+                    end = -1;
+                }
+            }
+            if (end > 0)
+            {
+                g->chain_bytes += h.frame_bytes;
+                g->chain_frames++;
+                g->stats.frames++;
+                p = end;
+                continue;
+            }
+            /* Cut short, corrupt, or a tag: everything up to the next frame goes */
+            ret = forward(g, el, buf + out, p - out, ticks);
+            out = p;
+            lose_sync(g, p);
+            t0 = esp_timer_get_time();
+            continue;
+        }
+
+        /* An ID3v2 tag goes whole: its pictures are full of sync-like bytes */
+        if (memcmp(buf + p, "ID3", 3) == 0)
+        {
+            if (avail < MP3_GUARD_ID3V2_HDR_BYTES && !eof)
+            {
+                break;
+            }
+            const size_t tag = mp3_id3v2_size(buf + p, avail);
+            if (tag)
+            {
+                g->tag_left = tag;
+                continue;
+            }
+        }
+
+        const int c = find_sync(buf, p, g->len);
+        if (c < 0)
+        {
+            /* A trailing 0xFF may be the first half of a sync word */
+            const int keep = !eof && buf[g->len - 1] == 0xFF ? 1 : 0;
+            drop(g, g->len - keep - p);
+            p = out = g->len - keep;
+            break;
+        }
+        drop(g, c - p);
+        p = out = c;
+        if (g->len - p < MP3_GUARD_HDR_BYTES)
+        {
+            break;
+        }
+
+        bool found = mp3_parse_frame_header(buf + p, &h) && (!g->locked || mp3_headers_consistent(&h, &g->lock));
+        if (found)
+        {
+            const int end = p + h.frame_bytes;
+            if (end + MP3_GUARD_HDR_BYTES <= g->len)
+            {
+                found = mp3_parse_frame_header(buf + end, &next) && mp3_headers_consistent(&h, &next);
+            }
+            else if (!eof)
+            {
+                break; /* wait for the header that confirms it */
+            }
+            else
+            {
+                /* Nothing follows: take a complete frame of the stream we know */
+                found = g->locked && end <= g->len;
+            }
+        }
+        if (!found)
+        {
+            drop(g, 1);
+            p = out = p + 1;
+            continue;
+        }
+
+        if (!g->locked)
+        {
+            g->locked = true;
+            g->lock = h;
+            make_silence(g, buf + p);
+        }
+        g->synced = true;
+        g->in_tag = false;
+        if (g->in_gap)
+        {
+            g->gap_search_us += (uint32_t)(esp_timer_get_time() - t0);
+            ret = end_gap(g, el, false, ticks);
+        }
+    }
+
+    if (ret >= 0)
+    {
+        ret = forward(g, el, buf + out, p - out, ticks);
+    }
+    if (!g->synced && g->in_gap)
+    {
+        g->gap_search_us += (uint32_t)(esp_timer_get_time() - t0);
+    }
+
+    if (eof)
+    {
+        /* A partial frame at the end is a truncated file */
+        if (g->len > p)
+        {
+            if (g->synced)
+            {
+                lose_sync(g, p);
+            }
+            drop(g, g->len - p);
+        }
+        if (g->in_gap && ret >= 0)
+        {
+            ret = end_gap(g, el, true, ticks);
+        }
+        stream_restart(g, g->next_pos);
+        return ret;
+    }
+
+    g->len -= p;
+    memmove(g->buf, g->buf + p, g->len);
+    g->base += p;
+    return ret;
+}
+
+static int _reader_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buffer, int len, TickType_t ticks)
+{
+    mp3_frame_guard_handle_t g = (mp3_frame_guard_handle_t)hook->ctx;
+    audio_element_info_t info;
+    audio_element_getinfo(el, &info);
+
+    /* The reader counts a read before writing it. Anything but the continuation of the last
+       write is a seek, a restart or the next file: what is held belongs to the old stream.
+       The gapless player shortens a write only at the end of a file. */
+    const int64_t start = info.byte_pos - len;
+    const bool at_end = info.total_bytes > 0 && info.byte_pos >= info.total_bytes;
+    if (start != g->next_pos && !(at_end && start > g->next_pos))
+    {
+        stream_restart(g, start);
+    }
+    g->next_pos = info.byte_pos;
+
+    int done = 0;
+    while (done < len)
+    {
+        int n = g->cfg.buf_size - g->len;
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(g->buf + g->len, buffer + done, n);
+        g->len += n;
+        done += n;
+        int ret = guard_pass(g, el, at_end && done == len, ticks);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return len;
+}
+
+static void release(mp3_frame_guard_handle_t g)
+{
+    audio_io_hook_remove(g->cfg.reader, AUDIO_IO_HOOK_WRITE, &g->hook);
+    if (g->evt)
+    {
+        audio_event_iface_destroy(g->evt);
+    }
+    if (g->buf)
+    {
+        audio_free(g->buf);
+    }
+    audio_free(g);
+}
+
+mp3_frame_guard_handle_t mp3_frame_guard_init(const mp3_frame_guard_cfg_t *cfg)
+{
+    /* Room for a frame, its successor's header and a frame's worth of new data */
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->reader && cfg->buf_size >= 2 * MP3_GUARD_MAX_FRAME + MP3_GUARD_HDR_BYTES &&
+                              cfg->max_gap_ms >= 0,
+                     return NULL);
+
+    mp3_frame_guard_handle_t g = audio_calloc(1, sizeof(struct mp3_frame_guard));
+    AUDIO_MEM_CHECK(TAG, g, return NULL);
+    g->cfg = *cfg;
+    g->next_pos = -1;
+    g->hook = (audio_io_hook_t){.fn = _reader_write_hook, .ctx = g};
+    g->buf = audio_malloc(cfg->buf_size);
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    g->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, g->buf && g->evt, {
+        release(g);
+        return NULL;
+    });
+
+    if (audio_io_hook_add(cfg->reader, AUDIO_IO_HOOK_WRITE, &g->hook) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Pipeline must be linked before mp3_frame_guard_init");
+        release(g);
+        return NULL;
+    }
+    if (cfg->listener)
+    {
+        audio_event_iface_set_listener(g->evt, cfg->listener);
+    }
+    return g;
+}
+
+esp_err_t mp3_frame_guard_get_stats(mp3_frame_guard_handle_t g, mp3_frame_guard_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, g && stats, return ESP_ERR_INVALID_ARG);
+    *stats = g->stats;
+    return ESP_OK;
+}
+
+void mp3_frame_guard_deinit(mp3_frame_guard_handle_t g)
+{
+    if (g == NULL)
+    {
+        return;
+    }
+    if (g->cfg.listener)
+    {
+        audio_event_iface_remove_listener(g->cfg.listener, g->evt);
+    }
+    release(g);
+}
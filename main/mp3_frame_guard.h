@@ -0,0 +1,102 @@
+/* MPEG frame validation and resynchronisation on the reader->decoder link
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __MP3_FRAME_GUARD_H__
+#define __MP3_FRAME_GUARD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of frame guard messages */
+#define MP3_FRAME_GUARD_SOURCE_TYPE (0x53594E43) /* "SYNC" */
+/* audio_event_iface_msg_t.cmd of a recovery; data points to a mp3_frame_guard_report_t */
+#define MP3_FRAME_GUARD_CMD_RESYNC (1)
+
+    /**
+     * @brief One damaged stretch of the stream and its recovery
+     */
+    typedef struct
+    {
+        uint32_t seq;            /*!< Report number */
+        int64_t offset;          /*!< Reader position where the frame chain broke */
+        uint32_t skipped_bytes;  /*!< Bytes dropped before the next valid frame */
+        uint32_t skipped_frames; /*!< Frames those bytes amounted to, at the stream's average frame size */
+        uint32_t silent_frames;  /*!< Silent frames passed to the decoder in their place */
+        uint32_t search_us;      /*!< CPU time spent finding the next frame */
+        bool truncated;          /*!< The stream ended before a valid frame came back */
+    } mp3_frame_guard_report_t;
+
+    /**
+     * @brief Counters since init
+     */
+    typedef struct
+    {
+        uint32_t frames;         /*!< Frames passed to the decoder */
+        uint32_t resyncs;        /*!< Damaged stretches recovered from */
+        uint32_t skipped_bytes;  /*!< Bytes dropped inside the audio */
+        uint32_t skipped_frames; /*!< Frames those bytes amounted to */
+        uint32_t silent_frames;  /*!< Silent frames inserted */
+        uint32_t ignored_bytes;  /*!< Tags and bytes ahead of the first frame, dropped without a report */
+        uint32_t max_search_us;  /*!< Longest search for the next frame */
+    } mp3_frame_guard_stats_t;
+
+    /**
+     * @brief Frame guard configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t reader;       /*!< Element feeding the decoder the MPEG stream */
+        audio_event_iface_handle_t listener; /*!< Receives a report per recovery, may be NULL */
+        int buf_size;                        /*!< Work buffer; holds the frame awaiting its successor */
+        int max_gap_ms;                      /*!< Silence inserted for one damaged stretch at most */
+    } mp3_frame_guard_cfg_t;
+
+#define MP3_FRAME_GUARD_CFG_DEFAULT() \
+    {                                 \
+        .reader = NULL,               \
+        .listener = NULL,             \
+        .buf_size = 8 * 1024,         \
+        .max_gap_ms = 1000,           \
+    }
+
+    typedef struct mp3_frame_guard *mp3_frame_guard_handle_t;
+
+    /**
+     * @brief Hook the reader's output so the decoder only receives frames whose header is
+     *        followed by a consistent one. Call after audio_pipeline_link() and before other
+     *        hooks on the reader's output that trim the stream, e.g. the gapless player's:
+     *        hooks added later run first, so the guard sees what they pass on.
+     *
+     * @return The guard handle, NULL on failure
+     */
+    mp3_frame_guard_handle_t mp3_frame_guard_init(const mp3_frame_guard_cfg_t *cfg);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t mp3_frame_guard_get_stats(mp3_frame_guard_handle_t guard, mp3_frame_guard_stats_t *stats);
+
+    /**
+     * @brief Unhook and free. The pipeline must be stopped.
+     */
+    void mp3_frame_guard_deinit(mp3_frame_guard_handle_t guard);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
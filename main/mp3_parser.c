@@ -0,0 +1,653 @@
+/* MPEG audio header, ID3v2 and Xing/LAME parsing
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "mp3_parser.h"
+
+static const char *TAG = "MP3_PARSER";
+
+#define XING_FLAG_FRAMES (0x0001)
+#define XING_FLAG_BYTES (0x0002)
+#define XING_FLAG_TOC (0x0004)
+#define XING_FLAG_QUALITY (0x0008)
+
+#define VBRI_OFFSET (4 + 32)
+#define VBRI_HEADER_SIZE (26)
+
+#define ID3V1_SIZE (128)
+#define ID3V1_FIELD_SIZE (30)
+#define ID3V2_HEADER_SIZE (10)
+#define APE_FOOTER_SIZE (32)
+
+static const uint16_t s_bitrates[2][3][15] = {
+    /* MPEG-1: layer 1, 2, 3 */
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    },
+    /* MPEG-2 and 2.5: layer 1, 2, 3 */
+    {
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    },
+};
+
+static const uint32_t s_sample_rates[3] = {44100, 48000, 32000};
+
+static inline uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t read_be16(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+bool mp3_parse_frame_header(const uint8_t *p, mp3_frame_header_t *hdr)
+{
+    const uint32_t h = read_be32(p);
+    if ((h & 0xFFE00000u) != 0xFFE00000u)
+    {
+        return false;
+    }
+
+    const int version_bits = (h >> 19) & 0x3;
+    const int layer_bits = (h >> 17) & 0x3;
+    const int bitrate_idx = (h >> 12) & 0xF;
+    const int rate_idx = (h >> 10) & 0x3;
+    const int emphasis = h & 0x3;
+    /* Reserved values, and free-format bitrate which we cannot size */
+    if (version_bits == 1 || layer_bits == 0 || bitrate_idx == 0 || bitrate_idx == 15 || rate_idx == 3 || emphasis == 2)
+    {
+        return false;
+    }
+
+    mp3_frame_header_t out;
+    out.version = version_bits == 3 ? 1 : (version_bits == 2 ? 2 : 3);
+    out.layer = 4 - layer_bits;
+    out.crc = ((h >> 16) & 0x1) == 0;
+    out.channel_mode = (h >> 6) & 0x3;
+    out.channels = out.channel_mode == 3 ? 1 : 2;
+    out.bitrate_kbps = s_bitrates[out.version == 1 ? 0 : 1][out.layer - 1][bitrate_idx];
+    out.sample_rate = s_sample_rates[rate_idx] >> (out.version - 1);
+    const int padding = (h >> 9) & 0x1;
+
+    if (out.layer == 1)
+    {
+        out.samples_per_frame = 384;
+        out.frame_bytes = (12 * out.bitrate_kbps * 1000 / out.sample_rate + padding) * 4;
+    }
+    else if (out.layer == 2 || out.version == 1)
+    {
+        out.samples_per_frame = 1152;
+        out.frame_bytes = 144 * out.bitrate_kbps * 1000 / out.sample_rate + padding;
+    }
+    else
+    {
+        out.samples_per_frame = 576;
+        out.frame_bytes = 72 * out.bitrate_kbps * 1000 / out.sample_rate + padding;
+    }
+
+    if (hdr)
+    {
+        *hdr = out;
+    }
+    return true;
+}
+
+bool mp3_headers_consistent(const mp3_frame_header_t *a, const mp3_frame_header_t *b)
+{
+    return a->version == b->version && a->layer == b->layer && a->sample_rate == b->sample_rate &&
+           (a->channel_mode == 3) == (b->channel_mode == 3);
+}
+
+size_t mp3_id3v2_size(const uint8_t *p, size_t len)
+{
+    if (len < 10 || memcmp(p, "ID3", 3) != 0)
+    {
+        return 0;
+    }
+    /* Size is a 28-bit syncsafe integer */
+    if ((p[6] | p[7] | p[8] | p[9]) & 0x80)
+    {
+        return 0;
+    }
+    size_t size = ((size_t)p[6] << 21) | ((size_t)p[7] << 14) | ((size_t)p[8] << 7) | p[9];
+    size += 10;
+    if (p[5] & 0x10)
+    {
+        size += 10; /* footer present */
+    }
+    return size;
+}
+
+/* Append code point `cp` to `out` as UTF-8 unless it would not fit with the terminator */
+static size_t utf8_put(char *out, size_t pos, size_t size, uint32_t cp)
+{
+    uint8_t b[4];
+    size_t n;
+    if (cp < 0x80)
+    {
+        b[0] = cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        b[0] = 0xC0 | (cp >> 6);
+        b[1] = 0x80 | (cp & 0x3F);
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        b[0] = 0xE0 | (cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3F);
+        b[2] = 0x80 | (cp & 0x3F);
+        n = 3;
+    }
+    else
+    {
+        b[0] = 0xF0 | (cp >> 18);
+        b[1] = 0x80 | ((cp >> 12) & 0x3F);
+        b[2] = 0x80 | ((cp >> 6) & 0x3F);
+        b[3] = 0x80 | (cp & 0x3F);
+        n = 4;
+    }
+    if (pos + n >= size)
+    {
+        return pos;
+    }
+    memcpy(out + pos, b, n);
+    return pos + n;
+}
+
+/* Convert an ID3 text field to UTF-8; `enc` is the ID3v2 encoding byte (0 for ID3v1) */
+static void tag_text_copy(char *out, size_t size, uint8_t enc, const uint8_t *p, size_t len)
+{
+    size_t pos = 0;
+    if (enc == 1 || enc == 2)
+    {
+        /* UTF-16 with a BOM, or UTF-16BE without one */
+        bool be = enc == 2;
+        if (len >= 2 && ((p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF)))
+        {
+            be = p[0] == 0xFE;
+            p += 2;
+            len -= 2;
+        }
+        for (size_t i = 0; i + 1 < len; i += 2)
+        {
+            uint32_t cp = be ? read_be16(p + i) : (uint16_t)(p[i] | (p[i + 1] << 8));
+            if (cp == 0)
+            {
+                break;
+            }
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < len)
+            {
+                const uint32_t lo = be ? read_be16(p + i + 2) : (uint16_t)(p[i + 2] | (p[i + 3] << 8));
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+            pos = utf8_put(out, pos, size, cp);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < len && p[i]; i++)
+        {
+            if (enc == 3)
+            {
+                /* Already UTF-8: copy, but never cut a sequence in half */
+                size_t n = 1;
+                while (i + n < len && (p[i + n] & 0xC0) == 0x80)
+                {
+                    n++;
+                }
+                if (pos + n >= size)
+                {
+                    break;
+                }
+                memcpy(out + pos, p + i, n);
+                pos += n;
+                i += n - 1;
+            }
+            else
+            {
+                pos = utf8_put(out, pos, size, p[i]);
+            }
+        }
+    }
+    /* ID3v1 pads with spaces */
+    while (pos > 0 && out[pos - 1] == ' ')
+    {
+        pos--;
+    }
+    out[pos] = '\0';
+}
+
+/* Called per frame with its ID and body; return false to stop the walk */
+typedef bool (*id3v2_frame_fn)(const uint8_t *id, const uint8_t *body, size_t len, void *ctx);
+
+/* Walk the frames of an ID3v2 tag that lie within `len`, skipping compressed or encrypted ones.
+   IDs passed to `fn` are 3 characters for v2.2 and 4 otherwise. */
+static void id3v2_walk(const uint8_t *p, size_t len, id3v2_frame_fn fn, void *ctx)
+{
+    const size_t size = mp3_id3v2_size(p, len);
+    if (size == 0)
+    {
+        return;
+    }
+    const uint8_t major = p[3];
+    /* v2.2 has 3-character IDs and 3-byte sizes, v2.4 syncsafe frame sizes */
+    const size_t hdr_len = major == 2 ? 6 : 10;
+    size_t end = size < len ? size : len;
+    size_t pos = ID3V2_HEADER_SIZE;
+    if (major == 3 && (p[5] & 0x40) && pos + 4 <= end)
+    {
+        pos += 4 + read_be32(p + pos); /* extended header, size excludes itself */
+    }
+    else if (major == 4 && (p[5] & 0x40) && pos + 4 <= end)
+    {
+        pos += ((size_t)p[pos] << 21) | ((size_t)p[pos + 1] << 14) | ((size_t)p[pos + 2] << 7) | p[pos + 3];
+    }
+
+    while (pos + hdr_len <= end && p[pos] != 0)
+    {
+        const uint8_t *f = p + pos;
+        size_t flen;
+        if (major == 2)
+        {
+            flen = ((size_t)f[3] << 16) | ((size_t)f[4] << 8) | f[5];
+        }
+        else if (major == 4)
+        {
+            flen = ((size_t)f[4] << 21) | ((size_t)f[5] << 14) | ((size_t)f[6] << 7) | f[7];
+        }
+        else
+        {
+            flen = read_be32(f + 4);
+        }
+        if (pos + hdr_len + flen > end)
+        {
+            break;
+        }
+        /* Compressed or encrypted frames (v2.3 flags) are left alone */
+        const bool plain = major == 2 || !(f[9] & (major == 4 ? 0x0C : 0xC0));
+        if (plain && !fn(f, f + hdr_len, flen, ctx))
+        {
+            break;
+        }
+        pos += hdr_len + flen;
+    }
+}
+
+typedef struct
+{
+    mp3_tag_text_t *text;
+    bool v22;
+    bool found;
+} id3v2_text_ctx_t;
+
+static bool id3v2_text_frame(const uint8_t *id, const uint8_t *body, size_t len, void *ctx)
+{
+    id3v2_text_ctx_t *t = (id3v2_text_ctx_t *)ctx;
+    char *dst = NULL;
+    if (!memcmp(id, t->v22 ? "TT2" : "TIT2", t->v22 ? 3 : 4))
+    {
+        dst = t->text->title;
+    }
+    else if (!memcmp(id, t->v22 ? "TP1" : "TPE1", t->v22 ? 3 : 4))
+    {
+        dst = t->text->artist;
+    }
+    if (dst && dst[0] == '\0' && len > 1)
+    {
+        tag_text_copy(dst, MP3_TAG_TEXT_SIZE, body[0], body + 1, len - 1);
+        t->found = true;
+    }
+    return true;
+}
+
+bool mp3_parse_id3v2_text(const uint8_t *p, size_t len, mp3_tag_text_t *text)
+{
+    id3v2_text_ctx_t ctx = {.text = text, .v22 = len > 3 && p[3] == 2};
+    id3v2_walk(p, len, id3v2_text_frame, &ctx);
+    return ctx.found;
+}
+
+typedef struct
+{
+    mp3_replaygain_t *rg;
+    bool v22;
+} id3v2_rg_ctx_t;
+
+/* Length of a NUL-terminated string in encoding `enc`, without the terminator */
+static size_t id3v2_strlen(uint8_t enc, const uint8_t *p, size_t len)
+{
+    const size_t unit = enc == 1 || enc == 2 ? 2 : 1;
+    size_t i = 0;
+    while (i + unit <= len && (p[i] || (unit == 2 && p[i + 1])))
+    {
+        i += unit;
+    }
+    return i;
+}
+
+/* "-6.54 dB" or "0.988553" */
+static bool parse_decimal(const char *s, float *out)
+{
+    char *end;
+    const float v = strtof(s, &end);
+    if (end == s)
+    {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+static bool id3v2_rg_frame(const uint8_t *id, const uint8_t *body, size_t len, void *ctx)
+{
+    id3v2_rg_ctx_t *t = (id3v2_rg_ctx_t *)ctx;
+    if (memcmp(id, t->v22 ? "TXX" : "TXXX", t->v22 ? 3 : 4) || len < 2)
+    {
+        return true;
+    }
+    /* Encoding, description, terminator, value */
+    const uint8_t enc = body[0];
+    const size_t unit = enc == 1 || enc == 2 ? 2 : 1;
+    const size_t desc_len = id3v2_strlen(enc, body + 1, len - 1);
+    if (1 + desc_len + unit > len)
+    {
+        return true;
+    }
+    char desc[32];
+    char value[32];
+    tag_text_copy(desc, sizeof(desc), enc, body + 1, desc_len);
+    tag_text_copy(value, sizeof(value), enc, body + 1 + desc_len + unit, len - 1 - desc_len - unit);
+    if (!strcasecmp(desc, "REPLAYGAIN_TRACK_GAIN") && parse_decimal(value, &t->rg->track_gain_db))
+    {
+        t->rg->has_gain = true;
+    }
+    else if (!strcasecmp(desc, "REPLAYGAIN_TRACK_PEAK") && parse_decimal(value, &t->rg->track_peak))
+    {
+        t->rg->has_peak = true;
+    }
+    return !(t->rg->has_gain && t->rg->has_peak);
+}
+
+bool mp3_parse_id3v2_replaygain(const uint8_t *p, size_t len, mp3_replaygain_t *rg)
+{
+    memset(rg, 0, sizeof(*rg));
+    id3v2_rg_ctx_t ctx = {.rg = rg, .v22 = len > 3 && p[3] == 2};
+    id3v2_walk(p, len, id3v2_rg_frame, &ctx);
+    return rg->has_gain;
+}
+
+static int xing_offset(const mp3_frame_header_t *hdr)
+{
+    if (hdr->version == 1)
+    {
+        return 4 + (hdr->channels == 1 ? 17 : 32);
+    }
+    return 4 + (hdr->channels == 1 ? 9 : 17);
+}
+
+bool mp3_parse_xing(const uint8_t *frame, size_t len, const mp3_frame_header_t *hdr, mp3_xing_info_t *xing)
+{
+    memset(xing, 0, sizeof(*xing));
+    if (hdr->layer != 3)
+    {
+        return false;
+    }
+
+    /* Encoders disagree on whether the CRC shifts the tag, so try both places */
+    const uint8_t *p = NULL;
+    const int base = xing_offset(hdr);
+    for (int shift = 0; shift <= (hdr->crc ? 2 : 0); shift += 2)
+    {
+        const size_t off = base + shift;
+        if (off + 8 <= len && (memcmp(frame + off, "Xing", 4) == 0 || memcmp(frame + off, "Info", 4) == 0))
+        {
+            p = frame + off;
+            break;
+        }
+    }
+    if (p == NULL)
+    {
+        return false;
+    }
+
+    const uint8_t *end = frame + len;
+    const uint32_t flags = read_be32(p + 4);
+    p += 8;
+    if ((flags & XING_FLAG_FRAMES) && p + 4 <= end)
+    {
+        xing->frames = read_be32(p);
+        xing->has_frames = true;
+        p += 4;
+    }
+    if ((flags & XING_FLAG_BYTES) && p + 4 <= end)
+    {
+        xing->bytes = read_be32(p);
+        xing->has_bytes = true;
+        p += 4;
+    }
+    if ((flags & XING_FLAG_TOC) && p + 100 <= end)
+    {
+        memcpy(xing->toc, p, 100);
+        xing->has_toc = true;
+        p += 100;
+    }
+    if (flags & XING_FLAG_QUALITY)
+    {
+        p += 4;
+    }
+    xing->present = true;
+
+    /* LAME tag: 9-byte encoder string, then delay/padding as two 12-bit fields at +21 */
+    if (p + 24 <= end &&
+        (memcmp(p, "LAME", 4) == 0 || memcmp(p, "Lavc", 4) == 0 || memcmp(p, "Lavf", 4) == 0 || memcmp(p, "GOGO", 4) == 0))
+    {
+        xing->enc_delay = ((uint16_t)p[21] << 4) | (p[22] >> 4);
+        xing->enc_padding = ((uint16_t)(p[22] & 0x0F) << 8) | p[23];
+        xing->has_lame = true;
+    }
+    return true;
+}
+
+bool mp3_parse_vbri(const uint8_t *frame, size_t len, mp3_vbri_info_t *vbri)
+{
+    memset(vbri, 0, sizeof(*vbri));
+    if (len < VBRI_OFFSET + VBRI_HEADER_SIZE || memcmp(frame + VBRI_OFFSET, "VBRI", 4) != 0)
+    {
+        return false;
+    }
+
+    /* "VBRI", version, delay, quality, bytes, frames, entries, scale, entry size, frames per entry */
+    const uint8_t *p = frame + VBRI_OFFSET;
+    vbri->bytes = read_be32(p + 10);
+    vbri->frames = read_be32(p + 14);
+    vbri->toc_entries = read_be16(p + 18);
+    vbri->toc_scale = read_be16(p + 20);
+    vbri->toc_entry_size = read_be16(p + 22);
+    vbri->frames_per_entry = read_be16(p + 24);
+    vbri->toc_offset = VBRI_OFFSET + VBRI_HEADER_SIZE;
+    if (vbri->toc_entry_size < 1 || vbri->toc_entry_size > 4 || vbri->frames_per_entry == 0)
+    {
+        vbri->toc_entries = 0;
+    }
+    vbri->present = true;
+    return true;
+}
+
+int mp3_find_frame(const uint8_t *buf, size_t len, mp3_frame_header_t *hdr)
+{
+    mp3_frame_header_t cur, next;
+    for (size_t i = 0; i + 4 <= len; i++)
+    {
+        if (buf[i] != 0xFF || !mp3_parse_frame_header(buf + i, &cur))
+        {
+            continue;
+        }
+        const size_t n = i + cur.frame_bytes;
+        /* A lone sync word is common in garbage; require the next header unless the buffer ends first */
+        if (n + 4 <= len && !(mp3_parse_frame_header(buf + n, &next) && mp3_headers_consistent(&cur, &next)))
+        {
+            continue;
+        }
+        if (hdr)
+        {
+            *hdr = cur;
+        }
+        return (int)i;
+    }
+    return -1;
+}
+
+static uint32_t probe_audio_end(FILE *f, int64_t file_size, mp3_tag_text_t *text)
+{
+    uint8_t tail[ID3V1_SIZE];
+    int64_t end = file_size;
+
+    if (end >= ID3V1_SIZE && fseek(f, end - ID3V1_SIZE, SEEK_SET) == 0 &&
+        fread(tail, 1, 3, f) == 3 && memcmp(tail, "TAG", 3) == 0)
+    {
+        end -= ID3V1_SIZE;
+        /* ID3v1 text is Latin-1 in practice */
+        if (text && (!text->title[0] || !text->artist[0]) && fread(tail + 3, 1, ID3V1_SIZE - 3, f) == ID3V1_SIZE - 3)
+        {
+            if (!text->title[0])
+            {
+                tag_text_copy(text->title, sizeof(text->title), 0, tail + 3, ID3V1_FIELD_SIZE);
+            }
+            if (!text->artist[0])
+            {
+                tag_text_copy(text->artist, sizeof(text->artist), 0, tail + 3 + ID3V1_FIELD_SIZE, ID3V1_FIELD_SIZE);
+            }
+        }
+    }
+    if (end >= APE_FOOTER_SIZE && fseek(f, end - APE_FOOTER_SIZE, SEEK_SET) == 0 &&
+        fread(tail, 1, APE_FOOTER_SIZE, f) == APE_FOOTER_SIZE && memcmp(tail, "APETAGEX", 8) == 0)
+    {
+        int64_t ape = read_le32(tail + 12);
+        if (read_le32(tail + 20) & 0x80000000u)
+        {
+            ape += APE_FOOTER_SIZE; /* header present in addition to the footer */
+        }
+        if (ape <= end)
+        {
+            end -= ape;
+        }
+    }
+    return (uint32_t)end;
+}
+
+esp_err_t mp3_probe_file(const char *path, mp3_stream_info_t *info)
+{
+    return mp3_probe_file_tags(path, info, NULL);
+}
+
+esp_err_t mp3_probe_file_tags(const char *path, mp3_stream_info_t *info, mp3_tag_text_t *text)
+{
+    memset(info, 0, sizeof(*info));
+    if (text)
+    {
+        memset(text, 0, sizeof(*text));
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Cannot open %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0)
+    {
+        info->file_size = st.st_size;
+    }
+
+    /* Off the stack: callers include app_main and small background tasks */
+    uint8_t *buf = audio_malloc(MP3_PROBE_BUF_SIZE);
+    if (buf == NULL)
+    {
+        fclose(f);
+        return ESP_ERR_NO_MEM;
+    }
+    uint32_t offset = 0;
+    size_t n = 0;
+    /* Skip any number of ID3v2 tags; they may be far larger than the probe buffer */
+    while (1)
+    {
+        if (fseek(f, offset, SEEK_SET) != 0)
+        {
+            break;
+        }
+        n = fread(buf, 1, MP3_PROBE_BUF_SIZE, f);
+        const size_t tag = mp3_id3v2_size(buf, n);
+        if (tag == 0)
+        {
+            break;
+        }
+        if (text && offset == 0)
+        {
+            mp3_parse_id3v2_text(buf, n, text);
+        }
+        offset += tag;
+    }
+
+    esp_err_t ret = ESP_FAIL;
+    const int pos = mp3_find_frame(buf, n, &info->header);
+    if (pos < 0)
+    {
+        ESP_LOGW(TAG, "No MPEG audio frame in the first %d bytes of %s", (int)n, path);
+        goto _probe_exit;
+    }
+
+    info->first_frame_offset = offset + pos;
+    info->audio_start = info->first_frame_offset;
+    info->audio_end = probe_audio_end(f, info->file_size, text);
+    if (mp3_parse_xing(buf + pos, n - pos, &info->header, &info->xing))
+    {
+        info->audio_start += info->header.frame_bytes;
+        if (info->xing.has_bytes && info->first_frame_offset + info->xing.bytes < info->audio_end)
+        {
+            info->audio_end = info->first_frame_offset + info->xing.bytes;
+        }
+        if (info->xing.has_frames)
+        {
+            info->total_samples = (uint64_t)info->xing.frames * info->header.samples_per_frame;
+        }
+    }
+    else if (mp3_parse_vbri(buf + pos, n - pos, &info->vbri))
+    {
+        info->audio_start += info->header.frame_bytes;
+        info->total_samples = (uint64_t)info->vbri.frames * info->header.samples_per_frame;
+    }
+    ret = ESP_OK;
+
+_probe_exit:
+    audio_free(buf);
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,210 @@
+/* MPEG audio header, ID3v2 and Xing/LAME parsing
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __MP3_PARSER_H__
+#define __MP3_PARSER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Samples the MP3 synthesis filterbank delays its output by (LAME's convention) */
+#define MP3_DECODER_DELAY_SAMPLES (529)
+
+/* Bytes read from the start of a file when probing it, into a heap buffer */
+#define MP3_PROBE_BUF_SIZE (4096)
+
+/* Bytes kept of a tag text field, including the terminator */
+#define MP3_TAG_TEXT_SIZE (64)
+
+    /**
+     * @brief Decoded MPEG audio frame header
+     */
+    typedef struct
+    {
+        uint8_t version;            /*!< 1 = MPEG-1, 2 = MPEG-2, 3 = MPEG-2.5 */
+        uint8_t layer;              /*!< 1, 2 or 3 */
+        uint8_t channels;           /*!< 1 or 2 */
+        uint8_t channel_mode;       /*!< Raw channel mode bits, 3 = mono */
+        bool crc;                   /*!< A 16-bit CRC follows the header */
+        uint16_t bitrate_kbps;      /*!< Bitrate of this frame */
+        uint32_t sample_rate;       /*!< Sample rate in Hz */
+        uint16_t samples_per_frame; /*!< PCM samples per channel produced by this frame */
+        uint16_t frame_bytes;       /*!< Frame length including the header */
+    } mp3_frame_header_t;
+
+    /**
+     * @brief Xing/Info header and LAME extension found in the first frame
+     */
+    typedef struct
+    {
+        bool present;         /*!< A Xing or Info tag was found */
+        bool has_frames;      /*!< `frames` is valid */
+        bool has_bytes;       /*!< `bytes` is valid */
+        bool has_toc;         /*!< `toc` is valid */
+        bool has_lame;        /*!< `enc_delay`/`enc_padding` come from a LAME tag */
+        uint32_t frames;      /*!< Audio frames in the stream, not counting the Xing frame */
+        uint32_t bytes;       /*!< Stream bytes, counting the Xing frame */
+        uint8_t toc[100];     /*!< Seek table, toc[i] * file_size / 256 is the byte offset of i % */
+        uint16_t enc_delay;   /*!< Encoder delay in samples */
+        uint16_t enc_padding; /*!< Encoder padding in samples */
+    } mp3_xing_info_t;
+
+    /**
+     * @brief Fraunhofer VBRI header found in the first frame
+     */
+    typedef struct
+    {
+        bool present;              /*!< A VBRI tag was found */
+        uint32_t bytes;            /*!< Stream bytes */
+        uint32_t frames;           /*!< Audio frames in the stream */
+        uint16_t toc_entries;      /*!< Entries in the seek table */
+        uint16_t toc_scale;        /*!< Multiply an entry by this to get bytes */
+        uint16_t toc_entry_size;   /*!< Bytes per entry, 1 to 4 */
+        uint16_t frames_per_entry; /*!< Frames covered by one entry */
+        uint32_t toc_offset;       /*!< Offset of the table from the start of the frame */
+    } mp3_vbri_info_t;
+
+    /**
+     * @brief What a player needs to know about a file before streaming it
+     */
+    typedef struct
+    {
+        int64_t file_size;            /*!< Size of the file */
+        uint32_t audio_start;         /*!< Offset of the first audio frame, after ID3v2 and the Xing frame */
+        uint32_t audio_end;           /*!< Offset one past the last audio byte, before ID3v1/APE */
+        uint32_t first_frame_offset;  /*!< Offset of the first frame, which may be the Xing frame */
+        mp3_frame_header_t header;    /*!< Header of the first frame */
+        mp3_xing_info_t xing;         /*!< Xing/LAME information, `present` false if none */
+        mp3_vbri_info_t vbri;         /*!< VBRI information, `present` false if none */
+        uint64_t total_samples;       /*!< Decoded samples per channel, 0 when unknown */
+    } mp3_stream_info_t;
+
+    /**
+     * @brief Title and artist from ID3v2 (TIT2/TPE1, or TT2/TP1 in v2.2) or ID3v1, as UTF-8
+     */
+    typedef struct
+    {
+        char title[MP3_TAG_TEXT_SIZE];  /*!< Empty when the file has none */
+        char artist[MP3_TAG_TEXT_SIZE]; /*!< Empty when the file has none */
+    } mp3_tag_text_t;
+
+    /**
+     * @brief ReplayGain track values from ID3v2 TXXX frames (REPLAYGAIN_TRACK_GAIN/PEAK)
+     */
+    typedef struct
+    {
+        bool has_gain;       /*!< `track_gain_db` is valid */
+        bool has_peak;       /*!< `track_peak` is valid */
+        float track_gain_db; /*!< Gain bringing the track to the ReplayGain reference, -18 LUFS */
+        float track_peak;    /*!< Sample peak, 1.0 is full scale */
+    } mp3_replaygain_t;
+
+    /**
+     * @brief Parse a 4-byte MPEG audio frame header
+     *
+     * @param p   at least 4 bytes
+     * @param hdr filled on success
+     *
+     * @return true if the bytes form a valid, supported header
+     */
+    bool mp3_parse_frame_header(const uint8_t *p, mp3_frame_header_t *hdr);
+
+    /**
+     * @brief Whether two headers belong to the same stream (version, layer, rate and channel mode match)
+     */
+    bool mp3_headers_consistent(const mp3_frame_header_t *a, const mp3_frame_header_t *b);
+
+    /**
+     * @brief Size of an ID3v2 tag at `p`, including header and footer
+     *
+     * @return tag size, or 0 if there is no tag
+     */
+    size_t mp3_id3v2_size(const uint8_t *p, size_t len);
+
+    /**
+     * @brief Read title and artist from the text frames of an ID3v2 tag. Only the frames within
+     *        `len` are looked at, which covers the text frames of usual tags: they precede the
+     *        pictures. Fields already set in `text` are kept.
+     *
+     * @return true if either field was found
+     */
+    bool mp3_parse_id3v2_text(const uint8_t *p, size_t len, mp3_tag_text_t *text);
+
+    /**
+     * @brief Read the ReplayGain track gain and peak from the TXXX frames of an ID3v2 tag.
+     *        Unlike title and artist these may follow the pictures: pass the whole tag.
+     *
+     * @return true if a track gain was found
+     */
+    bool mp3_parse_id3v2_replaygain(const uint8_t *p, size_t len, mp3_replaygain_t *rg);
+
+    /**
+     * @brief Parse a Xing/Info tag and its LAME extension inside a frame
+     *
+     * @param frame start of the frame header
+     * @param len   bytes available from `frame`
+     * @param hdr   header parsed from `frame`
+     * @param xing  filled, `present` is false when the frame carries no tag
+     *
+     * @return true if a tag was found
+     */
+    bool mp3_parse_xing(const uint8_t *frame, size_t len, const mp3_frame_header_t *hdr, mp3_xing_info_t *xing);
+
+    /**
+     * @brief Parse a VBRI tag inside a frame; the seek table itself is left in the file
+     *
+     * @return true if a tag was found
+     */
+    bool mp3_parse_vbri(const uint8_t *frame, size_t len, mp3_vbri_info_t *vbri);
+
+    /**
+     * @brief Locate the first frame in a buffer, requiring the following frame to be consistent
+     *
+     * @param buf    data
+     * @param len    bytes in `buf`
+     * @param hdr    header of the frame found
+     *
+     * @return offset of the frame, or -1
+     */
+    int mp3_find_frame(const uint8_t *buf, size_t len, mp3_frame_header_t *hdr);
+
+    /**
+     * @brief Probe a file: skip ID3v2, find the first frame, read Xing/LAME/VBRI and trailing tags
+     *
+     * @param path file to probe
+     * @param info filled on success
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_NOT_FOUND  file cannot be opened
+     *     - ESP_ERR_NO_MEM     no heap for the MP3_PROBE_BUF_SIZE read buffer
+     *     - ESP_FAIL           no MPEG audio frame found
+     */
+    esp_err_t mp3_probe_file(const char *path, mp3_stream_info_t *info);
+
+    /**
+     * @brief mp3_probe_file() that also reads title and artist from the first ID3v2 tag,
+     *        falling back to ID3v1, in the same pass over the file
+     *
+     * @param text filled on success, fields empty when the file has no such tag
+     */
+    esp_err_t mp3_probe_file_tags(const char *path, mp3_stream_info_t *info, mp3_tag_text_t *text);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
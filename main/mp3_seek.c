@@ -0,0 +1,559 @@
+/* Seek index for MP3 files: sidecar frame index, VBRI/Xing TOC, CBR fallback
+
+   A seek has to turn a time into a byte offset without scanning frames. The
+   index picks the best mapping the file offers:
+
+     - a sidecar "<name>.six" next to the MP3, holding the offset of every
+       MP3_SEEK_FRAMES_PER_ENTRY-th frame as 16-bit deltas. It is expanded to
+       absolute offsets on load, so a lookup is one division and one array read;
+     - the VBRI table, accumulated into the same absolute table;
+     - the Xing 100-point TOC, interpolated;
+     - a CBR estimate. A file in this case gets its sidecar built by a
+       low-priority task the first time it is opened, and the open index picks
+       the sidecar up on the next lookup after the build completes.
+
+   The sidecar uses a short extension so it stays valid on volumes without
+   long file names. It records the size and mtime of the MP3 and is ignored
+   if either changed.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "mp3_seek.h"
+
+static const char *TAG = "MP3_SEEK";
+
+#define MP3_SEEK_PATH_MAX (256)
+#define MP3_SEEK_SIDECAR_EXT ".six"
+#define MP3_SEEK_SIDECAR_TMP_EXT ".si~"
+#define MP3_SEEK_MAGIC (0x5853334D) /* "M3SX" */
+#define MP3_SEEK_VERSION (1)
+
+#define MP3_SEEK_BUILDER_QUEUE_LEN (4)
+#define MP3_SEEK_BUILDER_STACK (4096)
+#define MP3_SEEK_BUILDER_STACK_MARGIN (512) /* Warn when a build leaves less stack than this, bytes */
+#define MP3_SEEK_BUILDER_PRIO (1)
+#define MP3_SEEK_BUILDER_CORE (0)
+#define MP3_SEEK_SCAN_BUF_SIZE (16 * 1024)
+#define MP3_SEEK_INITIAL_ENTRIES (1024)
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t frames_per_entry;
+    uint32_t sample_rate;
+    uint16_t samples_per_frame;
+    uint16_t reserved;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t audio_start;
+    uint32_t entry_count;
+    uint32_t total_frames;
+} mp3_seek_sidecar_hdr_t;
+
+struct mp3_seek_index
+{
+    char path[MP3_SEEK_PATH_MAX];
+    mp3_seek_source_t source;
+    uint32_t sample_rate;
+    uint32_t samples_per_frame;
+    uint32_t bitrate_kbps;
+    uint32_t first_frame_offset;
+    uint32_t audio_start;
+    uint32_t audio_end;
+    uint32_t total_frames;
+    /* Sidecar and VBRI: absolute offset of frame n * frames_per_entry */
+    uint32_t *offsets;
+    uint32_t entry_count;
+    uint32_t frames_per_entry;
+    /* Xing */
+    uint8_t toc[100];
+    uint32_t toc_bytes;
+    uint32_t builds_seen;
+};
+
+static QueueHandle_t s_build_queue;
+static volatile uint32_t s_builds_done;
+
+static void sidecar_path(const char *path, const char *ext, char *out, size_t out_len)
+{
+    strlcpy(out, path, out_len);
+    char *dot = strrchr(out, '.');
+    char *slash = strrchr(out, '/');
+    if (dot == NULL || (slash && dot < slash))
+    {
+        dot = out + strlen(out);
+    }
+    *dot = '\0';
+    strlcat(out, ext, out_len);
+}
+
+static bool load_sidecar(mp3_seek_index_handle_t idx)
+{
+    struct stat st;
+    if (stat(idx->path, &st) != 0)
+    {
+        return false;
+    }
+
+    char name[MP3_SEEK_PATH_MAX];
+    sidecar_path(idx->path, MP3_SEEK_SIDECAR_EXT, name, sizeof(name));
+    FILE *f = fopen(name, "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    bool ok = false;
+    uint16_t *deltas = NULL;
+    uint32_t *offsets = NULL;
+    mp3_seek_sidecar_hdr_t hdr;
+    if (fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+    {
+        goto _exit;
+    }
+    if (hdr.magic != MP3_SEEK_MAGIC || hdr.version != MP3_SEEK_VERSION || hdr.frames_per_entry == 0 ||
+        hdr.entry_count == 0 || hdr.source_size != (uint32_t)st.st_size || hdr.source_mtime != (uint32_t)st.st_mtime ||
+        hdr.audio_start != idx->audio_start || hdr.sample_rate != idx->sample_rate)
+    {
+        ESP_LOGW(TAG, "Stale sidecar %s ignored", name);
+        goto _exit;
+    }
+
+    offsets = audio_calloc(hdr.entry_count, sizeof(uint32_t));
+    deltas = audio_calloc(hdr.entry_count, sizeof(uint16_t));
+    if (offsets == NULL || deltas == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for %u index entries", (unsigned)hdr.entry_count);
+        goto _exit;
+    }
+    const size_t n = hdr.entry_count - 1;
+    if (fread(deltas, sizeof(uint16_t), n, f) != n)
+    {
+        goto _exit;
+    }
+    offsets[0] = hdr.audio_start;
+    for (size_t i = 0; i < n; i++)
+    {
+        offsets[i + 1] = offsets[i] + deltas[i];
+    }
+
+    audio_free(idx->offsets);
+    idx->offsets = offsets;
+    offsets = NULL;
+    idx->entry_count = hdr.entry_count;
+    idx->frames_per_entry = hdr.frames_per_entry;
+    idx->total_frames = hdr.total_frames;
+    idx->source = MP3_SEEK_SRC_SIDECAR;
+    ok = true;
+
+_exit:
+    audio_free(deltas);
+    audio_free(offsets);
+    fclose(f);
+    return ok;
+}
+
+static bool load_vbri(mp3_seek_index_handle_t idx, const mp3_vbri_info_t *vbri)
+{
+    if (vbri->toc_entries == 0 || vbri->frames_per_entry == 0 || vbri->toc_entry_size == 0 || vbri->toc_entry_size > 4)
+    {
+        return false;
+    }
+    FILE *f = fopen(idx->path, "rb");
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    const size_t table_len = (size_t)vbri->toc_entries * vbri->toc_entry_size;
+    uint8_t *table = audio_malloc(table_len);
+    uint32_t *offsets = audio_calloc(vbri->toc_entries + 1, sizeof(uint32_t));
+    bool ok = table && offsets && fseek(f, idx->first_frame_offset + vbri->toc_offset, SEEK_SET) == 0 &&
+              fread(table, 1, table_len, f) == table_len;
+    fclose(f);
+
+    if (ok)
+    {
+        /* Entries are chunk sizes; accumulate them from the first audio frame */
+        offsets[0] = idx->audio_start;
+        const uint8_t *p = table;
+        for (int i = 0; i < vbri->toc_entries; i++)
+        {
+            uint32_t v = 0;
+            for (int b = 0; b < vbri->toc_entry_size; b++)
+            {
+                v = (v << 8) | *p++;
+            }
+            offsets[i + 1] = offsets[i] + v * vbri->toc_scale;
+        }
+        idx->offsets = offsets;
+        idx->entry_count = vbri->toc_entries + 1;
+        idx->frames_per_entry = vbri->frames_per_entry;
+        idx->source = MP3_SEEK_SRC_VBRI;
+    }
+    else
+    {
+        audio_free(offsets);
+    }
+    audio_free(table);
+    return ok;
+}
+
+mp3_seek_index_handle_t mp3_seek_index_open(const char *path, const mp3_stream_info_t *info)
+{
+    AUDIO_NULL_CHECK(TAG, path && info, return NULL);
+
+    mp3_seek_index_handle_t idx = audio_calloc(1, sizeof(struct mp3_seek_index));
+    AUDIO_MEM_CHECK(TAG, idx, return NULL);
+    strlcpy(idx->path, path, sizeof(idx->path));
+    idx->sample_rate = info->header.sample_rate;
+    idx->samples_per_frame = info->header.samples_per_frame;
+    idx->bitrate_kbps = info->header.bitrate_kbps;
+    idx->first_frame_offset = info->first_frame_offset;
+    idx->audio_start = info->audio_start;
+    idx->audio_end = info->audio_end;
+    idx->total_frames = info->total_samples / info->header.samples_per_frame;
+    idx->builds_seen = s_builds_done;
+
+    if (load_sidecar(idx))
+    {
+        ESP_LOGI(TAG, "%s: sidecar, %u entries", path, (unsigned)idx->entry_count);
+        return idx;
+    }
+    if (info->vbri.present && load_vbri(idx, &info->vbri))
+    {
+        ESP_LOGI(TAG, "%s: VBRI table, %u entries", path, (unsigned)idx->entry_count);
+        return idx;
+    }
+    if (info->xing.present && info->xing.has_toc && info->xing.has_frames)
+    {
+        memcpy(idx->toc, info->xing.toc, sizeof(idx->toc));
+        idx->toc_bytes = info->xing.has_bytes ? info->xing.bytes : info->audio_end - info->first_frame_offset;
+        idx->source = MP3_SEEK_SRC_XING_TOC;
+        ESP_LOGI(TAG, "%s: Xing TOC", path);
+        return idx;
+    }
+
+    idx->source = MP3_SEEK_SRC_CBR;
+    mp3_seek_build_sidecar(path);
+    return idx;
+}
+
+static uint32_t cbr_offset(mp3_seek_index_handle_t idx, uint32_t frame)
+{
+    /* Average frame length is spf / 8 * bitrate / rate bytes, padding included */
+    return idx->audio_start + (uint32_t)((uint64_t)frame * idx->samples_per_frame * idx->bitrate_kbps * 125 / idx->sample_rate);
+}
+
+esp_err_t mp3_seek_index_lookup(mp3_seek_index_handle_t idx, uint32_t time_ms, mp3_seek_point_t *point)
+{
+    AUDIO_NULL_CHECK(TAG, idx && point, return ESP_ERR_INVALID_ARG);
+
+    if (idx->source == MP3_SEEK_SRC_CBR && idx->builds_seen != s_builds_done)
+    {
+        idx->builds_seen = s_builds_done;
+        if (load_sidecar(idx))
+        {
+            ESP_LOGI(TAG, "%s: switched to sidecar", idx->path);
+        }
+    }
+
+    uint32_t frame = (uint32_t)((uint64_t)time_ms * idx->sample_rate / 1000 / idx->samples_per_frame);
+    if (idx->total_frames && frame >= idx->total_frames)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t offset;
+    switch (idx->source)
+    {
+        case MP3_SEEK_SRC_SIDECAR:
+        case MP3_SEEK_SRC_VBRI:
+        {
+            uint32_t entry = frame / idx->frames_per_entry;
+            if (entry >= idx->entry_count)
+            {
+                entry = idx->entry_count - 1;
+            }
+            frame = entry * idx->frames_per_entry;
+            offset = idx->offsets[entry];
+            break;
+        }
+        case MP3_SEEK_SRC_XING_TOC:
+        {
+            /* Linear interpolation between the two surrounding percent points */
+            const uint64_t pct_x1000 = (uint64_t)frame * 100000 / idx->total_frames;
+            const int i = pct_x1000 / 1000;
+            const uint32_t a = idx->toc[i];
+            uint32_t b = i < 99 ? idx->toc[i + 1] : 256;
+            if (b < a)
+            {
+                b = a;
+            }
+            const uint64_t toc_x1000 = (uint64_t)a * 1000 + (b - a) * (pct_x1000 % 1000);
+            offset = idx->first_frame_offset + (uint32_t)(toc_x1000 * idx->toc_bytes / 256000);
+            if (offset < idx->audio_start)
+            {
+                offset = idx->audio_start;
+            }
+            break;
+        }
+        default:
+            offset = cbr_offset(idx, frame);
+            break;
+    }
+    if (offset >= idx->audio_end)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    point->byte_offset = offset;
+    point->frame = frame;
+    point->time_ms = (uint32_t)((uint64_t)frame * idx->samples_per_frame * 1000 / idx->sample_rate);
+    return ESP_OK;
+}
+
+mp3_seek_source_t mp3_seek_index_source(mp3_seek_index_handle_t idx)
+{
+    return idx->source;
+}
+
+const char *mp3_seek_index_path(mp3_seek_index_handle_t idx)
+{
+    return idx->path;
+}
+
+void mp3_seek_index_close(mp3_seek_index_handle_t idx)
+{
+    if (idx)
+    {
+        audio_free(idx->offsets);
+        audio_free(idx);
+    }
+}
+
+typedef struct
+{
+    FILE *f;
+    uint8_t *buf;
+    uint32_t buf_pos; /* file offset of buf[0] */
+    uint32_t buf_len;
+} scan_ctx_t;
+
+/* Return the buffered bytes at file offset `pos`, refilling unless `want` of them are there; NULL if fewer than `need` */
+static const uint8_t *scan_at(scan_ctx_t *s, uint32_t pos, uint32_t want, uint32_t need)
+{
+    if (pos >= s->buf_pos && pos + want <= s->buf_pos + s->buf_len)
+    {
+        return s->buf + (pos - s->buf_pos);
+    }
+    if (fseek(s->f, pos, SEEK_SET) != 0)
+    {
+        return NULL;
+    }
+    s->buf_pos = pos;
+    s->buf_len = fread(s->buf, 1, MP3_SEEK_SCAN_BUF_SIZE, s->f);
+    /* Give the playback reader the card between chunks */
+    vTaskDelay(1);
+    return s->buf_len >= need ? s->buf : NULL;
+}
+
+static esp_err_t build_sidecar(const char *path)
+{
+    mp3_stream_info_t info;
+    if (mp3_probe_file(path, &info) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return ESP_FAIL;
+    }
+
+    const int64_t t0 = esp_timer_get_time();
+    scan_ctx_t s = {0};
+    s.f = fopen(path, "rb");
+    s.buf = audio_malloc(MP3_SEEK_SCAN_BUF_SIZE);
+    uint32_t max_entries = MP3_SEEK_INITIAL_ENTRIES;
+    uint16_t *deltas = audio_malloc(max_entries * sizeof(uint16_t));
+    esp_err_t ret = ESP_FAIL;
+    if (s.f == NULL || s.buf == NULL || deltas == NULL)
+    {
+        goto _exit;
+    }
+    setvbuf(s.f, NULL, _IONBF, 0);
+
+    uint32_t pos = info.audio_start;
+    uint32_t last_entry = pos;
+    uint32_t frames = 0;
+    uint32_t entries = 1;
+    while (pos + 4 <= info.audio_end)
+    {
+        const uint8_t *p = scan_at(&s, pos, 4, 4);
+        if (p == NULL)
+        {
+            break;
+        }
+        mp3_frame_header_t hdr;
+        if (!mp3_parse_frame_header(p, &hdr) || !mp3_headers_consistent(&hdr, &info.header))
+        {
+            /* Damaged frame: resync on the next pair of consistent headers */
+            p = scan_at(&s, pos + 1, MP3_PROBE_BUF_SIZE, 4);
+            if (p == NULL)
+            {
+                break;
+            }
+            const uint32_t avail = s.buf_len - (pos + 1 - s.buf_pos);
+            int skip = mp3_find_frame(p, avail, &hdr);
+            pos += 1 + (skip >= 0 ? skip : (int)avail - 3);
+            continue;
+        }
+
+        if (frames > 0 && frames % MP3_SEEK_FRAMES_PER_ENTRY == 0)
+        {
+            if (pos - last_entry > UINT16_MAX)
+            {
+                ESP_LOGW(TAG, "%s: frame spacing does not fit the sidecar", path);
+                goto _exit;
+            }
+            if (entries > max_entries)
+            {
+                uint16_t *grown = audio_realloc(deltas, 2 * max_entries * sizeof(uint16_t));
+                AUDIO_MEM_CHECK(TAG, grown, goto _exit);
+                deltas = grown;
+                max_entries *= 2;
+            }
+            deltas[entries - 1] = pos - last_entry;
+            last_entry = pos;
+            entries++;
+        }
+        frames++;
+        pos += hdr.frame_bytes;
+    }
+
+    char tmp[MP3_SEEK_PATH_MAX];
+    char name[MP3_SEEK_PATH_MAX];
+    sidecar_path(path, MP3_SEEK_SIDECAR_TMP_EXT, tmp, sizeof(tmp));
+    sidecar_path(path, MP3_SEEK_SIDECAR_EXT, name, sizeof(name));
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL)
+    {
+        ESP_LOGW(TAG, "Cannot create %s", tmp);
+        goto _exit;
+    }
+    mp3_seek_sidecar_hdr_t hdr = {
+        .magic = MP3_SEEK_MAGIC,
+        .version = MP3_SEEK_VERSION,
+        .frames_per_entry = MP3_SEEK_FRAMES_PER_ENTRY,
+        .sample_rate = info.header.sample_rate,
+        .samples_per_frame = info.header.samples_per_frame,
+        .source_size = (uint32_t)st.st_size,
+        .source_mtime = (uint32_t)st.st_mtime,
+        .audio_start = info.audio_start,
+        .entry_count = entries,
+        .total_frames = frames,
+    };
+    bool ok = fwrite(&hdr, 1, sizeof(hdr), out) == sizeof(hdr) &&
+              fwrite(deltas, sizeof(uint16_t), entries - 1, out) == entries - 1;
+    ok = (fclose(out) == 0) && ok;
+    /* FATFS rename does not replace an existing file */
+    unlink(name);
+    if (!ok || rename(tmp, name) != 0)
+    {
+        ESP_LOGW(TAG, "Failed to write %s", name);
+        unlink(tmp);
+        goto _exit;
+    }
+    ESP_LOGI(TAG, "Built %s: %u frames, %u entries in %d ms", name, (unsigned)frames, (unsigned)entries,
+             (int)((esp_timer_get_time() - t0) / 1000));
+    ret = ESP_OK;
+
+_exit:
+    if (s.f)
+    {
+        fclose(s.f);
+    }
+    audio_free(s.buf);
+    audio_free(deltas);
+    return ret;
+}
+
+static void mp3_seek_builder_task(void *arg)
+{
+    char path[MP3_SEEK_PATH_MAX];
+    while (1)
+    {
+        if (xQueueReceive(s_build_queue, path, portMAX_DELAY) == pdTRUE)
+        {
+            build_sidecar(path);
+            s_builds_done++;
+            const UBaseType_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+            if (stack_free < MP3_SEEK_BUILDER_STACK_MARGIN)
+            {
+                ESP_LOGW(TAG, "Indexer stack down to %u bytes free", (unsigned)stack_free);
+            }
+            else
+            {
+                ESP_LOGD(TAG, "Indexer stack low point: %u bytes free", (unsigned)stack_free);
+            }
+        }
+    }
+}
+
+esp_err_t mp3_seek_build_sidecar(const char *path)
+{
+    AUDIO_NULL_CHECK(TAG, path, return ESP_ERR_INVALID_ARG);
+    if (s_build_queue == NULL)
+    {
+        s_build_queue = xQueueCreate(MP3_SEEK_BUILDER_QUEUE_LEN, MP3_SEEK_PATH_MAX);
+        AUDIO_MEM_CHECK(TAG, s_build_queue, return ESP_ERR_NO_MEM);
+        if (xTaskCreatePinnedToCore(mp3_seek_builder_task, "mp3_seek_idx", MP3_SEEK_BUILDER_STACK, NULL,
+                                    MP3_SEEK_BUILDER_PRIO, NULL, MP3_SEEK_BUILDER_CORE) != pdPASS)
+        {
+            vQueueDelete(s_build_queue);
+            s_build_queue = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    char item[MP3_SEEK_PATH_MAX] = {0};
+    strlcpy(item, path, sizeof(item));
+    if (xQueueSend(s_build_queue, item, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Indexer busy, %s not queued", path);
+        return ESP_ERR_TIMEOUT;
+    }
+    ESP_LOGI(TAG, "Queued sidecar build for %s", path);
+    return ESP_OK;
+}
+
+esp_err_t mp3_seek_pipeline(audio_pipeline_handle_t pipeline, audio_element_handle_t reader, const mp3_seek_point_t *point)
+{
+    AUDIO_NULL_CHECK(TAG, pipeline && reader && point, return ESP_ERR_INVALID_ARG);
+
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_reset_ringbuffer(pipeline);
+    audio_pipeline_reset_elements(pipeline);
+    audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
+    audio_element_set_byte_pos(reader, point->byte_offset);
+    return audio_pipeline_run(pipeline);
+}
@@ -0,0 +1,114 @@
+/* Seek index for MP3 files: sidecar frame index, VBRI/Xing TOC, CBR fallback
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __MP3_SEEK_H__
+#define __MP3_SEEK_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "mp3_parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Frames between two sidecar entries, about 0.4 s at 44.1 kHz */
+#define MP3_SEEK_FRAMES_PER_ENTRY (16)
+
+    /**
+     * @brief Where the byte/time mapping of an index comes from, best first
+     */
+    typedef enum
+    {
+        MP3_SEEK_SRC_SIDECAR = 0, /*!< Frame-accurate index persisted next to the file */
+        MP3_SEEK_SRC_VBRI,        /*!< Fraunhofer VBRI table */
+        MP3_SEEK_SRC_XING_TOC,    /*!< Xing 100-point table, 1% resolution */
+        MP3_SEEK_SRC_CBR,         /*!< Constant-bitrate estimate while the sidecar is being built */
+    } mp3_seek_source_t;
+
+    /**
+     * @brief Result of a lookup
+     */
+    typedef struct
+    {
+        uint32_t byte_offset; /*!< Where the reader should resume */
+        uint32_t frame;       /*!< Audio frame starting at `byte_offset`, counted from the first audio frame */
+        uint32_t time_ms;     /*!< Time of `frame` */
+    } mp3_seek_point_t;
+
+    typedef struct mp3_seek_index *mp3_seek_index_handle_t;
+
+    /**
+     * @brief Open the best seek index for a file
+     *
+     *        A valid sidecar is loaded if present. Otherwise the VBRI or Xing table is used.
+     *        Files with neither get a CBR estimate, and a sidecar build is queued on the
+     *        background indexer; the handle switches to the sidecar once it exists.
+     *
+     * @param path file the index describes
+     * @param info result of mp3_probe_file() for `path`
+     *
+     * @return The index handle, NULL if out of memory
+     */
+    mp3_seek_index_handle_t mp3_seek_index_open(const char *path, const mp3_stream_info_t *info);
+
+    /**
+     * @brief Map a time to a byte offset: a table lookup, no file access
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG  time is past the end of the track
+     */
+    esp_err_t mp3_seek_index_lookup(mp3_seek_index_handle_t idx, uint32_t time_ms, mp3_seek_point_t *point);
+
+    /**
+     * @brief Source currently backing the index
+     */
+    mp3_seek_source_t mp3_seek_index_source(mp3_seek_index_handle_t idx);
+
+    /**
+     * @brief Path the index was opened for
+     */
+    const char *mp3_seek_index_path(mp3_seek_index_handle_t idx);
+
+    /**
+     * @brief Release the index
+     */
+    void mp3_seek_index_close(mp3_seek_index_handle_t idx);
+
+    /**
+     * @brief Queue a sidecar build for `path` on the low-priority indexer task
+     *
+     * @return
+     *     - ESP_OK             queued
+     *     - ESP_ERR_NO_MEM     the indexer could not be started
+     *     - ESP_ERR_TIMEOUT    the queue is full
+     */
+    esp_err_t mp3_seek_build_sidecar(const char *path);
+
+    /**
+     * @brief Restart a stopped-or-running pipeline from `point`
+     *
+     *        Stops the pipeline, resets ringbuffers and element states, points the reader at
+     *        `point->byte_offset` and runs it again. The i2s element is not reinitialised.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_FAIL
+     */
+    esp_err_t mp3_seek_pipeline(audio_pipeline_handle_t pipeline, audio_element_handle_t reader, const mp3_seek_point_t *point);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
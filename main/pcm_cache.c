@@ -0,0 +1,1071 @@
+/* Cache of decoded PCM for tracks that are played again and again
+
+   The first play of a track decodes it as usual while a hook on the decoder
+   output records the PCM. Once the decoder has reached the end of the track
+   the recording becomes a cache entry, and later plays read it back with the
+   "pcm" reader element instead of running file->mp3.
+
+   Two tiers, each with its own budget:
+
+     - PSRAM, for tracks whose PCM fits the PSRAM budget. The decoder hook
+       copies straight into one buffer; entries are lost on reboot;
+     - the card, one "<id>.PCM" file per track in the cache directory. The
+       hook fills a few chunks that a low-priority task appends to a
+       temporary file, so the decoder never waits for the card. If the card
+       falls behind and no chunk is free the recording is dropped instead.
+
+   A file starts with a 512-byte header holding the source path, size and
+   mtime, the PCM format and size, the decoder time measured while recording
+   and an LRU sequence number, so the index is rebuilt from the directory on
+   boot. An entry whose source changed size or mtime is dropped on lookup;
+   the least recently played entries go first when a tier is over budget.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "pcm_cache.h"
+
+static const char *TAG = "PCM_CACHE";
+
+#define PCM_CACHE_PATH_MAX (256)
+#define PCM_CACHE_MAGIC (0x434D4350) /* "PCMC" */
+#define PCM_CACHE_VERSION (1)
+#define PCM_CACHE_EXT ".PCM"
+#define PCM_CACHE_TMP_NAME "REC.TMP"
+/* PCM follows the header at one sector in */
+#define PCM_CACHE_DATA_OFFSET (512)
+
+/* Chunks between the decoder hook and the writer task, about 0.7 s of 44.1 kHz stereo */
+#define PCM_CACHE_CHUNKS (4)
+#define PCM_CACHE_CHUNK_SIZE (32 * 1024)
+/* Headroom over the expected size: CBR estimates and decoder delay */
+#define PCM_CACHE_SLACK_BYTES (64 * 1024)
+/* Same rule as the telemetry: a longer gap between decoder hooks is the task idling */
+#define PCM_CACHE_DECODE_GAP_MAX_US (50 * 1000)
+#define PCM_CACHE_DMA_ALIGN (128)
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t pcm_bytes;
+    uint32_t decode_us;
+    uint32_t last_used;
+    char path[PCM_CACHE_PATH_MAX];
+} pcm_cache_file_hdr_t;
+
+_Static_assert(sizeof(pcm_cache_file_hdr_t) <= PCM_CACHE_DATA_OFFSET, "header overlaps the PCM");
+
+typedef struct
+{
+    char path[PCM_CACHE_PATH_MAX]; /* Source track, empty for a free slot */
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t rate;
+    uint16_t ch;
+    uint32_t pcm_bytes;
+    uint32_t decode_us;
+    uint32_t last_used;
+    uint32_t id;  /* File on the card, 0 for a PSRAM entry */
+    uint8_t *pcm; /* PSRAM entry */
+    int readers;  /* Open "pcm" elements; the entry is not dropped while they read it */
+} pcm_cache_entry_t;
+
+typedef enum
+{
+    PCM_CACHE_MSG_DATA = 0,
+    PCM_CACHE_MSG_COMMIT,
+    PCM_CACHE_MSG_DISCARD,
+    PCM_CACHE_MSG_TOUCH,
+    PCM_CACHE_MSG_EXIT,
+} pcm_cache_msg_type_t;
+
+typedef struct
+{
+    pcm_cache_msg_type_t type;
+    uint8_t *chunk;           /* DATA */
+    int len;                  /* DATA */
+    pcm_cache_entry_t *entry; /* COMMIT, freed by the writer */
+    uint32_t id;              /* TOUCH */
+    uint32_t seq;             /* TOUCH */
+} pcm_cache_msg_t;
+
+typedef enum
+{
+    PCM_CACHE_REC_IDLE = 0,
+    PCM_CACHE_REC_ON,
+    PCM_CACHE_REC_FAILED,
+} pcm_cache_rec_state_t;
+
+/* Recording state, owned by the decoder task while it runs and by the caller otherwise */
+typedef struct
+{
+    volatile pcm_cache_rec_state_t state;
+    pcm_cache_entry_t meta;
+    uint32_t limit;
+    uint32_t bytes;
+    uint8_t *pcm;   /* PSRAM tier */
+    uint8_t *chunk; /* Card tier: chunk being filled */
+    int fill;
+    int64_t last_exit;
+    uint32_t busy_us;
+} pcm_cache_rec_t;
+
+struct pcm_cache
+{
+    pcm_cache_cfg_t cfg;
+    char dir[PCM_CACHE_PATH_MAX];
+    SemaphoreHandle_t lock;
+    pcm_cache_entry_t *entries;
+    uint32_t seq;
+    uint32_t next_id;
+    uint64_t sd_budget;
+    uint64_t psram_budget;
+    pcm_cache_stats_t stats;
+
+    audio_element_handle_t decoder;
+    audio_io_hook_t decoder_in;
+    audio_io_hook_t decoder_out;
+    pcm_cache_rec_t rec;
+
+    QueueHandle_t msgs;
+    QueueHandle_t free_chunks;
+    uint8_t *chunks[PCM_CACHE_CHUNKS];
+    SemaphoreHandle_t finished; /* Given by the writer after each COMMIT or DISCARD */
+    SemaphoreHandle_t exited;
+};
+
+static void entry_file(pcm_cache_handle_t c, uint32_t id, char *out, size_t size)
+{
+    snprintf(out, size, "%s/%08" PRIX32 PCM_CACHE_EXT, c->dir, id);
+}
+
+static int entry_find(pcm_cache_handle_t c, const char *path)
+{
+    for (int i = 0; i < c->cfg.max_entries; i++)
+    {
+        if (c->entries[i].path[0] && strcmp(c->entries[i].path, path) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Under the lock */
+static void entry_drop(pcm_cache_handle_t c, pcm_cache_entry_t *e)
+{
+    if (e->id)
+    {
+        char name[PCM_CACHE_PATH_MAX];
+        entry_file(c, e->id, name, sizeof(name));
+        unlink(name);
+        c->stats.sd_bytes -= e->pcm_bytes;
+    }
+    if (e->pcm)
+    {
+        heap_caps_free(e->pcm);
+        c->stats.psram_bytes -= e->pcm_bytes;
+    }
+    c->stats.entries--;
+    memset(e, 0, sizeof(*e));
+}
+
+/* Under the lock: evict until `bytes` more fit the tier and a slot is free */
+static pcm_cache_entry_t *make_room(pcm_cache_handle_t c, bool psram, uint32_t bytes)
+{
+    const uint64_t budget = psram ? c->psram_budget : c->sd_budget;
+    if (bytes > budget)
+    {
+        return NULL;
+    }
+    while (1)
+    {
+        const uint64_t used = psram ? c->stats.psram_bytes : c->stats.sd_bytes;
+        pcm_cache_entry_t *free_slot = NULL;
+        pcm_cache_entry_t *lru = NULL;
+        pcm_cache_entry_t *lru_tier = NULL;
+        for (int i = 0; i < c->cfg.max_entries; i++)
+        {
+            pcm_cache_entry_t *e = &c->entries[i];
+            if (e->path[0] == '\0')
+            {
+                free_slot = free_slot ? free_slot : e;
+                continue;
+            }
+            if (e->readers)
+            {
+                continue;
+            }
+            if (lru == NULL || e->last_used < lru->last_used)
+            {
+                lru = e;
+            }
+            if ((e->pcm != NULL) == psram && (lru_tier == NULL || e->last_used < lru_tier->last_used))
+            {
+                lru_tier = e;
+            }
+        }
+        pcm_cache_entry_t *victim = used + bytes > budget ? lru_tier : free_slot == NULL ? lru : NULL;
+        if (victim == NULL)
+        {
+            return used + bytes > budget ? NULL : free_slot;
+        }
+        ESP_LOGI(TAG, "Evicting %s (%u KB, %s)", victim->path, (unsigned)(victim->pcm_bytes / 1024),
+                 victim->pcm ? "PSRAM" : "card");
+        entry_drop(c, victim);
+        c->stats.evicted++;
+    }
+}
+
+/* Under the lock */
+static pcm_cache_entry_t *entry_insert(pcm_cache_handle_t c, const pcm_cache_entry_t *src)
+{
+    const int old = entry_find(c, src->path);
+    if (old >= 0 && c->entries[old].readers == 0)
+    {
+        entry_drop(c, &c->entries[old]);
+    }
+    else if (old >= 0)
+    {
+        return NULL;
+    }
+    pcm_cache_entry_t *e = make_room(c, src->pcm != NULL, src->pcm_bytes);
+    if (e)
+    {
+        *e = *src;
+        e->readers = 0;
+        e->last_used = ++c->seq;
+        if (e->pcm)
+        {
+            c->stats.psram_bytes += e->pcm_bytes;
+        }
+        else
+        {
+            c->stats.sd_bytes += e->pcm_bytes;
+        }
+        c->stats.entries++;
+        c->stats.recorded++;
+    }
+    return e;
+}
+
+static bool source_matches(const pcm_cache_entry_t *e)
+{
+    struct stat st;
+    return stat(e->path, &st) == 0 && (uint32_t)st.st_size == e->source_size && (uint32_t)st.st_mtime == e->source_mtime;
+}
+
+bool pcm_cache_lookup(pcm_cache_handle_t c, const char *path)
+{
+    AUDIO_NULL_CHECK(TAG, c && path, return false);
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    bool hit = false;
+    const int i = entry_find(c, path);
+    if (i >= 0)
+    {
+        pcm_cache_entry_t *e = &c->entries[i];
+        hit = source_matches(e);
+        if (!hit && e->readers == 0)
+        {
+            ESP_LOGI(TAG, "%s changed, dropping its cached PCM", path);
+            entry_drop(c, e);
+            c->stats.invalidated++;
+        }
+    }
+    if (!hit)
+    {
+        c->stats.misses++;
+    }
+    xSemaphoreGive(c->lock);
+    return hit;
+}
+
+/* Reader side: pin an entry and mark it most recently used */
+static esp_err_t entry_acquire(pcm_cache_handle_t c, const char *path, pcm_cache_entry_t *out)
+{
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    const int i = entry_find(c, path);
+    if (i < 0)
+    {
+        xSemaphoreGive(c->lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    pcm_cache_entry_t *e = &c->entries[i];
+    e->readers++;
+    e->last_used = ++c->seq;
+    c->stats.hits++;
+    *out = *e;
+    xSemaphoreGive(c->lock);
+
+    if (out->id)
+    {
+        /* Persist the LRU order; a lost update only makes the entry look older */
+        pcm_cache_msg_t msg = {.type = PCM_CACHE_MSG_TOUCH, .id = out->id, .seq = out->last_used};
+        xQueueSend(c->msgs, &msg, 0);
+    }
+    return ESP_OK;
+}
+
+static void entry_release(pcm_cache_handle_t c, const char *path, uint32_t served)
+{
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    const int i = entry_find(c, path);
+    if (i >= 0)
+    {
+        pcm_cache_entry_t *e = &c->entries[i];
+        e->readers--;
+        if (e->pcm_bytes)
+        {
+            c->stats.decode_us_saved += (uint64_t)e->decode_us * served / e->pcm_bytes;
+        }
+    }
+    xSemaphoreGive(c->lock);
+}
+
+/* ---- Writer task: card files ---- */
+
+static FILE *tmp_open(pcm_cache_handle_t c, char *tmp, size_t size)
+{
+    snprintf(tmp, size, "%s/" PCM_CACHE_TMP_NAME, c->dir);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        ESP_LOGW(TAG, "Cannot create %s", tmp);
+        return NULL;
+    }
+    static const uint8_t zero[PCM_CACHE_DATA_OFFSET];
+    if (fwrite(zero, 1, sizeof(zero), f) != sizeof(zero))
+    {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+static bool tmp_commit(pcm_cache_handle_t c, FILE *f, const char *tmp, pcm_cache_entry_t *meta)
+{
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    meta->id = c->next_id++;
+    const uint32_t seq = c->seq + 1;
+    xSemaphoreGive(c->lock);
+
+    pcm_cache_file_hdr_t hdr = {
+        .magic = PCM_CACHE_MAGIC,
+        .version = PCM_CACHE_VERSION,
+        .channels = meta->ch,
+        .sample_rate = meta->rate,
+        .source_size = meta->source_size,
+        .source_mtime = meta->source_mtime,
+        .pcm_bytes = meta->pcm_bytes,
+        .decode_us = meta->decode_us,
+        .last_used = seq,
+    };
+    strlcpy(hdr.path, meta->path, sizeof(hdr.path));
+
+    char name[PCM_CACHE_PATH_MAX];
+    entry_file(c, meta->id, name, sizeof(name));
+    bool ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, 1, sizeof(hdr), f) == sizeof(hdr);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, name) != 0)
+    {
+        ESP_LOGW(TAG, "Cannot finish %s", name);
+        unlink(tmp);
+        return false;
+    }
+
+    /* Only now visible to readers; evicts older entries to make room */
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    ok = entry_insert(c, meta) != NULL;
+    xSemaphoreGive(c->lock);
+    if (!ok)
+    {
+        unlink(name);
+        return false;
+    }
+    ESP_LOGI(TAG, "Cached %s on the card: %u KB, decoded in %u ms", meta->path, (unsigned)(meta->pcm_bytes / 1024),
+             (unsigned)(meta->decode_us / 1000));
+    return true;
+}
+
+static void touch_file(pcm_cache_handle_t c, uint32_t id, uint32_t seq)
+{
+    char name[PCM_CACHE_PATH_MAX];
+    entry_file(c, id, name, sizeof(name));
+    FILE *f = fopen(name, "r+b");
+    if (f)
+    {
+        if (fseek(f, offsetof(pcm_cache_file_hdr_t, last_used), SEEK_SET) == 0)
+        {
+            fwrite(&seq, 1, sizeof(seq), f);
+        }
+        fclose(f);
+    }
+}
+
+static void _writer_task(void *arg)
+{
+    pcm_cache_handle_t c = (pcm_cache_handle_t)arg;
+    char tmp[PCM_CACHE_PATH_MAX];
+    FILE *f = NULL;
+    bool failed = false;
+    pcm_cache_msg_t msg;
+
+    while (xQueueReceive(c->msgs, &msg, portMAX_DELAY) == pdTRUE && msg.type != PCM_CACHE_MSG_EXIT)
+    {
+        switch (msg.type)
+        {
+        case PCM_CACHE_MSG_DATA:
+            if (!failed && f == NULL)
+            {
+                f = tmp_open(c, tmp, sizeof(tmp));
+                failed = f == NULL;
+            }
+            if (!failed && fwrite(msg.chunk, 1, msg.len, f) != (size_t)msg.len)
+            {
+                ESP_LOGW(TAG, "Write to %s failed, card full?", tmp);
+                failed = true;
+            }
+            xQueueSend(c->free_chunks, &msg.chunk, portMAX_DELAY);
+            break;
+        case PCM_CACHE_MSG_COMMIT:
+        case PCM_CACHE_MSG_DISCARD:
+        {
+            bool ok = false;
+            if (msg.type == PCM_CACHE_MSG_COMMIT && f && !failed)
+            {
+                ok = tmp_commit(c, f, tmp, msg.entry);
+            }
+            else if (f)
+            {
+                fclose(f);
+                unlink(tmp);
+            }
+            if (!ok)
+            {
+                xSemaphoreTake(c->lock, portMAX_DELAY);
+                c->stats.aborted++;
+                xSemaphoreGive(c->lock);
+            }
+            audio_free(msg.entry);
+            f = NULL;
+            failed = false;
+            xSemaphoreGive(c->finished);
+            break;
+        }
+        case PCM_CACHE_MSG_TOUCH:
+            touch_file(c, msg.id, msg.seq);
+            break;
+        default:
+            break;
+        }
+    }
+    if (f)
+    {
+        fclose(f);
+        unlink(tmp);
+    }
+    xSemaphoreGive(c->exited);
+    vTaskDelete(NULL);
+}
+
+/* ---- Recording, from the decoder task ---- */
+
+static void rec_append(pcm_cache_handle_t c, const char *buf, int len)
+{
+    pcm_cache_rec_t *r = &c->rec;
+    if (r->bytes + (uint32_t)len > r->limit)
+    {
+        ESP_LOGW(TAG, "%s decodes to more than the %u KB expected, not caching it", r->meta.path,
+                 (unsigned)(r->limit / 1024));
+        r->state = PCM_CACHE_REC_FAILED;
+        return;
+    }
+    if (r->pcm)
+    {
+        memcpy(r->pcm + r->bytes, buf, len);
+        r->bytes += len;
+        return;
+    }
+    while (len > 0)
+    {
+        if (r->chunk == NULL && xQueueReceive(c->free_chunks, &r->chunk, 0) != pdTRUE)
+        {
+            ESP_LOGW(TAG, "Card fell behind, not caching %s", r->meta.path);
+            r->chunk = NULL;
+            r->state = PCM_CACHE_REC_FAILED;
+            return;
+        }
+        const int n = len < PCM_CACHE_CHUNK_SIZE - r->fill ? len : PCM_CACHE_CHUNK_SIZE - r->fill;
+        memcpy(r->chunk + r->fill, buf, n);
+        r->fill += n;
+        r->bytes += n;
+        buf += n;
+        len -= n;
+        if (r->fill == PCM_CACHE_CHUNK_SIZE)
+        {
+            pcm_cache_msg_t msg = {.type = PCM_CACHE_MSG_DATA, .chunk = r->chunk, .len = r->fill};
+            xQueueSend(c->msgs, &msg, portMAX_DELAY);
+            r->chunk = NULL;
+            r->fill = 0;
+        }
+    }
+}
+
+static void rec_enter(pcm_cache_rec_t *r, int64_t now)
+{
+    if (r->last_exit && now - r->last_exit < PCM_CACHE_DECODE_GAP_MAX_US)
+    {
+        r->busy_us += (uint32_t)(now - r->last_exit);
+    }
+}
+
+static int _decoder_read_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pcm_cache_handle_t c = (pcm_cache_handle_t)hook->ctx;
+    if (c->rec.state != PCM_CACHE_REC_ON)
+    {
+        return audio_io_hook_next(hook, el, buf, len, ticks);
+    }
+    rec_enter(&c->rec, esp_timer_get_time());
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    c->rec.last_exit = esp_timer_get_time();
+    return ret;
+}
+
+static int _decoder_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pcm_cache_handle_t c = (pcm_cache_handle_t)hook->ctx;
+    if (c->rec.state != PCM_CACHE_REC_ON)
+    {
+        return audio_io_hook_next(hook, el, buf, len, ticks);
+    }
+    rec_enter(&c->rec, esp_timer_get_time());
+    if (len > 0)
+    {
+        rec_append(c, buf, len);
+    }
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    c->rec.last_exit = esp_timer_get_time();
+    return ret;
+}
+
+esp_err_t pcm_cache_attach_decoder(pcm_cache_handle_t c, audio_element_handle_t decoder)
+{
+    AUDIO_NULL_CHECK(TAG, c && decoder && c->decoder == NULL, return ESP_ERR_INVALID_ARG);
+    c->decoder_in.fn = _decoder_read_hook;
+    c->decoder_in.ctx = c;
+    c->decoder_out.fn = _decoder_write_hook;
+    c->decoder_out.ctx = c;
+    esp_err_t ret = audio_io_hook_add(decoder, AUDIO_IO_HOOK_READ, &c->decoder_in);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    ret = audio_io_hook_add(decoder, AUDIO_IO_HOOK_WRITE, &c->decoder_out);
+    if (ret != ESP_OK)
+    {
+        audio_io_hook_remove(decoder, AUDIO_IO_HOOK_READ, &c->decoder_in);
+        return ret;
+    }
+    c->decoder = decoder;
+    return ESP_OK;
+}
+
+esp_err_t pcm_cache_record_start(pcm_cache_handle_t c, const char *path, int rate, int ch, uint32_t expected_bytes)
+{
+    AUDIO_NULL_CHECK(TAG, c && path && rate > 0 && ch > 0, return ESP_ERR_INVALID_ARG);
+    pcm_cache_rec_t *r = &c->rec;
+    if (r->state != PCM_CACHE_REC_IDLE)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (strlen(path) >= PCM_CACHE_PATH_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memset(r, 0, sizeof(*r));
+    strlcpy(r->meta.path, path, sizeof(r->meta.path));
+    r->meta.source_size = (uint32_t)st.st_size;
+    r->meta.source_mtime = (uint32_t)st.st_mtime;
+    r->meta.rate = rate;
+    r->meta.ch = ch;
+    r->limit = expected_bytes + expected_bytes / 32 + PCM_CACHE_SLACK_BYTES;
+
+    if (r->limit <= c->psram_budget)
+    {
+        r->pcm = heap_caps_malloc(r->limit, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (r->pcm == NULL && (r->limit > c->sd_budget || c->free_chunks == NULL))
+    {
+        ESP_LOGI(TAG, "%s (%u KB) fits no cache budget", path, (unsigned)(expected_bytes / 1024));
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ESP_LOGI(TAG, "Recording %s, up to %u KB, into %s", path, (unsigned)(r->limit / 1024), r->pcm ? "PSRAM" : "the card");
+    r->state = PCM_CACHE_REC_ON;
+    return ESP_OK;
+}
+
+void pcm_cache_record_finish(pcm_cache_handle_t c, bool complete)
+{
+    if (c == NULL || c->rec.state == PCM_CACHE_REC_IDLE)
+    {
+        return;
+    }
+    pcm_cache_rec_t *r = &c->rec;
+    const bool ok = complete && r->state == PCM_CACHE_REC_ON && r->bytes > 0;
+    r->meta.pcm_bytes = r->bytes;
+    r->meta.decode_us = r->busy_us;
+    r->state = PCM_CACHE_REC_IDLE;
+
+    if (r->pcm)
+    {
+        bool added = false;
+        if (ok)
+        {
+            r->meta.pcm = r->pcm;
+            xSemaphoreTake(c->lock, portMAX_DELAY);
+            added = entry_insert(c, &r->meta) != NULL;
+            c->stats.aborted += !added;
+            xSemaphoreGive(c->lock);
+        }
+        else
+        {
+            xSemaphoreTake(c->lock, portMAX_DELAY);
+            c->stats.aborted++;
+            xSemaphoreGive(c->lock);
+        }
+        if (added)
+        {
+            ESP_LOGI(TAG, "Cached %s in PSRAM: %u KB, decoded in %u ms", r->meta.path, (unsigned)(r->bytes / 1024),
+                     (unsigned)(r->busy_us / 1000));
+        }
+        else
+        {
+            heap_caps_free(r->pcm);
+        }
+        r->pcm = NULL;
+        return;
+    }
+
+    if (r->chunk)
+    {
+        if (ok && r->fill)
+        {
+            pcm_cache_msg_t msg = {.type = PCM_CACHE_MSG_DATA, .chunk = r->chunk, .len = r->fill};
+            xQueueSend(c->msgs, &msg, portMAX_DELAY);
+        }
+        else
+        {
+            xQueueSend(c->free_chunks, &r->chunk, portMAX_DELAY);
+        }
+        r->chunk = NULL;
+    }
+    pcm_cache_msg_t msg = {.type = PCM_CACHE_MSG_DISCARD};
+    if (ok)
+    {
+        msg.entry = audio_malloc(sizeof(pcm_cache_entry_t));
+        if (msg.entry)
+        {
+            *msg.entry = r->meta;
+            msg.type = PCM_CACHE_MSG_COMMIT;
+        }
+    }
+    xQueueSend(c->msgs, &msg, portMAX_DELAY);
+    /* The queued chunks are written by now; a lookup right after this sees the entry */
+    xSemaphoreTake(c->finished, portMAX_DELAY);
+}
+
+/* ---- Index ---- */
+
+static void load_index(pcm_cache_handle_t c)
+{
+    DIR *d = opendir(c->dir);
+    if (d == NULL)
+    {
+        return;
+    }
+    char name[PCM_CACHE_PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        const size_t len = strlen(ent->d_name);
+        snprintf(name, sizeof(name), "%s/%s", c->dir, ent->d_name);
+        if (strcasecmp(ent->d_name, PCM_CACHE_TMP_NAME) == 0)
+        {
+            unlink(name);
+            continue;
+        }
+        if (len != 12 || strcasecmp(ent->d_name + 8, PCM_CACHE_EXT) != 0)
+        {
+            continue;
+        }
+
+        pcm_cache_file_hdr_t hdr;
+        struct stat st;
+        FILE *f = fopen(name, "rb");
+        bool valid = f && fread(&hdr, 1, sizeof(hdr), f) == sizeof(hdr) && fstat(fileno(f), &st) == 0 &&
+                     hdr.magic == PCM_CACHE_MAGIC && hdr.version == PCM_CACHE_VERSION &&
+                     (uint64_t)st.st_size == PCM_CACHE_DATA_OFFSET + (uint64_t)hdr.pcm_bytes;
+        if (f)
+        {
+            fclose(f);
+        }
+        hdr.path[sizeof(hdr.path) - 1] = '\0';
+        const uint32_t id = (uint32_t)strtoul(ent->d_name, NULL, 16);
+        pcm_cache_entry_t *e = NULL;
+        for (int i = 0; valid && i < c->cfg.max_entries && e == NULL; i++)
+        {
+            e = c->entries[i].path[0] ? NULL : &c->entries[i];
+        }
+        if (!valid || id == 0 || e == NULL || entry_find(c, hdr.path) >= 0)
+        {
+            unlink(name);
+            continue;
+        }
+        strlcpy(e->path, hdr.path, sizeof(e->path));
+        e->source_size = hdr.source_size;
+        e->source_mtime = hdr.source_mtime;
+        e->rate = hdr.sample_rate;
+        e->ch = hdr.channels;
+        e->pcm_bytes = hdr.pcm_bytes;
+        e->decode_us = hdr.decode_us;
+        e->last_used = hdr.last_used;
+        e->id = id;
+        c->stats.entries++;
+        c->stats.sd_bytes += hdr.pcm_bytes;
+        c->seq = hdr.last_used > c->seq ? hdr.last_used : c->seq;
+        c->next_id = id >= c->next_id ? id + 1 : c->next_id;
+    }
+    closedir(d);
+
+    /* The budget may have shrunk since the files were written */
+    make_room(c, false, 0);
+}
+
+pcm_cache_handle_t pcm_cache_init(const pcm_cache_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->dir && cfg->max_entries > 0, return NULL);
+
+    pcm_cache_handle_t c = audio_calloc(1, sizeof(struct pcm_cache));
+    AUDIO_MEM_CHECK(TAG, c, return NULL);
+    c->cfg = *cfg;
+    strlcpy(c->dir, cfg->dir, sizeof(c->dir));
+    c->cfg.dir = c->dir;
+    c->sd_budget = (uint64_t)cfg->sd_budget_kb * 1024;
+    c->psram_budget = (uint64_t)cfg->psram_budget_kb * 1024;
+    c->next_id = 1;
+    c->entries = audio_calloc(cfg->max_entries, sizeof(pcm_cache_entry_t));
+    c->lock = xSemaphoreCreateMutex();
+    c->exited = xSemaphoreCreateBinary();
+    c->finished = xSemaphoreCreateBinary();
+    c->msgs = xQueueCreate(PCM_CACHE_CHUNKS + 4, sizeof(pcm_cache_msg_t));
+    AUDIO_MEM_CHECK(TAG, c->entries && c->lock && c->exited && c->finished && c->msgs, goto _fail);
+
+    if (c->sd_budget)
+    {
+        mkdir(c->dir, 0775);
+        c->free_chunks = xQueueCreate(PCM_CACHE_CHUNKS, sizeof(uint8_t *));
+        AUDIO_MEM_CHECK(TAG, c->free_chunks, goto _fail);
+        for (int i = 0; i < PCM_CACHE_CHUNKS; i++)
+        {
+            c->chunks[i] = audio_malloc(PCM_CACHE_CHUNK_SIZE);
+            AUDIO_MEM_CHECK(TAG, c->chunks[i], goto _fail);
+            xQueueSend(c->free_chunks, &c->chunks[i], 0);
+        }
+        load_index(c);
+    }
+
+    if (xTaskCreatePinnedToCore(_writer_task, "pcm_cache", cfg->task_stack, c, cfg->task_prio, NULL, cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the writer task");
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "%u tracks, %llu KB on the card (budget %u KB), PSRAM budget %u KB", (unsigned)c->stats.entries,
+             (unsigned long long)(c->stats.sd_bytes / 1024), (unsigned)cfg->sd_budget_kb, (unsigned)cfg->psram_budget_kb);
+    return c;
+
+_fail:
+    for (int i = 0; i < PCM_CACHE_CHUNKS; i++)
+    {
+        audio_free(c->chunks[i]);
+    }
+    if (c->free_chunks)
+    {
+        vQueueDelete(c->free_chunks);
+    }
+    if (c->msgs)
+    {
+        vQueueDelete(c->msgs);
+    }
+    if (c->exited)
+    {
+        vSemaphoreDelete(c->exited);
+    }
+    if (c->finished)
+    {
+        vSemaphoreDelete(c->finished);
+    }
+    if (c->lock)
+    {
+        vSemaphoreDelete(c->lock);
+    }
+    audio_free(c->entries);
+    audio_free(c);
+    return NULL;
+}
+
+esp_err_t pcm_cache_get_stats(pcm_cache_handle_t c, pcm_cache_stats_t *stats)
+{
+    if (!c || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(c->lock, portMAX_DELAY);
+    *stats = c->stats;
+    xSemaphoreGive(c->lock);
+    return ESP_OK;
+}
+
+void pcm_cache_deinit(pcm_cache_handle_t c)
+{
+    if (c == NULL)
+    {
+        return;
+    }
+    pcm_cache_record_finish(c, false);
+    pcm_cache_msg_t msg = {.type = PCM_CACHE_MSG_EXIT};
+    xQueueSend(c->msgs, &msg, portMAX_DELAY);
+    xSemaphoreTake(c->exited, portMAX_DELAY);
+    if (c->decoder)
+    {
+        audio_io_hook_remove(c->decoder, AUDIO_IO_HOOK_READ, &c->decoder_in);
+        audio_io_hook_remove(c->decoder, AUDIO_IO_HOOK_WRITE, &c->decoder_out);
+    }
+    for (int i = 0; i < c->cfg.max_entries; i++)
+    {
+        heap_caps_free(c->entries[i].pcm);
+    }
+    for (int i = 0; i < PCM_CACHE_CHUNKS; i++)
+    {
+        audio_free(c->chunks[i]);
+    }
+    if (c->free_chunks)
+    {
+        vQueueDelete(c->free_chunks);
+    }
+    vQueueDelete(c->msgs);
+    vSemaphoreDelete(c->exited);
+    vSemaphoreDelete(c->finished);
+    vSemaphoreDelete(c->lock);
+    audio_free(c->entries);
+    audio_free(c);
+}
+
+/* ---- "pcm" reader element ---- */
+
+typedef struct
+{
+    pcm_cache_handle_t cache;
+    pcm_cache_entry_t entry; /* Copy of the entry being played */
+    bool is_open;
+    FILE *file;
+    uint8_t *buf;
+    int read_size;
+    uint32_t start;
+    uint32_t pos;
+} pcm_cache_stream_t;
+
+static esp_err_t _pcm_open(audio_element_handle_t self)
+{
+    pcm_cache_stream_t *s = (pcm_cache_stream_t *)audio_element_getdata(self);
+    if (s->is_open)
+    {
+        ESP_LOGE(TAG, "Already opened");
+        return ESP_FAIL;
+    }
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    if (info.uri == NULL || entry_acquire(s->cache, info.uri, &s->entry) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "No cached PCM for %s", info.uri ? info.uri : "(no uri)");
+        return ESP_FAIL;
+    }
+
+    s->start = info.byte_pos > 0 && info.byte_pos < s->entry.pcm_bytes ? (uint32_t)info.byte_pos : 0;
+    s->pos = s->start;
+    if (s->entry.id)
+    {
+        char name[PCM_CACHE_PATH_MAX];
+        entry_file(s->cache, s->entry.id, name, sizeof(name));
+        s->file = fopen(name, "rb");
+        if (s->file)
+        {
+            /* Unbuffered, as in readahead_stream: reads go straight into s->buf */
+            setvbuf(s->file, NULL, _IONBF, 0);
+        }
+        if (s->file == NULL || fseek(s->file, PCM_CACHE_DATA_OFFSET + s->start, SEEK_SET) != 0)
+        {
+            ESP_LOGE(TAG, "Cannot read %s", name);
+            if (s->file)
+            {
+                fclose(s->file);
+                s->file = NULL;
+            }
+            entry_release(s->cache, s->entry.path, 0);
+            return ESP_FAIL;
+        }
+    }
+
+    audio_element_set_total_bytes(self, s->entry.pcm_bytes);
+    audio_element_set_music_info(self, s->entry.rate, s->entry.ch, 16);
+    audio_element_report_info(self);
+    s->is_open = true;
+    ESP_LOGI(TAG, "Playing %s from the %s cache", s->entry.path, s->entry.pcm ? "PSRAM" : "card");
+    return ESP_OK;
+}
+
+static int _pcm_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    pcm_cache_stream_t *s = (pcm_cache_stream_t *)audio_element_getdata(self);
+    const uint32_t left = s->entry.pcm_bytes - s->pos;
+    if (left == 0)
+    {
+        return AEL_IO_DONE;
+    }
+    if ((uint32_t)len > left)
+    {
+        len = (int)left;
+    }
+    if (s->entry.pcm)
+    {
+        memcpy(buffer, s->entry.pcm + s->pos, len);
+    }
+    else if (fread(buffer, 1, len, s->file) != (size_t)len)
+    {
+        ESP_LOGE(TAG, "Read error at %u", (unsigned)s->pos);
+        return AEL_IO_FAIL;
+    }
+    s->pos += len;
+    audio_element_update_byte_pos(self, len);
+    return len;
+}
+
+static audio_element_err_t _pcm_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    pcm_cache_stream_t *s = (pcm_cache_stream_t *)audio_element_getdata(self);
+    /* Card reads end on read_size boundaries of the file, as in readahead_stream */
+    const uint32_t file_pos = PCM_CACHE_DATA_OFFSET + s->pos;
+    const int len = s->entry.pcm ? s->read_size : s->read_size - (int)(file_pos % s->read_size);
+    int r_size = audio_element_input(self, (char *)s->buf, len);
+    if (r_size <= 0)
+    {
+        return r_size;
+    }
+    return audio_element_output(self, (char *)s->buf, r_size);
+}
+
+static esp_err_t _pcm_close(audio_element_handle_t self)
+{
+    pcm_cache_stream_t *s = (pcm_cache_stream_t *)audio_element_getdata(self);
+    if (s->is_open)
+    {
+        if (s->file)
+        {
+            fclose(s->file);
+            s->file = NULL;
+        }
+        entry_release(s->cache, s->entry.path, s->pos - s->start);
+        s->is_open = false;
+    }
+    if (AEL_STATE_PAUSED != audio_element_get_state(self))
+    {
+        audio_element_report_pos(self);
+        audio_element_set_byte_pos(self, 0);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _pcm_destroy(audio_element_handle_t self)
+{
+    pcm_cache_stream_t *s = (pcm_cache_stream_t *)audio_element_getdata(self);
+    heap_caps_free(s->buf);
+    audio_free(s);
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_cache_stream_init(pcm_cache_handle_t cache, pcm_cache_stream_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, cache && config && config->read_size > 0, return NULL);
+
+    pcm_cache_stream_t *s = audio_calloc(1, sizeof(pcm_cache_stream_t));
+    AUDIO_MEM_CHECK(TAG, s, return NULL);
+    s->cache = cache;
+    s->read_size = config->read_size;
+    s->buf = heap_caps_aligned_alloc(PCM_CACHE_DMA_ALIGN, config->read_size, MALLOC_CAP_DMA);
+    if (s->buf == NULL)
+    {
+        s->buf = heap_caps_aligned_alloc(PCM_CACHE_DMA_ALIGN, config->read_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    AUDIO_MEM_CHECK(TAG, s->buf, {
+        audio_free(s);
+        return NULL;
+    });
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _pcm_open;
+    cfg.close = _pcm_close;
+    cfg.process = _pcm_process;
+    cfg.destroy = _pcm_destroy;
+    cfg.read = _pcm_read;
+    cfg.buffer_len = 0; /* reads go into s->buf */
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.tag = "pcm";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        heap_caps_free(s->buf);
+        audio_free(s);
+        return NULL;
+    });
+    audio_element_setdata(el, s);
+    return el;
+}
@@ -0,0 +1,166 @@
+/* Cache of decoded PCM for tracks that are played again and again
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PCM_CACHE_H__
+#define __PCM_CACHE_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief PCM cache configuration
+     */
+    typedef struct
+    {
+        const char *dir;          /*!< Directory on the card for cached tracks, created if missing */
+        uint32_t sd_budget_kb;    /*!< Total size of the cached files, 0 to keep nothing on the card */
+        uint32_t psram_budget_kb; /*!< PCM kept in PSRAM instead, for tracks that fit; 0 to not use it */
+        int max_entries;          /*!< Cached tracks, both tiers together */
+        int task_stack;           /*!< Stack of the task that writes cache files */
+        int task_core;            /*!< Its core */
+        int task_prio;            /*!< Its priority, below the decoder */
+    } pcm_cache_cfg_t;
+
+#define PCM_CACHE_TASK_STACK (3072)
+#define PCM_CACHE_TASK_CORE (0)
+#define PCM_CACHE_TASK_PRIO (1)
+
+#define PCM_CACHE_CFG_DEFAULT()             \
+    {                                       \
+        .dir = "/sdcard/PCMCACHE",          \
+        .sd_budget_kb = 512 * 1024,         \
+        .psram_budget_kb = 0,               \
+        .max_entries = 32,                  \
+        .task_stack = PCM_CACHE_TASK_STACK, \
+        .task_core = PCM_CACHE_TASK_CORE,   \
+        .task_prio = PCM_CACHE_TASK_PRIO,   \
+    }
+
+    /**
+     * @brief Cache counters since init
+     */
+    typedef struct
+    {
+        uint32_t hits;            /*!< Plays served from the cache */
+        uint32_t misses;          /*!< Lookups without a valid entry */
+        uint32_t invalidated;     /*!< Entries dropped because their source changed size or mtime */
+        uint32_t evicted;         /*!< Entries dropped to make room, least recently played first */
+        uint32_t recorded;        /*!< Tracks added */
+        uint32_t aborted;         /*!< Recordings dropped: stopped early, too large, or the card fell behind */
+        uint32_t entries;         /*!< Entries now */
+        uint64_t sd_bytes;        /*!< PCM now cached on the card */
+        uint64_t psram_bytes;     /*!< PCM now cached in PSRAM */
+        uint64_t decode_us_saved; /*!< Decoder CPU time the hits did not spend, as measured when recording */
+    } pcm_cache_stats_t;
+
+    typedef struct pcm_cache *pcm_cache_handle_t;
+
+    /**
+     * @brief Load the index from the cache directory and start the writer task.
+     *        Leftovers of an interrupted recording are deleted.
+     *
+     * @return The cache handle, NULL on failure
+     */
+    pcm_cache_handle_t pcm_cache_init(const pcm_cache_cfg_t *cfg);
+
+    /**
+     * @brief Whether `path` has a valid entry. An entry whose source no longer matches
+     *        in size and mtime is dropped here.
+     */
+    bool pcm_cache_lookup(pcm_cache_handle_t cache, const char *path);
+
+    /**
+     * @brief Tap the output of `decoder` for recording. Call once, after audio_pipeline_link().
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NO_MEM  no free hook chain
+     */
+    esp_err_t pcm_cache_attach_decoder(pcm_cache_handle_t cache, audio_element_handle_t decoder);
+
+    /**
+     * @brief Record what the decoder outputs from now on as the PCM of `path`.
+     *        Call while the decoder is stopped. `expected_bytes` picks the tier and is a
+     *        limit: a recording that outgrows it is dropped.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_SIZE  the track fits neither budget
+     *     - ESP_ERR_INVALID_STATE  a recording is already running
+     *     - ESP_ERR_NO_MEM
+     */
+    esp_err_t pcm_cache_record_start(pcm_cache_handle_t cache, const char *path, int rate, int ch, uint32_t expected_bytes);
+
+    /**
+     * @brief End the recording: add it when `complete` (the decoder reached the end of the
+     *        track), drop it otherwise. Waits for the writer task to finish the file, which
+     *        takes the card time to write the last few chunks. A no-op when nothing is recorded.
+     */
+    void pcm_cache_record_finish(pcm_cache_handle_t cache, bool complete);
+
+    /**
+     * @brief Reader element configuration
+     */
+    typedef struct
+    {
+        int read_size;   /*!< Bytes per card read, a multiple of the FAT cluster size */
+        int out_rb_size; /*!< Output ringbuffer size */
+        int task_stack;  /*!< Task stack size */
+        int task_core;   /*!< Task running in core */
+        int task_prio;   /*!< Task priority */
+        bool ext_stack;  /*!< Allocate the task stack in PSRAM */
+    } pcm_cache_stream_cfg_t;
+
+#define PCM_CACHE_STREAM_READ_SIZE (16 * 1024)
+#define PCM_CACHE_STREAM_RINGBUFFER_SIZE (32 * 1024)
+#define PCM_CACHE_STREAM_TASK_STACK (3072)
+#define PCM_CACHE_STREAM_TASK_CORE (0)
+#define PCM_CACHE_STREAM_TASK_PRIO (4)
+
+#define PCM_CACHE_STREAM_CFG_DEFAULT()                   \
+    {                                                    \
+        .read_size = PCM_CACHE_STREAM_READ_SIZE,         \
+        .out_rb_size = PCM_CACHE_STREAM_RINGBUFFER_SIZE, \
+        .task_stack = PCM_CACHE_STREAM_TASK_STACK,       \
+        .task_core = PCM_CACHE_STREAM_TASK_CORE,         \
+        .task_prio = PCM_CACHE_STREAM_TASK_PRIO,         \
+        .ext_stack = false,                              \
+    }
+
+    /**
+     * @brief Create a reader element, tag "pcm", that plays the cached PCM of the track named by
+     *        its URI and honours byte_pos on open. It reports the track format with
+     *        AEL_MSG_CMD_REPORT_MUSIC_INFO, as a decoder would.
+     *
+     * @return The audio element handle
+     */
+    audio_element_handle_t pcm_cache_stream_init(pcm_cache_handle_t cache, pcm_cache_stream_cfg_t *config);
+
+    /**
+     * @brief Get the cache counters
+     */
+    esp_err_t pcm_cache_get_stats(pcm_cache_handle_t cache, pcm_cache_stats_t *stats);
+
+    /**
+     * @brief Stop the writer task and free the index. The pipeline must be stopped
+     *        and no recording running.
+     */
+    void pcm_cache_deinit(pcm_cache_handle_t cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
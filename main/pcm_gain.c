@@ -0,0 +1,259 @@
+/* Per-track loudness gain and peak limiter on the decoded PCM
+
+   The gain is a hook on the WRITE side of the decoder (and of a PCM cache
+   reader when one plays cached tracks), so it scales the PCM in place as
+   it leaves the element: no extra element, task or ringbuffer. The gapless
+   player sets the next track's gain from the decoder task right before the
+   track's first sample is written, so the change lands exactly on the
+   track boundary.
+
+   A gain at or below unity with no risk of clipping is esp-dsp's
+   dsps_mulc_s16, which has a PIE SIMD version on the P4; the part of the
+   buffer before the first 16-byte boundary is done in C. Q15 cannot
+   express a gain above unity, so a boost, and any gain that would lift the
+   track's peak over the ceiling, run the C path: blocks of
+   GAIN_BLOCK_SAMPLES, each scaled by the lower of the track gain and the
+   gain that keeps the block's peak under the ceiling. The limiter turns
+   down at once, at the start of the block holding the peak, and recovers
+   linearly over release_ms, so it needs no lookahead and never overshoots.
+
+   The hook assumes the next link takes the buffer whole, as a ringbuffer
+   or sink does until the pipeline is stopped; a short write leaves the
+   rest scaled and is not retried by the element anyway.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "dsps_mulc.h"
+#include "audio_io_hook.h"
+#include "pcm_gain.h"
+
+static const char *TAG = "PCM_GAIN";
+
+/* Limiter granularity, 0.7 ms of 48 kHz stereo */
+#define GAIN_BLOCK_SAMPLES (64)
+/* 128-bit PIE loads */
+#define GAIN_ALIGN (16)
+#define GAIN_Q15_ONE (32767)
+
+typedef struct
+{
+    audio_io_hook_t hook;
+    audio_element_handle_t el;
+} gain_source_t;
+
+struct pcm_gain
+{
+    pcm_gain_cfg_t cfg;
+    gain_source_t sources[PCM_GAIN_MAX_SOURCES];
+    float ceiling; /* Full scale units */
+    /* Set per track, read by the writing task */
+    volatile float gain;
+    volatile bool limit;
+    volatile float release_step; /* Gain recovered per block */
+    volatile uint32_t generation;
+    /* Limiter state, owned by the writing task */
+    uint32_t applied;
+    float env;
+    pcm_gain_stats_t stats;
+};
+
+static inline int16_t to_q15(float g)
+{
+    return g >= 1.0f ? GAIN_Q15_ONE : g <= 0.0f ? 0 : (int16_t)(g * 32768.0f);
+}
+
+static inline int16_t scale_sat(int16_t x, float g)
+{
+    const float v = x * g;
+    return v >= INT16_MAX ? INT16_MAX : v <= INT16_MIN ? INT16_MIN : (int16_t)v;
+}
+
+static void gain_dsp(pcm_gain_handle_t g, int16_t *p, int n, float gain)
+{
+    const int16_t q = to_q15(gain);
+    int head = (int)(((GAIN_ALIGN - ((uintptr_t)p & (GAIN_ALIGN - 1))) & (GAIN_ALIGN - 1)) / sizeof(int16_t));
+    head = head < n ? head : n;
+    for (int i = 0; i < head; i++)
+    {
+        p[i] = (int16_t)(((int32_t)p[i] * q) >> 15);
+    }
+    if (n > head)
+    {
+        dsps_mulc_s16(p + head, p + head, n - head, q, 1, 1);
+        g->stats.dsp_samples += n - head;
+    }
+}
+
+static void gain_limit(pcm_gain_handle_t g, int16_t *p, int n, float gain)
+{
+    const float step = g->release_step;
+    for (int b = 0; b < n; b += GAIN_BLOCK_SAMPLES)
+    {
+        const int len = n - b < GAIN_BLOCK_SAMPLES ? n - b : GAIN_BLOCK_SAMPLES;
+        int peak = 0;
+        for (int i = 0; i < len; i++)
+        {
+            const int a = abs(p[b + i]);
+            peak = a > peak ? a : peak;
+        }
+        float want = gain;
+        if (peak * gain > g->ceiling)
+        {
+            want = g->ceiling / peak;
+            g->stats.limited_samples += len;
+        }
+        if (want < g->env)
+        {
+            g->env = want;
+        }
+        else
+        {
+            g->env = g->env + step < want ? g->env + step : want;
+        }
+        for (int i = 0; i < len; i++)
+        {
+            p[b + i] = scale_sat(p[b + i], g->env);
+        }
+    }
+}
+
+static int _gain_hook(audio_io_hook_t *hook, audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait)
+{
+    pcm_gain_handle_t g = (pcm_gain_handle_t)hook->ctx;
+    const uint32_t generation = g->generation;
+    const float gain = g->gain;
+    const bool limit = g->limit;
+    if (generation != g->applied)
+    {
+        g->applied = generation;
+        g->env = gain;
+    }
+    const int n = len / (int)sizeof(int16_t);
+    if (n > 0 && (gain != 1.0f || limit))
+    {
+        const uint32_t t0 = esp_cpu_get_cycle_count();
+        int16_t *p = (int16_t *)buffer;
+        if (limit)
+        {
+            gain_limit(g, p, n, gain);
+        }
+        else if (gain < 1.0f)
+        {
+            gain_dsp(g, p, n, gain);
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+            {
+                p[i] = scale_sat(p[i], gain);
+            }
+        }
+        g->stats.cycles += esp_cpu_get_cycle_count() - t0;
+        g->stats.samples += n;
+        g->stats.cycles_per_ksample = (uint32_t)(g->stats.cycles * 1000 / g->stats.samples);
+    }
+    return audio_io_hook_next(hook, self, buffer, len, ticks_to_wait);
+}
+
+pcm_gain_handle_t pcm_gain_init(const pcm_gain_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg, return NULL);
+    if (cfg->release_ms <= 0 || cfg->rate <= 0 || cfg->max_boost_db < 0 || cfg->ceiling_dbfs > 0)
+    {
+        ESP_LOGE(TAG, "Invalid gain configuration");
+        return NULL;
+    }
+    pcm_gain_handle_t g = audio_calloc(1, sizeof(struct pcm_gain));
+    AUDIO_MEM_CHECK(TAG, g, return NULL);
+    g->cfg = *cfg;
+    g->ceiling = powf(10.0f, cfg->ceiling_dbfs / 20.0f) * GAIN_Q15_ONE;
+    g->gain = 1.0f;
+    g->env = 1.0f;
+    ESP_LOGI(TAG, "Target %.1f LUFS, ceiling %.1f dBFS, boost up to %.1f dB", cfg->target_lufs, cfg->ceiling_dbfs,
+             cfg->max_boost_db);
+    return g;
+}
+
+esp_err_t pcm_gain_attach(pcm_gain_handle_t g, audio_element_handle_t el)
+{
+    AUDIO_NULL_CHECK(TAG, g && el, return ESP_ERR_INVALID_ARG);
+    gain_source_t *free_src = NULL;
+    for (int i = 0; i < PCM_GAIN_MAX_SOURCES; i++)
+    {
+        if (g->sources[i].el == el)
+        {
+            return ESP_OK;
+        }
+        if (g->sources[i].el == NULL && free_src == NULL)
+        {
+            free_src = &g->sources[i];
+        }
+    }
+    if (free_src == NULL)
+    {
+        ESP_LOGE(TAG, "All %d sources in use", PCM_GAIN_MAX_SOURCES);
+        return ESP_ERR_NO_MEM;
+    }
+    free_src->hook = (audio_io_hook_t){.fn = _gain_hook, .ctx = g};
+    esp_err_t ret = audio_io_hook_add(el, AUDIO_IO_HOOK_WRITE, &free_src->hook);
+    if (ret == ESP_OK)
+    {
+        free_src->el = el;
+    }
+    return ret;
+}
+
+esp_err_t pcm_gain_set_track(pcm_gain_handle_t g, const pcm_gain_track_t *track)
+{
+    AUDIO_NULL_CHECK(TAG, g, return ESP_ERR_INVALID_ARG);
+    const float lufs = track ? track->loudness_lufs : g->cfg.unknown_lufs;
+    const float peak = track ? track->peak_dbtp : 0.0f;
+    float db = g->cfg.target_lufs - lufs;
+    db = db > g->cfg.max_boost_db ? g->cfg.max_boost_db : db;
+    const float gain = powf(10.0f, db / 20.0f);
+    const float blocks = (float)g->cfg.release_ms * g->cfg.rate * 2 / 1000 / GAIN_BLOCK_SAMPLES;
+
+    g->gain = gain;
+    g->limit = peak + db > g->cfg.ceiling_dbfs;
+    g->release_step = blocks > 1.0f ? gain / blocks : gain;
+    g->generation++;
+    g->stats.tracks++;
+    g->stats.gain_db = db;
+    ESP_LOGI(TAG, "Track at %.1f LUFS%s: %+.1f dB%s", lufs, track ? "" : " (assumed)", db,
+             g->limit ? ", limited" : "");
+    return ESP_OK;
+}
+
+esp_err_t pcm_gain_get_stats(pcm_gain_handle_t g, pcm_gain_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, g && stats, return ESP_ERR_INVALID_ARG);
+    *stats = g->stats;
+    return ESP_OK;
+}
+
+void pcm_gain_deinit(pcm_gain_handle_t g)
+{
+    if (g == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < PCM_GAIN_MAX_SOURCES; i++)
+    {
+        if (g->sources[i].el)
+        {
+            audio_io_hook_remove(g->sources[i].el, AUDIO_IO_HOOK_WRITE, &g->sources[i].hook);
+        }
+    }
+    audio_free(g);
+}
@@ -0,0 +1,110 @@
+/* Per-track loudness gain and peak limiter on the decoded PCM
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PCM_GAIN_H__
+#define __PCM_GAIN_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Elements whose output one gain stage can hook, e.g. the decoder and a PCM cache reader */
+#define PCM_GAIN_MAX_SOURCES (2)
+
+    /**
+     * @brief Gain stage configuration
+     */
+    typedef struct
+    {
+        float target_lufs;  /*!< Loudness every track is brought to */
+        float ceiling_dbfs; /*!< Level the limiter keeps peaks under */
+        float max_boost_db; /*!< Largest gain above unity, for quiet tracks */
+        float unknown_lufs; /*!< Loudness assumed for a track not analysed yet */
+        int release_ms;     /*!< Limiter recovery time */
+        int rate;           /*!< Nominal sample rate, for the release time only */
+    } pcm_gain_cfg_t;
+
+#define PCM_GAIN_CFG_DEFAULT()   \
+    {                            \
+        .target_lufs = -18.0f,   \
+        .ceiling_dbfs = -1.0f,   \
+        .max_boost_db = 6.0f,    \
+        .unknown_lufs = -14.0f,  \
+        .release_ms = 200,       \
+        .rate = 44100,           \
+    }
+
+    /**
+     * @brief Loudness of the track about to play
+     */
+    typedef struct
+    {
+        float loudness_lufs; /*!< Integrated loudness */
+        float peak_dbtp;     /*!< Peak; the limiter only runs when the gain would lift it over the ceiling */
+    } pcm_gain_track_t;
+
+    /**
+     * @brief Counters since init
+     */
+    typedef struct
+    {
+        uint64_t samples;            /*!< Samples scaled */
+        uint64_t dsp_samples;        /*!< Of those, scaled by esp-dsp */
+        uint64_t limited_samples;    /*!< Samples the limiter turned down further */
+        uint64_t cycles;             /*!< CPU cycles spent scaling */
+        uint32_t cycles_per_ksample; /*!< cycles per 1000 samples */
+        uint32_t tracks;             /*!< Track gains set */
+        float gain_db;               /*!< Gain of the current track */
+    } pcm_gain_stats_t;
+
+    typedef struct pcm_gain *pcm_gain_handle_t;
+
+    /**
+     * @brief Create a gain stage, at unity until a track is set
+     *
+     * @return The gain handle, NULL on failure
+     */
+    pcm_gain_handle_t pcm_gain_init(const pcm_gain_cfg_t *cfg);
+
+    /**
+     * @brief Scale the 16-bit PCM `el` writes, in place, before it reaches the next element.
+     *        Call after audio_pipeline_link(), before hooks on that output that must see
+     *        the PCM as heard (hooks added later run first).
+     */
+    esp_err_t pcm_gain_attach(pcm_gain_handle_t g, audio_element_handle_t el);
+
+    /**
+     * @brief Set the gain for the PCM written from now on: the target over the track's
+     *        loudness, at most max_boost_db. Call before the track's first sample is written,
+     *        from the writing task or with the pipeline stopped, so the change is sample-exact.
+     *
+     * @param track its loudness, NULL when it is not known yet
+     */
+    esp_err_t pcm_gain_set_track(pcm_gain_handle_t g, const pcm_gain_track_t *track);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t pcm_gain_get_stats(pcm_gain_handle_t g, pcm_gain_stats_t *stats);
+
+    /**
+     * @brief Unhook and free. The pipeline must be stopped.
+     */
+    void pcm_gain_deinit(pcm_gain_handle_t g);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
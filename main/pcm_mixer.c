@@ -0,0 +1,696 @@
+/* Mixer element overlaying extra PCM streams on the pipeline output
+
+   Stream 0 is the element's input, the decoded (and resampled) music. The
+   other streams are ringbuffers that any task fills with
+   pcm_mixer_write(), e.g. the prompt player. Every block, each stream that
+   has audio queued is scaled by its gain and summed into the music block
+   with saturation; a stream with nothing queued is skipped after one look
+   at its fill level, so the cost is linear in the number of streams that
+   actually play.
+
+   Gains and sums are esp-dsp's dsps_mulc_s16 and dsps_add_s16, which have
+   PIE SIMD versions on the P4. Only those saturate: the plain C version of
+   dsps_add_s16 wraps, so init checks which one the build has and falls back
+   to a saturating C loop.
+
+   Gain changes, including ducking, ramp in steps of MIX_RAMP_FRAMES. While a
+   stream has audio, every other stream is scaled by its duck gain; the ramp
+   down and back up use the ducking stream's attack and release times.
+
+   If the pipeline stalls (between tracks, on an underrun) for longer than
+   pipeline_wait_ms while an extra stream has audio, a block of silence
+   stands in for the music so the extra streams keep playing.
+
+   A mixer created without pipeline input is first in its pipeline and
+   mixes extra streams only. The lowest one with audio takes the place of
+   the pipeline: the block is read from it, waiting up to pipeline_wait_ms,
+   and the others are mixed over it as usual.
+
+   A crossfade scales two streams by cos and sin of a quarter turn, so the
+   summed power stays constant; the factor is recomputed every
+   MIX_RAMP_FRAMES and applied with the same dsps_mulc_s16 as the gains.
+   The stream fading in may be held beforehand: its writer fills the queue
+   ahead of time and the fade starts the moment it is released, without
+   waiting for the writer.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "ringbuf.h"
+#include "dsps_add.h"
+#include "dsps_mulc.h"
+#include "pcm_mixer.h"
+
+static const char *TAG = "PCM_MIXER";
+
+#define MIX_CH (2)
+#define MIX_FRAME_BYTES ((int)(MIX_CH * sizeof(int16_t)))
+/* Gain step granularity, 0.7 ms at 48 kHz */
+#define MIX_RAMP_FRAMES (32)
+#define MIX_DEFAULT_RAMP_MS (10)
+/* 128-bit PIE loads */
+#define MIX_ALIGN (16)
+#define MIX_Q15_ONE (32767)
+
+typedef struct
+{
+    ringbuf_handle_t rb; /* NULL for the pipeline stream */
+    volatile bool open;  /* Written to and not ended yet */
+    volatile bool held;  /* Queued but not played */
+    bool active;         /* Has audio this block */
+    bool sounding;       /* Audio of it is in the block being written */
+    /* When a block with its audio was first written out since the last flush, 0 before */
+    volatile int64_t started_us;
+    volatile float gain;
+    float cur; /* Applied gain */
+    float target;
+    float down; /* Gain change per ramp step */
+    float up;
+    bool ducked; /* Ramping with the times of the stream that ducks it */
+    float fade;  /* Crossfade factor outside a fade: 1, or 0 once faded out */
+    /* Ducking applied to the other streams */
+    volatile float duck_gain;
+    volatile float attack;
+    volatile float release;
+} mix_stream_t;
+
+typedef struct
+{
+    /* Requested by pcm_mixer_crossfade(), `armed` last */
+    volatile int req_from;
+    volatile int req_to;
+    volatile int req_frames;
+    volatile bool armed; /* Starts once `req_to` has audio */
+    /* The fade running, mixer task only */
+    bool running;
+    int from;
+    int to;
+    int frames;
+    int pos;
+} mix_fade_t;
+
+typedef struct
+{
+    int rate;
+    int streams;
+    int block_frames;
+    int wait_ms;
+    bool input;      /* Stream 0 is the element's input */
+    int lead;        /* Extra stream read in place of the input, -1 for none */
+    float gain_step; /* Ramp of a plain gain change */
+    int16_t *acc;
+    int16_t *tmp;
+    int carry;
+    bool dsp_sum;
+    mix_stream_t s[PCM_MIXER_MAX_STREAMS];
+    mix_fade_t fade;
+    pcm_mixer_stats_t stats;
+} pcm_mixer_t;
+
+static float ramp_step(const pcm_mixer_t *mix, int ms)
+{
+    const float frames = (float)mix->rate * ms / 1000;
+    return frames > MIX_RAMP_FRAMES ? MIX_RAMP_FRAMES / frames : 1.0f;
+}
+
+static inline int16_t to_q15(float g)
+{
+    return g >= 1.0f ? MIX_Q15_ONE : g <= 0.0f ? 0 : (int16_t)(g * 32768.0f);
+}
+
+static void mix_add_sat(int16_t *acc, const int16_t *in, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        const int32_t v = (int32_t)acc[i] + in[i];
+        acc[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+    }
+}
+
+/* The plain C dsps_add_s16 wraps on overflow; the SIMD versions saturate */
+static bool dsp_add_saturates(void)
+{
+    int16_t a[8] __attribute__((aligned(MIX_ALIGN)));
+    int16_t b[8] __attribute__((aligned(MIX_ALIGN)));
+    int16_t out[8] __attribute__((aligned(MIX_ALIGN)));
+    for (int i = 0; i < 8; i++)
+    {
+        a[i] = INT16_MAX;
+        b[i] = 1;
+    }
+    return dsps_add_s16(a, b, out, 8, 1, 1, 1, 0) == ESP_OK && out[0] == INT16_MAX && out[7] == INT16_MAX;
+}
+
+static void mix_sum(pcm_mixer_t *mix, int16_t *acc, const int16_t *in, int samples)
+{
+    if (mix->dsp_sum)
+    {
+        dsps_add_s16(acc, in, acc, samples, 1, 1, 1, 0);
+    }
+    else
+    {
+        mix_add_sat(acc, in, samples);
+    }
+}
+
+/* Crossfade factor of stream `i`, `offset` frames into the block */
+static float mix_fade(const pcm_mixer_t *mix, int i, int offset)
+{
+    const mix_fade_t *xf = &mix->fade;
+    if (!xf->running || (i != xf->from && i != xf->to))
+    {
+        return mix->s[i].fade;
+    }
+    const float p = xf->pos + offset < xf->frames ? (float)(xf->pos + offset) / xf->frames : 1.0f;
+    const float a = p * (float)M_PI_2;
+    return i == xf->to ? sinf(a) : cosf(a);
+}
+
+/* Scale `frames` of stream `i`, stepping its gain towards the target every MIX_RAMP_FRAMES */
+static void mix_gain(pcm_mixer_t *mix, int i, int16_t *buf, int frames)
+{
+    mix_stream_t *s = &mix->s[i];
+    const bool fading = mix->fade.running && (i == mix->fade.from || i == mix->fade.to);
+    if (s->cur == s->target && !fading)
+    {
+        const float g = s->cur * s->fade;
+        if (g < 1.0f)
+        {
+            dsps_mulc_s16(buf, buf, frames * MIX_CH, to_q15(g), 1, 1);
+        }
+        return;
+    }
+    for (int f = 0; f < frames; f += MIX_RAMP_FRAMES)
+    {
+        if (s->cur > s->target)
+        {
+            s->cur = s->cur - s->down > s->target ? s->cur - s->down : s->target;
+        }
+        else if (s->cur < s->target)
+        {
+            s->cur = s->cur + s->up < s->target ? s->cur + s->up : s->target;
+        }
+        const int n = frames - f < MIX_RAMP_FRAMES ? frames - f : MIX_RAMP_FRAMES;
+        const float g = s->cur * mix_fade(mix, i, f);
+        if (g < 1.0f)
+        {
+            dsps_mulc_s16(buf + f * MIX_CH, buf + f * MIX_CH, n * MIX_CH, to_q15(g), 1, 1);
+        }
+    }
+}
+
+static void mix_fade_done(pcm_mixer_t *mix)
+{
+    mix_fade_t *xf = &mix->fade;
+    if (xf->from >= 0)
+    {
+        mix->s[xf->from].fade = 0.0f;
+    }
+    mix->s[xf->to].fade = 1.0f;
+    xf->running = false;
+    mix->stats.crossfades++;
+}
+
+/* Advance a running fade past this block */
+static void mix_fade_step(pcm_mixer_t *mix, int frames)
+{
+    mix_fade_t *xf = &mix->fade;
+    if (xf->running)
+    {
+        xf->pos += frames;
+        if (xf->pos >= xf->frames)
+        {
+            mix_fade_done(mix);
+        }
+    }
+}
+
+static bool mix_has_audio(const mix_stream_t *s)
+{
+    return !s->held && (s->open || rb_bytes_filled(s->rb) >= MIX_FRAME_BYTES);
+}
+
+/* Which streams play this block, and the gain each one ramps to. `base` is the stream read
+   into the block, the pipeline or the lead, and `has_base` whether it had audio. */
+static void mix_update(pcm_mixer_t *mix, int base, bool has_base)
+{
+    for (int i = 0; i < mix->streams; i++)
+    {
+        mix_stream_t *s = &mix->s[i];
+        s->active = i == base ? has_base : s->rb ? mix_has_audio(s) : false;
+    }
+    mix_fade_t *xf = &mix->fade;
+    if (xf->armed && mix->s[xf->req_to].active)
+    {
+        if (xf->running)
+        {
+            mix_fade_done(mix);
+        }
+        xf->armed = false;
+        xf->from = xf->req_from;
+        xf->to = xf->req_to;
+        xf->frames = xf->req_frames;
+        xf->running = true;
+        xf->pos = 0;
+        mix->s[xf->to].fade = 0.0f;
+        if (xf->frames <= 0)
+        {
+            mix_fade_done(mix);
+        }
+    }
+    for (int i = 0; i < mix->streams; i++)
+    {
+        mix_stream_t *s = &mix->s[i];
+        float duck = 1.0f;
+        for (int j = 0; j < mix->streams; j++)
+        {
+            const mix_stream_t *d = &mix->s[j];
+            if (j != i && d->active && d->duck_gain < duck)
+            {
+                duck = d->duck_gain;
+                s->down = d->attack;
+                s->up = d->release;
+            }
+        }
+        s->target = s->gain * duck;
+        if (duck < 1.0f)
+        {
+            s->ducked = true;
+        }
+        else if (s->ducked && s->cur == s->target)
+        {
+            s->ducked = false;
+        }
+        if (!s->ducked)
+        {
+            s->down = s->up = mix->gain_step;
+        }
+    }
+}
+
+static esp_err_t _mixer_open(audio_element_handle_t self)
+{
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(self);
+    for (int i = 0; i < mix->streams; i++)
+    {
+        if (mix->s[i].rb)
+        {
+            rb_reset(mix->s[i].rb);
+        }
+    }
+    mix->carry = 0;
+    mix->lead = -1;
+    if (mix->input)
+    {
+        audio_element_set_input_timeout(self, pdMS_TO_TICKS(mix->wait_ms));
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _mixer_close(audio_element_handle_t self)
+{
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(self);
+    /* Writers blocked on a full stream must not wait for a restart */
+    for (int i = 0; i < mix->streams; i++)
+    {
+        if (mix->s[i].rb)
+        {
+            rb_abort(mix->s[i].rb);
+        }
+    }
+    if (mix->stats.stream_frames)
+    {
+        ESP_LOGI(TAG, "%u cycles per stream frame (%s sums)", (unsigned)mix->stats.cycles_per_stream_frame,
+                 mix->dsp_sum ? "esp-dsp" : "C");
+    }
+    return ESP_OK;
+}
+
+static bool mix_extra_active(pcm_mixer_t *mix)
+{
+    for (int i = 1; i < mix->streams; i++)
+    {
+        if (mix_has_audio(&mix->s[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Without pipeline input: the lowest extra stream with audio, kept while a frame is split */
+static int mix_pick_lead(pcm_mixer_t *mix)
+{
+    if (mix->carry == 0)
+    {
+        mix->lead = -1;
+        for (int i = 1; i < mix->streams && mix->lead < 0; i++)
+        {
+            if (mix_has_audio(&mix->s[i]))
+            {
+                mix->lead = i;
+            }
+        }
+    }
+    return mix->lead;
+}
+
+static int _mixer_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(self);
+    const int block_bytes = mix->block_frames * MIX_FRAME_BYTES;
+    char *acc = (char *)mix->acc;
+
+    int base = PCM_MIXER_STREAM_PIPELINE;
+    int r;
+    if (mix->input)
+    {
+        r = audio_element_input(self, acc + mix->carry, block_bytes - mix->carry);
+    }
+    else if ((base = mix_pick_lead(mix)) >= 0)
+    {
+        r = rb_read(mix->s[base].rb, acc + mix->carry, block_bytes - mix->carry, pdMS_TO_TICKS(mix->wait_ms));
+    }
+    else
+    {
+        /* Nothing to play: wait here rather than spin, the output blocks on nothing */
+        vTaskDelay(pdMS_TO_TICKS(mix->wait_ms));
+        return AEL_IO_TIMEOUT;
+    }
+    int frames;
+    bool pipeline = r > 0;
+    if (pipeline)
+    {
+        r += mix->carry;
+        frames = r / MIX_FRAME_BYTES;
+        if (frames == 0)
+        {
+            /* Less than a frame; 0 would end the element */
+            mix->carry = r;
+            return r;
+        }
+    }
+    else if (r == AEL_IO_TIMEOUT && mix->carry == 0 && mix_extra_active(mix))
+    {
+        frames = mix->block_frames;
+        memset(acc, 0, block_bytes);
+        r = 0;
+    }
+    else
+    {
+        return r;
+    }
+
+    const uint32_t t0 = esp_cpu_get_cycle_count();
+    mix_update(mix, base, pipeline);
+    int mixed = 0;
+    if (pipeline)
+    {
+        mix_gain(mix, base, mix->acc, frames);
+        mix->s[base].sounding = true;
+        mixed += frames;
+    }
+    for (int i = 1; i < mix->streams; i++)
+    {
+        mix_stream_t *s = &mix->s[i];
+        if (!s->active || i == base)
+        {
+            continue;
+        }
+        int take = rb_bytes_filled(s->rb) / MIX_FRAME_BYTES * MIX_FRAME_BYTES;
+        if (take > frames * MIX_FRAME_BYTES)
+        {
+            take = frames * MIX_FRAME_BYTES;
+        }
+        if (take <= 0 || (take = rb_read(s->rb, (char *)mix->tmp, take, 0)) <= 0)
+        {
+            continue;
+        }
+        mix_gain(mix, i, mix->tmp, take / MIX_FRAME_BYTES);
+        mix_sum(mix, mix->acc, mix->tmp, take / sizeof(int16_t));
+        s->sounding = true;
+        mixed += take / MIX_FRAME_BYTES;
+    }
+    mix_fade_step(mix, frames);
+    mix->stats.cycles += esp_cpu_get_cycle_count() - t0;
+    mix->stats.frames += frames;
+    mix->stats.stream_frames += mixed;
+    if (mix->stats.stream_frames)
+    {
+        mix->stats.cycles_per_stream_frame = (uint32_t)(mix->stats.cycles / mix->stats.stream_frames);
+    }
+
+    int ret = audio_element_output(self, acc, frames * MIX_FRAME_BYTES);
+    const int64_t now_us = ret > 0 ? esp_timer_get_time() : 0;
+    for (int i = 0; i < mix->streams; i++)
+    {
+        mix_stream_t *s = &mix->s[i];
+        if (s->sounding && s->started_us == 0)
+        {
+            s->started_us = now_us;
+        }
+        s->sounding = false;
+    }
+    /* A frame split across reads is completed by the next one */
+    mix->carry = r - frames * MIX_FRAME_BYTES;
+    if (mix->carry > 0)
+    {
+        memmove(acc, acc + frames * MIX_FRAME_BYTES, mix->carry);
+    }
+    else
+    {
+        mix->carry = 0;
+    }
+    return ret <= 0 ? ret : frames * MIX_FRAME_BYTES;
+}
+
+static esp_err_t _mixer_destroy(audio_element_handle_t self)
+{
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(self);
+    for (int i = 1; i < mix->streams; i++)
+    {
+        rb_destroy(mix->s[i].rb);
+    }
+    heap_caps_free(mix->acc);
+    heap_caps_free(mix->tmp);
+    audio_free(mix);
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_mixer_init(pcm_mixer_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, config, return NULL);
+    if (config->rate <= 0 || config->streams < 1 || config->streams > PCM_MIXER_MAX_STREAMS ||
+        config->block_frames <= 0 || config->block_frames % MIX_RAMP_FRAMES || config->stream_rb_size <= 0)
+    {
+        ESP_LOGE(TAG, "Invalid mixer configuration");
+        return NULL;
+    }
+
+    pcm_mixer_t *mix = audio_calloc(1, sizeof(pcm_mixer_t));
+    AUDIO_MEM_CHECK(TAG, mix, return NULL);
+    mix->rate = config->rate;
+    mix->streams = config->streams;
+    mix->block_frames = config->block_frames;
+    mix->wait_ms = config->pipeline_wait_ms;
+    mix->input = config->pipeline_input;
+    mix->lead = -1;
+    mix->fade.from = mix->fade.req_from = -1;
+    mix->gain_step = ramp_step(mix, MIX_DEFAULT_RAMP_MS);
+    mix->dsp_sum = dsp_add_saturates();
+    mix->stats.dsp_sum = mix->dsp_sum;
+
+    const size_t block_bytes = config->block_frames * MIX_FRAME_BYTES;
+    mix->acc = heap_caps_aligned_alloc(MIX_ALIGN, block_bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    mix->tmp = heap_caps_aligned_alloc(MIX_ALIGN, block_bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    bool ok = mix->acc && mix->tmp;
+    for (int i = 0; i < mix->streams; i++)
+    {
+        mix_stream_t *s = &mix->s[i];
+        s->gain = s->cur = s->target = s->fade = 1.0f;
+        s->duck_gain = 1.0f;
+        s->down = s->up = s->attack = s->release = mix->gain_step;
+        if (i > 0)
+        {
+            s->rb = rb_create(config->stream_rb_size, 1);
+            ok = ok && s->rb;
+        }
+    }
+
+    audio_element_handle_t el = NULL;
+    if (ok)
+    {
+        audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+        cfg.open = _mixer_open;
+        cfg.close = _mixer_close;
+        cfg.process = _mixer_process;
+        cfg.destroy = _mixer_destroy;
+        cfg.buffer_len = 0; /* input goes into mix->acc */
+        cfg.out_rb_size = config->out_rb_size;
+        cfg.task_stack = config->task_stack;
+        cfg.task_core = config->task_core;
+        cfg.task_prio = config->task_prio;
+        cfg.stack_in_ext = config->ext_stack;
+        cfg.tag = "mix";
+        el = audio_element_init(&cfg);
+    }
+    AUDIO_MEM_CHECK(TAG, el, {
+        for (int i = 1; i < mix->streams; i++)
+        {
+            if (mix->s[i].rb)
+            {
+                rb_destroy(mix->s[i].rb);
+            }
+        }
+        heap_caps_free(mix->acc);
+        heap_caps_free(mix->tmp);
+        audio_free(mix);
+        return NULL;
+    });
+    audio_element_setdata(el, mix);
+    ESP_LOGI(TAG, "%d streams at %d Hz%s, %d frame blocks, %s sums", mix->streams, mix->rate,
+             mix->input ? "" : " (no pipeline input)", mix->block_frames, mix->dsp_sum ? "esp-dsp" : "C");
+    return el;
+}
+
+static mix_stream_t *get_stream(audio_element_handle_t el, int stream, bool extra)
+{
+    if (el == NULL)
+    {
+        return NULL;
+    }
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(el);
+    if (stream < (extra ? 1 : 0) || stream >= mix->streams)
+    {
+        return NULL;
+    }
+    return &mix->s[stream];
+}
+
+esp_err_t pcm_mixer_set_gain(audio_element_handle_t el, int stream, float gain)
+{
+    mix_stream_t *s = get_stream(el, stream, false);
+    if (s == NULL || gain < 0.0f || gain > 1.0f)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s->gain = gain;
+    return ESP_OK;
+}
+
+esp_err_t pcm_mixer_set_ducking(audio_element_handle_t el, int stream, float duck_gain, int attack_ms, int release_ms)
+{
+    mix_stream_t *s = get_stream(el, stream, false);
+    if (s == NULL || duck_gain < 0.0f || duck_gain > 1.0f || attack_ms < 0 || release_ms < 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const pcm_mixer_t *mix = (const pcm_mixer_t *)audio_element_getdata(el);
+    s->attack = ramp_step(mix, attack_ms);
+    s->release = ramp_step(mix, release_ms);
+    s->duck_gain = duck_gain;
+    return ESP_OK;
+}
+
+int pcm_mixer_write(audio_element_handle_t el, int stream, const void *buf, int len, TickType_t ticks)
+{
+    mix_stream_t *s = get_stream(el, stream, true);
+    if (s == NULL || buf == NULL)
+    {
+        return RB_FAIL;
+    }
+    s->open = true;
+    return rb_write(s->rb, (char *)buf, len, ticks);
+}
+
+esp_err_t pcm_mixer_flush(audio_element_handle_t el, int stream)
+{
+    mix_stream_t *s = get_stream(el, stream, true);
+    if (s == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t ret = rb_reset(s->rb);
+    s->started_us = 0;
+    return ret;
+}
+
+int64_t pcm_mixer_started_us(audio_element_handle_t el, int stream)
+{
+    mix_stream_t *s = get_stream(el, stream, true);
+    if (s == NULL)
+    {
+        return 0;
+    }
+    /* Two words, written by the mixer task */
+    int64_t us;
+    do
+    {
+        us = s->started_us;
+    } while (us != s->started_us);
+    return us;
+}
+
+esp_err_t pcm_mixer_stream_end(audio_element_handle_t el, int stream)
+{
+    mix_stream_t *s = get_stream(el, stream, true);
+    if (s == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s->open = false;
+    return ESP_OK;
+}
+
+esp_err_t pcm_mixer_set_hold(audio_element_handle_t el, int stream, bool hold)
+{
+    mix_stream_t *s = get_stream(el, stream, true);
+    if (s == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s->held = hold;
+    return ESP_OK;
+}
+
+esp_err_t pcm_mixer_crossfade(audio_element_handle_t el, int from, int to, int ms)
+{
+    mix_stream_t *s = get_stream(el, to, false);
+    if (s == NULL || from == to || (from >= 0 && get_stream(el, from, false) == NULL) || ms < 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(el);
+    mix_fade_t *xf = &mix->fade;
+    xf->armed = false;
+    xf->req_from = from;
+    xf->req_to = to;
+    xf->req_frames = (int)((int64_t)mix->rate * ms / 1000);
+    xf->armed = true;
+    s->held = false;
+    return ESP_OK;
+}
+
+esp_err_t pcm_mixer_get_stats(audio_element_handle_t el, pcm_mixer_stats_t *stats)
+{
+    if (!el || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pcm_mixer_t *mix = (pcm_mixer_t *)audio_element_getdata(el);
+    *stats = mix->stats;
+    return ESP_OK;
+}
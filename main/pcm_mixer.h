@@ -0,0 +1,154 @@
+/* Mixer element overlaying extra PCM streams on the pipeline output
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PCM_MIXER_H__
+#define __PCM_MIXER_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define PCM_MIXER_MAX_STREAMS (4)
+/* The element's own input, i.e. the pipeline */
+#define PCM_MIXER_STREAM_PIPELINE (0)
+
+    /**
+     * @brief Mixer configuration. Every stream is 16-bit stereo at `rate`.
+     */
+    typedef struct
+    {
+        int rate;             /*!< Sample rate of all streams, for the gain ramps */
+        int streams;          /*!< Inputs including the pipeline, up to PCM_MIXER_MAX_STREAMS */
+        int block_frames;     /*!< Frames mixed per process call, a multiple of 32 */
+        int stream_rb_size;   /*!< Ringbuffer of each extra stream */
+        int pipeline_wait_ms; /*!< How long a stalled pipeline may hold back the extra streams */
+        bool pipeline_input;  /*!< false when the mixer is first in its pipeline: stream 0 is unused */
+        int out_rb_size;      /*!< Output ringbuffer size */
+        int task_stack;       /*!< Task stack size */
+        int task_core;        /*!< Task running in core */
+        int task_prio;        /*!< Task priority */
+        bool ext_stack;       /*!< Allocate the task stack in PSRAM */
+    } pcm_mixer_cfg_t;
+
+#define PCM_MIXER_BLOCK_FRAMES (256)
+#define PCM_MIXER_STREAM_RINGBUFFER_SIZE (8 * 1024)
+#define PCM_MIXER_RINGBUFFER_SIZE (8 * 1024)
+#define PCM_MIXER_TASK_STACK (3072)
+#define PCM_MIXER_TASK_CORE (0)
+#define PCM_MIXER_TASK_PRIO (5)
+
+#define PCM_MIXER_CFG_DEFAULT()                             \
+    {                                                       \
+        .rate = 48000,                                      \
+        .streams = 2,                                       \
+        .block_frames = PCM_MIXER_BLOCK_FRAMES,             \
+        .stream_rb_size = PCM_MIXER_STREAM_RINGBUFFER_SIZE, \
+        .pipeline_wait_ms = 20,                             \
+        .pipeline_input = true,                             \
+        .out_rb_size = PCM_MIXER_RINGBUFFER_SIZE,           \
+        .task_stack = PCM_MIXER_TASK_STACK,                 \
+        .task_core = PCM_MIXER_TASK_CORE,                   \
+        .task_prio = PCM_MIXER_TASK_PRIO,                   \
+        .ext_stack = false,                                 \
+    }
+
+    /**
+     * @brief Mixing cost since the element was created
+     */
+    typedef struct
+    {
+        uint64_t frames;                  /*!< Output frames */
+        uint64_t stream_frames;           /*!< Input frames mixed, summed over the streams that had audio */
+        uint64_t cycles;                  /*!< CPU cycles spent on gains and sums */
+        uint32_t cycles_per_stream_frame; /*!< cycles / stream_frames */
+        bool dsp_sum;                     /*!< Sums run on esp-dsp; false when its build wraps instead of saturating */
+        uint32_t crossfades;              /*!< Crossfades completed */
+    } pcm_mixer_stats_t;
+
+    /**
+     * @brief Create the mixer element. Its input is the pipeline (stream 0); the other streams
+     *        are fed with pcm_mixer_write(). A stream without queued audio costs nothing.
+     *        Without `pipeline_input` the lowest extra stream with audio sets the pace instead.
+     *
+     * @param config the configuration
+     *
+     * @return The audio element handle
+     */
+    audio_element_handle_t pcm_mixer_init(pcm_mixer_cfg_t *config);
+
+    /**
+     * @brief Set the gain of a stream, 0.0 to 1.0. Ramps in over about 10 ms.
+     */
+    esp_err_t pcm_mixer_set_gain(audio_element_handle_t el, int stream, float gain);
+
+    /**
+     * @brief While `stream` has audio, scale every other stream by `duck_gain`.
+     *        The other streams ramp down over `attack_ms` and back up over `release_ms`
+     *        once it has played out. A duck_gain of 1.0 (the default) disables ducking.
+     */
+    esp_err_t pcm_mixer_set_ducking(audio_element_handle_t el, int stream, float duck_gain, int attack_ms, int release_ms);
+
+    /**
+     * @brief Queue audio on an extra stream (not PCM_MIXER_STREAM_PIPELINE)
+     *
+     * @return Bytes queued, or a negative ringbuffer error such as RB_TIMEOUT, RB_ABORT
+     *         once the element has stopped
+     */
+    int pcm_mixer_write(audio_element_handle_t el, int stream, const void *buf, int len, TickType_t ticks);
+
+    /**
+     * @brief Drop the audio queued on an extra stream
+     */
+    esp_err_t pcm_mixer_flush(audio_element_handle_t el, int stream);
+
+    /**
+     * @brief When the first audio queued on an extra stream since its last flush was written
+     *        to the output, e.g. into the I2S DMA buffers by a direct sink
+     *
+     * @return esp_timer time, 0 while none of it has been written
+     */
+    int64_t pcm_mixer_started_us(audio_element_handle_t el, int stream);
+
+    /**
+     * @brief Mark the end of what is queued on an extra stream. A stream ducks the others
+     *        from its first write until its queue has played out after this call.
+     */
+    esp_err_t pcm_mixer_stream_end(audio_element_handle_t el, int stream);
+
+    /**
+     * @brief Hold an extra stream: its queue fills, up to blocking the writer, but nothing of it
+     *        is played until it is released, e.g. by pcm_mixer_crossfade()
+     */
+    esp_err_t pcm_mixer_set_hold(audio_element_handle_t el, int stream, bool hold);
+
+    /**
+     * @brief Fade `from` out and `to` in over `ms` with equal-power gains, cosine and sine, on top
+     *        of their gains and ducking. `to` is released from hold and the fade starts with the
+     *        first block it has audio in; a fade still running completes at once. `from` stays
+     *        silent afterwards until it is faded in again.
+     *
+     * @param from stream to fade out, -1 for none
+     * @param ms   0 to switch at once
+     */
+    esp_err_t pcm_mixer_crossfade(audio_element_handle_t el, int from, int to, int ms);
+
+    /**
+     * @brief Get the mixing statistics
+     */
+    esp_err_t pcm_mixer_get_stats(audio_element_handle_t el, pcm_mixer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,472 @@
+/* Polyphase resampler element locking the output at a fixed rate
+
+   The ratio out_rate / src_rate is reduced to L / M. The prototype low-pass
+   (Kaiser-windowed sinc, cutoff below the lower of the two Nyquist rates) is
+   designed at L * src_rate and split into L phases of `taps` coefficients.
+   Each output sample is one dot product of a phase with the newest `taps`
+   input samples; after it the input position advances by M / L.
+
+   Coefficients are Q14 so a full-scale overshoot of the filter cannot wrap:
+   the dot product yields half the output level, which is then doubled with
+   saturation. The dot product is esp-dsp's dsps_dotprod_s16, which maps to
+   the PIE SIMD version on the P4 and to plain C elsewhere.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "dsps_dotprod.h"
+#include "pcm_resampler.h"
+
+static const char *TAG = "PCM_RESAMPLER";
+
+/* 11025 -> 48000 needs 640 phases, the most of any MP3 rate pair */
+#define RSP_MAX_PHASES (1024)
+#define RSP_MAX_CH (2)
+/* Output frames per audio_element_output() call */
+#define RSP_OUT_FRAMES (256)
+/* 128-bit PIE loads; taps are multiples of 8 so every phase row stays aligned */
+#define RSP_ALIGN (16)
+
+typedef struct
+{
+    int taps;
+    float beta;
+    float cutoff;
+} rsp_quality_t;
+
+static const rsp_quality_t s_quality[] = {
+    [PCM_RESAMPLER_QUALITY_LOW] = {16, 5.0f, 0.80f},
+    [PCM_RESAMPLER_QUALITY_MEDIUM] = {32, 7.0f, 0.90f},
+    [PCM_RESAMPLER_QUALITY_HIGH] = {64, 9.0f, 0.94f},
+};
+
+typedef struct
+{
+    const rsp_quality_t *q;
+    int out_rate;
+    /* Format the filter is built for */
+    int src_rate;
+    int src_ch;
+    /* Written by pcm_resampler_set_src_info() from another task */
+    volatile int pending_rate;
+    volatile int pending_ch;
+    bool passthrough;
+    int phases; /* L */
+    int step;   /* M */
+    int16_t *bank;
+    /* Per-channel input history: taps - 1 samples of context, then the unconsumed input */
+    int16_t *hist[RSP_MAX_CH];
+    int hist_cap;
+    int hist_fill;
+    int pos;
+    int phase;
+    char *in_buf;
+    int in_size;
+    int in_carry;
+    int16_t *out_buf;
+    pcm_resampler_stats_t stats;
+} pcm_resampler_t;
+
+static int gcd(int a, int b)
+{
+    while (b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Zeroth-order modified Bessel function of the first kind, for the Kaiser window */
+static float bessel_i0(float x)
+{
+    float sum = 1.0f, term = 1.0f;
+    const float q = x * x / 4.0f;
+    for (int k = 1; k < 32 && term > sum * 1e-8f; k++)
+    {
+        term *= q / ((float)k * k);
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * bank[p * taps + j] multiplies hist[pos + j]; the newest sample is at j = taps - 1,
+ * so the row is the phase-p polyphase branch reversed. Each row is normalised to a
+ * DC gain of 1, which also absorbs the interpolation gain of L.
+ */
+static void rsp_design(pcm_resampler_t *rsp)
+{
+    const int taps = rsp->q->taps;
+    const int L = rsp->phases;
+    const int n = L * taps;
+    const float centre = (n - 1) / 2.0f;
+    const float wc = rsp->q->cutoff / (float)(L > rsp->step ? L : rsp->step);
+    const float i0_beta = bessel_i0(rsp->q->beta);
+
+    for (int p = 0; p < L; p++)
+    {
+        float h[64];
+        float sum = 0.0f;
+        for (int j = 0; j < taps; j++)
+        {
+            const float t = (float)((taps - 1 - j) * L + p) - centre;
+            const float x = wc * t;
+            const float sinc = fabsf(x) < 1e-6f ? 1.0f : sinf((float)M_PI * x) / ((float)M_PI * x);
+            const float r = 2.0f * t / (float)(n - 1);
+            const float w = bessel_i0(rsp->q->beta * sqrtf(fmaxf(0.0f, 1.0f - r * r))) / i0_beta;
+            h[j] = sinc * w;
+            sum += h[j];
+        }
+        for (int j = 0; j < taps; j++)
+        {
+            rsp->bank[p * taps + j] = (int16_t)lrintf(h[j] / sum * 16384.0f);
+        }
+    }
+}
+
+static void rsp_reset_history(pcm_resampler_t *rsp)
+{
+    /* Start on silence so the first output is already a full-length window */
+    rsp->hist_fill = rsp->passthrough ? 0 : rsp->q->taps - 1;
+    for (int c = 0; c < RSP_MAX_CH; c++)
+    {
+        memset(rsp->hist[c], 0, rsp->hist_fill * sizeof(int16_t));
+    }
+    rsp->pos = 0;
+    rsp->phase = 0;
+    rsp->in_carry = 0;
+}
+
+static esp_err_t rsp_configure(pcm_resampler_t *rsp)
+{
+    const int rate = rsp->pending_rate;
+    const int ch = rsp->pending_ch;
+    const int g = gcd(rsp->out_rate, rate);
+    const int L = rsp->out_rate / g;
+    if (L > RSP_MAX_PHASES)
+    {
+        ESP_LOGE(TAG, "%d Hz -> %d Hz needs %d phases", rate, rsp->out_rate, L);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    rsp->src_rate = rate;
+    rsp->src_ch = ch;
+    rsp->passthrough = rate == rsp->out_rate;
+    rsp->stats.src_rate = rate;
+    if (!rsp->passthrough && (L != rsp->phases || rate / g != rsp->step || rsp->bank == NULL))
+    {
+        const size_t size = (size_t)L * rsp->q->taps * sizeof(int16_t);
+        heap_caps_free(rsp->bank);
+        rsp->bank = heap_caps_aligned_alloc(RSP_ALIGN, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (rsp->bank == NULL)
+        {
+            rsp->bank = heap_caps_aligned_alloc(RSP_ALIGN, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        AUDIO_MEM_CHECK(TAG, rsp->bank, return ESP_ERR_NO_MEM);
+        rsp->phases = L;
+        rsp->step = rate / g;
+        rsp_design(rsp);
+    }
+    rsp->stats.phases = rsp->passthrough ? 0 : L;
+    rsp_reset_history(rsp);
+    ESP_LOGI(TAG, "%d Hz %d ch -> %d Hz: %s", rate, ch, rsp->out_rate, rsp->passthrough ? "pass through" : "filtering");
+    return ESP_OK;
+}
+
+static int rsp_flush(audio_element_handle_t self, pcm_resampler_t *rsp, int frames)
+{
+    if (frames == 0)
+    {
+        return 0;
+    }
+    return audio_element_output(self, (char *)rsp->out_buf, frames * RSP_MAX_CH * sizeof(int16_t));
+}
+
+static inline int16_t sat_double(int16_t half)
+{
+    const int32_t v = (int32_t)half * 2;
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+}
+
+static int rsp_filter(audio_element_handle_t self, pcm_resampler_t *rsp)
+{
+    const int taps = rsp->q->taps;
+    const int L = rsp->phases;
+    const int M = rsp->step;
+    int frames = 0;
+    int ret = 0;
+    uint64_t cycles = 0;
+    uint32_t samples = 0;
+
+    uint32_t t0 = esp_cpu_get_cycle_count();
+    while (rsp->pos + taps <= rsp->hist_fill)
+    {
+        const int16_t *h = rsp->bank + rsp->phase * taps;
+        int16_t *out = rsp->out_buf + frames * RSP_MAX_CH;
+        int16_t half;
+        dsps_dotprod_s16(rsp->hist[0] + rsp->pos, h, &half, taps, 0);
+        out[0] = sat_double(half);
+        if (rsp->src_ch == 2)
+        {
+            dsps_dotprod_s16(rsp->hist[1] + rsp->pos, h, &half, taps, 0);
+            out[1] = sat_double(half);
+        }
+        else
+        {
+            out[1] = out[0];
+        }
+        /* The output is stereo whatever the input */
+        samples += 2;
+
+        rsp->phase += M;
+        rsp->pos += rsp->phase / L;
+        rsp->phase %= L;
+        if (++frames == RSP_OUT_FRAMES)
+        {
+            cycles += esp_cpu_get_cycle_count() - t0;
+            ret = rsp_flush(self, rsp, frames);
+            frames = 0;
+            t0 = esp_cpu_get_cycle_count();
+            if (ret <= 0)
+            {
+                /* Still compact below, or the next call appends past hist_cap */
+                break;
+            }
+        }
+    }
+    cycles += esp_cpu_get_cycle_count() - t0;
+
+    rsp->stats.cycles += cycles;
+    rsp->stats.out_samples += samples;
+    if (rsp->stats.out_samples)
+    {
+        rsp->stats.cycles_per_sample = (uint32_t)(rsp->stats.cycles / rsp->stats.out_samples);
+    }
+
+    /* Keep the unconsumed tail, which always includes the taps - 1 samples of context */
+    const int keep = rsp->hist_fill - rsp->pos;
+    for (int c = 0; c < rsp->src_ch; c++)
+    {
+        memmove(rsp->hist[c], rsp->hist[c] + rsp->pos, keep * sizeof(int16_t));
+    }
+    rsp->hist_fill = keep;
+    rsp->pos = 0;
+
+    if (frames)
+    {
+        ret = rsp_flush(self, rsp, frames);
+    }
+    return ret;
+}
+
+static int rsp_passthrough(audio_element_handle_t self, pcm_resampler_t *rsp, int frames)
+{
+    const int16_t *in = (const int16_t *)rsp->in_buf;
+    if (rsp->src_ch == 2)
+    {
+        return audio_element_output(self, rsp->in_buf, frames * 2 * sizeof(int16_t));
+    }
+    int ret = 0;
+    for (int i = 0; i < frames;)
+    {
+        int n = 0;
+        for (; n < RSP_OUT_FRAMES && i < frames; n++, i++)
+        {
+            rsp->out_buf[n * 2] = rsp->out_buf[n * 2 + 1] = in[i];
+        }
+        ret = rsp_flush(self, rsp, n);
+        if (ret <= 0)
+        {
+            return ret;
+        }
+    }
+    return ret;
+}
+
+static esp_err_t _rsp_open(audio_element_handle_t self)
+{
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(self);
+    if (rsp->pending_rate != rsp->src_rate || rsp->pending_ch != rsp->src_ch)
+    {
+        return rsp_configure(rsp);
+    }
+    rsp_reset_history(rsp);
+    return ESP_OK;
+}
+
+static esp_err_t _rsp_close(audio_element_handle_t self)
+{
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(self);
+    if (rsp->stats.out_samples)
+    {
+        ESP_LOGI(TAG, "%d phases x %d taps: %u cycles per output sample", rsp->stats.phases, rsp->stats.taps,
+                 (unsigned)rsp->stats.cycles_per_sample);
+    }
+    return ESP_OK;
+}
+
+static int _rsp_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(self);
+    if (rsp->pending_rate != rsp->src_rate || rsp->pending_ch != rsp->src_ch)
+    {
+        if (rsp_configure(rsp) != ESP_OK)
+        {
+            return AEL_PROCESS_FAIL;
+        }
+    }
+
+    int r = audio_element_input(self, rsp->in_buf + rsp->in_carry, rsp->in_size - rsp->in_carry);
+    if (r <= 0)
+    {
+        return r;
+    }
+    r += rsp->in_carry;
+    const int frame_bytes = rsp->src_ch * sizeof(int16_t);
+    const int frames = r / frame_bytes;
+
+    int ret;
+    if (rsp->passthrough)
+    {
+        ret = rsp_passthrough(self, rsp, frames);
+    }
+    else
+    {
+        /* hist_cap leaves room for a full in_buf after the context */
+        const int16_t *in = (const int16_t *)rsp->in_buf;
+        for (int c = 0; c < rsp->src_ch; c++)
+        {
+            int16_t *h = rsp->hist[c] + rsp->hist_fill;
+            for (int i = 0; i < frames; i++)
+            {
+                h[i] = in[i * rsp->src_ch + c];
+            }
+        }
+        rsp->hist_fill += frames;
+        ret = rsp_filter(self, rsp);
+    }
+
+    /* A frame split across reads is completed by the next one */
+    rsp->in_carry = r - frames * frame_bytes;
+    if (rsp->in_carry)
+    {
+        memmove(rsp->in_buf, rsp->in_buf + frames * frame_bytes, rsp->in_carry);
+    }
+    /* A read that completed no output frame is still progress, and 0 would end the element */
+    return ret < 0 ? ret : r;
+}
+
+static esp_err_t _rsp_destroy(audio_element_handle_t self)
+{
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(self);
+    heap_caps_free(rsp->bank);
+    for (int c = 0; c < RSP_MAX_CH; c++)
+    {
+        heap_caps_free(rsp->hist[c]);
+    }
+    audio_free(rsp->in_buf);
+    audio_free(rsp->out_buf);
+    audio_free(rsp);
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_resampler_init(pcm_resampler_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, config, return NULL);
+    if (config->out_rate <= 0 || config->src_rate <= 0 || config->src_ch < 1 || config->src_ch > RSP_MAX_CH ||
+        config->quality > PCM_RESAMPLER_QUALITY_HIGH || config->in_size < (int)(RSP_MAX_CH * sizeof(int16_t)))
+    {
+        ESP_LOGE(TAG, "Invalid resampler configuration");
+        return NULL;
+    }
+
+    pcm_resampler_t *rsp = audio_calloc(1, sizeof(pcm_resampler_t));
+    AUDIO_MEM_CHECK(TAG, rsp, return NULL);
+    rsp->q = &s_quality[config->quality];
+    rsp->out_rate = config->out_rate;
+    rsp->pending_rate = config->src_rate;
+    rsp->pending_ch = config->src_ch;
+    rsp->in_size = config->in_size;
+    rsp->stats.out_rate = config->out_rate;
+    rsp->stats.taps = rsp->q->taps;
+
+    /* Worst case is mono input: in_size / 2 new samples on top of the context */
+    rsp->hist_cap = rsp->q->taps + config->in_size / sizeof(int16_t);
+    bool ok = true;
+    for (int c = 0; c < RSP_MAX_CH; c++)
+    {
+        rsp->hist[c] = heap_caps_aligned_alloc(RSP_ALIGN, rsp->hist_cap * sizeof(int16_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        ok = ok && rsp->hist[c];
+    }
+    rsp->in_buf = audio_calloc(1, config->in_size);
+    rsp->out_buf = audio_calloc(RSP_OUT_FRAMES * RSP_MAX_CH, sizeof(int16_t));
+    ok = ok && rsp->in_buf && rsp->out_buf;
+
+    audio_element_handle_t el = NULL;
+    if (ok)
+    {
+        audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+        cfg.open = _rsp_open;
+        cfg.close = _rsp_close;
+        cfg.process = _rsp_process;
+        cfg.destroy = _rsp_destroy;
+        cfg.buffer_len = 0; /* input goes into rsp->in_buf */
+        cfg.out_rb_size = config->out_rb_size;
+        cfg.task_stack = config->task_stack;
+        cfg.task_core = config->task_core;
+        cfg.task_prio = config->task_prio;
+        cfg.stack_in_ext = config->ext_stack;
+        cfg.tag = "rsp";
+        el = audio_element_init(&cfg);
+    }
+    AUDIO_MEM_CHECK(TAG, el, {
+        for (int c = 0; c < RSP_MAX_CH; c++)
+        {
+            heap_caps_free(rsp->hist[c]);
+        }
+        audio_free(rsp->in_buf);
+        audio_free(rsp->out_buf);
+        audio_free(rsp);
+        return NULL;
+    });
+    audio_element_setdata(el, rsp);
+    ESP_LOGI(TAG, "Output locked at %d Hz, %d taps per phase", config->out_rate, rsp->q->taps);
+    return el;
+}
+
+esp_err_t pcm_resampler_set_src_info(audio_element_handle_t el, int rate, int ch)
+{
+    if (!el || rate <= 0 || ch < 1 || ch > RSP_MAX_CH)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(el);
+    rsp->pending_ch = ch;
+    rsp->pending_rate = rate;
+    return ESP_OK;
+}
+
+esp_err_t pcm_resampler_get_stats(audio_element_handle_t el, pcm_resampler_stats_t *stats)
+{
+    if (!el || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pcm_resampler_t *rsp = (pcm_resampler_t *)audio_element_getdata(el);
+    *stats = rsp->stats;
+    return ESP_OK;
+}
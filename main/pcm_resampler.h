@@ -0,0 +1,115 @@
+/* Polyphase resampler element locking the output at a fixed rate
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PCM_RESAMPLER_H__
+#define __PCM_RESAMPLER_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Filter quality
+     */
+    typedef enum
+    {
+        PCM_RESAMPLER_QUALITY_LOW = 0, /*!< 16 taps per phase, Kaiser beta 5, cutoff at 80% of the lower Nyquist */
+        PCM_RESAMPLER_QUALITY_MEDIUM,  /*!< 32 taps per phase, Kaiser beta 7, cutoff at 90% */
+        PCM_RESAMPLER_QUALITY_HIGH,    /*!< 64 taps per phase, Kaiser beta 9, cutoff at 94% */
+    } pcm_resampler_quality_t;
+
+    /**
+     * @brief Resampler configuration
+     */
+    typedef struct
+    {
+        int out_rate;                    /*!< Fixed output rate; output is always 16-bit stereo */
+        int src_rate;                    /*!< Input rate assumed until pcm_resampler_set_src_info() */
+        int src_ch;                      /*!< Input channels assumed until pcm_resampler_set_src_info() */
+        pcm_resampler_quality_t quality; /*!< Filter quality */
+        int in_size;                     /*!< Bytes read from the input ringbuffer per process call */
+        int out_rb_size;                 /*!< Output ringbuffer size */
+        int task_stack;                  /*!< Task stack size */
+        int task_core;                   /*!< Task running in core */
+        int task_prio;                   /*!< Task priority */
+        bool ext_stack;                  /*!< Allocate the task stack in PSRAM */
+    } pcm_resampler_cfg_t;
+
+#define PCM_RESAMPLER_IN_SIZE (2048)
+#define PCM_RESAMPLER_RINGBUFFER_SIZE (8 * 1024)
+#define PCM_RESAMPLER_TASK_STACK (3072)
+#define PCM_RESAMPLER_TASK_CORE (0)
+#define PCM_RESAMPLER_TASK_PRIO (5)
+
+#define PCM_RESAMPLER_CFG_DEFAULT()                     \
+    {                                                   \
+        .out_rate = 48000,                              \
+        .src_rate = 44100,                              \
+        .src_ch = 2,                                    \
+        .quality = PCM_RESAMPLER_QUALITY_MEDIUM,        \
+        .in_size = PCM_RESAMPLER_IN_SIZE,               \
+        .out_rb_size = PCM_RESAMPLER_RINGBUFFER_SIZE,   \
+        .task_stack = PCM_RESAMPLER_TASK_STACK,         \
+        .task_core = PCM_RESAMPLER_TASK_CORE,           \
+        .task_prio = PCM_RESAMPLER_TASK_PRIO,           \
+        .ext_stack = false,                             \
+    }
+
+    /**
+     * @brief Filter cost since the element was created
+     */
+    typedef struct
+    {
+        int src_rate;               /*!< Current input rate */
+        int out_rate;               /*!< Output rate */
+        int phases;                 /*!< Filter phases, out_rate / gcd(src_rate, out_rate); 0 when passing through */
+        int taps;                   /*!< Taps per phase */
+        uint64_t out_samples;       /*!< Filtered output samples, two per stereo frame */
+        uint64_t cycles;            /*!< CPU cycles spent filtering them */
+        uint32_t cycles_per_sample; /*!< cycles / out_samples */
+    } pcm_resampler_stats_t;
+
+    /**
+     * @brief Create the resampler element. It reads 16-bit PCM at the source rate and writes
+     *        16-bit stereo at `out_rate`, so the I2S and codec clocks never change.
+     *
+     * @param config the configuration
+     *
+     * @return The audio element handle
+     */
+    audio_element_handle_t pcm_resampler_init(pcm_resampler_cfg_t *config);
+
+    /**
+     * @brief Set the input format, usually from the decoder's music info.
+     *        Takes effect before the next block is filtered.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t pcm_resampler_set_src_info(audio_element_handle_t el, int rate, int ch);
+
+    /**
+     * @brief Get the filter statistics
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t pcm_resampler_get_stats(audio_element_handle_t el, pcm_resampler_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
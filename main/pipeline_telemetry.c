@@ -0,0 +1,372 @@
+/* Per-element telemetry for the file->mp3->i2s pipeline
+
+   Counters are collected by IO hooks on the links between the elements, so
+   the hot path costs a couple of esp_timer_get_time() calls per ringbuffer
+   access and nothing per sample:
+
+     - reader write: compressed bytes read;
+     - decoder read/write: time between leaving one hook and entering the
+       next is decoder CPU time, time inside them is spent blocked on a
+       ringbuffer. Every write is one decoded frame;
+     - writer read: PCM bytes consumed, and underruns. An underrun is a read
+       that found the input ring empty and then waited longer than the I2S
+       DMA buffers last, so the DMA ran dry.
+
+   Without a writer element the PCM byte and underrun counts are those of the
+   i2s_direct_sink the last element writes into.
+
+   A low-priority task turns the counters into a snapshot every period, adds
+   the ringbuffer levels and sends a copy of it to the listener as an event,
+   so a listener that falls behind never sees a snapshot being rewritten.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "pipeline_telemetry.h"
+
+static const char *TAG = "TELEMETRY";
+
+/* A longer gap between decoder hooks is the task idling, not decoding */
+#define TELEMETRY_DECODE_GAP_MAX_US (50 * 1000)
+
+struct pipeline_telemetry
+{
+    pipeline_telemetry_cfg_t cfg;
+    audio_io_hook_t reader_out;
+    audio_io_hook_t decoder_in;
+    audio_io_hook_t decoder_out;
+    audio_io_hook_t writer_in;
+    audio_event_iface_handle_t evt;
+
+    /* Written by the element tasks, read by the snapshot task */
+    volatile uint32_t read_bytes;
+    volatile uint32_t pcm_bytes;
+    volatile uint32_t frames;
+    volatile uint32_t decode_us;
+    volatile uint32_t decode_us_max;
+    volatile uint32_t underruns;
+    volatile uint32_t underrun_us;
+
+    /* Decoder task only */
+    int64_t dec_last_exit;
+    uint32_t dec_busy;
+    /* Writer task only */
+    bool i2s_streaming;
+
+    /* Snapshot task only */
+    uint32_t last_read_bytes;
+    uint32_t last_pcm_bytes;
+    uint32_t last_frames;
+    uint32_t last_decode_us;
+    uint32_t last_underruns;
+    int64_t last_time;
+    uint32_t seq;
+    pipeline_telemetry_snapshot_t snap[2];
+    volatile int latest;
+
+    volatile bool running;
+    SemaphoreHandle_t exited;
+};
+
+static int _reader_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pipeline_telemetry_handle_t t = (pipeline_telemetry_handle_t)hook->ctx;
+    t->read_bytes += len;
+    return audio_io_hook_next(hook, el, buf, len, ticks);
+}
+
+static void decoder_enter(pipeline_telemetry_handle_t t, int64_t now)
+{
+    if (t->dec_last_exit)
+    {
+        const int64_t gap = now - t->dec_last_exit;
+        if (gap < TELEMETRY_DECODE_GAP_MAX_US)
+        {
+            t->dec_busy += (uint32_t)gap;
+        }
+    }
+}
+
+static int _decoder_read_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pipeline_telemetry_handle_t t = (pipeline_telemetry_handle_t)hook->ctx;
+    decoder_enter(t, esp_timer_get_time());
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    t->dec_last_exit = esp_timer_get_time();
+    return ret;
+}
+
+static int _decoder_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pipeline_telemetry_handle_t t = (pipeline_telemetry_handle_t)hook->ctx;
+    decoder_enter(t, esp_timer_get_time());
+    t->frames++;
+    t->decode_us += t->dec_busy;
+    if (t->dec_busy > t->decode_us_max)
+    {
+        t->decode_us_max = t->dec_busy;
+    }
+    t->dec_busy = 0;
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    t->dec_last_exit = esp_timer_get_time();
+    return ret;
+}
+
+static int _writer_read_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    pipeline_telemetry_handle_t t = (pipeline_telemetry_handle_t)hook->ctx;
+    const bool empty = rb_bytes_filled(audio_element_get_input_ringbuf(el)) == 0;
+    const int64_t t0 = esp_timer_get_time();
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    if (ret > 0)
+    {
+        if (empty && t->i2s_streaming && esp_timer_get_time() - t0 > t->underrun_us)
+        {
+            t->underruns++;
+        }
+        t->pcm_bytes += ret;
+        t->i2s_streaming = true;
+    }
+    else
+    {
+        /* Stopped or finished: the next wait is the start of a stream, not an underrun */
+        t->i2s_streaming = false;
+    }
+    return ret;
+}
+
+static void fill_element(pipeline_telemetry_element_t *e, audio_element_handle_t el)
+{
+    memset(e, 0, sizeof(*e));
+    strncpy(e->tag, audio_element_get_tag(el), sizeof(e->tag));
+    ringbuf_handle_t in = audio_element_get_input_ringbuf(el);
+    ringbuf_handle_t out = audio_element_get_output_ringbuf(el);
+    if (in)
+    {
+        e->in_fill = rb_bytes_filled(in);
+        e->in_size = rb_get_size(in);
+    }
+    if (out)
+    {
+        e->out_fill = rb_bytes_filled(out);
+        e->out_size = rb_get_size(out);
+    }
+}
+
+static uint32_t per_second(uint32_t delta, uint32_t period_ms)
+{
+    return period_ms ? (uint32_t)((uint64_t)delta * 1000 / period_ms) : 0;
+}
+
+static void take_snapshot(pipeline_telemetry_handle_t t)
+{
+    const int64_t t0 = esp_timer_get_time();
+    pipeline_telemetry_snapshot_t *s = &t->snap[t->latest == 0 ? 1 : 0];
+
+    if (t->cfg.writer)
+    {
+        audio_element_info_t info;
+        audio_element_getinfo(t->cfg.writer, &info);
+        if (info.sample_rates > 0)
+        {
+            t->underrun_us = (uint32_t)((int64_t)t->cfg.i2s_dma_frames * 1000000 / info.sample_rates);
+        }
+    }
+
+    uint32_t pcm_bytes = t->pcm_bytes;
+    uint32_t underruns = t->underruns;
+    i2s_direct_sink_stats_t sink_stats;
+    if (t->cfg.writer == NULL && t->cfg.sink && i2s_direct_sink_get_stats(t->cfg.sink, &sink_stats) == ESP_OK)
+    {
+        pcm_bytes = (uint32_t)sink_stats.bytes;
+        underruns = sink_stats.underruns;
+    }
+    const uint32_t read_bytes = t->read_bytes;
+    const uint32_t frames = t->frames;
+    const uint32_t decode_us = t->decode_us;
+    const uint32_t period_ms = (uint32_t)((t0 - t->last_time) / 1000);
+
+    s->magic = PIPELINE_TELEMETRY_MAGIC;
+    s->version = PIPELINE_TELEMETRY_VERSION;
+    s->element_count = PIPELINE_TELEMETRY_ELEMENTS;
+    s->seq = t->seq++;
+    s->uptime_ms = (uint32_t)(t0 / 1000);
+    s->period_ms = period_ms;
+    s->read_bytes_per_s = per_second(read_bytes - t->last_read_bytes, period_ms);
+    s->pcm_bytes_per_s = per_second(pcm_bytes - t->last_pcm_bytes, period_ms);
+    s->frames = frames - t->last_frames;
+    s->decode_us_avg = s->frames ? (decode_us - t->last_decode_us) / s->frames : 0;
+    s->decode_us_max = t->decode_us_max;
+    t->decode_us_max = 0;
+    s->i2s_underruns = underruns;
+    s->i2s_underruns_new = underruns - t->last_underruns;
+    fill_element(&s->elements[0], t->cfg.reader);
+    fill_element(&s->elements[1], t->cfg.decoder);
+    if (t->cfg.writer)
+    {
+        fill_element(&s->elements[2], t->cfg.writer);
+    }
+    else
+    {
+        memset(&s->elements[2], 0, sizeof(s->elements[2]));
+        if (t->cfg.sink)
+        {
+            strncpy(s->elements[2].tag, "i2s", sizeof(s->elements[2].tag));
+        }
+    }
+
+    t->last_read_bytes = read_bytes;
+    t->last_pcm_bytes = pcm_bytes;
+    t->last_frames = frames;
+    t->last_decode_us = decode_us;
+    t->last_underruns = underruns;
+    t->last_time = t0;
+    s->collect_us = (uint32_t)(esp_timer_get_time() - t0);
+    t->latest = s == &t->snap[0] ? 0 : 1;
+}
+
+static void pipeline_telemetry_task(void *arg)
+{
+    pipeline_telemetry_handle_t t = (pipeline_telemetry_handle_t)arg;
+    TickType_t wake = xTaskGetTickCount();
+    t->last_time = esp_timer_get_time();
+
+    while (t->running)
+    {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(t->cfg.period_ms));
+        if (!t->running)
+        {
+            break;
+        }
+        take_snapshot(t);
+        pipeline_telemetry_snapshot_t *copy = t->cfg.listener ? audio_malloc(sizeof(pipeline_telemetry_snapshot_t)) : NULL;
+        if (copy)
+        {
+            memcpy(copy, &t->snap[t->latest], sizeof(pipeline_telemetry_snapshot_t));
+            audio_event_iface_msg_t msg = {
+                .cmd = PIPELINE_TELEMETRY_CMD_SNAPSHOT,
+                .data = copy,
+                .data_len = sizeof(pipeline_telemetry_snapshot_t),
+                .source = t,
+                .source_type = PIPELINE_TELEMETRY_SOURCE_TYPE,
+                .need_free_data = true,
+            };
+            if (audio_event_iface_sendout(t->evt, &msg) != ESP_OK)
+            {
+                audio_free(copy);
+            }
+        }
+    }
+    xSemaphoreGive(t->exited);
+    vTaskDelete(NULL);
+}
+
+static void unhook(pipeline_telemetry_handle_t t)
+{
+    audio_io_hook_remove(t->cfg.reader, AUDIO_IO_HOOK_WRITE, &t->reader_out);
+    audio_io_hook_remove(t->cfg.decoder, AUDIO_IO_HOOK_READ, &t->decoder_in);
+    audio_io_hook_remove(t->cfg.decoder, AUDIO_IO_HOOK_WRITE, &t->decoder_out);
+    if (t->cfg.writer)
+    {
+        audio_io_hook_remove(t->cfg.writer, AUDIO_IO_HOOK_READ, &t->writer_in);
+    }
+}
+
+static void release(pipeline_telemetry_handle_t t)
+{
+    unhook(t);
+    if (t->evt)
+    {
+        audio_event_iface_destroy(t->evt);
+    }
+    if (t->exited)
+    {
+        vSemaphoreDelete(t->exited);
+    }
+    audio_free(t);
+}
+
+pipeline_telemetry_handle_t pipeline_telemetry_init(const pipeline_telemetry_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->reader && cfg->decoder && cfg->period_ms > 0, return NULL);
+
+    pipeline_telemetry_handle_t t = audio_calloc(1, sizeof(struct pipeline_telemetry));
+    AUDIO_MEM_CHECK(TAG, t, return NULL);
+    t->cfg = *cfg;
+    t->latest = -1;
+    t->underrun_us = UINT32_MAX;
+    t->reader_out = (audio_io_hook_t){.fn = _reader_write_hook, .ctx = t};
+    t->decoder_in = (audio_io_hook_t){.fn = _decoder_read_hook, .ctx = t};
+    t->decoder_out = (audio_io_hook_t){.fn = _decoder_write_hook, .ctx = t};
+    t->writer_in = (audio_io_hook_t){.fn = _writer_read_hook, .ctx = t};
+
+    if (audio_io_hook_add(cfg->reader, AUDIO_IO_HOOK_WRITE, &t->reader_out) != ESP_OK ||
+        audio_io_hook_add(cfg->decoder, AUDIO_IO_HOOK_READ, &t->decoder_in) != ESP_OK ||
+        audio_io_hook_add(cfg->decoder, AUDIO_IO_HOOK_WRITE, &t->decoder_out) != ESP_OK ||
+        (cfg->writer && audio_io_hook_add(cfg->writer, AUDIO_IO_HOOK_READ, &t->writer_in) != ESP_OK))
+    {
+        ESP_LOGE(TAG, "Pipeline must be linked before pipeline_telemetry_init");
+        release(t);
+        return NULL;
+    }
+
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    t->evt = audio_event_iface_init(&evt_cfg);
+    t->exited = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, t->evt && t->exited, {
+        release(t);
+        return NULL;
+    });
+    if (cfg->listener)
+    {
+        audio_event_iface_set_listener(t->evt, cfg->listener);
+    }
+
+    t->running = true;
+    if (xTaskCreatePinnedToCore(pipeline_telemetry_task, "telemetry", cfg->task_stack, t, cfg->task_prio, NULL,
+                                cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create telemetry task");
+        release(t);
+        return NULL;
+    }
+    return t;
+}
+
+size_t pipeline_telemetry_dump(pipeline_telemetry_handle_t t, void *buf, size_t len)
+{
+    if (t == NULL || buf == NULL || len < sizeof(pipeline_telemetry_snapshot_t) || t->latest < 0)
+    {
+        return 0;
+    }
+    memcpy(buf, &t->snap[t->latest], sizeof(pipeline_telemetry_snapshot_t));
+    return sizeof(pipeline_telemetry_snapshot_t);
+}
+
+void pipeline_telemetry_deinit(pipeline_telemetry_handle_t t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    t->running = false;
+    xSemaphoreTake(t->exited, portMAX_DELAY);
+    if (t->cfg.listener)
+    {
+        audio_event_iface_remove_listener(t->cfg.listener, t->evt);
+    }
+    release(t);
+}
@@ -0,0 +1,134 @@
+/* Per-element telemetry for the file->mp3->i2s pipeline
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PIPELINE_TELEMETRY_H__
+#define __PIPELINE_TELEMETRY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "i2s_direct_sink.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of telemetry messages */
+#define PIPELINE_TELEMETRY_SOURCE_TYPE (0x54454C45) /* "TELE" */
+/* audio_event_iface_msg_t.cmd of a periodic snapshot; data is a copy of the pipeline_telemetry_snapshot_t,
+   owned by the receiver, which releases it with audio_free() (need_free_data is set) */
+#define PIPELINE_TELEMETRY_CMD_SNAPSHOT (1)
+
+#define PIPELINE_TELEMETRY_MAGIC (0x544C)
+#define PIPELINE_TELEMETRY_VERSION (1)
+#define PIPELINE_TELEMETRY_ELEMENTS (3)
+
+    /**
+     * @brief Ringbuffer levels of one element; sizes are 0 where the element has no ring
+     */
+    typedef struct __attribute__((packed))
+    {
+        char tag[4];       /*!< Element tag, not NUL-terminated when 4 characters long */
+        uint32_t in_fill;  /*!< Bytes waiting in the input ringbuffer */
+        uint32_t in_size;  /*!< Input ringbuffer capacity */
+        uint32_t out_fill; /*!< Bytes waiting in the output ringbuffer */
+        uint32_t out_size; /*!< Output ringbuffer capacity */
+    } pipeline_telemetry_element_t;
+
+    /**
+     * @brief One telemetry period. Packed little-endian, also the binary dump format.
+     */
+    typedef struct __attribute__((packed))
+    {
+        uint16_t magic;              /*!< PIPELINE_TELEMETRY_MAGIC */
+        uint8_t version;             /*!< PIPELINE_TELEMETRY_VERSION */
+        uint8_t element_count;       /*!< Entries in `elements` */
+        uint32_t seq;                /*!< Snapshot number */
+        uint32_t uptime_ms;          /*!< When the snapshot was taken */
+        uint32_t period_ms;          /*!< Time covered by the rates below */
+        uint32_t read_bytes_per_s;   /*!< Compressed bytes leaving the reader */
+        uint32_t pcm_bytes_per_s;    /*!< PCM bytes consumed by the I2S writer, or handed to the direct sink's DMA buffers */
+        uint32_t frames;             /*!< Frames decoded during the period */
+        uint32_t decode_us_avg;      /*!< Decoder busy time per frame, waits on its ringbuffers excluded */
+        uint32_t decode_us_max;      /*!< Slowest frame of the period */
+        uint32_t i2s_underruns;      /*!< I2S reads that found the ring empty and outlasted the DMA buffers, since start;
+                                          with the direct sink, DMA buffers it had to send again as silence */
+        uint32_t i2s_underruns_new;  /*!< Of those, during this period */
+        uint32_t collect_us;         /*!< Time spent building this snapshot */
+        pipeline_telemetry_element_t elements[PIPELINE_TELEMETRY_ELEMENTS]; /*!< file, mp3, i2s */
+    } pipeline_telemetry_snapshot_t;
+
+    /**
+     * @brief Telemetry configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t reader;  /*!< "file" element */
+        audio_element_handle_t decoder; /*!< "mp3" element */
+        audio_element_handle_t writer;  /*!< "i2s" element; NULL without one */
+        i2s_direct_sink_handle_t sink;  /*!< Direct sink feeding I2S when there is no `writer`; PCM and underrun
+                                             counters come from its stats. Both NULL leaves them at 0 */
+        audio_event_iface_handle_t listener; /*!< Receives the periodic snapshots, may be NULL */
+        int period_ms;                  /*!< Snapshot period */
+        int i2s_dma_frames;             /*!< Frames held by all I2S DMA descriptors, dma_desc_num * dma_frame_num */
+        int task_stack;                 /*!< Task stack size */
+        int task_core;                  /*!< Task running in core */
+        int task_prio;                  /*!< Task priority */
+    } pipeline_telemetry_cfg_t;
+
+#define PIPELINE_TELEMETRY_TASK_STACK (3072)
+#define PIPELINE_TELEMETRY_TASK_CORE (0)
+#define PIPELINE_TELEMETRY_TASK_PRIO (1)
+
+#define PIPELINE_TELEMETRY_CFG_DEFAULT()                \
+    {                                                   \
+        .reader = NULL,                                 \
+        .decoder = NULL,                                \
+        .writer = NULL,                                 \
+        .sink = NULL,                                   \
+        .listener = NULL,                               \
+        .period_ms = 1000,                              \
+        .i2s_dma_frames = 3 * 312,                      \
+        .task_stack = PIPELINE_TELEMETRY_TASK_STACK,    \
+        .task_core = PIPELINE_TELEMETRY_TASK_CORE,      \
+        .task_prio = PIPELINE_TELEMETRY_TASK_PRIO,      \
+    }
+
+    typedef struct pipeline_telemetry *pipeline_telemetry_handle_t;
+
+    /**
+     * @brief Hook the three elements and start the snapshot task.
+     *        Call after audio_pipeline_link() and after any other hooks on the same links.
+     *
+     * @return The telemetry handle, NULL on failure
+     */
+    pipeline_telemetry_handle_t pipeline_telemetry_init(const pipeline_telemetry_cfg_t *cfg);
+
+    /**
+     * @brief Copy the latest snapshot as a binary record
+     *
+     * @param buf  destination
+     * @param len  capacity of `buf`
+     *
+     * @return bytes written, 0 if `len` is too small or no snapshot was taken yet
+     */
+    size_t pipeline_telemetry_dump(pipeline_telemetry_handle_t tele, void *buf, size_t len);
+
+    /**
+     * @brief Stop the task and unhook the elements. The pipeline must be stopped.
+     */
+    void pipeline_telemetry_deinit(pipeline_telemetry_handle_t tele);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,358 @@
+/* Asynchronous control of the player task
+
+   Callers queue commands and return at once; the player task, the only one
+   that touches the pipeline and the codec, takes them when its listener
+   wakes up.
+
+   The queue is a bounded array of slots, each with a sequence number
+   (Vyukov's bounded queue). A producer claims a position with one
+   compare-and-swap on the enqueue counter, fills the slot and publishes it
+   by advancing the slot's sequence; the single consumer reads slots in
+   order while their sequence says they are published. No task ever waits
+   for another, so a producer preempted between claim and publish only
+   delays the commands behind its own.
+
+   The player task is woken through its audio_event_iface listener, the same
+   way pipeline events reach it: one message per batch, coalesced by a
+   doorbell flag the consumer clears before draining.
+
+   Command-to-effect latency is measured from the post, or from the time
+   given to player_control_post_at(), e.g. a button edge. Commands the
+   listener hears, such as a seek, end at the first PCM handed to I2S after
+   they were executed, observed by an IO hook on the output element.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "player_control.h"
+
+static const char *TAG = "PLAYER_CTRL";
+
+typedef struct
+{
+    atomic_uint seq; /* == position: free for it; == position + 1: published */
+    player_cmd_t cmd;
+} control_slot_t;
+
+struct player_control
+{
+    player_control_cfg_t cfg;
+    audio_event_iface_handle_t evt;
+    audio_io_hook_t output_hook;
+    control_slot_t *slots;
+    uint32_t mask;
+    atomic_uint enqueue_pos;
+    uint32_t dequeue_pos; /* Player task only */
+    atomic_bool doorbell; /* A wake-up message is on its way */
+
+    atomic_uint posted[PLAYER_CMD_MAX];
+    atomic_uint dropped[PLAYER_CMD_MAX];
+
+    /* Latency records, written by the player task and the output element task */
+    portMUX_TYPE lock;
+    player_control_stats_t stats[PLAYER_CMD_MAX];
+    volatile bool audible_pending;
+    player_cmd_type_t audible_type;
+    int64_t audible_posted_us;
+};
+
+static const char *const s_cmd_names[PLAYER_CMD_MAX] = {
+    [PLAYER_CMD_PLAY] = "play",
+    [PLAYER_CMD_PAUSE] = "pause",
+    [PLAYER_CMD_RESUME] = "resume",
+    [PLAYER_CMD_STOP] = "stop",
+    [PLAYER_CMD_SEEK] = "seek",
+    [PLAYER_CMD_NEXT] = "next",
+    [PLAYER_CMD_PREV] = "prev",
+    [PLAYER_CMD_VOLUME] = "volume",
+    [PLAYER_CMD_VOLUME_STEP] = "volume_step",
+    [PLAYER_CMD_PLAY_PAUSE] = "play_pause",
+};
+
+/* Call with `lock` held */
+static void record_latency(player_control_handle_t ctl, player_cmd_type_t type, int64_t posted_us, int64_t now)
+{
+    player_control_stats_t *s = &ctl->stats[type];
+    const int64_t took = now - posted_us;
+    const uint32_t us = took > UINT32_MAX ? UINT32_MAX : (uint32_t)took;
+    s->measured++;
+    s->last_us = us;
+    s->total_us += us;
+    if (us > s->max_us)
+    {
+        s->max_us = us;
+    }
+}
+
+static int _output_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    player_control_handle_t ctl = (player_control_handle_t)hook->ctx;
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    if (ret > 0 && ctl->audible_pending)
+    {
+        const int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&ctl->lock);
+        if (ctl->audible_pending)
+        {
+            record_latency(ctl, ctl->audible_type, ctl->audible_posted_us, now);
+            ctl->audible_pending = false;
+        }
+        portEXIT_CRITICAL(&ctl->lock);
+    }
+    return ret;
+}
+
+static void release(player_control_handle_t ctl)
+{
+    if (ctl->output_hook.fn && ctl->cfg.output)
+    {
+        audio_io_hook_remove(ctl->cfg.output, ctl->cfg.output_dir, &ctl->output_hook);
+    }
+    if (ctl->evt)
+    {
+        audio_event_iface_remove_listener(ctl->cfg.listener, ctl->evt);
+        audio_event_iface_destroy(ctl->evt);
+    }
+    audio_free(ctl->slots);
+    audio_free(ctl);
+}
+
+player_control_handle_t player_control_init(const player_control_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->listener, return NULL);
+    if (cfg->queue_len <= 0 || (cfg->queue_len & (cfg->queue_len - 1)))
+    {
+        ESP_LOGE(TAG, "Queue length %d is not a power of two", cfg->queue_len);
+        return NULL;
+    }
+
+    player_control_handle_t ctl = audio_calloc(1, sizeof(struct player_control));
+    AUDIO_MEM_CHECK(TAG, ctl, return NULL);
+    ctl->cfg = *cfg;
+    ctl->mask = cfg->queue_len - 1;
+    ctl->lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+    ctl->slots = audio_calloc(cfg->queue_len, sizeof(control_slot_t));
+    AUDIO_MEM_CHECK(TAG, ctl->slots, {
+        release(ctl);
+        return NULL;
+    });
+    for (int i = 0; i < cfg->queue_len; i++)
+    {
+        atomic_init(&ctl->slots[i].seq, i);
+    }
+    atomic_init(&ctl->enqueue_pos, 0);
+    atomic_init(&ctl->doorbell, false);
+
+    if (cfg->output)
+    {
+        ctl->output_hook = (audio_io_hook_t){.fn = _output_hook, .ctx = ctl};
+        if (audio_io_hook_add(cfg->output, cfg->output_dir, &ctl->output_hook) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Pipeline must be linked before player_control_init");
+            ctl->output_hook.fn = NULL;
+            release(ctl);
+            return NULL;
+        }
+    }
+
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    ctl->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, ctl->evt, {
+        release(ctl);
+        return NULL;
+    });
+    audio_event_iface_set_listener(ctl->evt, cfg->listener);
+    return ctl;
+}
+
+esp_err_t player_control_post(player_control_handle_t ctl, player_cmd_type_t type, int32_t arg)
+{
+    return player_control_post_at(ctl, type, arg, esp_timer_get_time());
+}
+
+esp_err_t player_control_post_at(player_control_handle_t ctl, player_cmd_type_t type, int32_t arg, int64_t since_us)
+{
+    AUDIO_NULL_CHECK(TAG, ctl && type >= 0 && type < PLAYER_CMD_MAX, return ESP_ERR_INVALID_ARG);
+
+    control_slot_t *slot;
+    unsigned pos = atomic_load_explicit(&ctl->enqueue_pos, memory_order_relaxed);
+    while (1)
+    {
+        slot = &ctl->slots[pos & ctl->mask];
+        const unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        const int diff = (int)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ctl->enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+            /* `pos` now holds the current counter: retry there */
+        }
+        else if (diff < 0)
+        {
+            /* The slot a full lap back is still unread */
+            atomic_fetch_add_explicit(&ctl->dropped[type], 1, memory_order_relaxed);
+            return ESP_FAIL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ctl->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->cmd = (player_cmd_t){.type = type, .arg = arg, .posted_us = since_us};
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ctl->posted[type], 1, memory_order_relaxed);
+
+    /* One message wakes the player task for everything queued until it drains */
+    if (!atomic_exchange(&ctl->doorbell, true))
+    {
+        audio_event_iface_msg_t msg = {
+            .cmd = 0,
+            .data = NULL,
+            .data_len = 0,
+            .source = ctl,
+            .source_type = PLAYER_CONTROL_SOURCE_TYPE,
+            .need_free_data = false,
+        };
+        if (audio_event_iface_sendout(ctl->evt, &msg) != ESP_OK)
+        {
+            /* The listener queue is full, so the player task is about to wake anyway */
+            atomic_store(&ctl->doorbell, false);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t player_control_play(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_PLAY, 0);
+}
+
+esp_err_t player_control_pause(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_PAUSE, 0);
+}
+
+esp_err_t player_control_resume(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_RESUME, 0);
+}
+
+esp_err_t player_control_stop(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_STOP, 0);
+}
+
+esp_err_t player_control_seek(player_control_handle_t ctl, uint32_t time_ms)
+{
+    return player_control_post(ctl, PLAYER_CMD_SEEK, (int32_t)time_ms);
+}
+
+esp_err_t player_control_next(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_NEXT, 0);
+}
+
+esp_err_t player_control_prev(player_control_handle_t ctl)
+{
+    return player_control_post(ctl, PLAYER_CMD_PREV, 0);
+}
+
+esp_err_t player_control_set_volume(player_control_handle_t ctl, int volume)
+{
+    return player_control_post(ctl, PLAYER_CMD_VOLUME, volume);
+}
+
+esp_err_t player_control_volume_step(player_control_handle_t ctl, int delta)
+{
+    return player_control_post(ctl, PLAYER_CMD_VOLUME_STEP, delta);
+}
+
+bool player_control_receive(player_control_handle_t ctl, player_cmd_t *cmd)
+{
+    if (ctl == NULL || cmd == NULL)
+    {
+        return false;
+    }
+    /* Before looking at the slots: a post that finds the flag set is then sure to be seen */
+    atomic_store(&ctl->doorbell, false);
+
+    control_slot_t *slot = &ctl->slots[ctl->dequeue_pos & ctl->mask];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ctl->dequeue_pos + 1)
+    {
+        return false;
+    }
+    *cmd = slot->cmd;
+    /* Free for the producer one lap ahead */
+    atomic_store_explicit(&slot->seq, ctl->dequeue_pos + ctl->mask + 1, memory_order_release);
+    ctl->dequeue_pos++;
+    return true;
+}
+
+void player_control_done(player_control_handle_t ctl, const player_cmd_t *cmd, esp_err_t ret, bool audible)
+{
+    if (ctl == NULL || cmd == NULL || cmd->type < 0 || cmd->type >= PLAYER_CMD_MAX)
+    {
+        return;
+    }
+    const int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&ctl->lock);
+    if (ret != ESP_OK)
+    {
+        ctl->stats[cmd->type].failed++;
+    }
+    else if (audible && ctl->cfg.output)
+    {
+        /* A newer audible command supersedes one whose effect was not heard yet */
+        ctl->audible_type = cmd->type;
+        ctl->audible_posted_us = cmd->posted_us;
+        ctl->audible_pending = true;
+    }
+    else
+    {
+        record_latency(ctl, cmd->type, cmd->posted_us, now);
+    }
+    portEXIT_CRITICAL(&ctl->lock);
+
+    if (ret != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s failed: %s", s_cmd_names[cmd->type], esp_err_to_name(ret));
+    }
+}
+
+esp_err_t player_control_get_stats(player_control_handle_t ctl, player_cmd_type_t type, player_control_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, ctl && stats && type >= 0 && type < PLAYER_CMD_MAX, return ESP_ERR_INVALID_ARG);
+    portENTER_CRITICAL(&ctl->lock);
+    *stats = ctl->stats[type];
+    portEXIT_CRITICAL(&ctl->lock);
+    stats->posted = atomic_load_explicit(&ctl->posted[type], memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ctl->dropped[type], memory_order_relaxed);
+    return ESP_OK;
+}
+
+const char *player_control_cmd_name(player_cmd_type_t type)
+{
+    return type >= 0 && type < PLAYER_CMD_MAX ? s_cmd_names[type] : "?";
+}
+
+void player_control_deinit(player_control_handle_t ctl)
+{
+    if (ctl)
+    {
+        release(ctl);
+    }
+}
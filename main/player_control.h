@@ -0,0 +1,165 @@
+/* Asynchronous play/pause/seek/volume control of the player task
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PLAYER_CONTROL_H__
+#define __PLAYER_CONTROL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "audio_io_hook.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of the message waking the player task */
+#define PLAYER_CONTROL_SOURCE_TYPE (0x4354524C) /* "CTRL" */
+
+    /**
+     * @brief Commands, in the order their counters are reported
+     */
+    typedef enum
+    {
+        PLAYER_CMD_PLAY = 0,    /*!< Start from the beginning when stopped, resume when paused */
+        PLAYER_CMD_PAUSE,       /*!< Hold the pipeline where it is */
+        PLAYER_CMD_RESUME,      /*!< Continue after a pause */
+        PLAYER_CMD_STOP,        /*!< Stop the pipeline; PLAY starts over */
+        PLAYER_CMD_SEEK,        /*!< `arg`: position in the current track, ms */
+        PLAYER_CMD_NEXT,        /*!< Next track */
+        PLAYER_CMD_PREV,        /*!< Previous track */
+        PLAYER_CMD_VOLUME,      /*!< `arg`: codec volume, 0..100 */
+        PLAYER_CMD_VOLUME_STEP, /*!< `arg`: added to the codec volume */
+        PLAYER_CMD_PLAY_PAUSE,  /*!< PAUSE when playing, PLAY otherwise */
+        PLAYER_CMD_MAX,
+    } player_cmd_type_t;
+
+    /**
+     * @brief A queued command
+     */
+    typedef struct
+    {
+        player_cmd_type_t type;
+        int32_t arg;
+        int64_t posted_us; /*!< esp_timer_get_time() the latency is measured from, normally when queued */
+    } player_cmd_t;
+
+    /**
+     * @brief Command-to-effect latency of one command type. The effect is the first PCM
+     *        reaching the output for PLAY, RESUME, SEEK, NEXT and PREV, and the return of
+     *        the pipeline or codec call for the others.
+     */
+    typedef struct
+    {
+        uint32_t posted;   /*!< Queued */
+        uint32_t dropped;  /*!< Refused because the queue was full */
+        uint32_t failed;   /*!< Executed with an error */
+        uint32_t measured; /*!< Latencies recorded */
+        uint32_t last_us;  /*!< Latency of the last one */
+        uint32_t max_us;   /*!< Worst latency */
+        uint64_t total_us; /*!< Sum of latencies, for the average */
+    } player_control_stats_t;
+
+    /**
+     * @brief Control configuration
+     */
+    typedef struct
+    {
+        audio_event_iface_handle_t listener; /*!< Listener the player task waits on */
+        audio_element_handle_t output;       /*!< Element whose PCM reaching I2S marks an audible effect, may be NULL */
+        audio_io_hook_dir_t output_dir;      /*!< Side of `output` where that PCM passes */
+        int queue_len;                       /*!< Commands queued at most, a power of two */
+    } player_control_cfg_t;
+
+#define PLAYER_CONTROL_CFG_DEFAULT()      \
+    {                                     \
+        .listener = NULL,                 \
+        .output = NULL,                   \
+        .output_dir = AUDIO_IO_HOOK_READ, \
+        .queue_len = 16,                  \
+    }
+
+    typedef struct player_control *player_control_handle_t;
+
+    /**
+     * @brief Create the command queue and attach to the player task's listener.
+     *        Call after audio_pipeline_link() when `output` is set.
+     *
+     * @return The control handle, NULL on failure
+     */
+    player_control_handle_t player_control_init(const player_control_cfg_t *cfg);
+
+    /**
+     * @brief Queue a command. Never waits: neither on the queue, which is lock-free, nor on
+     *        the pipeline or the codec, which only the player task touches. Any task may call
+     *        it concurrently; not from an ISR.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_FAIL  the queue is full, the command is dropped
+     */
+    esp_err_t player_control_post(player_control_handle_t ctl, player_cmd_type_t type, int32_t arg);
+
+    /**
+     * @brief Same, measuring the latency from `since_us` instead of now, e.g. the interrupt
+     *        of the button that caused the command
+     */
+    esp_err_t player_control_post_at(player_control_handle_t ctl, player_cmd_type_t type, int32_t arg, int64_t since_us);
+
+    /**
+     * @brief Shorthands for player_control_post(), same return values
+     */
+    esp_err_t player_control_play(player_control_handle_t ctl);
+    esp_err_t player_control_pause(player_control_handle_t ctl);
+    esp_err_t player_control_resume(player_control_handle_t ctl);
+    esp_err_t player_control_stop(player_control_handle_t ctl);
+    esp_err_t player_control_seek(player_control_handle_t ctl, uint32_t time_ms);
+    esp_err_t player_control_next(player_control_handle_t ctl);
+    esp_err_t player_control_prev(player_control_handle_t ctl);
+    esp_err_t player_control_set_volume(player_control_handle_t ctl, int volume);
+    esp_err_t player_control_volume_step(player_control_handle_t ctl, int delta);
+
+    /**
+     * @brief Take the oldest queued command. Player task only; call whenever the listener
+     *        returns, until it returns false.
+     */
+    bool player_control_receive(player_control_handle_t ctl, player_cmd_t *cmd);
+
+    /**
+     * @brief Report a received command as executed. Player task only.
+     *
+     * @param ret     result of the execution; errors are counted, not measured
+     * @param audible the effect is the next PCM reaching the output rather than now
+     */
+    void player_control_done(player_control_handle_t ctl, const player_cmd_t *cmd, esp_err_t ret, bool audible);
+
+    /**
+     * @brief Get the counters of one command type
+     */
+    esp_err_t player_control_get_stats(player_control_handle_t ctl, player_cmd_type_t type, player_control_stats_t *stats);
+
+    /**
+     * @brief Command name for logs, e.g. "seek"
+     */
+    const char *player_control_cmd_name(player_cmd_type_t type);
+
+    /**
+     * @brief Detach from the listener and the output, and free the queue
+     */
+    void player_control_deinit(player_control_handle_t ctl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
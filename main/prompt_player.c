@@ -0,0 +1,308 @@
+/* Prompt tones and voice prompts played from a memory-mapped flash partition
+
+   tools/pack_prompts.py packs the clips, already converted to the output
+   format, into an image for the "assets" partition: a header, a table of
+   named entries and the PCM of each clip. The image is mapped once at init;
+   a prompt is then a pointer into flash handed to the output, with no file
+   system, no decoder and no copy on the way.
+
+   Triggering only posts to the prompt task, which runs above the audio
+   elements. It takes the output, which drops the audio queued in front of
+   the DAC and preloads the start of the clip, so the prompt is heard as soon
+   as begin() returns; the rest of the clip follows in chunk_size writes. A
+   newer prompt or a stop cuts in between two writes. An output that mixes
+   the clip over the music instead reports through started_us() when the
+   first sample reached the DAC, and the latency is taken from that.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "prompt_player.h"
+
+static const char *TAG = "PROMPT_PLAYER";
+
+#define PROMPT_REQ_STOP (-1)
+#define PROMPT_REQ_EXIT (-2)
+/* Polling started_us() once the whole clip is queued; a newer request still cuts in */
+#define PROMPT_START_POLL_MS (10)
+#define PROMPT_START_TIMEOUT_MS (1000)
+
+typedef struct
+{
+    int index; /* Entry to play, or PROMPT_REQ_* */
+    int64_t trigger_us;
+} prompt_req_t;
+
+struct prompt_player
+{
+    prompt_player_cfg_t cfg;
+    const esp_partition_t *part;
+    esp_partition_mmap_handle_t map;
+    const uint8_t *base;
+    prompt_pack_header_t hdr;
+    const prompt_pack_entry_t *entries;
+    QueueHandle_t req; /* Length 1: the newest request wins */
+    SemaphoreHandle_t exited;
+    prompt_player_stats_t stats;
+};
+
+static void record_latency(prompt_player_handle_t p, const prompt_pack_entry_t *e, int64_t trigger_us, int64_t started_us)
+{
+    const uint32_t us = (uint32_t)(started_us - trigger_us);
+    p->stats.played++;
+    p->stats.last_us = us;
+    p->stats.total_us += us;
+    if (us > p->stats.max_us)
+    {
+        p->stats.max_us = us;
+    }
+    ESP_LOGD(TAG, "\"%s\" started %u us after the trigger", e->name, (unsigned)us);
+}
+
+static void prompt_task(void *arg)
+{
+    prompt_player_handle_t p = (prompt_player_handle_t)arg;
+    const prompt_output_t *out = &p->cfg.output;
+    prompt_req_t req;
+
+    while (xQueueReceive(p->req, &req, portMAX_DELAY) == pdTRUE)
+    {
+        bool claimed = false;
+        while (req.index >= 0)
+        {
+            const prompt_pack_entry_t *e = &p->entries[req.index];
+            const int64_t trigger_us = req.trigger_us;
+            const uint8_t *pcm = p->base + e->offset;
+            size_t left = e->length;
+
+            const int loaded = out->begin(out->ctx, p->hdr.sample_rate, p->hdr.bits, p->hdr.channels, pcm, left);
+            claimed = true;
+            if (loaded < 0)
+            {
+                ESP_LOGE(TAG, "Output refused prompt \"%s\"", e->name);
+                break;
+            }
+            /* Without started_us(), the head is in front of the DAC once begin() returns */
+            bool timed = out->started_us == NULL;
+            if (timed)
+            {
+                record_latency(p, e, trigger_us, esp_timer_get_time());
+            }
+            pcm += loaded;
+            left -= loaded;
+
+            req.index = PROMPT_REQ_STOP;
+            int polls = 0;
+            while (left > 0 || !timed)
+            {
+                if (!timed)
+                {
+                    const int64_t started_us = out->started_us(out->ctx);
+                    if (started_us)
+                    {
+                        record_latency(p, e, trigger_us, started_us);
+                        timed = true;
+                        continue;
+                    }
+                }
+                if (xQueueReceive(p->req, &req, left > 0 ? 0 : pdMS_TO_TICKS(PROMPT_START_POLL_MS)) == pdTRUE)
+                {
+                    p->stats.interrupted++;
+                    break;
+                }
+                if (left == 0)
+                {
+                    if (++polls * PROMPT_START_POLL_MS >= PROMPT_START_TIMEOUT_MS)
+                    {
+                        ESP_LOGW(TAG, "\"%s\" queued but not played after %d ms", e->name, PROMPT_START_TIMEOUT_MS);
+                        break;
+                    }
+                    continue;
+                }
+                const int w = out->write(out->ctx, pcm, left < (size_t)p->cfg.chunk_size ? left : (size_t)p->cfg.chunk_size,
+                                         portMAX_DELAY);
+                if (w <= 0)
+                {
+                    ESP_LOGE(TAG, "Output write failed (%d), \"%s\" cut short", w, e->name);
+                    break;
+                }
+                pcm += w;
+                left -= w;
+            }
+        }
+        if (claimed)
+        {
+            out->end(out->ctx);
+        }
+        if (req.index == PROMPT_REQ_EXIT)
+        {
+            break;
+        }
+    }
+    xSemaphoreGive(p->exited);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t map_image(prompt_player_handle_t p)
+{
+    p->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, p->cfg.partition_label);
+    if (p->part == NULL)
+    {
+        ESP_LOGE(TAG, "No \"%s\" partition", p->cfg.partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = esp_partition_read(p->part, 0, &p->hdr, sizeof(p->hdr));
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    const prompt_pack_header_t *h = &p->hdr;
+    const size_t table_end = sizeof(*h) + (size_t)h->count * sizeof(prompt_pack_entry_t);
+    if (h->magic != PROMPT_PACK_MAGIC || h->version != PROMPT_PACK_VERSION)
+    {
+        ESP_LOGE(TAG, "\"%s\" holds no prompt image (flash it with `idf.py flash`)", p->cfg.partition_label);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (h->count == 0 || h->image_size > p->part->size || table_end > h->image_size ||
+        (h->bits != 16 && h->bits != 24 && h->bits != 32) || (h->channels != 1 && h->channels != 2))
+    {
+        ESP_LOGE(TAG, "Corrupt prompt image header");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const void *base = NULL;
+    ret = esp_partition_mmap(p->part, 0, h->image_size, ESP_PARTITION_MMAP_DATA, &base, &p->map);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to map %u bytes of \"%s\": %s", (unsigned)h->image_size, p->cfg.partition_label,
+                 esp_err_to_name(ret));
+        return ret;
+    }
+    p->base = (const uint8_t *)base;
+    p->entries = (const prompt_pack_entry_t *)(p->base + sizeof(*h));
+
+    const uint32_t frame = h->channels * (h->bits / 8);
+    for (int i = 0; i < h->count; i++)
+    {
+        const prompt_pack_entry_t *e = &p->entries[i];
+        if (e->offset < table_end || e->offset > h->image_size || e->length > h->image_size - e->offset ||
+            e->length % frame || memchr(e->name, '\0', sizeof(e->name)) == NULL)
+        {
+            ESP_LOGE(TAG, "Corrupt prompt entry %d", i);
+            esp_partition_munmap(p->map);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    return ESP_OK;
+}
+
+prompt_player_handle_t prompt_player_init(const prompt_player_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->partition_label && cfg->output.begin && cfg->output.write && cfg->output.end &&
+                              cfg->chunk_size > 0,
+                     return NULL);
+
+    prompt_player_handle_t p = audio_calloc(1, sizeof(struct prompt_player));
+    AUDIO_MEM_CHECK(TAG, p, return NULL);
+    p->cfg = *cfg;
+    if (map_image(p) != ESP_OK)
+    {
+        audio_free(p);
+        return NULL;
+    }
+
+    p->req = xQueueCreate(1, sizeof(prompt_req_t));
+    p->exited = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, p->req && p->exited, goto _fail);
+    if (xTaskCreatePinnedToCore(prompt_task, "prompt", cfg->task_stack, p, cfg->task_prio, NULL, cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create prompt task");
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "%d prompts in \"%s\" (%u bytes mapped), %u Hz, %d bits, %d ch", p->hdr.count,
+             cfg->partition_label, (unsigned)p->hdr.image_size, (unsigned)p->hdr.sample_rate, p->hdr.bits,
+             p->hdr.channels);
+    return p;
+
+_fail:
+    if (p->req)
+    {
+        vQueueDelete(p->req);
+    }
+    if (p->exited)
+    {
+        vSemaphoreDelete(p->exited);
+    }
+    esp_partition_munmap(p->map);
+    audio_free(p);
+    return NULL;
+}
+
+static void post(prompt_player_handle_t p, int index)
+{
+    const prompt_req_t req = {
+        .index = index,
+        .trigger_us = esp_timer_get_time(),
+    };
+    xQueueOverwrite(p->req, &req);
+}
+
+esp_err_t prompt_player_play(prompt_player_handle_t player, const char *name)
+{
+    AUDIO_NULL_CHECK(TAG, player && name, return ESP_ERR_INVALID_ARG);
+    for (int i = 0; i < player->hdr.count; i++)
+    {
+        if (strncmp(player->entries[i].name, name, PROMPT_PACK_NAME_LEN) == 0)
+        {
+            post(player, i);
+            return ESP_OK;
+        }
+    }
+    ESP_LOGW(TAG, "No prompt \"%s\"", name);
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t prompt_player_stop(prompt_player_handle_t player)
+{
+    AUDIO_NULL_CHECK(TAG, player, return ESP_ERR_INVALID_ARG);
+    post(player, PROMPT_REQ_STOP);
+    return ESP_OK;
+}
+
+esp_err_t prompt_player_get_stats(prompt_player_handle_t player, prompt_player_stats_t *stats)
+{
+    if (!player || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *stats = player->stats;
+    return ESP_OK;
+}
+
+void prompt_player_deinit(prompt_player_handle_t player)
+{
+    if (player == NULL)
+    {
+        return;
+    }
+    post(player, PROMPT_REQ_EXIT);
+    xSemaphoreTake(player->exited, portMAX_DELAY);
+    vQueueDelete(player->req);
+    vSemaphoreDelete(player->exited);
+    esp_partition_munmap(player->map);
+    audio_free(player);
+}
@@ -0,0 +1,150 @@
+/* Prompt tones and voice prompts played from a memory-mapped flash partition
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __PROMPT_PLAYER_H__
+#define __PROMPT_PLAYER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Image layout written by tools/pack_prompts.py, little endian */
+#define PROMPT_PACK_MAGIC (0x544d5250) /* "PRMT" */
+#define PROMPT_PACK_VERSION (1)
+#define PROMPT_PACK_NAME_LEN (24)
+#define PROMPT_PACK_ALIGN (64)
+
+    typedef struct
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t count;       /*!< Entries following the header */
+        uint32_t sample_rate; /*!< Format of every clip */
+        uint8_t bits;
+        uint8_t channels;
+        uint16_t reserved;
+        uint32_t image_size; /*!< Header, entries and PCM, from the start of the partition */
+    } prompt_pack_header_t;
+
+    typedef struct
+    {
+        char name[PROMPT_PACK_NAME_LEN]; /*!< NUL terminated */
+        uint32_t offset;                 /*!< PCM start from the start of the partition, PROMPT_PACK_ALIGN aligned */
+        uint32_t length;                 /*!< PCM bytes */
+    } prompt_pack_entry_t;
+
+    /**
+     * @brief Where prompts are played. All calls come from the prompt task.
+     */
+    typedef struct
+    {
+        /**
+         * Take the output from the pipeline, switch it to the clip format and drop the audio queued
+         * in front of the DAC, then load `len` bytes of `head` to be played first.
+         * Called again without end() when a prompt interrupts another one.
+         *
+         * @return Bytes of `head` loaded, negative on failure
+         */
+        int (*begin)(void *ctx, int rate, int bits, int ch, const void *head, size_t len);
+        /** Queue more of the clip behind what is playing; blocks like a pipeline write */
+        int (*write)(void *ctx, const void *buf, size_t len, TickType_t ticks);
+        /** Give the output back to the pipeline */
+        void (*end)(void *ctx);
+        /**
+         * Optional, for an output where begin() only queues the clip: the esp_timer time the first
+         * sample since begin() was written to the DAC, 0 until then. NULL when begin() does that itself.
+         */
+        int64_t (*started_us)(void *ctx);
+        void *ctx;
+    } prompt_output_t;
+
+    /**
+     * @brief Prompt player configuration
+     */
+    typedef struct
+    {
+        const char *partition_label; /*!< Data partition holding the packed clips */
+        prompt_output_t output;
+        int chunk_size; /*!< Bytes per output write; a new prompt can cut in between writes */
+        int task_stack; /*!< Task stack size */
+        int task_core;  /*!< Task running in core */
+        int task_prio;  /*!< Task priority, above the audio elements so a trigger is served at once */
+    } prompt_player_cfg_t;
+
+#define PROMPT_PLAYER_TASK_STACK (3072)
+#define PROMPT_PLAYER_TASK_PRIO (22)
+
+#define PROMPT_PLAYER_CFG_DEFAULT()             \
+    {                                           \
+        .partition_label = "assets",            \
+        .output = {0},                          \
+        .chunk_size = 1024,                     \
+        .task_stack = PROMPT_PLAYER_TASK_STACK, \
+        .task_core = 0,                         \
+        .task_prio = PROMPT_PLAYER_TASK_PRIO,   \
+    }
+
+    /**
+     * @brief Trigger-to-first-sample latency, from prompt_player_play() to the return of begin(),
+     *        or to the time started_us() reports when the output has it
+     */
+    typedef struct
+    {
+        uint32_t played;      /*!< Prompts started */
+        uint32_t interrupted; /*!< Prompts cut short by a newer one or a stop */
+        uint32_t last_us;     /*!< Latency of the last prompt */
+        uint32_t max_us;      /*!< Worst latency */
+        uint64_t total_us;    /*!< Sum of latencies, for the average */
+    } prompt_player_stats_t;
+
+    typedef struct prompt_player *prompt_player_handle_t;
+
+    /**
+     * @brief Map the partition, check the clip table and start the prompt task
+     *
+     * @return The player handle, NULL if the partition is missing or holds no valid image
+     */
+    prompt_player_handle_t prompt_player_init(const prompt_player_cfg_t *cfg);
+
+    /**
+     * @brief Play a clip by name, cutting short the one playing. Returns without waiting.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_NOT_FOUND   No clip with that name
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t prompt_player_play(prompt_player_handle_t player, const char *name);
+
+    /**
+     * @brief Stop the prompt playing, if any, and give the output back
+     */
+    esp_err_t prompt_player_stop(prompt_player_handle_t player);
+
+    /**
+     * @brief Get the latency counters
+     */
+    esp_err_t prompt_player_get_stats(prompt_player_handle_t player, prompt_player_stats_t *stats);
+
+    /**
+     * @brief Stop the task and unmap the partition
+     */
+    void prompt_player_deinit(prompt_player_handle_t player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
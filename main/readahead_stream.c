@@ -0,0 +1,307 @@
+/* SD card reader element with a large read-ahead ring and aligned bulk reads
+
+   fatfs_stream reads in buffer-sized pieces through a buffered FILE, which
+   turns into many short SDMMC transfers, some of them bounced sector by
+   sector through the driver's internal buffer. This reader instead:
+
+     - keeps the file unbuffered and reads read_size bytes at file offsets that
+       are multiples of read_size (and therefore of the cluster size), into a
+       cache-line aligned DMA-capable buffer, so FATFS issues one multi-block
+       transfer straight into our memory;
+     - runs at low priority and refills a large output ring in bursts, from
+       the low watermark up to the high watermark, then idles. Card latency
+       spikes are absorbed by the ring instead of stalling the decoder.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "readahead_stream.h"
+
+static const char *TAG = "READAHEAD_STREAM";
+
+/* Largest cache line on the P4 (L2); also satisfies the SDMMC DMA alignment */
+#define READAHEAD_DMA_ALIGN (128)
+/* While above the low watermark, sleep in slices so stop/pause commands are still handled */
+#define READAHEAD_IDLE_SLICE_MS (10)
+#define READAHEAD_IDLE_POLL_US (50 * 1000)
+
+typedef struct
+{
+    FILE *file;
+    bool is_open;
+    uint8_t *buf;
+    int read_size;
+    int high_limit;
+    int high_bytes;
+    int low_bytes;
+    bool refilling;
+    int64_t pos;
+    readahead_stream_stats_t stats;
+} readahead_stream_t;
+
+static esp_err_t _ra_open(audio_element_handle_t self)
+{
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(self);
+    if (ra->is_open)
+    {
+        ESP_LOGE(TAG, "Already opened");
+        return ESP_FAIL;
+    }
+
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    if (info.uri == NULL)
+    {
+        ESP_LOGE(TAG, "Error, uri is not set");
+        return ESP_FAIL;
+    }
+
+    ra->file = fopen(info.uri, "rb");
+    if (ra->file == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", info.uri);
+        return ESP_FAIL;
+    }
+    /* No stdio buffer: large reads go straight from FATFS into ra->buf */
+    setvbuf(ra->file, NULL, _IONBF, 0);
+
+    struct stat st;
+    if (fstat(fileno(ra->file), &st) == 0)
+    {
+        audio_element_set_total_bytes(self, st.st_size);
+    }
+    ra->pos = 0;
+    if (info.byte_pos > 0)
+    {
+        if (fseek(ra->file, info.byte_pos, SEEK_SET) != 0)
+        {
+            ESP_LOGE(TAG, "Failed to seek to %lld", (long long)info.byte_pos);
+            fclose(ra->file);
+            ra->file = NULL;
+            return ESP_FAIL;
+        }
+        ra->pos = info.byte_pos;
+    }
+
+    ra->refilling = true;
+    ra->stats.refills++;
+    ra->is_open = true;
+    return ESP_OK;
+}
+
+static int _ra_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(self);
+
+    const int64_t t0 = esp_timer_get_time();
+    int rlen = fread(buffer, 1, len, ra->file);
+    const uint32_t dt = (uint32_t)(esp_timer_get_time() - t0);
+
+    ra->stats.reads++;
+    ra->stats.read_us += dt;
+    if (dt > ra->stats.max_read_us)
+    {
+        ra->stats.max_read_us = dt;
+    }
+    if (rlen <= 0)
+    {
+        if (ferror(ra->file))
+        {
+            ESP_LOGE(TAG, "Read error at %lld", (long long)ra->pos);
+            return AEL_IO_FAIL;
+        }
+        ESP_LOGI(TAG, "No more data, ret:%d", rlen);
+        return AEL_IO_DONE;
+    }
+    ra->stats.bytes += rlen;
+    ra->pos += rlen;
+    audio_element_update_byte_pos(self, rlen);
+    return rlen;
+}
+
+static audio_element_err_t _ra_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(self);
+    ringbuf_handle_t rb = audio_element_get_output_ringbuf(self);
+
+    if (rb && !ra->refilling)
+    {
+        const int64_t deadline = esp_timer_get_time() + READAHEAD_IDLE_POLL_US;
+        while (rb_bytes_filled(rb) > ra->low_bytes)
+        {
+            if (esp_timer_get_time() >= deadline)
+            {
+                return AEL_IO_TIMEOUT;
+            }
+            vTaskDelay(pdMS_TO_TICKS(READAHEAD_IDLE_SLICE_MS));
+        }
+        ra->refilling = true;
+        ra->stats.refills++;
+    }
+
+    /* The first read after open/seek only runs up to the next aligned offset */
+    const int len = ra->read_size - (int)(ra->pos % ra->read_size);
+    int r_size = audio_element_input(self, (char *)ra->buf, len);
+    int w_size = 0;
+    if (r_size > 0)
+    {
+        w_size = audio_element_output(self, (char *)ra->buf, r_size);
+        if (rb && rb_bytes_filled(rb) >= ra->high_bytes)
+        {
+            ra->refilling = false;
+        }
+    }
+    else
+    {
+        w_size = r_size;
+    }
+    return w_size;
+}
+
+static esp_err_t _ra_close(audio_element_handle_t self)
+{
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(self);
+    if (ra->is_open)
+    {
+        fclose(ra->file);
+        ra->file = NULL;
+        ra->is_open = false;
+    }
+    if (AEL_STATE_PAUSED != audio_element_get_state(self))
+    {
+        audio_element_report_pos(self);
+        audio_element_set_byte_pos(self, 0);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t _ra_destroy(audio_element_handle_t self)
+{
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(self);
+    heap_caps_free(ra->buf);
+    audio_free(ra);
+    return ESP_OK;
+}
+
+static void _ra_set_geometry(readahead_stream_t *ra, int read_size)
+{
+    ra->read_size = read_size;
+    ra->high_bytes = ra->high_limit;
+    /* A read must always fit above the high watermark or the burst never ends */
+    if (ra->high_bytes > ra->stats.ring_size - read_size)
+    {
+        ra->high_bytes = ra->stats.ring_size - read_size;
+    }
+}
+
+audio_element_handle_t readahead_stream_init(readahead_stream_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, config, return NULL);
+    if (config->read_size <= 0 || config->ring_size < 2 * config->read_size ||
+        config->low_watermark >= config->high_watermark || config->high_watermark > 100)
+    {
+        ESP_LOGE(TAG, "Invalid read-ahead geometry");
+        return NULL;
+    }
+
+    readahead_stream_t *ra = audio_calloc(1, sizeof(readahead_stream_t));
+    AUDIO_MEM_CHECK(TAG, ra, return NULL);
+
+    ra->buf = heap_caps_aligned_alloc(READAHEAD_DMA_ALIGN, config->read_size, MALLOC_CAP_DMA);
+    if (ra->buf == NULL)
+    {
+        ra->buf = heap_caps_aligned_alloc(READAHEAD_DMA_ALIGN, config->read_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    AUDIO_MEM_CHECK(TAG, ra->buf, {
+        audio_free(ra);
+        return NULL;
+    });
+
+    ra->stats.ring_size = config->ring_size;
+    ra->high_limit = (int)((int64_t)config->ring_size * config->high_watermark / 100);
+    ra->low_bytes = (int)((int64_t)config->ring_size * config->low_watermark / 100);
+    _ra_set_geometry(ra, config->read_size);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _ra_open;
+    cfg.close = _ra_close;
+    cfg.process = _ra_process;
+    cfg.destroy = _ra_destroy;
+    cfg.read = _ra_read;
+    cfg.buffer_len = 0; /* reads go into ra->buf */
+    cfg.out_rb_size = config->ring_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.stack_in_ext = config->ext_stack;
+    cfg.tag = "file";
+
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, {
+        heap_caps_free(ra->buf);
+        audio_free(ra);
+        return NULL;
+    });
+    audio_element_setdata(el, ra);
+    ESP_LOGI(TAG, "Ring %d KB, %d KB reads, refill %d%%..%d%%", config->ring_size / 1024, config->read_size / 1024,
+             config->low_watermark, config->high_watermark);
+    return el;
+}
+
+esp_err_t readahead_stream_get_stats(audio_element_handle_t el, readahead_stream_stats_t *stats)
+{
+    if (!el || !stats)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(el);
+    *stats = ra->stats;
+    ringbuf_handle_t rb = audio_element_get_output_ringbuf(el);
+    stats->ring_fill = rb ? rb_bytes_filled(rb) : 0;
+    return ESP_OK;
+}
+
+esp_err_t readahead_stream_set_read_size(audio_element_handle_t el, int read_size)
+{
+    AUDIO_NULL_CHECK(TAG, el, return ESP_ERR_INVALID_ARG);
+    readahead_stream_t *ra = (readahead_stream_t *)audio_element_getdata(el);
+    if (read_size <= 0 || ra->stats.ring_size < 2 * read_size || ra->low_bytes >= ra->stats.ring_size - read_size)
+    {
+        ESP_LOGE(TAG, "Read size %d does not fit the %d KB ring", read_size, ra->stats.ring_size / 1024);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (ra->is_open)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (read_size == ra->read_size)
+    {
+        return ESP_OK;
+    }
+    uint8_t *buf = heap_caps_aligned_alloc(READAHEAD_DMA_ALIGN, read_size, MALLOC_CAP_DMA);
+    if (buf == NULL)
+    {
+        buf = heap_caps_aligned_alloc(READAHEAD_DMA_ALIGN, read_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    AUDIO_MEM_CHECK(TAG, buf, return ESP_ERR_NO_MEM);
+    heap_caps_free(ra->buf);
+    ra->buf = buf;
+    _ra_set_geometry(ra, read_size);
+    ESP_LOGI(TAG, "%d KB reads", read_size / 1024);
+    return ESP_OK;
+}
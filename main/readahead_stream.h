@@ -0,0 +1,103 @@
+/* SD card reader element with a large read-ahead ring and aligned bulk reads
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __READAHEAD_STREAM_H__
+#define __READAHEAD_STREAM_H__
+
+#include <stdint.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Read-ahead stream configuration
+     */
+    typedef struct
+    {
+        int ring_size;      /*!< Output ringbuffer size; allocated from PSRAM when it is enabled */
+        int read_size;      /*!< Bytes per SD read, a multiple of the FAT cluster size */
+        int high_watermark; /*!< Stop refilling once the ring is this full (percent) */
+        int low_watermark;  /*!< Start refilling once the ring drains to this level (percent) */
+        int task_stack;     /*!< Task stack size */
+        int task_core;      /*!< Task running in core */
+        int task_prio;      /*!< Task priority, normally below the decoder */
+        bool ext_stack;     /*!< Allocate the task stack in PSRAM */
+    } readahead_stream_cfg_t;
+
+#define READAHEAD_STREAM_RING_SIZE (256 * 1024)
+#define READAHEAD_STREAM_READ_SIZE (16 * 1024)
+#define READAHEAD_STREAM_TASK_STACK (3072)
+#define READAHEAD_STREAM_TASK_CORE (0)
+#define READAHEAD_STREAM_TASK_PRIO (2)
+
+#define READAHEAD_STREAM_CFG_DEFAULT()                \
+    {                                                 \
+        .ring_size = READAHEAD_STREAM_RING_SIZE,      \
+        .read_size = READAHEAD_STREAM_READ_SIZE,      \
+        .high_watermark = 90,                         \
+        .low_watermark = 50,                          \
+        .task_stack = READAHEAD_STREAM_TASK_STACK,    \
+        .task_core = READAHEAD_STREAM_TASK_CORE,      \
+        .task_prio = READAHEAD_STREAM_TASK_PRIO,      \
+        .ext_stack = false,                           \
+    }
+
+    /**
+     * @brief Read-ahead statistics since the element was created
+     */
+    typedef struct
+    {
+        uint32_t reads;       /*!< SD read calls */
+        uint32_t refills;     /*!< Refill bursts, each from the low to the high watermark */
+        uint64_t bytes;       /*!< Bytes read from the card */
+        uint64_t read_us;     /*!< Time spent inside fread */
+        uint32_t max_read_us; /*!< Slowest single read */
+        int ring_fill;        /*!< Bytes in the ring when sampled */
+        int ring_size;        /*!< Ring capacity */
+    } readahead_stream_stats_t;
+
+    /**
+     * @brief Create a reader element that streams the file named by the element URI.
+     *        It honours byte_pos on open like fatfs_stream, so it can replace it in a pipeline.
+     *
+     * @param config the configuration
+     *
+     * @return The audio element handle
+     */
+    audio_element_handle_t readahead_stream_init(readahead_stream_cfg_t *config);
+
+    /**
+     * @brief Get the read-ahead statistics
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     */
+    esp_err_t readahead_stream_get_stats(audio_element_handle_t el, readahead_stream_stats_t *stats);
+
+    /**
+     * @brief Change the bytes per SD read, e.g. to what the card benchmarked best at.
+     *        The element must not be running.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG  the size does not leave room between the watermarks
+     *     - ESP_ERR_INVALID_STATE  the element is open
+     *     - ESP_ERR_NO_MEM
+     */
+    esp_err_t readahead_stream_set_read_size(audio_element_handle_t el, int read_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
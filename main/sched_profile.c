@@ -0,0 +1,270 @@
+/* Core, priority and stack placement profiles for the audio tasks
+
+   The ADF defaults put every element on core 0 with stacks in internal RAM.
+   The profiles below place the reader, decoder, resampler and I2S tasks for
+   the dual-core P4; the one in use is chosen in menuconfig.
+
+   The monitor measures what a profile achieves:
+
+     - CPU share: the FreeRTOS run-time counters of every task, as a share
+       of one core over the report period;
+     - deadline slack: a hook on the output of the element feeding I2S
+       compares the audio written so far with the time the I2S clock has
+       run since the stream started. The difference is how much audio sits
+       between the decoder and the DAC (ringbuffer plus DMA); its minimum is
+       how close the decoder came to an underrun. A negative value is a
+       missed deadline, after which the measurement restarts.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "sched_profile.h"
+
+static const char *TAG = "SCHED_PROFILE";
+
+#if CONFIG_SPIRAM_ALLOW_STACK_EXTERNAL_MEMORY
+#define SCHED_EXT_STACK true
+#else
+#define SCHED_EXT_STACK false
+#endif
+
+/* Slack right after a (re)start only reflects the prefill, not the steady state */
+#define SCHED_MONITOR_WARMUP_US (500 * 1000)
+/* Tasks below this share (per mille of a core) are left out of the report */
+#define SCHED_MONITOR_MIN_PERMILLE (1)
+
+/*
+ * Decoder on core 1 with internal stacks, the mixer one priority above it so
+ * prompts are not held back by a decode burst; the reader and the I2S task, which
+ * mostly block on the SD card and the DMA, share core 0. The reader stack can
+ * live in PSRAM: FATFS on SDMMC does not disable the cache.
+ */
+static const sched_profile_t s_split = {
+    .name = "decoder on core 1, I/O on core 0",
+    .reader = {.core = 0, .prio = 4, .ext_stack = SCHED_EXT_STACK},
+    .decoder = {.core = 1, .prio = 5, .ext_stack = false},
+    .resampler = {.core = 1, .prio = 5, .ext_stack = false},
+    .mixer = {.core = 1, .prio = 6, .ext_stack = false},
+    .writer = {.core = 0, .prio = 23, .ext_stack = false},
+    .aux = {.core = 0, .prio = 1, .ext_stack = SCHED_EXT_STACK},
+};
+
+/* All audio on core 1, core 0 left to the application */
+static const sched_profile_t s_core1 = {
+    .name = "all audio on core 1, core 0 free for app",
+    .reader = {.core = 1, .prio = 4, .ext_stack = SCHED_EXT_STACK},
+    .decoder = {.core = 1, .prio = 5, .ext_stack = false},
+    .resampler = {.core = 1, .prio = 5, .ext_stack = false},
+    .mixer = {.core = 1, .prio = 6, .ext_stack = false},
+    .writer = {.core = 1, .prio = 23, .ext_stack = false},
+    .aux = {.core = 1, .prio = 1, .ext_stack = SCHED_EXT_STACK},
+};
+
+const sched_profile_t *sched_profile_get(void)
+{
+#if CONFIG_PLAYER_SCHED_SPLIT
+    return &s_split;
+#elif CONFIG_PLAYER_SCHED_CORE1
+    return &s_core1;
+#else
+    (void)s_split;
+    (void)s_core1;
+    return NULL;
+#endif
+}
+
+struct sched_monitor
+{
+    sched_monitor_cfg_t cfg;
+    audio_io_hook_t feeder_out;
+    SemaphoreHandle_t exited;
+    volatile bool running;
+
+    /* Feeder task */
+    volatile uint32_t bytes_per_s;
+    volatile int64_t anchor_us;
+    int64_t written;
+    volatile int64_t min_slack_us;
+    volatile uint32_t misses;
+
+    /* Monitor task */
+    TaskStatus_t *prev;
+    UBaseType_t prev_count;
+    configRUN_TIME_COUNTER_TYPE prev_total;
+};
+
+static int _feeder_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    sched_monitor_handle_t mon = (sched_monitor_handle_t)hook->ctx;
+    const int64_t now = esp_timer_get_time();
+    const uint32_t bytes_per_s = mon->bytes_per_s;
+    if (mon->anchor_us && bytes_per_s)
+    {
+        const int64_t slack = mon->written * 1000000 / bytes_per_s - (now - mon->anchor_us);
+        if (slack < 0)
+        {
+            mon->misses++;
+            mon->anchor_us = 0;
+        }
+        else if (now - mon->anchor_us > SCHED_MONITOR_WARMUP_US && slack < mon->min_slack_us)
+        {
+            mon->min_slack_us = slack;
+        }
+    }
+
+    int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    if (ret > 0)
+    {
+        if (mon->anchor_us == 0)
+        {
+            mon->anchor_us = now;
+            mon->written = 0;
+        }
+        mon->written += ret;
+    }
+    else
+    {
+        /* Stopped or aborted: the I2S clock no longer runs against this stream */
+        mon->anchor_us = 0;
+    }
+    return ret;
+}
+
+static void report_cpu(sched_monitor_handle_t mon)
+{
+    const UBaseType_t cap = uxTaskGetNumberOfTasks() + 4;
+    TaskStatus_t *now = audio_calloc(cap, sizeof(TaskStatus_t));
+    AUDIO_MEM_CHECK(TAG, now, return);
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    const UBaseType_t count = uxTaskGetSystemState(now, cap, &total);
+
+    const configRUN_TIME_COUNTER_TYPE elapsed = total - mon->prev_total;
+    if (mon->prev && elapsed > 0)
+    {
+        for (UBaseType_t i = 0; i < count; i++)
+        {
+            configRUN_TIME_COUNTER_TYPE before = 0;
+            for (UBaseType_t j = 0; j < mon->prev_count; j++)
+            {
+                if (mon->prev[j].xHandle == now[i].xHandle)
+                {
+                    before = mon->prev[j].ulRunTimeCounter;
+                    break;
+                }
+            }
+            const uint32_t permille = (uint32_t)((uint64_t)(now[i].ulRunTimeCounter - before) * 1000 / elapsed);
+            if (permille >= SCHED_MONITOR_MIN_PERMILLE)
+            {
+                const BaseType_t core = xTaskGetCoreID(now[i].xHandle);
+                ESP_LOGI(TAG, "  %-16s core %2d prio %2u %3u.%u%%", now[i].pcTaskName, core == tskNO_AFFINITY ? -1 : (int)core,
+                         (unsigned)now[i].uxCurrentPriority, (unsigned)(permille / 10), (unsigned)(permille % 10));
+            }
+        }
+    }
+    audio_free(mon->prev);
+    mon->prev = now;
+    mon->prev_count = count;
+    mon->prev_total = total;
+}
+
+static void sched_monitor_task(void *arg)
+{
+    sched_monitor_handle_t mon = (sched_monitor_handle_t)arg;
+    TickType_t wake = xTaskGetTickCount();
+    report_cpu(mon);
+
+    while (mon->running)
+    {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(mon->cfg.period_ms));
+        if (!mon->running)
+        {
+            break;
+        }
+        const int64_t min_slack = mon->min_slack_us;
+        mon->min_slack_us = INT64_MAX;
+        ESP_LOGI(TAG, "CPU share per task over %d ms (of one core):", mon->cfg.period_ms);
+        report_cpu(mon);
+        if (min_slack == INT64_MAX)
+        {
+            ESP_LOGI(TAG, "Decode-to-I2S slack: no steady stream, %u missed deadlines", (unsigned)mon->misses);
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Decode-to-I2S slack: worst %lld.%03lld ms, %u missed deadlines", (long long)(min_slack / 1000),
+                     (long long)(min_slack % 1000), (unsigned)mon->misses);
+        }
+    }
+    xSemaphoreGive(mon->exited);
+    vTaskDelete(NULL);
+}
+
+sched_monitor_handle_t sched_monitor_init(const sched_monitor_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->feeder && cfg->period_ms > 0, return NULL);
+
+    sched_monitor_handle_t mon = audio_calloc(1, sizeof(struct sched_monitor));
+    AUDIO_MEM_CHECK(TAG, mon, return NULL);
+    mon->cfg = *cfg;
+    mon->min_slack_us = INT64_MAX;
+    mon->feeder_out = (audio_io_hook_t){.fn = _feeder_write_hook, .ctx = mon};
+    mon->exited = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, mon->exited, {
+        audio_free(mon);
+        return NULL;
+    });
+
+    if (audio_io_hook_add(cfg->feeder, AUDIO_IO_HOOK_WRITE, &mon->feeder_out) != ESP_OK)
+    {
+        vSemaphoreDelete(mon->exited);
+        audio_free(mon);
+        return NULL;
+    }
+
+    mon->running = true;
+    if (xTaskCreatePinnedToCore(sched_monitor_task, "sched_mon", cfg->task_stack, mon, cfg->task_prio, NULL, cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create monitor task");
+        audio_io_hook_remove(cfg->feeder, AUDIO_IO_HOOK_WRITE, &mon->feeder_out);
+        vSemaphoreDelete(mon->exited);
+        audio_free(mon);
+        return NULL;
+    }
+    return mon;
+}
+
+void sched_monitor_set_format(sched_monitor_handle_t mon, int rate, int bits, int ch)
+{
+    if (mon == NULL)
+    {
+        return;
+    }
+    mon->bytes_per_s = (uint32_t)rate * ch * (bits / 8);
+    mon->anchor_us = 0;
+}
+
+void sched_monitor_deinit(sched_monitor_handle_t mon)
+{
+    if (mon == NULL)
+    {
+        return;
+    }
+    mon->running = false;
+    xSemaphoreTake(mon->exited, portMAX_DELAY);
+    audio_io_hook_remove(mon->cfg.feeder, AUDIO_IO_HOOK_WRITE, &mon->feeder_out);
+    vSemaphoreDelete(mon->exited);
+    audio_free(mon->prev);
+    audio_free(mon);
+}
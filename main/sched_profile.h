@@ -0,0 +1,109 @@
+/* Core, priority and stack placement profiles for the audio tasks
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __SCHED_PROFILE_H__
+#define __SCHED_PROFILE_H__
+
+#include <stdbool.h>
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Placement of one task
+     */
+    typedef struct
+    {
+        int core;       /*!< Task running in core */
+        int prio;       /*!< Task priority */
+        bool ext_stack; /*!< Allocate the task stack in PSRAM */
+    } sched_task_t;
+
+    /**
+     * @brief A named set of placements, one per pipeline role
+     */
+    typedef struct
+    {
+        const char *name;
+        sched_task_t reader;    /*!< "file" element, and the read-ahead refill */
+        sched_task_t decoder;   /*!< "mp3" element */
+        sched_task_t resampler; /*!< "rsp" element */
+        sched_task_t mixer;     /*!< "mix" element */
+        sched_task_t writer;    /*!< "i2s" element */
+        sched_task_t aux;       /*!< Telemetry and measurement tasks */
+    } sched_profile_t;
+
+    /**
+     * @brief The profile selected in menuconfig
+     *
+     * @return The profile, NULL to keep the ADF element defaults
+     */
+    const sched_profile_t *sched_profile_get(void);
+
+/* Copy a placement into an element config whose stack flag is named `ext_field` */
+#define SCHED_PROFILE_APPLY(cfg, task, ext_field) \
+    do                                            \
+    {                                             \
+        (cfg).task_core = (task).core;            \
+        (cfg).task_prio = (task).prio;            \
+        (cfg).ext_field = (task).ext_stack;       \
+    } while (0)
+
+    /**
+     * @brief Measurement configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t feeder; /*!< Element whose output feeds I2S: "mp3", "rsp" or "mix" */
+        int period_ms;                 /*!< Report period */
+        int task_stack;                /*!< Task stack size */
+        int task_core;                 /*!< Task running in core */
+        int task_prio;                 /*!< Task priority */
+    } sched_monitor_cfg_t;
+
+#define SCHED_MONITOR_TASK_STACK (3072)
+
+#define SCHED_MONITOR_CFG_DEFAULT()                 \
+    {                                               \
+        .feeder = NULL,                             \
+        .period_ms = 5000,                          \
+        .task_stack = SCHED_MONITOR_TASK_STACK,     \
+        .task_core = 0,                             \
+        .task_prio = 1,                             \
+    }
+
+    typedef struct sched_monitor *sched_monitor_handle_t;
+
+    /**
+     * @brief Hook the feeder's output and start logging, every period, the CPU share of each
+     *        task and the worst decode-to-I2S deadline slack: how far ahead of the I2S clock the
+     *        feeder's output was at its closest. Call after audio_pipeline_link() and any sink.
+     *
+     * @return The monitor handle, NULL on failure
+     */
+    sched_monitor_handle_t sched_monitor_init(const sched_monitor_cfg_t *cfg);
+
+    /**
+     * @brief Output format the I2S clock runs at; restarts the slack measurement
+     */
+    void sched_monitor_set_format(sched_monitor_handle_t mon, int rate, int bits, int ch);
+
+    /**
+     * @brief Stop the task and unhook the feeder. The pipeline must be stopped.
+     */
+    void sched_monitor_deinit(sched_monitor_handle_t mon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
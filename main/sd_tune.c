@@ -0,0 +1,301 @@
+/* Mount-time SD card benchmark picking the bus clock and the reader request size
+
+   Cards differ a lot in how they cope with a fast clock and with request
+   size: some return CRC errors at SDR50 on a given board, some reach their
+   throughput only with large multi-block reads, some are already saturated
+   at 16 KB. The mount code cannot know, so this measures the card once:
+
+     - at each bus clock the card supports, fastest first, raw sequential
+       reads at 4..64 KB and 4 KB reads at random sectors;
+     - a clock that produces any failed read (CRC, timeout) is rejected;
+     - the fastest clean clock wins, and the reader request size is the
+       smallest one, not below min_read_size, reaching 90% of the best
+       sequential throughput at that clock.
+
+   Only sectors are read, so this is safe on a mounted card. The result is
+   stored in NVS keyed by the card CID, so a known card costs one NVS read
+   on later boots.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_heap_caps.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "sdmmc_cmd.h"
+#include "driver/sdmmc_host.h"
+#include "audio_error.h"
+#include "sd_tune.h"
+
+static const char *TAG = "SD_TUNE";
+
+#define SD_TUNE_NVS_NAMESPACE "sd_tune"
+/* Bump when sd_tune_result_t changes; older entries are then measured again */
+#define SD_TUNE_VERSION (1)
+#define SD_TUNE_DMA_ALIGN (128)
+#define SD_TUNE_RANDOM_SIZE (4 * 1024)
+/* Share of the best sequential throughput a smaller request size must reach to be picked */
+#define SD_TUNE_GOOD_ENOUGH_PCT (90)
+
+static const uint32_t s_sizes[SD_TUNE_SIZES] = {4 * 1024, 8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024};
+static const uint32_t s_freqs[SD_TUNE_FREQS] = {SDMMC_FREQ_SDR50, SDMMC_FREQ_HIGHSPEED, SDMMC_FREQ_DEFAULT};
+
+typedef struct
+{
+    uint32_t version;
+    sd_tune_result_t result;
+} sd_tune_blob_t;
+
+uint32_t sd_tune_size(int idx)
+{
+    return (idx >= 0 && idx < SD_TUNE_SIZES) ? s_sizes[idx] : 0;
+}
+
+static void sd_tune_key(const sdmmc_card_t *card, char *key, size_t len)
+{
+    /* 14 characters, within the 15 NVS allows */
+    snprintf(key, len, "%02x%04x%08x", (unsigned)(card->cid.mfg_id & 0xff), (unsigned)(card->cid.oem_id & 0xffff),
+             (unsigned)card->cid.serial);
+}
+
+static esp_err_t sd_tune_nvs_open(nvs_open_mode_t mode, nvs_handle_t *nvs)
+{
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_LOGW(TAG, "Erasing NVS (%s)", esp_err_to_name(ret));
+        nvs_flash_erase();
+        ret = nvs_flash_init();
+    }
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    return nvs_open(SD_TUNE_NVS_NAMESPACE, mode, nvs);
+}
+
+static bool sd_tune_load(const char *key, sd_tune_result_t *result)
+{
+    nvs_handle_t nvs;
+    if (sd_tune_nvs_open(NVS_READONLY, &nvs) != ESP_OK)
+    {
+        return false;
+    }
+    sd_tune_blob_t blob;
+    size_t len = sizeof(blob);
+    esp_err_t ret = nvs_get_blob(nvs, key, &blob, &len);
+    nvs_close(nvs);
+    if (ret != ESP_OK || len != sizeof(blob) || blob.version != SD_TUNE_VERSION)
+    {
+        return false;
+    }
+    *result = blob.result;
+    result->from_nvs = true;
+    return true;
+}
+
+static void sd_tune_save(const char *key, const sd_tune_result_t *result)
+{
+    nvs_handle_t nvs;
+    esp_err_t ret = sd_tune_nvs_open(NVS_READWRITE, &nvs);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Result not stored: %s", esp_err_to_name(ret));
+        return;
+    }
+    sd_tune_blob_t blob = {
+        .version = SD_TUNE_VERSION,
+        .result = *result,
+    };
+    ret = nvs_set_blob(nvs, key, &blob, sizeof(blob));
+    if (ret == ESP_OK)
+    {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Result not stored: %s", esp_err_to_name(ret));
+    }
+}
+
+static esp_err_t sd_tune_set_clock(sdmmc_card_t *card, uint32_t freq_khz)
+{
+    esp_err_t ret = card->host.set_card_clk(card->host.slot, freq_khz);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    int real_khz = freq_khz;
+    if (card->host.get_real_freq)
+    {
+        card->host.get_real_freq(card->host.slot, &real_khz);
+    }
+    card->real_freq_khz = real_khz;
+    return ESP_OK;
+}
+
+static bool sd_tune_read(sdmmc_card_t *card, uint8_t *buf, size_t sector, size_t count, sd_tune_point_t *point)
+{
+    esp_err_t ret = sdmmc_read_sectors(card, buf, sector, count);
+    if (ret != ESP_OK)
+    {
+        point->errors++;
+        ESP_LOGW(TAG, "Read of %u sectors at %u failed at %lu kHz: %s", (unsigned)count, (unsigned)sector,
+                 (unsigned long)point->freq_khz, esp_err_to_name(ret));
+        return false;
+    }
+    return true;
+}
+
+static void sd_tune_measure(sdmmc_card_t *card, const sd_tune_cfg_t *cfg, uint8_t *buf, sd_tune_point_t *point)
+{
+    const size_t sector_size = card->csd.sector_size;
+    const size_t capacity = card->csd.capacity;
+    const size_t span = cfg->bench_bytes / sector_size;
+    /* Away from the FAT at the start of the card; the data is never looked at */
+    const size_t base = (capacity / 2) & ~(size_t)(s_sizes[SD_TUNE_SIZES - 1] / sector_size - 1);
+
+    for (int i = 0; i < SD_TUNE_SIZES; i++)
+    {
+        const size_t count = s_sizes[i] / sector_size;
+        const int64_t t0 = esp_timer_get_time();
+        for (size_t s = 0; s < span; s += count)
+        {
+            if (!sd_tune_read(card, buf, base + s, count, point))
+            {
+                return;
+            }
+        }
+        const int64_t us = esp_timer_get_time() - t0;
+        point->seq_kbps[i] = us > 0 ? (uint32_t)((uint64_t)cfg->bench_bytes * 1000000 / 1024 / us) : 0;
+    }
+
+    const size_t count = SD_TUNE_RANDOM_SIZE / sector_size;
+    uint64_t total_us = 0;
+    for (int i = 0; i < cfg->random_reads; i++)
+    {
+        const size_t sector = (esp_random() % (capacity - count)) & ~(count - 1);
+        const int64_t t0 = esp_timer_get_time();
+        if (!sd_tune_read(card, buf, sector, count, point))
+        {
+            return;
+        }
+        const uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+        total_us += us;
+        if (us > point->rand_us_max)
+        {
+            point->rand_us_max = us;
+        }
+    }
+    point->rand_us_avg = cfg->random_reads > 0 ? (uint32_t)(total_us / cfg->random_reads) : 0;
+}
+
+static uint32_t sd_tune_pick_size(const sd_tune_cfg_t *cfg, const sd_tune_point_t *point)
+{
+    uint32_t best = 0;
+    for (int i = 0; i < SD_TUNE_SIZES; i++)
+    {
+        if (point->seq_kbps[i] > best)
+        {
+            best = point->seq_kbps[i];
+        }
+    }
+    for (int i = 0; i < SD_TUNE_SIZES; i++)
+    {
+        if (s_sizes[i] >= cfg->min_read_size && point->seq_kbps[i] * 100ULL >= best * (uint64_t)SD_TUNE_GOOD_ENOUGH_PCT)
+        {
+            return s_sizes[i];
+        }
+    }
+    return s_sizes[SD_TUNE_SIZES - 1];
+}
+
+static esp_err_t sd_tune_bench(sdmmc_card_t *card, const sd_tune_cfg_t *cfg, sd_tune_result_t *result)
+{
+    uint8_t *buf = heap_caps_aligned_alloc(SD_TUNE_DMA_ALIGN, s_sizes[SD_TUNE_SIZES - 1], MALLOC_CAP_DMA);
+    AUDIO_MEM_CHECK(TAG, buf, return ESP_ERR_NO_MEM);
+
+    const sd_tune_point_t *chosen = NULL;
+    for (int f = 0; f < SD_TUNE_FREQS; f++)
+    {
+        sd_tune_point_t *point = &result->points[f];
+        if (s_freqs[f] > (uint32_t)card->max_freq_khz)
+        {
+            continue;
+        }
+        point->freq_khz = s_freqs[f];
+        if (sd_tune_set_clock(card, s_freqs[f]) != ESP_OK)
+        {
+            point->errors++;
+            continue;
+        }
+        sd_tune_measure(card, cfg, buf, point);
+        ESP_LOGI(TAG, "%3lu MHz: seq 4K %lu, 8K %lu, 16K %lu, 32K %lu, 64K %lu KB/s; rand 4K avg %lu us max %lu us%s",
+                 (unsigned long)(point->freq_khz / 1000), (unsigned long)point->seq_kbps[0], (unsigned long)point->seq_kbps[1],
+                 (unsigned long)point->seq_kbps[2], (unsigned long)point->seq_kbps[3], (unsigned long)point->seq_kbps[4],
+                 (unsigned long)point->rand_us_avg, (unsigned long)point->rand_us_max, point->errors ? ", rejected" : "");
+        if (!point->errors && (!chosen || point->seq_kbps[SD_TUNE_SIZES - 1] > chosen->seq_kbps[SD_TUNE_SIZES - 1]))
+        {
+            chosen = point;
+        }
+    }
+    heap_caps_free(buf);
+
+    if (!chosen)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    result->freq_khz = chosen->freq_khz;
+    result->read_size = sd_tune_pick_size(cfg, chosen);
+    return ESP_OK;
+}
+
+esp_err_t sd_tune_apply(sdmmc_card_t *card, const sd_tune_cfg_t *cfg, sd_tune_result_t *result)
+{
+    if (!card || !cfg || !result || card->csd.sector_size <= 0 || cfg->bench_bytes < s_sizes[SD_TUNE_SIZES - 1] ||
+        card->csd.capacity < 2 * (int)(cfg->bench_bytes / card->csd.sector_size))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    char key[16];
+    sd_tune_key(card, key, sizeof(key));
+    memset(result, 0, sizeof(*result));
+
+    if (cfg->force || !sd_tune_load(key, result))
+    {
+        ESP_LOGI(TAG, "Benchmarking card %s", key);
+        const int64_t t0 = esp_timer_get_time();
+        esp_err_t ret = sd_tune_bench(card, cfg, result);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "No clock read the card cleanly");
+            return ret;
+        }
+        ESP_LOGI(TAG, "Benchmark took %lld ms", (long long)((esp_timer_get_time() - t0) / 1000));
+        sd_tune_save(key, result);
+    }
+    else if (result->freq_khz > (uint32_t)card->max_freq_khz)
+    {
+        /* Same card, but mounted slower than when it was measured */
+        result->freq_khz = card->max_freq_khz;
+    }
+
+    esp_err_t ret = sd_tune_set_clock(card, result->freq_khz);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    ESP_LOGI(TAG, "Card %s: %lu kHz (real %d kHz), %lu KB reads%s", key, (unsigned long)result->freq_khz,
+             card->real_freq_khz, (unsigned long)(result->read_size / 1024), result->from_nvs ? " (stored)" : "");
+    return ESP_OK;
+}
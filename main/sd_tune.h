@@ -0,0 +1,92 @@
+/* Mount-time SD card benchmark picking the bus clock and the reader request size
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __SD_TUNE_H__
+#define __SD_TUNE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Request sizes measured: 4, 8, 16, 32 and 64 KB */
+#define SD_TUNE_SIZES (5)
+/* Bus clocks tried, fastest first: SDR50, high speed, default speed */
+#define SD_TUNE_FREQS (3)
+
+    /**
+     * @brief Benchmark configuration
+     */
+    typedef struct
+    {
+        uint32_t min_read_size; /*!< Smallest request size to pick, e.g. the FAT allocation unit */
+        uint32_t bench_bytes;   /*!< Bytes read sequentially per request size and clock */
+        int random_reads;       /*!< 4 KB reads at random sectors per clock */
+        bool force;             /*!< Benchmark even if a result is stored for this card */
+    } sd_tune_cfg_t;
+
+#define SD_TUNE_CFG_DEFAULT()       \
+    {                               \
+        .min_read_size = 16 * 1024, \
+        .bench_bytes = 1024 * 1024, \
+        .random_reads = 64,         \
+        .force = false,             \
+    }
+
+    /**
+     * @brief Measurements at one bus clock
+     */
+    typedef struct
+    {
+        uint32_t freq_khz;                /*!< Requested clock */
+        uint32_t errors;                  /*!< Failed reads (CRC, timeout); the clock is rejected if any */
+        uint32_t seq_kbps[SD_TUNE_SIZES]; /*!< Sequential throughput per request size, KB/s */
+        uint32_t rand_us_avg;             /*!< 4 KB random read latency */
+        uint32_t rand_us_max;
+    } sd_tune_point_t;
+
+    /**
+     * @brief Benchmark result, stored in NVS per card CID
+     */
+    typedef struct
+    {
+        uint32_t freq_khz;                     /*!< Bus clock picked */
+        uint32_t read_size;                    /*!< Request size picked for the file reader */
+        sd_tune_point_t points[SD_TUNE_FREQS]; /*!< One per clock tried, fastest first; freq_khz 0 if skipped */
+        bool from_nvs;                         /*!< Loaded rather than measured on this boot */
+    } sd_tune_result_t;
+
+    /**
+     * @brief Apply the stored result for this card, or benchmark it first. Reads raw sectors
+     *        only; the card content is not touched. The card must be mounted at its fastest clock,
+     *        it is left at the picked one.
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NO_MEM
+     *     - ESP_ERR_NOT_FOUND  the card failed at every clock
+     */
+    esp_err_t sd_tune_apply(sdmmc_card_t *card, const sd_tune_cfg_t *cfg, sd_tune_result_t *result);
+
+    /**
+     * @brief Request size of an index of sd_tune_point_t::seq_kbps
+     */
+    uint32_t sd_tune_size(int idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
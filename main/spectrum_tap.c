@@ -0,0 +1,450 @@
+/* Spectrum and level meters of the PCM on its way to I2S
+
+   A hook on the output element copies one batch of fft_size frames every
+   1/frame_hz seconds into a ring of slots and skips the frames in between,
+   so the audio path pays for a memcpy of the batches actually analysed
+   and a counter otherwise. The ring is single producer, single consumer:
+   the hook publishes a slot with a release store of `head` and pokes the
+   task with a notification, the task frees it with a release store of
+   `tail`. When every slot is still waiting the batch is dropped and
+   counted; the hook never blocks.
+
+   The task computes, per batch:
+     - sample peak and RMS of each channel;
+     - a Hann-windowed FFT of the channels' mean with esp-dsp's
+       dsps_fft2r_fc32, whose power is summed into log-spaced bands and
+       scaled by the window's gain and noise bandwidth, so a full-scale
+       sine reads 0 dB in its band. Band levels rise at once and fall at
+       fall_db_s, as a display wants them.
+
+   The frame is published under a sequence counter, so spectrum_tap_get()
+   copies it from any task without a lock, and is also sent to the
+   listener if there is one.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "dsps_fft2r.h"
+#include "spectrum_tap.h"
+
+static const char *TAG = "SPECTRUM_TAP";
+
+#define TAP_ALIGN (16)
+#define TAP_MIN_FFT (256)
+#define TAP_MAX_FFT (4096)
+/* Hann: coherent gain 0.5, equivalent noise bandwidth 1.5 bins */
+#define TAP_HANN_ENBW (1.5f)
+#define TAP_FLOOR_DB (-120.0f)
+
+typedef struct
+{
+    int ch;
+    int16_t *pcm; /* fft_size frames */
+} tap_slot_t;
+
+struct spectrum_tap
+{
+    spectrum_tap_cfg_t cfg;
+    audio_io_hook_t hook;
+    tap_slot_t *slots;
+    atomic_uint head; /* Slots filled, written by the hook */
+    atomic_uint tail; /* Slots analysed, written by the task */
+
+    /* Set by spectrum_tap_set_format(), read by the hook and the task */
+    volatile int rate;
+    volatile int ch;
+    volatile int interval; /* Frames from one batch start to the next */
+
+    /* Hook only */
+    int fill;
+    int skip;
+    volatile uint32_t dropped;
+    volatile uint64_t hook_cycles;
+    volatile uint64_t hook_frames;
+
+    /* Task only */
+    TaskHandle_t task;
+    SemaphoreHandle_t exited;
+    volatile bool running;
+    float *window;
+    float *fft; /* Interleaved complex */
+    bool fft_ready;
+    int band_rate;
+    int band_lo[SPECTRUM_TAP_MAX_BANDS]; /* First bin */
+    int band_hi[SPECTRUM_TAP_MAX_BANDS]; /* Past the last bin */
+    float level[SPECTRUM_TAP_MAX_BANDS];
+    int64_t last_us;
+    int64_t start_us;
+    uint64_t busy_us;
+    audio_event_iface_handle_t evt;
+
+    /* Published */
+    atomic_uint pub_seq; /* Odd while `frame` is being written */
+    spectrum_tap_frame_t frame;
+    spectrum_tap_stats_t stats;
+};
+
+static void capture(spectrum_tap_handle_t t, const int16_t *pcm, int frames, int ch)
+{
+    const int n_fft = t->cfg.fft_size;
+    while (frames > 0)
+    {
+        if (t->skip > 0)
+        {
+            const int n = t->skip < frames ? t->skip : frames;
+            t->skip -= n;
+            pcm += n * ch;
+            frames -= n;
+            continue;
+        }
+        const unsigned head = atomic_load_explicit(&t->head, memory_order_relaxed);
+        if (t->fill == 0 && head - atomic_load_explicit(&t->tail, memory_order_acquire) >= (unsigned)t->cfg.slots)
+        {
+            /* The task is behind: leave this batch out */
+            t->dropped++;
+            t->skip = t->interval;
+            continue;
+        }
+        tap_slot_t *s = &t->slots[head % t->cfg.slots];
+        if (t->fill == 0)
+        {
+            s->ch = ch;
+        }
+        const int n = n_fft - t->fill < frames ? n_fft - t->fill : frames;
+        memcpy(s->pcm + t->fill * ch, pcm, n * ch * sizeof(int16_t));
+        t->fill += n;
+        pcm += n * ch;
+        frames -= n;
+        if (t->fill == n_fft)
+        {
+            t->fill = 0;
+            t->skip = t->interval > n_fft ? t->interval - n_fft : 0;
+            atomic_store_explicit(&t->head, head + 1, memory_order_release);
+            xTaskNotifyGive(t->task);
+        }
+    }
+}
+
+/* A partial frame at the end of a buffer is not captured */
+static int _tap_hook(audio_io_hook_t *hook, audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait)
+{
+    spectrum_tap_handle_t t = (spectrum_tap_handle_t)hook->ctx;
+    int ret = len;
+    if (hook->dir == AUDIO_IO_HOOK_READ)
+    {
+        ret = audio_io_hook_next(hook, self, buffer, len, ticks_to_wait);
+    }
+    const int ch = t->ch;
+    if (ret > 0 && ch > 0)
+    {
+        const uint32_t t0 = esp_cpu_get_cycle_count();
+        const int frames = ret / (ch * (int)sizeof(int16_t));
+        capture(t, (const int16_t *)buffer, frames, ch);
+        t->hook_cycles += esp_cpu_get_cycle_count() - t0;
+        t->hook_frames += frames;
+    }
+    if (hook->dir == AUDIO_IO_HOOK_WRITE)
+    {
+        ret = audio_io_hook_next(hook, self, buffer, len, ticks_to_wait);
+    }
+    return ret;
+}
+
+static float to_db(float v)
+{
+    return v > 0 ? 20.0f * log10f(v) : TAP_FLOOR_DB;
+}
+
+/* Log-spaced edges from min_hz to Nyquist, each band at least one bin wide */
+static void band_layout(spectrum_tap_handle_t t, int rate)
+{
+    const int n = t->cfg.fft_size;
+    const float nyquist = rate / 2.0f;
+    const float lo_hz = t->cfg.min_hz < nyquist ? t->cfg.min_hz : nyquist / 2;
+    int prev = (int)(lo_hz * n / rate);
+    prev = prev < 1 ? 1 : prev;
+    for (int b = 0; b < t->cfg.bands; b++)
+    {
+        const float edge = lo_hz * powf(nyquist / lo_hz, (float)(b + 1) / t->cfg.bands);
+        int hi = (int)lroundf(edge * n / rate);
+        hi = hi <= prev ? prev + 1 : hi;
+        hi = hi > n / 2 ? n / 2 : hi;
+        t->band_lo[b] = prev < n / 2 ? prev : n / 2 - 1;
+        t->band_hi[b] = hi > t->band_lo[b] ? hi : t->band_lo[b] + 1;
+        t->frame.band_hz[b] = (uint16_t)(sqrtf((float)t->band_lo[b] * t->band_hi[b]) * rate / n);
+        prev = t->band_hi[b];
+    }
+    t->band_rate = rate;
+}
+
+static void analyse(spectrum_tap_handle_t t, const tap_slot_t *s)
+{
+    const int64_t t0 = esp_timer_get_time();
+    const int n = t->cfg.fft_size;
+    const int ch = s->ch;
+    const int rate = t->rate;
+    float peak[SPECTRUM_TAP_MAX_CH] = {0};
+    float sum[SPECTRUM_TAP_MAX_CH] = {0};
+    const float scale = 1.0f / (32768.0f * ch);
+    for (int i = 0; i < n; i++)
+    {
+        float mono = 0;
+        for (int c = 0; c < ch; c++)
+        {
+            const float x = s->pcm[i * ch + c];
+            const float a = fabsf(x);
+            peak[c] = a > peak[c] ? a : peak[c];
+            sum[c] += x * x;
+            mono += x;
+        }
+        t->fft[2 * i] = mono * scale * t->window[i];
+        t->fft[2 * i + 1] = 0;
+    }
+    dsps_fft2r_fc32(t->fft, n);
+    dsps_bit_rev_fc32(t->fft, n);
+
+    /* A full-scale sine peaks at n/4 in each of its two mirrored bins; its band holds one of them */
+    const float norm = 16.0f / ((float)n * n * TAP_HANN_ENBW);
+    const float dt = t->last_us ? (t0 - t->last_us) / 1e6f : 0;
+    const float fall = t->cfg.fall_db_s * dt;
+    t->last_us = t0;
+
+    atomic_fetch_add_explicit(&t->pub_seq, 1, memory_order_acq_rel);
+    if (rate != t->band_rate)
+    {
+        band_layout(t, rate);
+    }
+    for (int b = 0; b < t->cfg.bands; b++)
+    {
+        float power = 0;
+        for (int k = t->band_lo[b]; k < t->band_hi[b]; k++)
+        {
+            power += t->fft[2 * k] * t->fft[2 * k] + t->fft[2 * k + 1] * t->fft[2 * k + 1];
+        }
+        const float db = power > 0 ? 10.0f * log10f(power * norm) : TAP_FLOOR_DB;
+        t->level[b] = db > t->level[b] - fall ? db : t->level[b] - fall;
+        t->frame.band_db[b] = t->level[b];
+    }
+    t->frame.seq++;
+    t->frame.uptime_ms = (uint32_t)(t0 / 1000);
+    t->frame.bands = t->cfg.bands;
+    t->frame.ch = ch;
+    for (int c = 0; c < ch; c++)
+    {
+        t->frame.peak_db[c] = to_db(peak[c] / 32768.0f);
+        t->frame.rms_db[c] = to_db(sqrtf(sum[c] / n) / 32768.0f);
+    }
+    atomic_fetch_add_explicit(&t->pub_seq, 1, memory_order_release);
+
+    const uint32_t took = (uint32_t)(esp_timer_get_time() - t0);
+    t->busy_us += took;
+    t->stats.frames++;
+    t->stats.analyse_us_max = took > t->stats.analyse_us_max ? took : t->stats.analyse_us_max;
+    t->stats.analyse_us_avg = (uint32_t)(t->busy_us / t->stats.frames);
+    const int64_t wall = esp_timer_get_time() - t->start_us;
+    t->stats.load_permille = wall > 0 ? (uint32_t)(t->busy_us * 1000 / wall) : 0;
+
+    if (t->cfg.listener)
+    {
+        audio_event_iface_msg_t msg = {
+            .cmd = SPECTRUM_TAP_CMD_FRAME,
+            .data = &t->frame,
+            .data_len = sizeof(spectrum_tap_frame_t),
+            .source = t,
+            .source_type = SPECTRUM_TAP_SOURCE_TYPE,
+            .need_free_data = false,
+        };
+        audio_event_iface_sendout(t->evt, &msg);
+    }
+}
+
+static void spectrum_tap_task(void *arg)
+{
+    spectrum_tap_handle_t t = (spectrum_tap_handle_t)arg;
+    t->start_us = esp_timer_get_time();
+    while (t->running)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        unsigned tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        while (t->running && tail != atomic_load_explicit(&t->head, memory_order_acquire))
+        {
+            analyse(t, &t->slots[tail % t->cfg.slots]);
+            atomic_store_explicit(&t->tail, ++tail, memory_order_release);
+        }
+    }
+    xSemaphoreGive(t->exited);
+    vTaskDelete(NULL);
+}
+
+static void release(spectrum_tap_handle_t t)
+{
+    if (t->hook.fn)
+    {
+        audio_io_hook_remove(t->cfg.el, t->cfg.dir, &t->hook);
+    }
+    if (t->slots)
+    {
+        for (int i = 0; i < t->cfg.slots; i++)
+        {
+            audio_free(t->slots[i].pcm);
+        }
+        audio_free(t->slots);
+    }
+    if (t->evt)
+    {
+        audio_event_iface_destroy(t->evt);
+    }
+    if (t->exited)
+    {
+        vSemaphoreDelete(t->exited);
+    }
+    if (t->fft_ready)
+    {
+        dsps_fft2r_deinit_fc32();
+    }
+    heap_caps_free(t->window);
+    heap_caps_free(t->fft);
+    audio_free(t);
+}
+
+spectrum_tap_handle_t spectrum_tap_init(const spectrum_tap_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->el, return NULL);
+    if (cfg->fft_size < TAP_MIN_FFT || cfg->fft_size > TAP_MAX_FFT || (cfg->fft_size & (cfg->fft_size - 1)) ||
+        cfg->bands < 1 || cfg->bands > SPECTRUM_TAP_MAX_BANDS || cfg->min_hz <= 0 || cfg->frame_hz <= 0 ||
+        cfg->slots < 1)
+    {
+        ESP_LOGE(TAG, "Invalid tap configuration");
+        return NULL;
+    }
+
+    spectrum_tap_handle_t t = audio_calloc(1, sizeof(struct spectrum_tap));
+    AUDIO_MEM_CHECK(TAG, t, return NULL);
+    t->cfg = *cfg;
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->pub_seq, 0);
+    for (int b = 0; b < SPECTRUM_TAP_MAX_BANDS; b++)
+    {
+        t->level[b] = TAP_FLOOR_DB;
+    }
+
+    const int n = cfg->fft_size;
+    t->window = heap_caps_aligned_alloc(TAP_ALIGN, n * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    t->fft = heap_caps_aligned_alloc(TAP_ALIGN, 2 * n * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    t->slots = audio_calloc(cfg->slots, sizeof(tap_slot_t));
+    t->exited = xSemaphoreCreateBinary();
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    t->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, t->window && t->fft && t->slots && t->exited && t->evt, goto _fail);
+    for (int i = 0; i < cfg->slots; i++)
+    {
+        /* Batches are only touched by memcpy and one pass of the task: PSRAM is fine */
+        t->slots[i].pcm = audio_calloc(n * SPECTRUM_TAP_MAX_CH, sizeof(int16_t));
+        AUDIO_MEM_CHECK(TAG, t->slots[i].pcm, goto _fail);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        t->window[i] = 0.5f - 0.5f * cosf(2 * (float)M_PI * i / n);
+    }
+    if (dsps_fft2r_init_fc32(NULL, n) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "FFT tables for %d points failed", n);
+        goto _fail;
+    }
+    t->fft_ready = true;
+    if (cfg->listener)
+    {
+        audio_event_iface_set_listener(t->evt, cfg->listener);
+    }
+
+    t->hook = (audio_io_hook_t){.fn = _tap_hook, .ctx = t};
+    if (audio_io_hook_add(cfg->el, cfg->dir, &t->hook) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Pipeline must be linked before spectrum_tap_init");
+        t->hook.fn = NULL;
+        goto _fail;
+    }
+    t->running = true;
+    if (xTaskCreatePinnedToCore(spectrum_tap_task, "spectrum", cfg->task_stack, t, cfg->task_prio, &t->task,
+                                cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create spectrum task");
+        goto _fail;
+    }
+    ESP_LOGI(TAG, "%d-point FFT, %d bands from %d Hz, %d frames/s", n, cfg->bands, cfg->min_hz, cfg->frame_hz);
+    return t;
+
+_fail:
+    release(t);
+    return NULL;
+}
+
+void spectrum_tap_set_format(spectrum_tap_handle_t t, int rate, int bits, int ch)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    if (bits != 16 || ch < 1 || ch > SPECTRUM_TAP_MAX_CH || rate <= 0)
+    {
+        ESP_LOGW(TAG, "%d bits, %d ch is not analysed", bits, ch);
+        t->ch = 0;
+        return;
+    }
+    t->rate = rate;
+    t->interval = rate / t->cfg.frame_hz;
+    t->ch = ch;
+}
+
+esp_err_t spectrum_tap_get(spectrum_tap_handle_t t, spectrum_tap_frame_t *frame)
+{
+    AUDIO_NULL_CHECK(TAG, t && frame, return ESP_ERR_INVALID_ARG);
+    unsigned before, after;
+    do
+    {
+        before = atomic_load_explicit(&t->pub_seq, memory_order_acquire);
+        memcpy(frame, &t->frame, sizeof(*frame));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&t->pub_seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return frame->seq ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t spectrum_tap_get_stats(spectrum_tap_handle_t t, spectrum_tap_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, t && stats, return ESP_ERR_INVALID_ARG);
+    *stats = t->stats;
+    stats->dropped = t->dropped;
+    const uint64_t frames = t->hook_frames;
+    stats->hook_cycles_per_frame = frames ? (uint32_t)(t->hook_cycles / frames) : 0;
+    return ESP_OK;
+}
+
+void spectrum_tap_deinit(spectrum_tap_handle_t t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    t->running = false;
+    xTaskNotifyGive(t->task);
+    xSemaphoreTake(t->exited, portMAX_DELAY);
+    release(t);
+}
@@ -0,0 +1,139 @@
+/* Spectrum and level meters of the PCM on its way to I2S
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __SPECTRUM_TAP_H__
+#define __SPECTRUM_TAP_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "audio_io_hook.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* audio_event_iface_msg_t.source_type of spectrum messages */
+#define SPECTRUM_TAP_SOURCE_TYPE (0x53504543) /* "SPEC" */
+/* audio_event_iface_msg_t.cmd of a new frame; data points to a spectrum_tap_frame_t valid until the next one */
+#define SPECTRUM_TAP_CMD_FRAME (1)
+
+#define SPECTRUM_TAP_MAX_BANDS (32)
+#define SPECTRUM_TAP_MAX_CH (2)
+
+    /**
+     * @brief Spectrum tap configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t el;           /*!< Element whose PCM is observed */
+        audio_io_hook_dir_t dir;             /*!< Its output, or its input when it is the I2S writer */
+        audio_event_iface_handle_t listener; /*!< Receives every frame, may be NULL: spectrum_tap_get() polls */
+        int fft_size;                        /*!< Frames per analysis, a power of two from 256 to 4096 */
+        int bands;                           /*!< Log-spaced bands, up to SPECTRUM_TAP_MAX_BANDS */
+        int min_hz;                          /*!< Lower edge of the first band */
+        int frame_hz;                        /*!< Analyses per second */
+        int fall_db_s;                       /*!< How fast a band level falls, for a readable display */
+        int slots;                           /*!< Batches the hook can queue ahead of the task */
+        int task_stack;                      /*!< Task stack size */
+        int task_core;                       /*!< Task running in core */
+        int task_prio;                       /*!< Task priority, below every element */
+    } spectrum_tap_cfg_t;
+
+#define SPECTRUM_TAP_TASK_STACK (3072)
+#define SPECTRUM_TAP_TASK_CORE (0)
+#define SPECTRUM_TAP_TASK_PRIO (1)
+
+#define SPECTRUM_TAP_CFG_DEFAULT()              \
+    {                                           \
+        .el = NULL,                             \
+        .dir = AUDIO_IO_HOOK_WRITE,             \
+        .listener = NULL,                       \
+        .fft_size = 1024,                       \
+        .bands = 16,                            \
+        .min_hz = 40,                           \
+        .frame_hz = 30,                         \
+        .fall_db_s = 24,                        \
+        .slots = 3,                             \
+        .task_stack = SPECTRUM_TAP_TASK_STACK,  \
+        .task_core = SPECTRUM_TAP_TASK_CORE,    \
+        .task_prio = SPECTRUM_TAP_TASK_PRIO,    \
+    }
+
+    /**
+     * @brief One analysis. Levels are dB relative to full scale; a full-scale sine reads 0 dB
+     *        in its band and as peak, -3 dB as RMS.
+     */
+    typedef struct
+    {
+        uint32_t seq;                           /*!< Frame number */
+        uint32_t uptime_ms;                     /*!< When it was computed */
+        int bands;                              /*!< Entries in `band_db` and `band_hz` */
+        int ch;                                 /*!< Entries in `peak_db` and `rms_db` */
+        float band_db[SPECTRUM_TAP_MAX_BANDS];  /*!< Level per band of the channels' mean */
+        uint16_t band_hz[SPECTRUM_TAP_MAX_BANDS]; /*!< Band centre */
+        float peak_db[SPECTRUM_TAP_MAX_CH];     /*!< Sample peak over the batch */
+        float rms_db[SPECTRUM_TAP_MAX_CH];      /*!< RMS over the batch */
+    } spectrum_tap_frame_t;
+
+    /**
+     * @brief Cost and losses since init
+     */
+    typedef struct
+    {
+        uint32_t frames;                /*!< Analyses published */
+        uint32_t dropped;               /*!< Batches dropped because the task was behind */
+        uint32_t analyse_us_avg;        /*!< Task time per analysis */
+        uint32_t analyse_us_max;        /*!< Slowest analysis */
+        uint32_t load_permille;         /*!< Task busy time over wall time */
+        uint32_t hook_cycles_per_frame; /*!< Hook cost per PCM frame passing through, copies included */
+    } spectrum_tap_stats_t;
+
+    typedef struct spectrum_tap *spectrum_tap_handle_t;
+
+    /**
+     * @brief Hook the element and start the analysis task. Call after audio_pipeline_link().
+     *        Nothing is captured until spectrum_tap_set_format().
+     *
+     * @return The tap handle, NULL on failure
+     */
+    spectrum_tap_handle_t spectrum_tap_init(const spectrum_tap_cfg_t *cfg);
+
+    /**
+     * @brief Format of the observed PCM. Only 16-bit mono or stereo is analysed.
+     */
+    void spectrum_tap_set_format(spectrum_tap_handle_t tap, int rate, int bits, int ch);
+
+    /**
+     * @brief Copy the latest frame, from any task
+     *
+     * @return
+     *     - ESP_OK
+     *     - ESP_ERR_INVALID_ARG
+     *     - ESP_ERR_NOT_FOUND  nothing analysed yet
+     */
+    esp_err_t spectrum_tap_get(spectrum_tap_handle_t tap, spectrum_tap_frame_t *frame);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t spectrum_tap_get_stats(spectrum_tap_handle_t tap, spectrum_tap_stats_t *stats);
+
+    /**
+     * @brief Stop the task and unhook the element. The pipeline must be stopped.
+     */
+    void spectrum_tap_deinit(spectrum_tap_handle_t tap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+/* FreeRTOS trace macros for trace_recorder.c
+
+   The project CMakeLists.txt includes this file into every source file of
+   the build, the kernel's included, which is the only way to define the
+   kernel's trace macros from the application. It defines nothing unless
+   CONFIG_PLAYER_TRACE is set.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __TRACE_HOOKS_H__
+#define __TRACE_HOOKS_H__
+
+#ifndef __ASSEMBLER__
+#include "sdkconfig.h"
+
+#if CONFIG_PLAYER_TRACE
+void trace_recorder_task_switched_in(void);
+#define traceTASK_SWITCHED_IN() trace_recorder_task_switched_in()
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,534 @@
+/* Binary trace of task switches, pipeline ringbuffer traffic and codec I2C
+
+   Events are 16-byte records in one ring per core, in PSRAM. Recording one
+   is a handful of instructions with no lock and no call: the slot is
+   reserved with an atomic add on the core's head, kept in internal RAM, the
+   record is filled in with the core's cycle counter and its type is stored
+   last, which is what makes it visible to the flush task. A task and an
+   interrupt on the same core each get their own slot. A full ring drops the
+   event and counts it, so recording never waits.
+
+   Sources:
+     - the kernel's traceTASK_SWITCHED_IN(), defined by main/trace_hooks.h,
+       which the project build includes into every source file;
+     - IO hooks on the ringbuffer links of the "file", "mp3" and "i2s"
+       elements: begin and end of each read and write, with the bytes the
+       ring held at the begin, so a wait on the ring is visible as such.
+       What an element does between two of its hooks is its own work (SD
+       read, decoding, I2S DMA write); the converter draws it from the gaps;
+     - the ES8311 driver's I2C trace callback.
+
+   A low-priority task drains the rings every flush period into chunks
+   appended to a file on the card, with the names of the tasks seen. Each
+   flush first records a SYNC event on every core, esp_timer time next to
+   the core's cycle counter, from which tools/trace2json.py maps the cycles
+   of each core to one timeline and unwraps them.
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_attr.h"
+#if !CONFIG_FREERTOS_UNICORE
+#include "esp_ipc.h"
+#endif
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "audio_io_hook.h"
+#include "es8311_codec.h"
+#include "trace_recorder.h"
+
+static const char *TAG = "TRACE";
+
+/* Slots kept free for writers that passed the full check at the same time */
+#define TRACE_RING_SLACK (8)
+#define TRACE_STAGE_EVENTS (256)
+#define TRACE_MAX_TASKS (64)
+#define TRACE_TASK_NAME (16)
+#define TRACE_OBJ_NAME (15)
+#define TRACE_CALIBRATE_EVENTS (256)
+
+_Static_assert(sizeof(trace_event_t) == 16, "trace_event_t is a 16-byte record");
+
+typedef struct
+{
+    trace_event_t *ev;      /* PSRAM */
+    volatile uint32_t head; /* Slots reserved by writers */
+    volatile uint32_t tail; /* Slots consumed by the flush task */
+    volatile uint32_t dropped;
+} trace_ring_t;
+
+typedef struct
+{
+    audio_io_hook_t hook;
+    trace_recorder_handle_t tr;
+    audio_element_handle_t el;
+    audio_io_hook_dir_t dir;
+    uint8_t obj;
+} trace_link_t;
+
+typedef struct
+{
+    TaskHandle_t handle;
+    char name[TRACE_TASK_NAME];
+} trace_task_t;
+
+struct trace_recorder
+{
+    trace_recorder_cfg_t cfg;
+    trace_ring_t rings[portNUM_PROCESSORS];
+    uint32_t mask; /* Ring slots - 1 */
+    trace_link_t links[4];
+    int link_count;
+    FILE *f;
+    trace_event_t *stage;
+    trace_task_t known[TRACE_MAX_TASKS];
+    int known_count;
+    TaskStatus_t *tasks;
+    UBaseType_t tasks_cap;
+    volatile bool running;
+    SemaphoreHandle_t exited;
+    SemaphoreHandle_t lock; /* stats, held by a flush */
+    trace_recorder_stats_t stats;
+};
+
+/* Read by the kernel hook; the recorder itself is in internal RAM */
+static DRAM_ATTR trace_recorder_handle_t volatile s_trace;
+
+static inline __attribute__((always_inline)) void trace_put(trace_recorder_handle_t tr, uint8_t type, uint8_t obj,
+                                                            uint32_t a, uint32_t b)
+{
+    trace_ring_t *r = &tr->rings[esp_cpu_get_core_id()];
+    if (r->head - r->tail > tr->mask - TRACE_RING_SLACK)
+    {
+        r->dropped++;
+        return;
+    }
+    const uint32_t i = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *e = &r->ev[i & tr->mask];
+    e->cycles = esp_cpu_get_cycle_count();
+    e->obj = obj;
+    e->a = a;
+    e->b = b;
+    __atomic_store_n(&e->type, type, __ATOMIC_RELEASE);
+}
+
+void IRAM_ATTR trace_recorder_task_switched_in(void)
+{
+    trace_recorder_handle_t tr = s_trace;
+    if (tr)
+    {
+        trace_put(tr, TRACE_EV_SWITCH, 0, (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle(), 0);
+    }
+}
+
+static uint32_t ring_level(ringbuf_handle_t rb, bool filled)
+{
+    if (rb == NULL)
+    {
+        return TRACE_RING_NONE;
+    }
+    return filled ? (uint32_t)rb_bytes_filled(rb) : (uint32_t)rb_bytes_available(rb);
+}
+
+static int _trace_read_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    trace_link_t *l = (trace_link_t *)hook->ctx;
+    trace_put(l->tr, TRACE_EV_READ_BEGIN, l->obj, len, ring_level(audio_element_get_input_ringbuf(el), true));
+    const int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    trace_put(l->tr, TRACE_EV_READ_END, l->obj, ret, 0);
+    return ret;
+}
+
+static int _trace_write_hook(audio_io_hook_t *hook, audio_element_handle_t el, char *buf, int len, TickType_t ticks)
+{
+    trace_link_t *l = (trace_link_t *)hook->ctx;
+    trace_put(l->tr, TRACE_EV_WRITE_BEGIN, l->obj, len, ring_level(audio_element_get_output_ringbuf(el), false));
+    const int ret = audio_io_hook_next(hook, el, buf, len, ticks);
+    trace_put(l->tr, TRACE_EV_WRITE_END, l->obj, ret, 0);
+    return ret;
+}
+
+static void _codec_i2c_trace(bool begin, uint8_t reg, int len, esp_err_t ret, void *ctx)
+{
+    trace_recorder_handle_t tr = (trace_recorder_handle_t)ctx;
+    if (begin)
+    {
+        trace_put(tr, TRACE_EV_I2C_BEGIN, TRACE_OBJ_CODEC, reg, len);
+    }
+    else
+    {
+        trace_put(tr, TRACE_EV_I2C_END, TRACE_OBJ_CODEC, (uint32_t)ret, 0);
+    }
+}
+
+/* ---- File ---- */
+
+static void write_chunk(trace_recorder_handle_t tr, uint32_t tag, const void *head, size_t head_len, const void *body,
+                        size_t body_len)
+{
+    const uint32_t hdr[2] = {tag, (uint32_t)(head_len + body_len)};
+    if (fwrite(hdr, sizeof(hdr), 1, tr->f) != 1 || (head_len && fwrite(head, head_len, 1, tr->f) != 1) ||
+        (body_len && fwrite(body, body_len, 1, tr->f) != 1))
+    {
+        ESP_LOGW(TAG, "Write to %s failed", tr->cfg.path);
+        return;
+    }
+    tr->stats.bytes += sizeof(hdr) + head_len + body_len;
+}
+
+static void write_header(trace_recorder_handle_t tr)
+{
+    struct __attribute__((packed))
+    {
+        uint16_t version;
+        uint8_t cores;
+        uint8_t event_size;
+        uint32_t cpu_hz;
+    } head = {
+        .version = TRACE_RECORDER_VERSION,
+        .cores = portNUM_PROCESSORS,
+        .event_size = sizeof(trace_event_t),
+        .cpu_hz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000000,
+    };
+    write_chunk(tr, TRACE_CHUNK_HEAD, &head, sizeof(head), NULL, 0);
+
+    struct __attribute__((packed))
+    {
+        uint8_t id;
+        char name[TRACE_OBJ_NAME];
+    } objs[5] = {0};
+    int n = 0;
+    for (int i = 0; i < tr->link_count; i++)
+    {
+        bool listed = false;
+        for (int j = 0; j < n; j++)
+        {
+            listed |= objs[j].id == tr->links[i].obj;
+        }
+        if (!listed)
+        {
+            objs[n].id = tr->links[i].obj;
+            strlcpy(objs[n++].name, audio_element_get_tag(tr->links[i].el), TRACE_OBJ_NAME);
+        }
+    }
+    if (tr->cfg.codec_i2c)
+    {
+        objs[n].id = TRACE_OBJ_CODEC;
+        strlcpy(objs[n++].name, "es8311", TRACE_OBJ_NAME);
+    }
+    write_chunk(tr, TRACE_CHUNK_OBJS, objs, n * sizeof(objs[0]), NULL, 0);
+}
+
+/* Names of the tasks not seen yet, or whose handle was reused */
+static void write_tasks(trace_recorder_handle_t tr)
+{
+    const UBaseType_t count = uxTaskGetNumberOfTasks();
+    if (count + 4 > tr->tasks_cap)
+    {
+        audio_free(tr->tasks);
+        tr->tasks_cap = count + 8;
+        tr->tasks = audio_calloc(tr->tasks_cap, sizeof(TaskStatus_t));
+        if (tr->tasks == NULL)
+        {
+            tr->tasks_cap = 0;
+            return;
+        }
+    }
+    const UBaseType_t got = uxTaskGetSystemState(tr->tasks, tr->tasks_cap, NULL);
+    struct __attribute__((packed))
+    {
+        uint32_t handle;
+        char name[TRACE_TASK_NAME];
+    } fresh[8];
+    int n = 0;
+    for (UBaseType_t i = 0; i < got; i++)
+    {
+        trace_task_t *t = NULL;
+        for (int k = 0; k < tr->known_count; k++)
+        {
+            if (tr->known[k].handle == tr->tasks[i].xHandle)
+            {
+                t = &tr->known[k];
+                break;
+            }
+        }
+        if (t && strncmp(t->name, tr->tasks[i].pcTaskName, TRACE_TASK_NAME) == 0)
+        {
+            continue;
+        }
+        if (t == NULL)
+        {
+            /* Past the table, a task is named again each flush */
+            t = tr->known_count < TRACE_MAX_TASKS ? &tr->known[tr->known_count++] : NULL;
+        }
+        if (t)
+        {
+            t->handle = tr->tasks[i].xHandle;
+            strncpy(t->name, tr->tasks[i].pcTaskName, TRACE_TASK_NAME);
+        }
+        fresh[n].handle = (uint32_t)(uintptr_t)tr->tasks[i].xHandle;
+        strncpy(fresh[n].name, tr->tasks[i].pcTaskName, TRACE_TASK_NAME);
+        if (++n == (int)(sizeof(fresh) / sizeof(fresh[0])))
+        {
+            write_chunk(tr, TRACE_CHUNK_TASK, fresh, sizeof(fresh), NULL, 0);
+            n = 0;
+        }
+    }
+    if (n)
+    {
+        write_chunk(tr, TRACE_CHUNK_TASK, fresh, n * sizeof(fresh[0]), NULL, 0);
+    }
+}
+
+static void drain(trace_recorder_handle_t tr, int core)
+{
+    trace_ring_t *r = &tr->rings[core];
+    const uint32_t hdr = core;
+    int n = 0;
+    while (r->tail != r->head)
+    {
+        trace_event_t *e = &r->ev[r->tail & tr->mask];
+        const uint8_t type = __atomic_load_n(&e->type, __ATOMIC_ACQUIRE);
+        if (type == TRACE_EV_NONE)
+        {
+            /* Reserved, still being written: next flush */
+            break;
+        }
+        tr->stage[n] = *e;
+        e->type = TRACE_EV_NONE;
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+        if (++n == TRACE_STAGE_EVENTS)
+        {
+            write_chunk(tr, TRACE_CHUNK_EVTS, &hdr, sizeof(hdr), tr->stage, n * sizeof(trace_event_t));
+            tr->stats.events += n;
+            n = 0;
+        }
+    }
+    if (n)
+    {
+        write_chunk(tr, TRACE_CHUNK_EVTS, &hdr, sizeof(hdr), tr->stage, n * sizeof(trace_event_t));
+        tr->stats.events += n;
+    }
+}
+
+static void trace_sync(void *arg)
+{
+    const int64_t now = esp_timer_get_time();
+    trace_put((trace_recorder_handle_t)arg, TRACE_EV_SYNC, 0, (uint32_t)now, (uint32_t)(now >> 32));
+}
+
+static void flush(trace_recorder_handle_t tr)
+{
+    const int64_t t0 = esp_timer_get_time();
+    xSemaphoreTake(tr->lock, portMAX_DELAY);
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+#if !CONFIG_FREERTOS_UNICORE
+        if (core != esp_cpu_get_core_id())
+        {
+            esp_ipc_call_blocking(core, trace_sync, tr);
+            continue;
+        }
+#endif
+        trace_sync(tr);
+    }
+    write_tasks(tr);
+    uint32_t dropped = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        drain(tr, core);
+        dropped += tr->rings[core].dropped;
+    }
+    fflush(tr->f);
+    const uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+    tr->stats.dropped = dropped;
+    tr->stats.flush_us_max = us > tr->stats.flush_us_max ? us : tr->stats.flush_us_max;
+    xSemaphoreGive(tr->lock);
+}
+
+static void _trace_task(void *arg)
+{
+    trace_recorder_handle_t tr = (trace_recorder_handle_t)arg;
+    while (tr->running)
+    {
+        vTaskDelay(pdMS_TO_TICKS(tr->cfg.flush_ms));
+        flush(tr);
+    }
+    xSemaphoreGive(tr->exited);
+    vTaskDelete(NULL);
+}
+
+/* ---- Setup ---- */
+
+static esp_err_t trace_link(trace_recorder_handle_t tr, audio_element_handle_t el, audio_io_hook_dir_t dir, uint8_t obj)
+{
+    if (el == NULL)
+    {
+        return ESP_OK;
+    }
+    trace_link_t *l = &tr->links[tr->link_count];
+    *l = (trace_link_t){
+        .hook = {.fn = dir == AUDIO_IO_HOOK_READ ? _trace_read_hook : _trace_write_hook, .ctx = l},
+        .tr = tr,
+        .el = el,
+        .dir = dir,
+        .obj = obj,
+    };
+    esp_err_t ret = audio_io_hook_add(el, dir, &l->hook);
+    if (ret == ESP_OK)
+    {
+        tr->link_count++;
+    }
+    return ret;
+}
+
+/* Cost of one event with the ring's cache lines warm, as on the hot path */
+static void calibrate(trace_recorder_handle_t tr)
+{
+    const uint32_t t0 = esp_cpu_get_cycle_count();
+    for (int i = 0; i < TRACE_CALIBRATE_EVENTS; i++)
+    {
+        trace_put(tr, TRACE_EV_CALIBRATE, 0, i, 0);
+    }
+    tr->stats.cycles_per_event = (esp_cpu_get_cycle_count() - t0) / TRACE_CALIBRATE_EVENTS;
+}
+
+static void release(trace_recorder_handle_t tr)
+{
+    for (int i = 0; i < tr->link_count; i++)
+    {
+        audio_io_hook_remove(tr->links[i].el, tr->links[i].dir, &tr->links[i].hook);
+    }
+    if (tr->f)
+    {
+        fclose(tr->f);
+    }
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        heap_caps_free(tr->rings[core].ev);
+    }
+    audio_free(tr->stage);
+    audio_free(tr->tasks);
+    if (tr->exited)
+    {
+        vSemaphoreDelete(tr->exited);
+    }
+    if (tr->lock)
+    {
+        vSemaphoreDelete(tr->lock);
+    }
+    audio_free(tr);
+}
+
+trace_recorder_handle_t trace_recorder_init(const trace_recorder_cfg_t *cfg)
+{
+    AUDIO_NULL_CHECK(TAG, cfg && cfg->path, return NULL);
+    if (cfg->ring_kb < 16 || cfg->flush_ms <= 0 || s_trace)
+    {
+        ESP_LOGE(TAG, "Invalid trace configuration, or already recording");
+        return NULL;
+    }
+
+    /* The ring heads are hit on every event, and by the kernel hook */
+    trace_recorder_handle_t tr = audio_calloc_inner(1, sizeof(struct trace_recorder));
+    AUDIO_MEM_CHECK(TAG, tr, return NULL);
+    tr->cfg = *cfg;
+    uint32_t slots = 1;
+    while (slots * 2 * sizeof(trace_event_t) <= (uint32_t)cfg->ring_kb * 1024)
+    {
+        slots *= 2;
+    }
+    tr->mask = slots - 1;
+#if CONFIG_SPIRAM
+    const uint32_t caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+#else
+    const uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+#endif
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        tr->rings[core].ev = heap_caps_calloc(slots, sizeof(trace_event_t), caps);
+        AUDIO_MEM_CHECK(TAG, tr->rings[core].ev, goto _fail);
+    }
+    tr->stage = audio_calloc(TRACE_STAGE_EVENTS, sizeof(trace_event_t));
+    tr->exited = xSemaphoreCreateBinary();
+    tr->lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, tr->stage && tr->exited && tr->lock, goto _fail);
+
+    tr->f = fopen(cfg->path, "wb");
+    if (tr->f == NULL)
+    {
+        ESP_LOGE(TAG, "Cannot create %s", cfg->path);
+        goto _fail;
+    }
+    if (trace_link(tr, cfg->reader, AUDIO_IO_HOOK_WRITE, TRACE_OBJ_FILE) != ESP_OK ||
+        trace_link(tr, cfg->decoder, AUDIO_IO_HOOK_READ, TRACE_OBJ_MP3) != ESP_OK ||
+        trace_link(tr, cfg->decoder, AUDIO_IO_HOOK_WRITE, TRACE_OBJ_MP3) != ESP_OK ||
+        trace_link(tr, cfg->writer, AUDIO_IO_HOOK_READ, TRACE_OBJ_I2S) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Pipeline must be linked before trace_recorder_init");
+        goto _fail;
+    }
+    write_header(tr);
+    calibrate(tr);
+
+    tr->running = true;
+    if (xTaskCreatePinnedToCore(_trace_task, "trace", cfg->task_stack, tr, cfg->task_prio, NULL, cfg->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create the trace task");
+        goto _fail;
+    }
+    if (cfg->codec_i2c)
+    {
+        new_codec_set_i2c_trace(_codec_i2c_trace, tr);
+    }
+    s_trace = tr;
+    ESP_LOGI(TAG, "Tracing to %s: %u events per core, %u cycles per event", cfg->path, (unsigned)slots,
+             (unsigned)tr->stats.cycles_per_event);
+    return tr;
+
+_fail:
+    release(tr);
+    return NULL;
+}
+
+esp_err_t trace_recorder_get_stats(trace_recorder_handle_t tr, trace_recorder_stats_t *stats)
+{
+    AUDIO_NULL_CHECK(TAG, tr && stats, return ESP_ERR_INVALID_ARG);
+    xSemaphoreTake(tr->lock, portMAX_DELAY);
+    *stats = tr->stats;
+    xSemaphoreGive(tr->lock);
+    return ESP_OK;
+}
+
+void trace_recorder_deinit(trace_recorder_handle_t tr)
+{
+    if (tr == NULL)
+    {
+        return;
+    }
+    s_trace = NULL;
+    if (tr->cfg.codec_i2c)
+    {
+        new_codec_set_i2c_trace(NULL, NULL);
+    }
+    tr->running = false;
+    xSemaphoreTake(tr->exited, portMAX_DELAY);
+    /* A context switch that read s_trace just before has long finished; drain what it left */
+    flush(tr);
+    ESP_LOGI(TAG, "%llu events, %u dropped, %u KB in %s", (unsigned long long)tr->stats.events,
+             (unsigned)tr->stats.dropped, (unsigned)(tr->stats.bytes / 1024), tr->cfg.path);
+    release(tr);
+}
@@ -0,0 +1,147 @@
+/* Binary trace of task switches, pipeline ringbuffer traffic and codec I2C
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __TRACE_RECORDER_H__
+#define __TRACE_RECORDER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* File layout, little endian, read by tools/trace2json.py: a sequence of chunks, each
+   a u32 tag and a u32 payload length, then the payload */
+#define TRACE_RECORDER_VERSION (1)
+#define TRACE_CHUNK_HEAD (0x44414548) /* "HEAD": u16 version, u8 cores, u8 event size, u32 cpu_hz */
+#define TRACE_CHUNK_OBJS (0x534A424F) /* "OBJS": u8 id, char name[15] per traced object */
+#define TRACE_CHUNK_TASK (0x4B534154) /* "TASK": u32 handle, char name[16] per task first seen */
+#define TRACE_CHUNK_EVTS (0x53545645) /* "EVTS": u32 core, then trace_event_t records */
+
+/* Objects an event refers to */
+#define TRACE_OBJ_FILE (0)
+#define TRACE_OBJ_MP3 (1)
+#define TRACE_OBJ_I2S (2)
+#define TRACE_OBJ_CODEC (3)
+
+/* b of a read/write begin on a link without a ringbuffer, e.g. into i2s_direct_sink */
+#define TRACE_RING_NONE (0xFFFFFFFF)
+
+    /**
+     * @brief Event types
+     */
+    typedef enum
+    {
+        TRACE_EV_NONE = 0,      /*!< Slot not written yet */
+        TRACE_EV_SYNC,          /*!< a:b = esp_timer_get_time(), to map this core's cycles to time */
+        TRACE_EV_SWITCH,        /*!< a = task handle switched in */
+        TRACE_EV_READ_BEGIN,    /*!< Element reads its input ringbuffer; a = bytes asked, b = bytes waiting or TRACE_RING_NONE */
+        TRACE_EV_READ_END,      /*!< a = bytes read or AEL_IO_* code */
+        TRACE_EV_WRITE_BEGIN,   /*!< Element writes its output ringbuffer; a = bytes, b = free space or TRACE_RING_NONE */
+        TRACE_EV_WRITE_END,     /*!< a = bytes written or AEL_IO_* code */
+        TRACE_EV_I2C_BEGIN,     /*!< a = first register, b = bytes */
+        TRACE_EV_I2C_END,       /*!< a = esp_err_t */
+        TRACE_EV_CALIBRATE,     /*!< Written by the overhead measurement at init, ignored */
+    } trace_event_type_t;
+
+    /**
+     * @brief One event, 16 bytes. A begin whose byte count exceeds what the ring holds is a wait on it.
+     */
+    typedef struct
+    {
+        uint32_t cycles; /*!< CPU cycle counter of the recording core */
+        uint8_t type;    /*!< trace_event_type_t, written last */
+        uint8_t obj;     /*!< TRACE_OBJ_* */
+        uint16_t reserved;
+        uint32_t a;
+        uint32_t b;
+    } trace_event_t;
+
+    /**
+     * @brief Trace recorder configuration
+     */
+    typedef struct
+    {
+        audio_element_handle_t reader;  /*!< "file" element, may be NULL */
+        audio_element_handle_t decoder; /*!< "mp3" element, may be NULL */
+        audio_element_handle_t writer;  /*!< "i2s" element, may be NULL (i2s_direct_sink) */
+        bool codec_i2c;                 /*!< Trace the ES8311 register writes */
+        const char *path;               /*!< Output file, truncated */
+        int ring_kb;                    /*!< PSRAM ring per core, at least 16 */
+        int flush_ms;                   /*!< Flush period */
+        int task_stack;                 /*!< Flush task stack size */
+        int task_core;                  /*!< Flush task running in core */
+        int task_prio;                  /*!< Flush task priority, below every element */
+    } trace_recorder_cfg_t;
+
+#define TRACE_RECORDER_TASK_STACK (4096)
+#define TRACE_RECORDER_TASK_CORE (0)
+#define TRACE_RECORDER_TASK_PRIO (1)
+
+#define TRACE_RECORDER_CFG_DEFAULT()               \
+    {                                              \
+        .reader = NULL,                            \
+        .decoder = NULL,                           \
+        .writer = NULL,                            \
+        .codec_i2c = true,                         \
+        .path = "/sdcard/TRACE.BIN",               \
+        .ring_kb = 128,                            \
+        .flush_ms = 100,                           \
+        .task_stack = TRACE_RECORDER_TASK_STACK,   \
+        .task_core = TRACE_RECORDER_TASK_CORE,     \
+        .task_prio = TRACE_RECORDER_TASK_PRIO,     \
+    }
+
+    /**
+     * @brief Recording cost and losses since init
+     */
+    typedef struct
+    {
+        uint64_t events;           /*!< Events written to the file */
+        uint32_t dropped;          /*!< Events lost to a full ring */
+        uint32_t bytes;            /*!< File size */
+        uint32_t cycles_per_event; /*!< Cost of recording one event, measured at init */
+        uint32_t flush_us_max;     /*!< Slowest flush */
+    } trace_recorder_stats_t;
+
+    typedef struct trace_recorder *trace_recorder_handle_t;
+
+    /**
+     * @brief Open the file, hook the elements and start recording. Call after audio_pipeline_link()
+     *        while the pipeline is stopped. Task switches are recorded only when the build has the
+     *        kernel hook, see main/trace_hooks.h. One recorder at a time.
+     *
+     * @return The recorder handle, NULL on failure
+     */
+    trace_recorder_handle_t trace_recorder_init(const trace_recorder_cfg_t *cfg);
+
+    /**
+     * @brief Get the counters
+     */
+    esp_err_t trace_recorder_get_stats(trace_recorder_handle_t tr, trace_recorder_stats_t *stats);
+
+    /**
+     * @brief Stop recording, flush what is left and close the file. The pipeline must be stopped.
+     */
+    void trace_recorder_deinit(trace_recorder_handle_t tr);
+
+    /**
+     * @brief Called by the kernel on every context switch through traceTASK_SWITCHED_IN()
+     */
+    void trace_recorder_task_switched_in(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+# Pack prompt clips into an image for the "assets" partition, read by
+# main/prompt_player.c through esp_partition_mmap().
+#
+#   pack_prompts.py --rate 44100 -o prompts.bin prompts/*.wav --tone beep:1000:60
+#
+# Every clip is stored in the output format (16 bit, --channels, --rate) so
+# playback is a copy from flash. WAV files are named after their file name
+# without the extension; they must be 16 bit PCM at --rate, mono files are
+# duplicated to stereo. Resample with e.g. `sox in.wav -r 44100 -b 16 out.wav`.
+#
+# Layout (little endian), see prompt_pack_header_t / prompt_pack_entry_t:
+#   header  magic "PRMT", u16 version, u16 count, u32 rate, u8 bits,
+#           u8 channels, u16 reserved, u32 image size
+#   entries count x (char name[24], u32 offset, u32 length)
+#   PCM     one block per clip, each aligned to 64 bytes
+#
+# This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+import argparse
+import array
+import math
+import os
+import struct
+import sys
+import wave
+
+MAGIC = b'PRMT'
+VERSION = 1
+NAME_LEN = 24
+ALIGN = 64
+HEADER = struct.Struct('<4sHHIBBHI')
+ENTRY = struct.Struct('<%dsII' % NAME_LEN)
+FADE_MS = 5
+
+
+def load_wav(path, rate, channels):
+    with wave.open(path, 'rb') as w:
+        if w.getsampwidth() != 2 or w.getcomptype() != 'NONE':
+            sys.exit('%s: only 16 bit PCM is supported' % path)
+        if w.getframerate() != rate:
+            sys.exit('%s: %d Hz, prompts are packed at %d Hz' % (path, w.getframerate(), rate))
+        src_ch = w.getnchannels()
+        samples = array.array('h', w.readframes(w.getnframes()))
+    if sys.byteorder == 'big':
+        samples.byteswap()
+    if src_ch == channels:
+        return samples
+    if src_ch == 1 and channels == 2:
+        out = array.array('h', bytes(len(samples) * 4))
+        out[0::2] = samples
+        out[1::2] = samples
+        return out
+    if src_ch == 2 and channels == 1:
+        return array.array('h', ((samples[i] + samples[i + 1]) // 2 for i in range(0, len(samples), 2)))
+    sys.exit('%s: %d channels not supported' % (path, src_ch))
+
+
+def make_tone(spec, rate, channels):
+    """name:freq_hz:ms[:dbfs] -> sine with a short raised-cosine fade at both ends"""
+    parts = spec.split(':')
+    if len(parts) not in (3, 4):
+        sys.exit('--tone %s: expected name:freq_hz:ms[:dbfs]' % spec)
+    name, freq, ms = parts[0], float(parts[1]), float(parts[2])
+    amp = 32767 * 10 ** ((float(parts[3]) if len(parts) == 4 else -12.0) / 20)
+    frames = int(rate * ms / 1000)
+    fade = min(int(rate * FADE_MS / 1000), frames // 2)
+    out = array.array('h')
+    for n in range(frames):
+        g = 1.0
+        edge = min(n, frames - 1 - n)
+        if edge < fade:
+            g = 0.5 - 0.5 * math.cos(math.pi * edge / fade)
+        s = int(round(amp * g * math.sin(2 * math.pi * freq * n / rate)))
+        out.extend([s] * channels)
+    return name, out
+
+
+def align(n):
+    return (n + ALIGN - 1) // ALIGN * ALIGN
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Pack prompt clips for the assets partition')
+    ap.add_argument('wavs', nargs='*', help='16 bit PCM WAV clips')
+    ap.add_argument('-o', '--output', required=True)
+    ap.add_argument('--rate', type=int, default=44100)
+    ap.add_argument('--channels', type=int, choices=(1, 2), default=2)
+    ap.add_argument('--tone', action='append', default=[], help='generated clip, name:freq_hz:ms[:dbfs]')
+    ap.add_argument('--max-size', type=lambda s: int(s, 0), help='partition size; fail if the image does not fit')
+    args = ap.parse_args()
+
+    clips = [(os.path.splitext(os.path.basename(p))[0], load_wav(p, args.rate, args.channels)) for p in args.wavs]
+    clips += [make_tone(t, args.rate, args.channels) for t in args.tone]
+    if not clips:
+        sys.exit('no clips')
+    names = set()
+    for name, _ in clips:
+        if len(name.encode()) >= NAME_LEN or name in names:
+            sys.exit('clip name "%s" is too long or duplicated' % name)
+        names.add(name)
+
+    offset = align(HEADER.size + ENTRY.size * len(clips))
+    entries = []
+    for name, pcm in clips:
+        length = len(pcm) * 2
+        entries.append((name, offset, length))
+        offset = align(offset + length)
+    size = entries[-1][1] + entries[-1][2]
+    if args.max_size is not None and size > args.max_size:
+        sys.exit('image is %d bytes, the partition holds %d' % (size, args.max_size))
+
+    image = bytearray(size)
+    image[0:HEADER.size] = HEADER.pack(MAGIC, VERSION, len(clips), args.rate, 16, args.channels, 0, size)
+    for i, ((name, pcm), (_, off, length)) in enumerate(zip(clips, entries)):
+        ENTRY.pack_into(image, HEADER.size + i * ENTRY.size, name.encode(), off, length)
+        if sys.byteorder == 'big':
+            pcm.byteswap()
+        image[off:off + length] = pcm.tobytes()
+
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    for name, off, length in entries:
+        print('  %-24s %6.0f ms  @0x%06x' % (name, length * 1000.0 / (2 * args.channels * args.rate), off))
+    print('%d clips, %d bytes -> %s' % (len(entries), size, args.output))
+
+
+if __name__ == '__main__':
+    main()
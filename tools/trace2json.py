@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+# Convert a trace recorded by main/trace_recorder.c (CONFIG_PLAYER_TRACE) into
+# the Chrome trace event format, for chrome://tracing or ui.perfetto.dev.
+#
+#   trace2json.py TRACE.BIN -o trace.json
+#
+# The timeline has one track per core with the task running on it, and one
+# track per pipeline element:
+#   read / write    a call on the element's input or output ringbuffer;
+#                   "(wait)" when the ring held less than asked at the begin,
+#                   so the call blocked on the element next to it; a link
+#                   without a ring (the direct I2S sink) has no level
+#   process         the element's own work between two of its calls: SD
+#                   reads for "file", decoding for "mp3", the DMA write for
+#                   "i2s"
+#   reg 0x..        an I2C register write on the codec track
+#
+# Layout (little endian), see trace_recorder.h: chunks of u32 tag, u32 length
+# and the payload; "HEAD" u16 version, u8 cores, u8 event size, u32 cpu_hz;
+# "OBJS" (u8 id, char name[15])...; "TASK" (u32 handle, char name[16])...;
+# "EVTS" u32 core, then (u32 cycles, u8 type, u8 obj, u16, u32 a, u32 b)...
+# Each core counts its own cycles; its SYNC events pair a cycle count with
+# esp_timer time, which is what puts both cores on one time axis.
+#
+# This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+import argparse
+import json
+import struct
+import sys
+
+VERSION = 1
+CHUNK = struct.Struct('<4sI')
+HEAD = struct.Struct('<HBBI')
+OBJ = struct.Struct('<B15s')
+TASK = struct.Struct('<I16s')
+EVENT = struct.Struct('<IBBHII')
+
+EV_SYNC, EV_SWITCH, EV_READ_BEGIN, EV_READ_END, EV_WRITE_BEGIN, EV_WRITE_END, EV_I2C_BEGIN, EV_I2C_END, \
+    EV_CALIBRATE = range(1, 10)
+OBJ_CODEC = 3
+RING_NONE = 0xFFFFFFFF
+PID_CORES = 0
+PID_PIPELINE = 1
+
+
+def cstr(b):
+    return b.split(b'\0', 1)[0].decode('ascii', 'replace')
+
+
+def signed(v):
+    return v - (1 << 32) if v & 0x80000000 else v
+
+
+class Core:
+    """Unwraps one core's cycle counter and maps it to esp_timer microseconds"""
+
+    def __init__(self, cpu_hz):
+        self.per_us = cpu_hz / 1e6
+        self.last = None
+        self.cycles = 0
+        self.syncs = []
+
+    def unwrap(self, raw):
+        # Consecutive events are far less than a wrap apart: flushes are periodic.
+        # An interrupt may record between a task's reservation and its cycle read,
+        # so a step can be slightly negative.
+        if self.last is not None:
+            self.cycles += signed((raw - self.last) & 0xFFFFFFFF)
+        self.last = raw
+        return self.cycles
+
+    def to_us(self, cycles, at):
+        """at: index of the first sync after the event, from the caller's sweep"""
+        if not self.syncs:
+            return cycles / self.per_us
+        lo = self.syncs[max(at - 1, 0)]
+        hi = self.syncs[min(at, len(self.syncs) - 1)]
+        if hi[0] != lo[0]:
+            # Between two syncs, follow esp_timer rather than the nominal clock
+            return lo[1] + (cycles - lo[0]) * (hi[1] - lo[1]) / (hi[0] - lo[0])
+        return lo[1] + (cycles - lo[0]) / self.per_us
+
+
+def read_trace(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    head = None
+    objs = {}
+    tasks = {}  # handle -> [(names written before it, name)]
+    named = 0
+    events = {}  # core -> [(cycles, type, obj, a, b, names written before it)]
+    pos = 0
+    while pos + CHUNK.size <= len(data):
+        tag, length = CHUNK.unpack_from(data, pos)
+        body = data[pos + CHUNK.size:pos + CHUNK.size + length]
+        pos += CHUNK.size + length
+        if len(body) < length:
+            print('warning: truncated %s chunk at the end, ignored' % tag.decode('ascii', 'replace'), file=sys.stderr)
+            break
+        if tag == b'HEAD':
+            version, cores, ev_size, cpu_hz = HEAD.unpack_from(body)
+            if version != VERSION or ev_size != EVENT.size:
+                sys.exit('%s: version %d, event size %d not supported' % (path, version, ev_size))
+            head = (cores, cpu_hz)
+        elif tag == b'OBJS':
+            for i in range(0, length - OBJ.size + 1, OBJ.size):
+                oid, name = OBJ.unpack_from(body, i)
+                objs[oid] = cstr(name)
+        elif tag == b'TASK':
+            for i in range(0, length - TASK.size + 1, TASK.size):
+                handle, name = TASK.unpack_from(body, i)
+                tasks.setdefault(handle, []).append((named, cstr(name)))
+                named += 1
+        elif tag == b'EVTS':
+            core, = struct.unpack_from('<I', body)
+            evs = events.setdefault(core, [])
+            for i in range(4, length - EVENT.size + 1, EVENT.size):
+                cycles, etype, obj, _, a, b = EVENT.unpack_from(body, i)
+                evs.append((cycles, etype, obj, a, b, named))
+        else:
+            print('warning: unknown chunk %r skipped' % tag, file=sys.stderr)
+    if head is None:
+        sys.exit('%s: no HEAD chunk, not a trace' % path)
+    return head, objs, tasks, events
+
+
+def timeline(head, events):
+    """[(us, core, type, obj, a, b, named)] sorted by time, SYNC and CALIBRATE left out"""
+    out = []
+    for core, evs in events.items():
+        c = Core(head[1])
+        unwrapped = [(c.unwrap(e[0]),) + e[1:] for e in evs]
+        c.syncs = [(u[0], u[3] | (u[4] << 32)) for u in unwrapped if u[1] == EV_SYNC]
+        at = 0
+        for cycles, etype, obj, a, b, named in unwrapped:
+            if etype == EV_SYNC:
+                at += 1
+                continue
+            if etype == EV_CALIBRATE:
+                continue
+            out.append((c.to_us(cycles, at), core, etype, obj, a, b, named))
+    out.sort(key=lambda e: e[0])
+    return out
+
+
+def task_name(tasks, handle, named):
+    """A flush names the tasks it sees before writing their events, so a handle
+    reused by a new task takes the name written last before the event"""
+    history = tasks.get(handle)
+    if not history:
+        return '0x%08x' % handle
+    name = history[0][1]
+    for at, n in history:
+        if at < named:
+            name = n
+    return name
+
+
+def slice_event(name, pid, tid, start, end, args=None):
+    e = {'name': name, 'ph': 'X', 'pid': pid, 'tid': tid, 'ts': round(start, 3), 'dur': round(max(end - start, 0), 3)}
+    if args:
+        e['args'] = args
+    return e
+
+
+def convert(head, objs, tasks, events):
+    out = [{'name': 'process_name', 'ph': 'M', 'pid': PID_CORES, 'args': {'name': 'CPU'}},
+           {'name': 'process_name', 'ph': 'M', 'pid': PID_PIPELINE, 'args': {'name': 'pipeline'}}]
+    for core in range(head[0]):
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': PID_CORES, 'tid': core, 'args': {'name': 'core %d' % core}})
+    for oid, name in sorted(objs.items()):
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': PID_PIPELINE, 'tid': oid, 'args': {'name': name}})
+
+    running = {}  # core -> (start, handle, named)
+    calls = {}  # (obj, begin type) -> (start, args, waited)
+    idle_since = {}  # obj -> end of its last call
+    for us, core, etype, obj, a, b, named in timeline(head, events):
+        if etype == EV_SWITCH:
+            prev = running.get(core)
+            if prev:
+                out.append(slice_event(task_name(tasks, prev[1], prev[2]), PID_CORES, core, prev[0], us))
+            running[core] = (us, a, named)
+        elif etype in (EV_READ_BEGIN, EV_WRITE_BEGIN):
+            if obj in idle_since:
+                out.append(slice_event('process', PID_PIPELINE, obj, idle_since.pop(obj), us))
+            args = {'bytes': a, 'core': core}
+            if b != RING_NONE:
+                args['fill' if etype == EV_READ_BEGIN else 'space'] = b
+            calls[(obj, etype)] = (us, args, b < a)
+        elif etype in (EV_READ_END, EV_WRITE_END):
+            begin = calls.pop((obj, etype - 1), None)
+            if begin is None:
+                continue
+            name = 'read' if etype == EV_READ_END else 'write'
+            if begin[2]:
+                name += ' (wait)'
+            args = dict(begin[1], result=signed(a))
+            out.append(slice_event(name, PID_PIPELINE, obj, begin[0], us, args))
+            idle_since[obj] = us
+        elif etype == EV_I2C_BEGIN:
+            calls[(OBJ_CODEC, etype)] = (us, {'reg': '0x%02x' % a, 'bytes': b, 'core': core}, False)
+        elif etype == EV_I2C_END:
+            begin = calls.pop((OBJ_CODEC, EV_I2C_BEGIN), None)
+            if begin is None:
+                continue
+            args = dict(begin[1], err=signed(a))
+            out.append(slice_event('reg %s' % begin[1]['reg'], PID_PIPELINE, OBJ_CODEC, begin[0], us, args))
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Convert a player trace to Chrome trace JSON')
+    ap.add_argument('trace', help='TRACE.BIN from the SD card')
+    ap.add_argument('-o', '--output', required=True)
+    args = ap.parse_args()
+
+    head, objs, tasks, events = read_trace(args.trace)
+    out = convert(head, objs, tasks, events)
+    with open(args.output, 'w') as f:
+        json.dump({'traceEvents': out, 'displayTimeUnit': 'ms'}, f)
+    counts = ', '.join('core %d: %d' % (core, len(evs)) for core, evs in sorted(events.items()))
+    print('%d events (%s), %d tasks, %d slices -> %s' % (sum(len(e) for e in events.values()), counts,
+                                                         len(tasks), len(out), args.output))
+
+
+if __name__ == '__main__':
+    main()